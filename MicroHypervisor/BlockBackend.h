@@ -0,0 +1,54 @@
+#ifndef BLOCKBACKEND_H
+#define BLOCKBACKEND_H
+
+#include <Windows.h>
+
+/// @brief Interface of the storage behind a virtual disk, called from the IO threads of the disk \class BlockBackend
+class BlockBackend
+{
+public:
+    static constexpr UINT32 SectorSize = 512;
+
+    virtual ~BlockBackend() = default;
+
+    /**
+     * @brief Gets the size of the disk in bytes
+     *
+     */
+    virtual UINT64 GetSize() const = 0;
+
+    /**
+     * @brief Checks if the disk refuses writes
+     *
+     */
+    virtual bool IsReadOnly() const = 0;
+
+    /**
+     * @brief Reads from the disk, concurrent calls for different ranges are allowed
+     *
+     * @param offset -> Byte offset on the disk
+     * @param buffer -> receives the data
+     * @param length -> Number of bytes
+     * @return true -> if all bytes were read
+     */
+    virtual bool Read(UINT64 offset, void* buffer, size_t length) = 0;
+
+    /**
+     * @brief Writes to the disk, concurrent calls for different ranges are allowed
+     *
+     * @param offset -> Byte offset on the disk
+     * @param buffer -> Data to write
+     * @param length -> Number of bytes
+     * @return true -> if all bytes were written
+     */
+    virtual bool Write(UINT64 offset, const void* buffer, size_t length) = 0;
+
+    /**
+     * @brief Makes the completed writes durable
+     *
+     * @return true -> if the writes reached stable storage
+     */
+    virtual bool Flush() = 0;
+};
+
+#endif // BLOCKBACKEND_H
\ No newline at end of file
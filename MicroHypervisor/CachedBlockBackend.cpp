@@ -0,0 +1,510 @@
+#define NOMINMAX
+#include "CachedBlockBackend.h"
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+    // Reads landing this close to where a reader stopped still count as sequential, the IO threads reorder them.
+    constexpr UINT64 SequentialSlack = 256 * 1024;
+    constexpr size_t MaxWriteBatch = 1024 * 1024;
+    constexpr size_t EvictionScan = 64;
+}
+
+CachedBlockBackend::CachedBlockBackend(std::unique_ptr<BlockBackend> backend, const Config& config)
+    : backend_(std::move(backend)), config_(config), capacityPages_(std::max<size_t>(config.capacityBytes / PageSize, 1)),
+    dirtySectors_(0), writeBackCursor_(0), writeBacksInFlight_(0), generations_(), streams_(), nextStream_(0), readBytes_(0),
+    hitBytes_(0), readAheadBytes_(0), writeBytes_(0), writeBackBytes_(0), writeBackIos_(0), flushes_(0), flushMicroseconds_(0),
+    lastFlushMicroseconds_(0), maxFlushMicroseconds_(0), logger_("CachedBlockBackend.log")
+{
+    logger_.Log(Logger::LogLevel::Info, std::string(config_.writePolicy == WritePolicy::WriteBack ? "Write-back" : "Write-through")
+        + " cache of " + std::to_string(capacityPages_ * PageSize) + " bytes");
+}
+
+CachedBlockBackend::~CachedBlockBackend()
+{
+    if (!backend_->IsReadOnly() && !Flush())
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to write back the cache, " + std::to_string(dirtySectors_ * SectorSize)
+            + " dirty bytes are lost");
+    }
+}
+
+BlockBackend* CachedBlockBackend::GetBackend() const
+{
+    return backend_.get();
+}
+
+CachedBlockBackend::Stats CachedBlockBackend::GetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = {};
+    stats.readBytes = readBytes_;
+    stats.hitBytes = hitBytes_;
+    stats.readAheadBytes = readAheadBytes_;
+    stats.writeBytes = writeBytes_;
+    stats.writeBackBytes = writeBackBytes_;
+    stats.writeBackIos = writeBackIos_;
+    stats.flushes = flushes_;
+    stats.lastFlushMicroseconds = lastFlushMicroseconds_;
+    stats.maxFlushMicroseconds = maxFlushMicroseconds_;
+    stats.averageFlushMicroseconds = flushes_ > 0 ? static_cast<double>(flushMicroseconds_) / static_cast<double>(flushes_) : 0.0;
+    stats.hitRatio = readBytes_ > 0 ? static_cast<double>(hitBytes_) / static_cast<double>(readBytes_) : 0.0;
+    stats.cachedBytes = pages_.size() * PageSize;
+    stats.dirtyBytes = dirtySectors_ * SectorSize;
+    return stats;
+}
+
+UINT64 CachedBlockBackend::GetSize() const
+{
+    return backend_->GetSize();
+}
+
+bool CachedBlockBackend::IsReadOnly() const
+{
+    return backend_->IsReadOnly();
+}
+
+bool CachedBlockBackend::Read(UINT64 offset, void* buffer, size_t length)
+{
+    const UINT64 size = backend_->GetSize();
+    if (offset > size || length > size - offset)
+    {
+        return false;
+    }
+    if (((offset | length) & (SectorSize - 1)) != 0)
+    {
+        return PassThrough(offset, buffer, nullptr, length);
+    }
+
+    UINT8* output = static_cast<UINT8*>(buffer);
+    const UINT64 end = offset + length;
+    UINT64 missStart = end;
+    UINT64 missEnd = offset;
+    std::array<UINT64, GenerationBuckets> generations;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        readBytes_ += length;
+        const bool sequential = IsSequential(offset, length);
+        for (UINT64 pageIndex = offset / PageSize; pageIndex * PageSize < end; pageIndex++)
+        {
+            auto found = pages_.find(pageIndex);
+            Page* page = found != pages_.end() ? &found->second : nullptr;
+            if (page != nullptr)
+            {
+                lru_.splice(lru_.begin(), lru_, page->lru);
+            }
+            const UINT64 to = std::min(end, (pageIndex + 1) * PageSize);
+            for (UINT64 position = std::max(offset, pageIndex * PageSize); position < to; position += SectorSize)
+            {
+                const size_t inPage = static_cast<size_t>(position % PageSize);
+                if (page != nullptr && page->valid[inPage / SectorSize])
+                {
+                    memcpy(output + (position - offset), page->data.data() + inPage, SectorSize);
+                    hitBytes_ += SectorSize;
+                }
+                else
+                {
+                    missStart = std::min(missStart, position);
+                    missEnd = std::max(missEnd, position + SectorSize);
+                }
+            }
+        }
+        if (missStart >= missEnd)
+        {
+            return true;
+        }
+
+        // A sequential reader gets the following pages in the same IO.
+        if (sequential && config_.readAheadBytes > 0)
+        {
+            missEnd = std::min(size, (missEnd + config_.readAheadBytes + PageSize - 1) / PageSize * PageSize);
+        }
+        generations = generations_;
+    }
+
+    thread_local std::vector<UINT8> scratch;
+    scratch.resize(static_cast<size_t>(missEnd - missStart));
+    if (!backend_->Read(missStart, scratch.data(), scratch.size()))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    readAheadBytes_ += missEnd > end ? missEnd - end : 0;
+    for (UINT64 pageIndex = missStart / PageSize; pageIndex * PageSize < missEnd; pageIndex++)
+    {
+        // A page written since the lookup may have been written back and evicted, the data read before is stale.
+        const bool cacheable = generations_[pageIndex % GenerationBuckets] == generations[pageIndex % GenerationBuckets];
+        Page* page = nullptr;
+        if (cacheable)
+        {
+            page = &GetPage(pageIndex);
+        }
+        else if (pages_.count(pageIndex) != 0)
+        {
+            page = &pages_.at(pageIndex);
+        }
+
+        const UINT64 to = std::min(missEnd, (pageIndex + 1) * PageSize);
+        for (UINT64 position = std::max(missStart, pageIndex * PageSize); position < to; position += SectorSize)
+        {
+            const size_t inPage = static_cast<size_t>(position % PageSize);
+            const size_t sector = inPage / SectorSize;
+            const UINT8* source = scratch.data() + (position - missStart);
+            if (page != nullptr && page->valid[sector])
+            {
+                source = page->data.data() + inPage;
+            }
+            else if (page != nullptr)
+            {
+                memcpy(page->data.data() + inPage, source, SectorSize);
+                page->valid.set(sector);
+            }
+            if (position >= offset && position < end)
+            {
+                memcpy(output + (position - offset), source, SectorSize);
+            }
+        }
+    }
+    return true;
+}
+
+bool CachedBlockBackend::Write(UINT64 offset, const void* buffer, size_t length)
+{
+    const UINT64 size = backend_->GetSize();
+    if (backend_->IsReadOnly() || offset > size || length > size - offset)
+    {
+        return false;
+    }
+    if (((offset | length) & (SectorSize - 1)) != 0)
+    {
+        return PassThrough(offset, nullptr, buffer, length);
+    }
+
+    // Write-through updates the cache and the image in one ordered step, racing writers cannot leave them disagreeing.
+    const bool writeBack = config_.writePolicy == WritePolicy::WriteBack;
+    std::unique_lock<std::mutex> writeLock(writeMutex_, std::defer_lock);
+    if (!writeBack)
+    {
+        writeLock.lock();
+    }
+
+    const UINT8* input = static_cast<const UINT8*>(buffer);
+    const UINT64 end = offset + length;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writeBytes_ += length;
+        for (UINT64 pageIndex = offset / PageSize; pageIndex * PageSize < end; pageIndex++)
+        {
+            Page& page = GetPage(pageIndex);
+            const UINT64 from = std::max(offset, pageIndex * PageSize);
+            const UINT64 to = std::min(end, (pageIndex + 1) * PageSize);
+            memcpy(page.data.data() + from % PageSize, input + (from - offset), static_cast<size_t>(to - from));
+            for (size_t sector = static_cast<size_t>(from % PageSize) / SectorSize; sector < (to - 1) % PageSize / SectorSize + 1; sector++)
+            {
+                page.valid.set(sector);
+            }
+            generations_[pageIndex % GenerationBuckets]++;
+        }
+        if (writeBack)
+        {
+            SetDirty(offset, length, true);
+        }
+    }
+
+    if (!writeBack)
+    {
+        if (backend_->Write(offset, buffer, length))
+        {
+            return true;
+        }
+
+        // The image still holds the old data, so the cached copy is dropped.
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (UINT64 pageIndex = offset / PageSize; pageIndex * PageSize < end; pageIndex++)
+        {
+            auto found = pages_.find(pageIndex);
+            if (found != pages_.end())
+            {
+                const UINT64 from = std::max(offset, pageIndex * PageSize);
+                const UINT64 to = std::min(end, (pageIndex + 1) * PageSize);
+                for (size_t sector = static_cast<size_t>(from % PageSize) / SectorSize; sector < (to - 1) % PageSize / SectorSize + 1; sector++)
+                {
+                    found->second.valid.reset(sector);
+                }
+            }
+            generations_[pageIndex % GenerationBuckets]++;
+        }
+        return false;
+    }
+
+    Trim();
+    return true;
+}
+
+bool CachedBlockBackend::Flush()
+{
+    if (backend_->IsReadOnly())
+    {
+        return true;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    bool flushed = true;
+    if (config_.writePolicy == WritePolicy::WriteBack)
+    {
+        flushed = WriteBack(SIZE_MAX);
+        std::unique_lock<std::mutex> lock(mutex_);
+        writeBackCv_.wait(lock, [this] { return writeBacksInFlight_ == 0; });
+    }
+    flushed = backend_->Flush() && flushed;
+
+    const UINT64 elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushes_++;
+    flushMicroseconds_ += elapsed;
+    lastFlushMicroseconds_ = elapsed;
+    maxFlushMicroseconds_ = std::max(maxFlushMicroseconds_, elapsed);
+    return flushed;
+}
+
+CachedBlockBackend::Page& CachedBlockBackend::GetPage(UINT64 index)
+{
+    auto found = pages_.find(index);
+    if (found != pages_.end())
+    {
+        lru_.splice(lru_.begin(), lru_, found->second.lru);
+        return found->second;
+    }
+
+    // The least recently used clean page makes room, dirty pages and pages being written back stay until Trim.
+    std::vector<UINT8> data;
+    if (pages_.size() >= capacityPages_)
+    {
+        auto candidate = lru_.end();
+        for (size_t scanned = 0; scanned < EvictionScan && candidate != lru_.begin(); scanned++)
+        {
+            --candidate;
+            Page& victim = pages_.at(*candidate);
+            if (victim.dirty.none() && victim.writeBacks == 0)
+            {
+                data = std::move(victim.data);
+                pages_.erase(*candidate);
+                lru_.erase(candidate);
+                break;
+            }
+        }
+    }
+    data.resize(PageSize);
+
+    lru_.push_front(index);
+    Page& page = pages_[index];
+    page.data = std::move(data);
+    page.valid.reset();
+    page.dirty.reset();
+    page.writeBacks = 0;
+    page.lru = lru_.begin();
+    return page;
+}
+
+bool CachedBlockBackend::IsSequential(UINT64 offset, size_t length)
+{
+    for (Stream& stream : streams_)
+    {
+        if (stream.next != 0 && offset + SequentialSlack >= stream.next && offset <= stream.next + SequentialSlack)
+        {
+            stream.hits++;
+            stream.next = std::max(stream.next, offset + length);
+            return stream.hits >= 2;
+        }
+    }
+    streams_[nextStream_] = { offset + length, 0 };
+    nextStream_ = (nextStream_ + 1) % StreamCount;
+    return false;
+}
+
+bool CachedBlockBackend::WriteBack(size_t targetBytes)
+{
+    // Dirty bits are cleared when the runs are collected, so a later write-back must not overtake this one at the image.
+    std::lock_guard<std::mutex> writeLock(writeMutex_);
+    return WriteBackLocked(targetBytes);
+}
+
+bool CachedBlockBackend::WriteBackLocked(size_t targetBytes)
+{
+    struct Run
+    {
+        UINT64 offset;
+        std::vector<UINT8> data;
+    };
+    std::vector<Run> runs;
+    std::vector<UINT64> touched;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (dirtyPages_.empty())
+        {
+            return true;
+        }
+
+        // Pages go out in disk order from where the last write-back stopped, so adjacent dirty sectors share a write.
+        size_t collected = 0;
+        auto next = dirtyPages_.lower_bound(writeBackCursor_);
+        while (collected < targetBytes && !dirtyPages_.empty())
+        {
+            if (next == dirtyPages_.end())
+            {
+                next = dirtyPages_.begin();
+            }
+            const UINT64 index = *next;
+            Page& page = pages_.at(index);
+            for (size_t sector = 0; sector < SectorsPerPage; sector++)
+            {
+                if (!page.dirty[sector])
+                {
+                    continue;
+                }
+                const UINT64 position = index * PageSize + sector * SectorSize;
+                if (runs.empty() || runs.back().offset + runs.back().data.size() != position || runs.back().data.size() >= MaxWriteBatch)
+                {
+                    runs.push_back({ position, {} });
+                    runs.back().data.reserve(MaxWriteBatch);
+                }
+                const UINT8* source = page.data.data() + sector * SectorSize;
+                runs.back().data.insert(runs.back().data.end(), source, source + SectorSize);
+                collected += SectorSize;
+            }
+            dirtySectors_ -= page.dirty.count();
+            page.dirty.reset();
+            page.writeBacks++;
+            touched.push_back(index);
+            next = dirtyPages_.erase(next);
+        }
+        writeBackCursor_ = next != dirtyPages_.end() ? *next : 0;
+        writeBacksInFlight_++;
+    }
+
+    bool written = true;
+    UINT64 bytes = 0;
+    std::vector<const Run*> failed;
+    for (const Run& run : runs)
+    {
+        if (backend_->Write(run.offset, run.data.data(), run.data.size()))
+        {
+            bytes += run.data.size();
+        }
+        else
+        {
+            failed.push_back(&run);
+            written = false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    writeBackBytes_ += bytes;
+    writeBackIos_ += runs.size();
+    for (const Run* run : failed)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Write-back of " + std::to_string(run->data.size()) + " bytes at offset "
+            + std::to_string(run->offset) + " failed");
+        SetDirty(run->offset, run->data.size(), true);
+    }
+    for (UINT64 index : touched)
+    {
+        pages_.at(index).writeBacks--;
+    }
+    writeBacksInFlight_--;
+    writeBackCv_.notify_all();
+    return written;
+}
+
+void CachedBlockBackend::Trim()
+{
+    size_t excess = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const size_t dirtyBytes = dirtySectors_ * SectorSize;
+        // Past the limit the cache writes down to half of it, one large batch instead of a write per guest request.
+        if (dirtyBytes > config_.dirtyLimitBytes)
+        {
+            excess = dirtyBytes - config_.dirtyLimitBytes / 2;
+        }
+        if (pages_.size() > capacityPages_)
+        {
+            excess = std::max(excess, (pages_.size() - capacityPages_) * PageSize);
+        }
+    }
+    if (excess == 0 || !WriteBack(excess))
+    {
+        return;
+    }
+
+    // Pages that were dirty when inserted made the cache grow, they are clean now.
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto candidate = lru_.end();
+    while (pages_.size() > capacityPages_ && candidate != lru_.begin())
+    {
+        --candidate;
+        auto found = pages_.find(*candidate);
+        if (found->second.dirty.none() && found->second.writeBacks == 0)
+        {
+            pages_.erase(found);
+            candidate = lru_.erase(candidate);
+        }
+    }
+}
+
+void CachedBlockBackend::SetDirty(UINT64 offset, size_t length, bool dirty)
+{
+    for (UINT64 position = offset; position < offset + length; position += SectorSize)
+    {
+        const UINT64 pageIndex = position / PageSize;
+        auto found = pages_.find(pageIndex);
+        if (found == pages_.end())
+        {
+            continue;
+        }
+        const size_t sector = static_cast<size_t>(position % PageSize) / SectorSize;
+        if (found->second.dirty[sector] != dirty)
+        {
+            found->second.dirty.set(sector, dirty);
+            dirtySectors_ = dirty ? dirtySectors_ + 1 : dirtySectors_ - 1;
+        }
+        if (dirty)
+        {
+            dirtyPages_.insert(pageIndex);
+        }
+    }
+}
+
+bool CachedBlockBackend::PassThrough(UINT64 offset, void* readBuffer, const void* writeBuffer, size_t length)
+{
+    // The image has to be current before it is accessed around the cache.
+    std::lock_guard<std::mutex> writeLock(writeMutex_);
+    if (!WriteBackLocked(SIZE_MAX))
+    {
+        return false;
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        writeBackCv_.wait(lock, [this] { return writeBacksInFlight_ == 0; });
+    }
+    if (readBuffer != nullptr)
+    {
+        return backend_->Read(offset, readBuffer, length);
+    }
+
+    const bool written = backend_->Write(offset, writeBuffer, length);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (UINT64 pageIndex = offset / PageSize; pageIndex * PageSize < offset + length; pageIndex++)
+    {
+        auto found = pages_.find(pageIndex);
+        if (found != pages_.end() && found->second.dirty.none() && found->second.writeBacks == 0)
+        {
+            lru_.erase(found->second.lru);
+            pages_.erase(found);
+        }
+        generations_[pageIndex % GenerationBuckets]++;
+    }
+    return written;
+}
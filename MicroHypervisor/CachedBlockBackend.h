@@ -0,0 +1,195 @@
+#ifndef CACHEDBLOCKBACKEND_H
+#define CACHEDBLOCKBACKEND_H
+
+#include <Windows.h>
+#include <array>
+#include <bitset>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "BlockBackend.h"
+#include "Logger.h"
+
+/// @brief Host page cache in front of a disk image, write-through or write-back with read-ahead for sequential readers \class CachedBlockBackend
+class CachedBlockBackend : public BlockBackend
+{
+public:
+    /**
+     * @brief When guest writes reach the image, write-back defers them until a flush, eviction or the dirty limit
+     *
+     */
+    enum class WritePolicy
+    {
+        WriteThrough,
+        WriteBack
+    };
+
+    /**
+     * @brief Cache configuration
+     *
+     */
+    struct Config
+    {
+        WritePolicy writePolicy = WritePolicy::WriteBack;
+        size_t capacityBytes = 64 * 1024 * 1024;
+        size_t dirtyLimitBytes = 16 * 1024 * 1024;
+        size_t readAheadBytes = 512 * 1024;
+    };
+
+    /**
+     * @brief Cache statistics, the hit ratio counts the read bytes that were already cached
+     *
+     */
+    struct Stats
+    {
+        UINT64 readBytes;
+        UINT64 hitBytes;
+        UINT64 readAheadBytes;
+        UINT64 writeBytes;
+        UINT64 writeBackBytes;
+        UINT64 writeBackIos;
+        UINT64 flushes;
+        UINT64 lastFlushMicroseconds;
+        UINT64 maxFlushMicroseconds;
+        double averageFlushMicroseconds;
+        double hitRatio;
+        size_t cachedBytes;
+        size_t dirtyBytes;
+    };
+
+    CachedBlockBackend(std::unique_ptr<BlockBackend> backend, const Config& config);
+    ~CachedBlockBackend();
+
+    /**
+     * @brief Gets the image behind the cache
+     *
+     */
+    BlockBackend* GetBackend() const;
+
+    /**
+     * @brief Gets the cache statistics
+     *
+     */
+    Stats GetStats();
+
+    UINT64 GetSize() const override;
+    bool IsReadOnly() const override;
+    bool Read(UINT64 offset, void* buffer, size_t length) override;
+    bool Write(UINT64 offset, const void* buffer, size_t length) override;
+
+    /**
+     * @brief Writes back every dirty sector, waits for the write-backs of other threads, then flushes the image
+     *
+     */
+    bool Flush() override;
+
+private:
+    static constexpr size_t PageSize = 64 * 1024;
+    static constexpr size_t SectorsPerPage = PageSize / SectorSize;
+    static constexpr size_t GenerationBuckets = 256;
+    static constexpr size_t StreamCount = 4;
+
+    /**
+     * @brief A cached page of the disk, valid and dirty track its sectors
+     *
+     */
+    struct Page
+    {
+        std::vector<UINT8> data;
+        std::bitset<SectorsPerPage> valid;
+        std::bitset<SectorsPerPage> dirty;
+        UINT32 writeBacks;
+        std::list<UINT64>::iterator lru;
+    };
+
+    /**
+     * @brief A sequential reader, next is where its following read is expected
+     *
+     */
+    struct Stream
+    {
+        UINT64 next;
+        UINT32 hits;
+    };
+
+    /**
+     * @brief Gets a page, inserting it and evicting a clean page when the cache is full, called with mutex_ held
+     *
+     */
+    Page& GetPage(UINT64 index);
+
+    /**
+     * @brief Checks if a read continues one of the recent sequential readers, called with mutex_ held
+     *
+     */
+    bool IsSequential(UINT64 offset, size_t length);
+
+    /**
+     * @brief Writes back dirty sectors in disk order, adjacent sectors are coalesced into one write
+     *
+     * @param targetBytes -> Number of dirty bytes to write back, the last page is always finished
+     * @return true -> if every write succeeded, failed sectors stay dirty
+     */
+    bool WriteBack(size_t targetBytes);
+
+    /**
+     * @brief Body of WriteBack, called with writeMutex_ held
+     *
+     */
+    bool WriteBackLocked(size_t targetBytes);
+
+    /**
+     * @brief Writes back to get under the dirty limit and the capacity
+     *
+     */
+    void Trim();
+
+    /**
+     * @brief Marks the sectors of a range dirty or clean, called with mutex_ held
+     *
+     */
+    void SetDirty(UINT64 offset, size_t length, bool dirty);
+
+    /**
+     * @brief Serves a request that is not sector aligned straight from the image after writing back the cache
+     *
+     */
+    bool PassThrough(UINT64 offset, void* readBuffer, const void* writeBuffer, size_t length);
+
+    std::unique_ptr<BlockBackend> backend_;
+    Config config_;
+    size_t capacityPages_;
+
+    std::mutex mutex_;
+    // Orders every write to the image (write-backs, write-through and pass-through), taken before mutex_.
+    std::mutex writeMutex_;
+    std::condition_variable writeBackCv_;
+    std::unordered_map<UINT64, Page> pages_;
+    std::list<UINT64> lru_;
+    std::set<UINT64> dirtyPages_;
+    size_t dirtySectors_;
+    UINT64 writeBackCursor_;
+    UINT32 writeBacksInFlight_;
+    std::array<UINT64, GenerationBuckets> generations_;
+    std::array<Stream, StreamCount> streams_;
+    size_t nextStream_;
+
+    UINT64 readBytes_;
+    UINT64 hitBytes_;
+    UINT64 readAheadBytes_;
+    UINT64 writeBytes_;
+    UINT64 writeBackBytes_;
+    UINT64 writeBackIos_;
+    UINT64 flushes_;
+    UINT64 flushMicroseconds_;
+    UINT64 lastFlushMicroseconds_;
+    UINT64 maxFlushMicroseconds_;
+
+    Logger logger_;
+};
+
+#endif // CACHEDBLOCKBACKEND_H
\ No newline at end of file
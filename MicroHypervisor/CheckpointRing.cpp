@@ -0,0 +1,300 @@
+#include "CheckpointRing.h"
+#include <algorithm>
+
+namespace
+{
+    UINT64 ElapsedMicroseconds(std::chrono::steady_clock::time_point since)
+    {
+        return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - since).count());
+    }
+}
+
+CheckpointRing::CheckpointRing() : virtualProcessor_(nullptr), memoryManager_(nullptr), snapshotManager_(nullptr), dirtyLog_(-1), running_(false),
+    bytesUsed_(0), stats_(), logger_("CheckpointRing.log")
+{
+
+}
+
+CheckpointRing::~CheckpointRing()
+{
+    Stop();
+}
+
+void CheckpointRing::Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager, SnapshotManager* snapshotManager)
+{
+    virtualProcessor_ = virtualProcessor;
+    memoryManager_ = memoryManager;
+    snapshotManager_ = snapshotManager;
+}
+
+bool CheckpointRing::Start(const Config& config)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_)
+        {
+            return true;
+        }
+
+        if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Cannot start checkpoints, virtual processor or guest memory not attached.");
+            return false;
+        }
+
+        if (dirtyLog_ < 0)
+        {
+            dirtyLog_ = memoryManager_->CreateDirtyLog();
+        }
+
+        HRESULT hr = virtualProcessor_->Pause();
+        if (FAILED(hr))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for the base checkpoint: HRESULT " + std::to_string(hr));
+            virtualProcessor_->Resume();
+            return false;
+        }
+
+        std::vector<UINT64> discarded;
+        memoryManager_->CollectDirtyPages(dirtyLog_, discarded);
+        const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+        baseImage_.assign(guestMemory, guestMemory + memoryManager_->GetGuestMemorySize());
+        virtualProcessor_->SaveState(baseRegisters_);
+        baseDevices_.clear();
+        if (snapshotManager_ != nullptr)
+        {
+            snapshotManager_->SaveDeviceStates(baseDevices_);
+        }
+        baseTimestamp_ = std::chrono::steady_clock::now();
+        virtualProcessor_->Resume();
+
+        checkpoints_.clear();
+        bytesUsed_ = 0;
+        stats_ = {};
+        config_ = config;
+        running_ = true;
+    }
+
+    timer_.Start(config.intervalMilliseconds, [this]() { TakeCheckpoint(); });
+    logger_.Log(Logger::LogLevel::Info, "Checkpoint ring started, interval = " + std::to_string(config.intervalMilliseconds)
+        + " ms, budget = " + std::to_string(config.memoryBudgetBytes) + " bytes");
+    return true;
+}
+
+void CheckpointRing::Stop()
+{
+    // The timer callback takes the ring lock, so the timer is joined before it is taken here.
+    timer_.Stop();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_)
+    {
+        return;
+    }
+    running_ = false;
+    checkpoints_.clear();
+    baseImage_.clear();
+    baseImage_.shrink_to_fit();
+    baseDevices_.clear();
+    bytesUsed_ = 0;
+    logger_.Log(Logger::LogLevel::Info, "Checkpoint ring stopped.");
+}
+
+bool CheckpointRing::IsRunning() const
+{
+    return running_;
+}
+
+bool CheckpointRing::TakeCheckpoint()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_)
+    {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for a checkpoint: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    // Dirty pages come out of the log in ascending order, which FindPage relies on.
+    Checkpoint checkpoint;
+    memoryManager_->CollectDirtyPages(dirtyLog_, checkpoint.pageIndices);
+    const size_t pageSize = MemoryManager::GuestPageSize;
+    const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    checkpoint.pageData.resize(checkpoint.pageIndices.size() * pageSize);
+    for (size_t i = 0; i < checkpoint.pageIndices.size(); ++i)
+    {
+        memcpy(checkpoint.pageData.data() + i * pageSize, guestMemory + checkpoint.pageIndices[i] * pageSize, pageSize);
+    }
+    virtualProcessor_->SaveState(checkpoint.registers);
+    if (snapshotManager_ != nullptr)
+    {
+        snapshotManager_->SaveDeviceStates(checkpoint.devices);
+    }
+    virtualProcessor_->Resume();
+
+    checkpoint.timestamp = std::chrono::steady_clock::now();
+    bytesUsed_ += GetCheckpointBytes(checkpoint);
+    stats_.lastCheckpointPages = checkpoint.pageIndices.size();
+    checkpoints_.push_back(std::move(checkpoint));
+
+    while (bytesUsed_ > config_.memoryBudgetBytes && !checkpoints_.empty())
+    {
+        MergeOldest();
+    }
+
+    stats_.lastCheckpointMicroseconds = ElapsedMicroseconds(start);
+    return true;
+}
+
+HRESULT CheckpointRing::RestoreCheckpoint(size_t index)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ || index > checkpoints_.size())
+    {
+        logger_.Log(Logger::LogLevel::Error, "Unknown checkpoint index " + std::to_string(index));
+        return E_INVALIDARG;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for a restore: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return hr;
+    }
+
+    // Only pages written after the target checkpoint can differ from it.
+    std::vector<UINT64> pages;
+    memoryManager_->CollectDirtyPages(dirtyLog_, pages);
+    for (size_t i = index; i < checkpoints_.size(); ++i)
+    {
+        pages.insert(pages.end(), checkpoints_[i].pageIndices.begin(), checkpoints_[i].pageIndices.end());
+    }
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    const size_t pageSize = MemoryManager::GuestPageSize;
+    UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    for (UINT64 page : pages)
+    {
+        memcpy(guestMemory + page * pageSize, FindPage(index, page), pageSize);
+    }
+    // The rewound pages match the target checkpoint, so the next checkpoint must not capture them again.
+    memoryManager_->MarkPagesDirty(pages, dirtyLog_);
+
+    hr = virtualProcessor_->LoadState(index == 0 ? baseRegisters_ : checkpoints_[index - 1].registers);
+
+    // Queue indices, interrupt controller and UART state have to match the rewound RAM.
+    if (snapshotManager_ != nullptr)
+    {
+        for (const auto& [name, state] : index == 0 ? baseDevices_ : checkpoints_[index - 1].devices)
+        {
+            snapshotManager_->LoadDeviceState(name, state);
+        }
+    }
+
+    while (checkpoints_.size() > index)
+    {
+        bytesUsed_ -= GetCheckpointBytes(checkpoints_.back());
+        checkpoints_.pop_back();
+    }
+    virtualProcessor_->Resume();
+
+    stats_.lastRestorePages = pages.size();
+    stats_.lastRestoreMicroseconds = ElapsedMicroseconds(start);
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to load the checkpoint registers: HRESULT " + std::to_string(hr));
+        return hr;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Restored checkpoint " + std::to_string(index) + ", " + std::to_string(pages.size())
+        + " pages in " + std::to_string(stats_.lastRestoreMicroseconds) + " us");
+    return S_OK;
+}
+
+HRESULT CheckpointRing::Rewind(UINT64 milliseconds)
+{
+    size_t index = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto target = std::chrono::steady_clock::now() - std::chrono::milliseconds(milliseconds);
+        if (!running_ || baseTimestamp_ > target)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Checkpoint ring does not reach back " + std::to_string(milliseconds) + " ms");
+            return E_INVALIDARG;
+        }
+
+        while (index < checkpoints_.size() && checkpoints_[index].timestamp <= target)
+        {
+            index++;
+        }
+    }
+    return RestoreCheckpoint(index);
+}
+
+size_t CheckpointRing::GetCheckpointCount()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_ ? checkpoints_.size() + 1 : 0;
+}
+
+CheckpointRing::Stats CheckpointRing::GetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.checkpointCount = running_ ? checkpoints_.size() + 1 : 0;
+    stats.bytesUsed = bytesUsed_;
+    stats.oldestAgeMilliseconds = running_ ? ElapsedMicroseconds(baseTimestamp_) / 1000 : 0;
+    return stats;
+}
+
+void CheckpointRing::MergeOldest()
+{
+    Checkpoint& oldest = checkpoints_.front();
+    const size_t pageSize = MemoryManager::GuestPageSize;
+    for (size_t i = 0; i < oldest.pageIndices.size(); ++i)
+    {
+        memcpy(baseImage_.data() + oldest.pageIndices[i] * pageSize, oldest.pageData.data() + i * pageSize, pageSize);
+    }
+    bytesUsed_ -= GetCheckpointBytes(oldest);
+    baseRegisters_ = std::move(oldest.registers);
+    baseDevices_ = std::move(oldest.devices);
+    baseTimestamp_ = oldest.timestamp;
+    checkpoints_.pop_front();
+    stats_.mergedCheckpoints++;
+}
+
+size_t CheckpointRing::GetCheckpointBytes(const Checkpoint& checkpoint)
+{
+    size_t bytes = checkpoint.pageData.size() + checkpoint.registers.size() * sizeof(WHV_REGISTER_VALUE);
+    for (const auto& [name, state] : checkpoint.devices)
+    {
+        bytes += name.size() + state.size();
+    }
+    return bytes;
+}
+
+const UINT8* CheckpointRing::FindPage(size_t index, UINT64 pageIndex) const
+{
+    const size_t pageSize = MemoryManager::GuestPageSize;
+    for (size_t i = index; i > 0; --i)
+    {
+        const Checkpoint& checkpoint = checkpoints_[i - 1];
+        auto it = std::lower_bound(checkpoint.pageIndices.begin(), checkpoint.pageIndices.end(), pageIndex);
+        if (it != checkpoint.pageIndices.end() && *it == pageIndex)
+        {
+            return checkpoint.pageData.data() + (it - checkpoint.pageIndices.begin()) * pageSize;
+        }
+    }
+    return baseImage_.data() + pageIndex * pageSize;
+}
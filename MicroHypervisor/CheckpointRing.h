@@ -0,0 +1,169 @@
+#ifndef CHECKPOINTRING_H
+#define CHECKPOINTRING_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <Windows.h>
+#include <WinHvPlatform.h>
+#include "Logger.h"
+#include "Timer.h"
+#include "VirtualProcessor.h"
+#include "MemoryManager.h"
+#include "SnapshotManager.h"
+
+/// @brief Bounded in-memory ring of periodic incremental checkpoints to step the guest back in time \class CheckpointRing
+class CheckpointRing
+{
+public:
+    CheckpointRing();
+    ~CheckpointRing();
+
+    /**
+     * @brief Configuration of the checkpoint ring
+     *
+     */
+    struct Config
+    {
+        UINT32 intervalMilliseconds = 250;
+        size_t memoryBudgetBytes = 64 * 1024 * 1024;
+    };
+
+    /**
+     * @brief Statistics of the checkpoint ring
+     *
+     */
+    struct Stats
+    {
+        size_t checkpointCount;
+        size_t bytesUsed;
+        UINT64 mergedCheckpoints;
+        UINT64 oldestAgeMilliseconds;
+        UINT64 lastCheckpointMicroseconds;
+        size_t lastCheckpointPages;
+        UINT64 lastRestoreMicroseconds;
+        size_t lastRestorePages;
+    };
+
+    /**
+     * @brief Attaches the virtual processor, guest memory and devices to checkpoint
+     *
+     * @param virtualProcessor -> VirtualProcessor*, the virtual processor to checkpoint
+     * @param memoryManager -> MemoryManager*, the memory manager owning the guest RAM
+     * @param snapshotManager -> SnapshotManager*, provides the device state serializers, nullptr to checkpoint RAM and registers only
+     */
+    void Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager, SnapshotManager* snapshotManager);
+
+    /**
+     * @brief Captures the base image and starts taking periodic checkpoints
+     *
+     * @param config -> Config, interval and memory budget of the incremental checkpoints
+     * @return true -> if the ring was started
+     * @return false -> if the virtual processor or guest memory is not available
+     */
+    bool Start(const Config& config);
+
+    /**
+     * @brief Stops taking checkpoints and drops the ring
+     *
+     */
+    void Stop();
+
+    /**
+     * @brief Checks if periodic checkpoints are being taken
+     *
+     */
+    bool IsRunning() const;
+
+    /**
+     * @brief Takes one incremental checkpoint holding the registers, the device states and the pages dirtied since the previous one
+     *
+     * @return true -> if the checkpoint was taken
+     * @return false -> if the ring is not started or the virtual processor could not be paused
+     */
+    bool TakeCheckpoint();
+
+    /**
+     * @brief Restores the guest to a checkpoint of the ring, checkpoints after it are dropped,
+     *        only the pages that changed since that checkpoint are copied
+     *
+     * @param index -> Index of the checkpoint, 0 is the oldest
+     * @return HRESULT -> S_OK on success, E_INVALIDARG for an unknown index
+     */
+    HRESULT RestoreCheckpoint(size_t index);
+
+    /**
+     * @brief Steps the guest back to the newest checkpoint that is at least the given time old
+     *
+     * @param milliseconds -> How far to step back
+     * @return HRESULT -> S_OK on success, E_INVALIDARG if the ring does not reach back that far
+     */
+    HRESULT Rewind(UINT64 milliseconds);
+
+    /**
+     * @brief Gets the number of checkpoints in the ring, the base image included
+     *
+     */
+    size_t GetCheckpointCount();
+
+    /**
+     * @brief Gets the statistics of the checkpoint ring
+     *
+     */
+    Stats GetStats();
+
+private:
+    /**
+     * @brief An incremental checkpoint, pageIndices is sorted and pageData holds one page per index
+     *
+     */
+    struct Checkpoint
+    {
+        std::chrono::steady_clock::time_point timestamp;
+        std::vector<WHV_REGISTER_VALUE> registers;
+        std::vector<std::pair<std::string, std::vector<UINT8>>> devices;
+        std::vector<UINT64> pageIndices;
+        std::vector<UINT8> pageData;
+    };
+
+    /**
+     * @brief Gets the memory held by a checkpoint, counted against the budget
+     *
+     */
+    static size_t GetCheckpointBytes(const Checkpoint& checkpoint);
+
+    /**
+     * @brief Folds the oldest incremental checkpoint into the base image
+     *
+     */
+    void MergeOldest();
+
+    /**
+     * @brief Finds the content of a page as it was at the given checkpoint
+     *
+     */
+    const UINT8* FindPage(size_t index, UINT64 pageIndex) const;
+
+    VirtualProcessor* virtualProcessor_;
+    MemoryManager* memoryManager_;
+    SnapshotManager* snapshotManager_;
+    int dirtyLog_;
+    Config config_;
+    std::atomic<bool> running_;
+
+    std::chrono::steady_clock::time_point baseTimestamp_;
+    std::vector<WHV_REGISTER_VALUE> baseRegisters_;
+    std::vector<std::pair<std::string, std::vector<UINT8>>> baseDevices_;
+    std::vector<UINT8> baseImage_;
+    std::deque<Checkpoint> checkpoints_;
+    size_t bytesUsed_;
+
+    Timer timer_;
+    std::mutex mutex_;
+    Stats stats_;
+    Logger logger_;
+};
+
+#endif // CHECKPOINTRING_H
\ No newline at end of file
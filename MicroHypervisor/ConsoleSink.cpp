@@ -0,0 +1,47 @@
+#include "ConsoleSink.h"
+#include <iostream>
+
+ConsoleSink::ConsoleSink() : toStdout_(false)
+{
+
+}
+
+ConsoleSink::~ConsoleSink() {}
+
+bool ConsoleSink::Open(const std::string& outputPath)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    toStdout_ = outputPath == "-";
+    if (outputPath.empty() || toStdout_)
+    {
+        return true;
+    }
+    file_.open(outputPath, std::ios::binary | std::ios::trunc);
+    return file_.is_open();
+}
+
+void ConsoleSink::Write(const char* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.is_open())
+    {
+        file_.write(data, size);
+        file_.flush();
+    }
+    if (toStdout_)
+    {
+        std::cout.write(data, size);
+        std::cout.flush();
+    }
+    text_.append(data, size);
+    if (text_.size() > TextLimit)
+    {
+        text_.erase(0, text_.size() - TextLimit);
+    }
+}
+
+std::string ConsoleSink::GetText()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return text_;
+}
@@ -0,0 +1,46 @@
+#ifndef CONSOLESINK_H
+#define CONSOLESINK_H
+
+#include <fstream>
+#include <mutex>
+#include <string>
+
+/// @brief Host side of the guest consoles, the output goes to the GUI text and optionally to a file or stdout \class ConsoleSink
+class ConsoleSink
+{
+public:
+    ConsoleSink();
+    ~ConsoleSink();
+
+    /**
+     * @brief Selects where the output is written besides the GUI text
+     *
+     * @param outputPath -> File that receives the output, "-" for stdout, empty for the GUI only
+     * @return true -> if the output was opened
+     */
+    bool Open(const std::string& outputPath);
+
+    /**
+     * @brief Writes guest output, called from the console drain threads
+     *
+     * @param data -> Bytes written by the guest
+     * @param size -> Number of bytes
+     */
+    void Write(const char* data, size_t size);
+
+    /**
+     * @brief Gets the tail of the output for the GUI
+     *
+     */
+    std::string GetText();
+
+private:
+    static constexpr size_t TextLimit = 64 * 1024;
+
+    std::mutex mutex_;
+    std::ofstream file_;
+    bool toStdout_;
+    std::string text_;
+};
+
+#endif // CONSOLESINK_H
\ No newline at end of file
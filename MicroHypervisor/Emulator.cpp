@@ -1,97 +1,109 @@
 #include "Emulator.h"
-#include <iostream>
+#include "VirtualProcessor.h"
+#include "EventRecorder.h"
+#include "IoBus.h"
+#include "MmioBus.h"
+#include "MemoryManager.h"
+#include "Trace.h"
+
+static EventRecorder* GetEventRecorder(void* Context)
+{
+    return Context != nullptr ? static_cast<VirtualProcessor*>(Context)->GetEventRecorder() : nullptr;
+}
+
+static IoBus* GetIoBus(void* Context)
+{
+    return Context != nullptr ? static_cast<VirtualProcessor*>(Context)->GetIoBus() : nullptr;
+}
 
 static LONG __stdcall EIoPortCallback(void* Context, WHV_EMULATOR_IO_ACCESS_INFO* IoAccess)
 {
+    IoBus* ioBus = GetIoBus(Context);
+    const UINT8 size = static_cast<UINT8>(IoAccess->AccessSize);
     if (IoAccess->Direction == 0)
     {
-        if (IoAccess->Port == 0x60)
+        IoAccess->Data = ioBus != nullptr ? ioBus->Read(IoAccess->Port, size) : 0xFFFFFFFF;
+        if (EventRecorder* recorder = GetEventRecorder(Context))
         {
-            IoAccess->Data = 0xFF;
-            std::cout << "[SUCCESS]: Read from I/O port 0x" << std::hex << IoAccess->Port
-                << ": " << std::hex << IoAccess->Data << std::dec << std::endl;
-        }
-        else
-        {
-            std::cerr << "[ERROR]: Read from unsupported I/O port: 0x" << std::hex << IoAccess->Port << std::dec << std::endl;
-            return E_INVALIDARG;
+            IoAccess->Data = recorder->OnIoRead(IoAccess->Port, size, IoAccess->Data);
         }
     }
-    else
+    else if (ioBus != nullptr)
     {
-        if (IoAccess->Port == 0x60)
-        {
-            std::cout << "[SUCCESS]: Wrote to I/O port 0x" << std::hex << IoAccess->Port
-                << ": " << std::hex << IoAccess->Data << std::dec << std::endl;
-        }
-        else
-        {
-            std::cerr << "[ERROR]: Write to unsupported I/O port: 0x" << std::hex << IoAccess->Port << std::dec << std::endl;
-            return E_INVALIDARG;
-        }
+        ioBus->Write(IoAccess->Port, size, IoAccess->Data);
     }
+    MH_TRACE(IoCallback, IoAccess->Port | (size << 16) | (IoAccess->Direction << 24), IoAccess->Data, 0);
     return S_OK;
 }
 
 static LONG __stdcall EMemoryCallback(void* Context, WHV_EMULATOR_MEMORY_ACCESS_INFO* MemoryAccess)
 {
+    VirtualProcessor* virtualProcessor = static_cast<VirtualProcessor*>(Context);
+    MmioBus* mmioBus = virtualProcessor != nullptr ? virtualProcessor->GetMmioBus() : nullptr;
+    MemoryManager* memoryManager = virtualProcessor != nullptr ? virtualProcessor->GetMemoryManager() : nullptr;
+    const UINT32 vpIndex = virtualProcessor != nullptr ? virtualProcessor->GetIndex() : 0;
+    const UINT8 size = MemoryAccess->AccessSize;
+    if (size == 0 || size > sizeof(UINT64))
+    {
+        return E_INVALIDARG;
+    }
+
+    // Only claimed addresses go to a device, string IO and emulated moves also touch guest RAM.
+    UINT64 value = ~0ull;
     if (MemoryAccess->Direction == 0)
     {
-        if (MemoryAccess->GpaAddress == 0x1000)
+        if (mmioBus != nullptr && mmioBus->Read(vpIndex, MemoryAccess->GpaAddress, size, value))
         {
-            MemoryAccess->Data[0] = 0xAB;
-            std::cout << "[SUCCESS]: Read from memory address 0x" << std::hex << MemoryAccess->GpaAddress
-                << ": " << std::hex << (int)MemoryAccess->Data[0] << std::dec << std::endl;
+            memcpy(MemoryAccess->Data, &value, size);
+            if (EventRecorder* recorder = GetEventRecorder(Context))
+            {
+                recorder->OnMmioRead(MemoryAccess->GpaAddress, size, MemoryAccess->Data);
+            }
+        }
+        else if (UINT8* host = memoryManager != nullptr ? memoryManager->GetHostRange(MemoryAccess->GpaAddress, size) : nullptr)
+        {
+            memcpy(MemoryAccess->Data, host, size);
+            value = 0;
+            memcpy(&value, host, size);
         }
         else
         {
-            std::cerr << "[ERROR]: Read from unsupported memory address: 0x"
-                << std::hex << MemoryAccess->GpaAddress << std::dec << std::endl;
-            return E_INVALIDARG;
+            memcpy(MemoryAccess->Data, &value, size);
         }
     }
     else
     {
-        if (MemoryAccess->GpaAddress == 0x1000)
-        {
-            std::cout << "[SUCCESS]: Wrote to memory address 0x" << std::hex << MemoryAccess->GpaAddress
-                << ": " << std::hex << (int)MemoryAccess->Data[0] << std::dec << std::endl;
-        }
-        else
+        value = 0;
+        memcpy(&value, MemoryAccess->Data, size);
+        if (mmioBus == nullptr || !mmioBus->Write(vpIndex, MemoryAccess->GpaAddress, size, value))
         {
-            std::cerr << "[ERROR]: Write to unsupported memory address: 0x"
-                << std::hex << MemoryAccess->GpaAddress << std::dec << std::endl;
-            return E_INVALIDARG;
+            UINT8* host = memoryManager != nullptr ? memoryManager->GetHostRange(MemoryAccess->GpaAddress, size) : nullptr;
+            if (host != nullptr)
+            {
+                memcpy(host, MemoryAccess->Data, size);
+                memoryManager->MarkDirty(MemoryAccess->GpaAddress, size);
+            }
         }
     }
+    MH_TRACE(MmioCallback, size | (MemoryAccess->Direction << 8), MemoryAccess->GpaAddress, value);
     return S_OK;
 }
 
 static LONG __stdcall EGetVirtualProcessorRegistersCallback(void* Context, const WHV_REGISTER_NAME* RegisterNames, UINT32 RegisterCount, WHV_REGISTER_VALUE* RegisterValues)
 {
-    for (UINT32 i = 0; i < RegisterCount; ++i)
-    {
-        RegisterValues[i].Reg64 = 0xDEADBEEF;
-        std::cout << "Register " << RegisterNames[i] << " read value: " << std::hex << RegisterValues[i].Reg64 << std::dec << std::endl;
-    }
-    return S_OK;
+    return static_cast<VirtualProcessor*>(Context)->ReadRegisters(RegisterNames, RegisterCount, RegisterValues);
 }
 
 static LONG __stdcall ESetVirtualProcessorRegistersCallback(void* Context, const WHV_REGISTER_NAME* RegisterNames, UINT32 RegisterCount, const WHV_REGISTER_VALUE* RegisterValues)
 {
-    for (UINT32 i = 0; i < RegisterCount; ++i)
-    {
-        std::cout << "Register " << RegisterNames[i] << " set value: " << std::hex << RegisterValues[i].Reg64 << std::dec << std::endl;
-    }
-    return S_OK;
+    return static_cast<VirtualProcessor*>(Context)->WriteRegisters(RegisterNames, RegisterCount, RegisterValues);
 }
 
 static LONG __stdcall ETranslateGvaPageCallback(void* Context, WHV_GUEST_VIRTUAL_ADDRESS Gva, WHV_TRANSLATE_GVA_FLAGS TranslateFlags, WHV_TRANSLATE_GVA_RESULT_CODE* TranslationResult, UINT64* Gpa)
 {
-    *Gpa = Gva;
-    *TranslationResult = WHvTranslateGvaResultSuccess;
-    std::cout << "Translated GVA: 0x" << std::hex << Gva << " to GPA: 0x" << std::hex << *Gpa << std::dec << std::endl;
-    return S_OK;
+    HRESULT result = static_cast<VirtualProcessor*>(Context)->TranslateGva(Gva, TranslateFlags, *TranslationResult, *Gpa);
+    MH_TRACE(TranslateGva, *TranslationResult, Gva, *Gpa);
+    return result;
 }
 
 Emulator::Emulator() : handle_(nullptr), logger_("Emulator.log")
@@ -141,3 +153,29 @@ bool Emulator::Initialize()
     }
     return true;
 }
+
+HRESULT Emulator::EmulateIo(VirtualProcessor* virtualProcessor, const WHV_RUN_VP_EXIT_CONTEXT& exitContext)
+{
+    WHV_EMULATOR_STATUS status = {};
+    HRESULT result = WHvEmulatorTryIoEmulation(handle_, virtualProcessor, &exitContext.VpContext, &exitContext.IoPortAccess, &status);
+    if (FAILED(result) || !status.EmulationSuccessful)
+    {
+        logger_.Log(Logger::LogLevel::Error, "IO emulation of port " + std::to_string(exitContext.IoPortAccess.PortNumber)
+            + " failed: HRESULT " + std::to_string(result) + ", status = " + std::to_string(status.AsUINT32));
+        return FAILED(result) ? result : E_FAIL;
+    }
+    return S_OK;
+}
+
+HRESULT Emulator::EmulateMmio(VirtualProcessor* virtualProcessor, const WHV_RUN_VP_EXIT_CONTEXT& exitContext)
+{
+    WHV_EMULATOR_STATUS status = {};
+    HRESULT result = WHvEmulatorTryMmioEmulation(handle_, virtualProcessor, &exitContext.VpContext, &exitContext.MemoryAccess, &status);
+    if (FAILED(result) || !status.EmulationSuccessful)
+    {
+        logger_.Log(Logger::LogLevel::Error, "MMIO emulation at GPA " + std::to_string(exitContext.MemoryAccess.Gpa)
+            + " failed: HRESULT " + std::to_string(result) + ", status = " + std::to_string(status.AsUINT32));
+        return FAILED(result) ? result : E_FAIL;
+    }
+    return S_OK;
+}
@@ -5,7 +5,9 @@
 #include <WinHvEmulation.h>
 #include "Logger.h"
 
-/// @brief Emulator class for the Hypervisor \class Emulator
+class VirtualProcessor;
+
+/// @brief Instruction emulator of one Virtual Processor, the callbacks run against the state of that vCPU \class Emulator
 class Emulator
 {
 public:
@@ -20,11 +22,28 @@ public:
      */
     bool Initialize();
 
+    /**
+     * @brief Emulates the IO port instruction of an exit, the port access is dispatched on the IO bus of the vCPU
+     *
+     * @param virtualProcessor -> VirtualProcessor*, the vCPU that exited, passed as callback context
+     * @param exitContext -> Exit context of the IO port access exit
+     * @return HRESULT -> S_OK if the instruction was emulated
+     */
+    HRESULT EmulateIo(VirtualProcessor* virtualProcessor, const WHV_RUN_VP_EXIT_CONTEXT& exitContext);
+
+    /**
+     * @brief Emulates the memory access instruction of an exit, the access is dispatched on the MMIO bus of the vCPU
+     *
+     * @param virtualProcessor -> VirtualProcessor*, the vCPU that exited, passed as callback context
+     * @param exitContext -> Exit context of the memory access exit
+     * @return HRESULT -> S_OK if the instruction was emulated
+     */
+    HRESULT EmulateMmio(VirtualProcessor* virtualProcessor, const WHV_RUN_VP_EXIT_CONTEXT& exitContext);
+
 private:
     WHV_EMULATOR_HANDLE handle_;
     WHV_EMULATOR_CALLBACKS callbacks_;
     Logger logger_;
 };
 
-
 #endif // EMULATOR_H
\ No newline at end of file
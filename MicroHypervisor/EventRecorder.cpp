@@ -0,0 +1,436 @@
+#include "EventRecorder.h"
+#include "SnapshotManager.h"
+#include <iterator>
+
+namespace
+{
+    constexpr UINT32 LogMagic = 0x5252484D; // "MHRR"
+    constexpr UINT32 LogVersion = 3;
+    constexpr UINT64 NoSnapshot = SnapshotManager::InvalidSnapshotId;
+    constexpr size_t FlushThreshold = 256 * 1024;
+
+    // Flags carried in the size field of an interrupt event.
+    constexpr UINT8 InterruptLevel = 0x1;
+    constexpr UINT8 InterruptPic = 0x2;
+
+#pragma pack(push, 1)
+    struct LogHeader
+    {
+        UINT32 magic;
+        UINT32 version;
+        UINT64 snapshotId;
+    };
+#pragma pack(pop)
+
+    inline void PutVarint(std::vector<UINT8>& out, UINT64 value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<UINT8>(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(static_cast<UINT8>(value));
+    }
+
+    inline bool GetVarint(const std::vector<UINT8>& in, size_t& offset, UINT64& value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && offset < in.size(); shift += 7)
+        {
+            UINT8 byte = in[offset++];
+            value |= static_cast<UINT64>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+EventRecorder::EventRecorder() : mode_(Mode::Off), snapshotManager_(nullptr), exitCount_(0), events_(0), bytes_(0),
+    divergences_(0), lastExit_(0), writerStop_(false), replayOffset_(0), nextOffset_(0), peeked_(false), next_(),
+    logger_("EventRecorder.log")
+{
+
+}
+
+EventRecorder::~EventRecorder()
+{
+    Stop();
+}
+
+void EventRecorder::Attach(SnapshotManager* snapshotManager)
+{
+    snapshotManager_ = snapshotManager;
+}
+
+bool EventRecorder::StartRecording(const std::string& path)
+{
+    Stop();
+
+    file_.open(path, std::ios::binary | std::ios::trunc);
+    if (!file_)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to create event log " + path);
+        return false;
+    }
+
+    // The snapshot is referenced by its ID, indices shift when older snapshots are deleted.
+    LogHeader header = { LogMagic, LogVersion, NoSnapshot };
+    if (snapshotManager_ != nullptr)
+    {
+        header.snapshotId = snapshotManager_->SaveSnapshot();
+        if (header.snapshotId == NoSnapshot)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to take the start snapshot of event log " + path);
+            file_.close();
+            return false;
+        }
+    }
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        buffer_.clear();
+        buffer_.reserve(FlushThreshold + 64);
+        pending_.clear();
+        writerStop_ = false;
+        lastExit_ = 0;
+    }
+    exitCount_ = 0;
+    events_ = 0;
+    bytes_ = sizeof(header);
+    divergences_ = 0;
+    writer_ = std::thread(&EventRecorder::WriterThread, this);
+    mode_ = Mode::Record;
+
+    logger_.Log(Logger::LogLevel::Info, "Recording guest inputs to " + path);
+    return true;
+}
+
+bool EventRecorder::StartReplay(const std::string& path)
+{
+    Stop();
+
+    std::ifstream file(path, std::ios::binary);
+    LogHeader header = {};
+    if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || header.magic != LogMagic || header.version != LogVersion)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to read event log " + path);
+        return false;
+    }
+
+    if (header.snapshotId != NoSnapshot)
+    {
+        if (snapshotManager_ == nullptr || !snapshotManager_->RestoreSnapshotById(header.snapshotId))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Snapshot " + std::to_string(header.snapshotId)
+                + " of event log " + path + " is not available.");
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        replay_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        replayOffset_ = 0;
+        peeked_ = false;
+        replayInterrupts_.clear();
+        lastExit_ = 0;
+    }
+    exitCount_ = 0;
+    events_ = 0;
+    bytes_ = sizeof(header) + replay_.size();
+    divergences_ = 0;
+    mode_ = Mode::Replay;
+
+    logger_.Log(Logger::LogLevel::Info, "Replaying guest inputs from " + path + ", " + std::to_string(replay_.size()) + " bytes");
+    return true;
+}
+
+void EventRecorder::Stop()
+{
+    Mode mode = mode_.exchange(Mode::Off);
+    if (mode == Mode::Record)
+    {
+        {
+            std::lock_guard<std::mutex> lock(recordMutex_);
+            pending_.insert(pending_.end(), buffer_.begin(), buffer_.end());
+            buffer_.clear();
+            writerStop_ = true;
+        }
+        writerCv_.notify_one();
+        writer_.join();
+        file_.close();
+        logger_.Log(Logger::LogLevel::Info, "Recording stopped after " + std::to_string(events_) + " events, "
+            + std::to_string(bytes_) + " bytes, " + std::to_string(exitCount_) + " exits");
+    }
+    else if (mode == Mode::Replay)
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        replay_.clear();
+        logger_.Log(Logger::LogLevel::Info, "Replay stopped after " + std::to_string(events_) + " events, "
+            + std::to_string(divergences_) + " divergences");
+    }
+}
+
+EventRecorder::Mode EventRecorder::GetMode() const
+{
+    return mode_;
+}
+
+void EventRecorder::OnExit()
+{
+    if (mode_ != Mode::Off)
+    {
+        exitCount_++;
+    }
+}
+
+UINT32 EventRecorder::OnIoRead(UINT16 port, UINT8 size, UINT32 value)
+{
+    Mode mode = mode_;
+    if (mode == Mode::Record)
+    {
+        Append(EventType::IoRead, port, size, value);
+    }
+    else if (mode == Mode::Replay)
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        Event event;
+        if (PeekInputEvent(event) && event.type == EventType::IoRead && event.key == port)
+        {
+            if (event.exit != exitCount_)
+            {
+                Diverged("IO read of port " + std::to_string(port) + " at exit " + std::to_string(exitCount_)
+                    + ", recorded at exit " + std::to_string(event.exit));
+            }
+            ConsumeEvent();
+            return static_cast<UINT32>(event.value);
+        }
+        Diverged("unexpected IO read of port " + std::to_string(port) + " at exit " + std::to_string(exitCount_));
+    }
+    return value;
+}
+
+void EventRecorder::OnMmioRead(UINT64 gpa, UINT8 size, UINT8* data)
+{
+    Mode mode = mode_;
+    if (mode == Mode::Record)
+    {
+        UINT64 value = 0;
+        memcpy(&value, data, size);
+        Append(EventType::MmioRead, gpa, size, value);
+    }
+    else if (mode == Mode::Replay)
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        Event event;
+        if (PeekInputEvent(event) && event.type == EventType::MmioRead && event.key == gpa && event.size == size)
+        {
+            if (event.exit != exitCount_)
+            {
+                Diverged("MMIO read of " + std::to_string(gpa) + " at exit " + std::to_string(exitCount_)
+                    + ", recorded at exit " + std::to_string(event.exit));
+            }
+            ConsumeEvent();
+            memcpy(data, &event.value, size);
+            return;
+        }
+        Diverged("unexpected MMIO read of " + std::to_string(gpa) + " at exit " + std::to_string(exitCount_));
+    }
+}
+
+UINT64 EventRecorder::OnTimerRead(UINT64 value)
+{
+    Mode mode = mode_;
+    if (mode == Mode::Record)
+    {
+        Append(EventType::TimerRead, 0, 0, value);
+    }
+    else if (mode == Mode::Replay)
+    {
+        std::lock_guard<std::mutex> lock(recordMutex_);
+        Event event;
+        if (PeekInputEvent(event) && event.type == EventType::TimerRead)
+        {
+            ConsumeEvent();
+            return event.value;
+        }
+        Diverged("unexpected timer read at exit " + std::to_string(exitCount_));
+    }
+    return value;
+}
+
+void EventRecorder::RecordInterrupt(UINT32 vector, UINT32 vpIndex, bool levelTriggered, bool fromPic)
+{
+    if (mode_ == Mode::Record)
+    {
+        Append(EventType::Interrupt, vector, static_cast<UINT8>((levelTriggered ? InterruptLevel : 0) | (fromPic ? InterruptPic : 0)), vpIndex);
+    }
+}
+
+bool EventRecorder::PeekReplayInterrupt(UINT32 vpIndex, UINT32& vector, bool& levelTriggered, bool& fromPic)
+{
+    if (mode_ != Mode::Replay)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(recordMutex_);
+    Event event;
+    if (!replayInterrupts_.empty())
+    {
+        event = replayInterrupts_.front();
+    }
+    else if (!PeekEvent(event) || event.type != EventType::Interrupt)
+    {
+        return false;
+    }
+
+    if (event.exit > exitCount_ || event.value != vpIndex)
+    {
+        return false;
+    }
+    vector = static_cast<UINT32>(event.key);
+    levelTriggered = (event.size & InterruptLevel) != 0;
+    fromPic = (event.size & InterruptPic) != 0;
+    return true;
+}
+
+void EventRecorder::ConsumeReplayInterrupt()
+{
+    std::lock_guard<std::mutex> lock(recordMutex_);
+    Event event;
+    if (!replayInterrupts_.empty())
+    {
+        replayInterrupts_.pop_front();
+        events_++;
+        FinishIfDone();
+    }
+    else if (PeekEvent(event) && event.type == EventType::Interrupt)
+    {
+        ConsumeEvent();
+        events_++;
+    }
+}
+
+EventRecorder::Stats EventRecorder::GetStats() const
+{
+    return { exitCount_, events_, bytes_, divergences_ };
+}
+
+void EventRecorder::Append(EventType type, UINT64 key, UINT8 size, UINT64 value)
+{
+    std::lock_guard<std::mutex> lock(recordMutex_);
+    const size_t before = buffer_.size();
+    const UINT64 exit = exitCount_;
+    PutVarint(buffer_, exit - lastExit_);
+    buffer_.push_back(static_cast<UINT8>(type));
+    PutVarint(buffer_, key);
+    buffer_.push_back(size);
+    PutVarint(buffer_, value);
+    lastExit_ = exit;
+    events_++;
+    bytes_ += buffer_.size() - before;
+
+    // Never block the vCPU on the disk, if the writer is behind the buffer just keeps growing.
+    if (buffer_.size() >= FlushThreshold && pending_.empty())
+    {
+        buffer_.swap(pending_);
+        writerCv_.notify_one();
+    }
+}
+
+bool EventRecorder::PeekEvent(Event& event)
+{
+    if (!peeked_)
+    {
+        size_t offset = replayOffset_;
+        UINT64 delta = 0;
+        UINT64 key = 0;
+        UINT64 value = 0;
+        if (offset >= replay_.size() || !GetVarint(replay_, offset, delta) || offset + 1 > replay_.size())
+        {
+            return false;
+        }
+        EventType type = static_cast<EventType>(replay_[offset++]);
+        if (!GetVarint(replay_, offset, key) || offset + 1 > replay_.size())
+        {
+            return false;
+        }
+        UINT8 size = replay_[offset++];
+        if (!GetVarint(replay_, offset, value))
+        {
+            return false;
+        }
+
+        next_ = { lastExit_ + delta, type, key, size, value };
+        nextOffset_ = offset;
+        peeked_ = true;
+    }
+    event = next_;
+    return true;
+}
+
+bool EventRecorder::PeekInputEvent(Event& event)
+{
+    // Interrupts recorded ahead of the next input are parked until they are due, so they are never lost.
+    while (PeekEvent(event) && event.type == EventType::Interrupt)
+    {
+        replayInterrupts_.push_back(event);
+        ConsumeEvent();
+    }
+    return PeekEvent(event);
+}
+
+void EventRecorder::ConsumeEvent()
+{
+    replayOffset_ = nextOffset_;
+    lastExit_ = next_.exit;
+    peeked_ = false;
+    if (next_.type != EventType::Interrupt)
+    {
+        events_++;
+    }
+    FinishIfDone();
+}
+
+void EventRecorder::FinishIfDone()
+{
+    if (replayOffset_ >= replay_.size() && replayInterrupts_.empty())
+    {
+        mode_ = Mode::Off;
+        logger_.Log(Logger::LogLevel::Info, "Replay finished after " + std::to_string(events_) + " events, "
+            + std::to_string(divergences_) + " divergences");
+    }
+}
+
+void EventRecorder::Diverged(const std::string& message)
+{
+    divergences_++;
+    logger_.Log(Logger::LogLevel::Warning, "Replay diverged: " + message);
+}
+
+void EventRecorder::WriterThread()
+{
+    std::vector<UINT8> chunk;
+    std::unique_lock<std::mutex> lock(recordMutex_);
+    while (true)
+    {
+        writerCv_.wait(lock, [this]() { return !pending_.empty() || writerStop_; });
+        if (pending_.empty() && writerStop_)
+        {
+            break;
+        }
+
+        chunk.swap(pending_);
+        lock.unlock();
+        file_.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+        chunk.clear();
+        lock.lock();
+    }
+    file_.flush();
+}
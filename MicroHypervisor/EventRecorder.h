@@ -0,0 +1,210 @@
+#ifndef EVENTRECORDER_H
+#define EVENTRECORDER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <Windows.h>
+#include "Logger.h"
+
+class SnapshotManager;
+
+/// @brief Deterministic record/replay of the non-deterministic guest inputs \class EventRecorder
+class EventRecorder
+{
+public:
+    EventRecorder();
+    ~EventRecorder();
+
+    /**
+     * @brief Enum with the possible modes of the recorder
+     *
+     */
+    enum class Mode
+    {
+        Off,
+        Record,
+        Replay
+    };
+
+    /**
+     * @brief Enum with the recorded event types
+     *
+     */
+    enum class EventType : UINT8
+    {
+        IoRead = 1,
+        MmioRead = 2,
+        Interrupt = 3,
+        TimerRead = 4,
+    };
+
+    /**
+     * @brief Statistics of the recorder
+     *
+     */
+    struct Stats
+    {
+        UINT64 exitCount;
+        UINT64 events;
+        UINT64 bytes;
+        UINT64 divergences;
+    };
+
+    /**
+     * @brief Attaches the snapshot manager, recordings start from a snapshot and replays restore it
+     *
+     * @param snapshotManager -> SnapshotManager*, the snapshot manager of the VM
+     */
+    void Attach(SnapshotManager* snapshotManager);
+
+    /**
+     * @brief Takes a snapshot and starts recording the guest inputs into a binary event log
+     *
+     * @param path -> Path of the event log
+     * @return true -> if recording started
+     * @return false -> if the event log could not be created
+     */
+    bool StartRecording(const std::string& path);
+
+    /**
+     * @brief Restores the snapshot of a recording and starts feeding its inputs back to the guest
+     *
+     * @param path -> Path of the event log
+     * @return true -> if replay started
+     * @return false -> if the event log could not be read or its snapshot is gone
+     */
+    bool StartReplay(const std::string& path);
+
+    /**
+     * @brief Stops recording or replaying, a recording is flushed to disk
+     *
+     */
+    void Stop();
+
+    /**
+     * @brief Gets the current mode of the recorder
+     *
+     */
+    Mode GetMode() const;
+
+    /**
+     * @brief Advances the exit clock, called by the virtual processor after every exit caused by the guest
+     *
+     */
+    void OnExit();
+
+    /**
+     * @brief Records or replays the value of an IO port read
+     *
+     * @param port -> Port that was read
+     * @param size -> Access size in bytes
+     * @param value -> Value produced by the device model
+     * @return UINT32 -> the value to hand to the guest
+     */
+    UINT32 OnIoRead(UINT16 port, UINT8 size, UINT32 value);
+
+    /**
+     * @brief Records or replays the data of an MMIO read, in replay the data is overwritten
+     *
+     * @param gpa -> Guest physical address that was read
+     * @param size -> Access size in bytes, at most 8
+     * @param data -> Data produced by the device model
+     */
+    void OnMmioRead(UINT64 gpa, UINT8 size, UINT8* data);
+
+    /**
+     * @brief Records or replays the value of an emulated timer read
+     *
+     * @param value -> Value of the timer
+     * @return UINT64 -> the value to hand to the guest
+     */
+    UINT64 OnTimerRead(UINT64 value);
+
+    /**
+     * @brief Records an interrupt at the point it is injected into the guest
+     *
+     * @param vector -> Interrupt vector
+     * @param vpIndex -> Virtual processor the interrupt was injected into
+     * @param levelTriggered -> Trigger mode of the interrupt
+     * @param fromPic -> true if the vector came from the PIC and bypassed the local APIC
+     */
+    void RecordInterrupt(UINT32 vector, UINT32 vpIndex, bool levelTriggered, bool fromPic);
+
+    /**
+     * @brief Gets the next recorded interrupt of a virtual processor that is due at the current exit, without consuming it
+     *
+     * @param vpIndex -> Virtual processor that is about to enter the guest
+     * @param vector -> receives the interrupt vector
+     * @param levelTriggered -> receives the trigger mode of the interrupt
+     * @param fromPic -> receives true if the vector came from the PIC
+     * @return true -> if an interrupt is due
+     */
+    bool PeekReplayInterrupt(UINT32 vpIndex, UINT32& vector, bool& levelTriggered, bool& fromPic);
+
+    /**
+     * @brief Consumes the interrupt returned by PeekReplayInterrupt once it has been injected
+     *
+     */
+    void ConsumeReplayInterrupt();
+
+    /**
+     * @brief Gets the statistics of the recorder
+     *
+     */
+    Stats GetStats() const;
+
+private:
+    /**
+     * @brief A decoded event of the replay log
+     *
+     */
+    struct Event
+    {
+        UINT64 exit;
+        EventType type;
+        UINT64 key;
+        UINT8 size;
+        UINT64 value;
+    };
+
+    void Append(EventType type, UINT64 key, UINT8 size, UINT64 value);
+    bool PeekEvent(Event& event);
+    bool PeekInputEvent(Event& event);
+    void ConsumeEvent();
+    void FinishIfDone();
+    void Diverged(const std::string& message);
+    void WriterThread();
+
+    std::atomic<Mode> mode_;
+    SnapshotManager* snapshotManager_;
+    std::atomic<UINT64> exitCount_;
+    std::atomic<UINT64> events_;
+    std::atomic<UINT64> bytes_;
+    std::atomic<UINT64> divergences_;
+
+    std::mutex recordMutex_;
+    UINT64 lastExit_;
+    std::vector<UINT8> buffer_;
+    std::vector<UINT8> pending_;
+    std::condition_variable writerCv_;
+    std::thread writer_;
+    bool writerStop_;
+    std::ofstream file_;
+
+    std::vector<UINT8> replay_;
+    size_t replayOffset_;
+    size_t nextOffset_;
+    bool peeked_;
+    Event next_;
+    std::deque<Event> replayInterrupts_;
+
+    Logger logger_;
+};
+
+#endif // EVENTRECORDER_H
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <limits>
 #include <conio.h>
+#include "Trace.h"
 #include "Registers.h"
 #include "PtrUtils.h"
 
@@ -10,8 +11,9 @@ HypervisorStateMachine::HypervisorStateMachine(size_t memorySize)
     : memorySize_(memorySize), currentState_(State::Initializing), running_(false),
     virtualProcessor_(nullptr), gui_(nullptr), g_pd3dDevice(NULL), g_pDXGIFactory(NULL),
     g_pd3dDeviceContext(NULL), g_pSwapChain(NULL), g_mainRenderTargetView(NULL), hwnd(NULL), 
-    interruptController_(partition_.GetHandle()), snapshotManager_(partition_.GetHandle()), partition_(), 
-    memoryManager_(partition_.GetHandle(), memorySize_), logger_("MicroHypervisor.log")
+    interruptController_(partition_.GetHandle()), serial_(&interruptController_), snapshotManager_(partition_.GetHandle()), partition_(), 
+    memoryManager_(partition_.GetHandle(), memorySize_), pvConsole_(&memoryManager_),
+    disk_(&memoryManager_, &interruptController_), logger_("MicroHypervisor.log")
 {
     logger_.Log(Logger::LogLevel::Info, "HypervisorStateMachine initialized.");
 }
@@ -20,6 +22,10 @@ HypervisorStateMachine::~HypervisorStateMachine()
 {
     logger_.Log(Logger::LogLevel::Info, "HypervisorStateMachine destroyed.");
     Stop();
+    if (!traceOutputPath_.empty() && !Trace::Dump(traceOutputPath_))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to write the trace to " + traceOutputPath_);
+    }
     CleanupDeviceD3D();
     tryDeletePtr(virtualProcessor_);
 }
@@ -30,6 +36,20 @@ void HypervisorStateMachine::Start()
     SetupPartition();
     InitializeComponents();
     memoryManager_.UpdateMemorySize(memorySize_);
+    if (migrateListenPort_ > 0 && !migrationManager_.ReceiveVM(migrateListenPort_))
+    {
+        TransitionState(State::Error);
+        logger_.Log(Logger::LogLevel::Error, "Failed to receive the incoming migration.");
+        return;
+    }
+    if (startupRecorderMode_ == EventRecorder::Mode::Record)
+    {
+        HandleMenuOption(MenuOption::StartRecording);
+    }
+    else if (startupRecorderMode_ == EventRecorder::Mode::Replay)
+    {
+        HandleMenuOption(MenuOption::StartReplay);
+    }
     RunHypervisor();
 }
 
@@ -175,10 +195,48 @@ void HypervisorStateMachine::RunGui()
                 {
                     HandleMenuOption(MenuOption::SaveSnapshot);
                 }
+                if (ImGui::MenuItem("Save Live Snapshot"))
+                {
+                    HandleMenuOption(MenuOption::SaveLiveSnapshot);
+                }
                 if (ImGui::MenuItem("Restore Snapshot"))
                 {
                     HandleMenuOption(MenuOption::RestoreSnapshot);
                 }
+                if (ImGui::MenuItem("Capture Reset Point"))
+                {
+                    HandleMenuOption(MenuOption::CaptureResetPoint);
+                }
+                if (ImGui::MenuItem("Fast Reset"))
+                {
+                    HandleMenuOption(MenuOption::FastReset);
+                }
+                if (ImGui::MenuItem("Migrate VM"))
+                {
+                    HandleMenuOption(MenuOption::MigrateVM);
+                }
+                ImGui::Separator();
+                if (ImGui::MenuItem("Time Travel Checkpoints", nullptr, checkpointRing_.IsRunning()))
+                {
+                    HandleMenuOption(MenuOption::ToggleCheckpoints);
+                }
+                if (ImGui::MenuItem("Rewind"))
+                {
+                    HandleMenuOption(MenuOption::Rewind);
+                }
+                ImGui::Separator();
+                if (ImGui::MenuItem("Start Recording"))
+                {
+                    HandleMenuOption(MenuOption::StartRecording);
+                }
+                if (ImGui::MenuItem("Start Replay"))
+                {
+                    HandleMenuOption(MenuOption::StartReplay);
+                }
+                if (ImGui::MenuItem("Stop Recording/Replay"))
+                {
+                    HandleMenuOption(MenuOption::StopRecording);
+                }
                 ImGui::Separator();
                 if (ImGui::MenuItem("Dump Registers"))
                 {
@@ -283,6 +341,134 @@ void HypervisorStateMachine::RunGui()
         ImGui::Text("Memory Usage: %zu / %zu bytes", static_cast<size_t>(memoryUsage_), memorySize_);
         ImGui::Text("Active Threads: %d", static_cast<int>(activeThreadCount_));
 
+        auto resetStats = snapshotManager_.GetResetStats();
+        ImGui::Text("Fast Resets: %llu (%.1f/s), last: %llu us, %zu pages",
+            resetStats.resetCount, resetStats.resetsPerSecond, resetStats.lastResetMicroseconds, resetStats.lastPagesRestored);
+
+        auto pageStoreStats = snapshotManager_.GetPageStoreStats();
+        ImGui::Text("Snapshots: %zu, pages: %zu logical / %zu unique (dedup %.2fx)",
+            snapshotManager_.GetSnapshotCount(), pageStoreStats.logicalPages, pageStoreStats.uniquePages, pageStoreStats.dedupRatio);
+        if (snapshotManager_.GetSnapshotCount() > 0)
+        {
+            auto liveStats = snapshotManager_.GetLiveSnapshotStats(snapshotManager_.GetSnapshotCount() - 1);
+            ImGui::Text("Last Snapshot: %u rounds, pause %llu us, %zu pages in pause window",
+                liveStats.rounds, liveStats.pauseMicroseconds, liveStats.finalDirtyPages);
+        }
+
+        auto checkpointStats = checkpointRing_.GetStats();
+        if (checkpointStats.checkpointCount > 0)
+        {
+            ImGui::Text("Checkpoints: %zu over %llu ms, %zu bytes, %llu merged, last: %llu us / %zu pages, restore: %llu us / %zu pages",
+                checkpointStats.checkpointCount, checkpointStats.oldestAgeMilliseconds, checkpointStats.bytesUsed,
+                checkpointStats.mergedCheckpoints, checkpointStats.lastCheckpointMicroseconds, checkpointStats.lastCheckpointPages,
+                checkpointStats.lastRestoreMicroseconds, checkpointStats.lastRestorePages);
+        }
+
+        if (eventRecorder_.GetMode() != EventRecorder::Mode::Off)
+        {
+            auto recorderStats = eventRecorder_.GetStats();
+            ImGui::Text("%s: %llu events, %llu bytes, %llu exits, %llu divergences",
+                eventRecorder_.GetMode() == EventRecorder::Mode::Record ? "Recording" : "Replaying",
+                recorderStats.events, recorderStats.bytes, recorderStats.exitCount, recorderStats.divergences);
+        }
+
+        auto latencyStats = interruptController_.GetLatencyStats();
+        if (latencyStats.posted > 0)
+        {
+            ImGui::Text("Interrupts: %llu posted (%llu MSI), %llu delivered, %llu kicks, latency avg %.1f us / max %llu us",
+                latencyStats.posted, latencyStats.msiSignaled, latencyStats.delivered, latencyStats.kicks,
+                latencyStats.averageMicroseconds, latencyStats.maxMicroseconds);
+        }
+
+        for (const auto& moderation : interruptController_.GetModerationStats())
+        {
+            ImGui::Text("Moderation %s: %llu raised, %llu delivered, interval %u us", moderation.name.c_str(),
+                moderation.raised, moderation.delivered, moderation.intervalMicroseconds);
+        }
+
+        auto windowStats = interruptController_.GetWindowStats();
+        if (windowStats.requests > 0)
+        {
+            ImGui::Text("Interrupt Windows: %llu requested, %llu opened, %llu deferrals coalesced",
+                windowStats.requests, windowStats.opened, windowStats.coalesced);
+        }
+
+        if (virtualProcessor_)
+        {
+            auto exitStats = virtualProcessor_->GetExitStats();
+            ImGui::Text("Port IO Exits: %llu fast path (avg %llu ns), %llu emulated (avg %llu ns)",
+                exitStats.fastIoExits, exitStats.fastIoExits ? exitStats.fastIoNanoseconds / exitStats.fastIoExits : 0,
+                exitStats.emulatedIoExits, exitStats.emulatedIoExits ? exitStats.emulatedIoNanoseconds / exitStats.emulatedIoExits : 0);
+            ImGui::Text("MMIO Exits: %llu decoded (avg %llu ns), %llu emulated (avg %llu ns)",
+                exitStats.fastMmioExits, exitStats.fastMmioExits ? exitStats.fastMmioNanoseconds / exitStats.fastMmioExits : 0,
+                exitStats.mmioExits, exitStats.mmioExits ? exitStats.mmioNanoseconds / exitStats.mmioExits : 0);
+            ImGui::Text("MMIO Instruction Cache: %llu hits, %llu misses, %llu unsupported",
+                exitStats.mmioInstructionCache.hits, exitStats.mmioInstructionCache.misses, exitStats.mmioInstructionCache.unsupported);
+        }
+
+        auto serialStats = serial_.GetStats();
+        ImGui::Text("Serial: %llu bytes out (%.0f B/s), %llu bytes in, %.2f IO exits per byte",
+            serialStats.txBytes, serialStats.txBytesPerSecond, serialStats.rxBytes, serialStats.exitsPerByte);
+        auto pvConsoleStats = pvConsole_.GetStats();
+        ImGui::Text("PV Console: %llu bytes (%.2f MB/s), %llu doorbells, %.0f bytes per doorbell",
+            pvConsoleStats.bytes, pvConsoleStats.bytesPerSecond / (1024.0 * 1024.0), pvConsoleStats.doorbells,
+            pvConsoleStats.bytesPerDoorbell);
+        if (!diskPath_.empty())
+        {
+            auto diskStats = disk_.GetStats();
+            ImGui::Text("Disk: %.0f IOPS, %.2f MB/s, queue depth %u (avg %.1f, max %u), %.1f requests per interrupt, %llu errors",
+                diskStats.iops, diskStats.bytesPerSecond / (1024.0 * 1024.0), diskStats.queueDepth, diskStats.averageQueueDepth,
+                diskStats.maxQueueDepth, diskStats.requestsPerInterrupt, diskStats.errors);
+            BlockBackend* image = diskImage_.get();
+            if (auto* cache = dynamic_cast<CachedBlockBackend*>(image))
+            {
+                auto cacheStats = cache->GetStats();
+                ImGui::Text("Disk Cache: hit ratio %.1f%%, %.1f MB read ahead, %.1f MB written back in %llu IOs, %.1f MB dirty of %.1f MB cached",
+                    cacheStats.hitRatio * 100.0, cacheStats.readAheadBytes / (1024.0 * 1024.0), cacheStats.writeBackBytes / (1024.0 * 1024.0),
+                    cacheStats.writeBackIos, cacheStats.dirtyBytes / (1024.0 * 1024.0), cacheStats.cachedBytes / (1024.0 * 1024.0));
+                ImGui::Text("Disk Flush: %llu flushes, latency %llu us (avg %.0f us, max %llu us)", cacheStats.flushes,
+                    cacheStats.lastFlushMicroseconds, cacheStats.averageFlushMicroseconds, cacheStats.maxFlushMicroseconds);
+                image = cache->GetBackend();
+            }
+            if (auto* sparseImage = dynamic_cast<SparseImageBackend*>(image))
+            {
+                auto imageStats = sparseImage->GetStats();
+                ImGui::Text("Disk Image: %llu clusters allocated, %llu copied from the backing image, L2 cache hit ratio %.1f%%",
+                    imageStats.allocatedClusters, imageStats.copiedClusters, imageStats.l2HitRatio * 100.0);
+            }
+        }
+        if (net_ != nullptr)
+        {
+            auto netStats = net_->GetStats();
+            ImGui::Text("Network: %u of %zu queue pairs active", netStats.activeQueuePairs, netStats.queues.size());
+            for (size_t i = 0; i < netStats.queues.size(); i++)
+            {
+                const auto& queue = netStats.queues[i];
+                ImGui::Text("  Queue %zu: TX %.0f pps (%llu dropped), RX %.0f pps (%llu dropped), %.1f packets per interrupt", i,
+                    queue.txPacketsPerSecond, queue.txDropped, queue.rxPacketsPerSecond, queue.rxDropped, queue.packetsPerInterrupt);
+            }
+        }
+        if (netBackendName_ == "switch")
+        {
+            auto switchStats = networkManager_.GetSwitch().GetStats();
+            ImGui::Text("Switch: %zu MACs learned, %llu forwarded, %llu flooded, %llu dropped",
+                switchStats.macEntries, switchStats.forwarded, switchStats.flooded, switchStats.dropped);
+            for (const auto& port : switchStats.ports)
+            {
+                ImGui::Text("  Port %s: TX %.0f pps, RX %.0f pps, latency %.1f us (max %.1f us), %llu backlogged, %llu dropped",
+                    port.name.c_str(), port.txPacketsPerSecond, port.rxPacketsPerSecond, port.averageLatencyMicroseconds,
+                    port.maxLatencyMicroseconds, port.rxBacklogged, port.rxDropped);
+            }
+        }
+
+        auto migrationStats = migrationManager_.GetStats();
+        if (migrationStats.rounds > 0)
+        {
+            ImGui::Text("Last Migration: %u rounds, %zu pages, %llu / %llu bytes on the wire, blackout %llu us",
+                migrationStats.rounds, migrationStats.pagesSent, migrationStats.wireBytes, migrationStats.rawBytes,
+                migrationStats.blackoutMicroseconds);
+        }
+
         const char* stateStr = "Unknown";
         {
             std::lock_guard<std::mutex> lock(stateMutex);
@@ -305,6 +491,18 @@ void HypervisorStateMachine::RunGui()
             ImGui::EndChild();
         }
 
+        ImGui::End();
+
+        ImGui::Begin("Console");
+        ImGui::BeginChild("ConsoleOutput", ImVec2(0, 300), true);
+        ImGui::TextUnformatted(console_.GetText().c_str());
+        ImGui::EndChild();
+        if (ImGui::InputText("Input", serialInput_, sizeof(serialInput_), ImGuiInputTextFlags_EnterReturnsTrue))
+        {
+            std::string line = std::string(serialInput_) + "\r";
+            serial_.SendInput(reinterpret_cast<const UINT8*>(line.data()), line.size());
+            serialInput_[0] = '\0';
+        }
         ImGui::End();
         ImGui::Render();
         const float clear_color_with_alpha[4] = { 0.45f, 0.55f, 0.60f, 1.00f };
@@ -369,6 +567,24 @@ void HypervisorStateMachine::RunCli()
         case '9':
             UpdateMemorySize();
             break;
+        case 'm':
+            HandleMenuOption(MenuOption::MigrateVM);
+            break;
+        case 't':
+            HandleMenuOption(MenuOption::ToggleCheckpoints);
+            break;
+        case 'r':
+            HandleMenuOption(MenuOption::Rewind);
+            break;
+        case 'e':
+            HandleMenuOption(MenuOption::StartRecording);
+            break;
+        case 'p':
+            HandleMenuOption(MenuOption::StartReplay);
+            break;
+        case 'x':
+            HandleMenuOption(MenuOption::StopRecording);
+            break;
         default:
             std::cout << "Unknown command. Please try again.\n";
             break;
@@ -525,6 +741,92 @@ void HypervisorStateMachine::SetupPartition()
     logger_.Log(Logger::LogLevel::Info, "VirtualProcessor instance created successfully.");
     logger_.LogStackTrace();
 
+    snapshotManager_.Attach(virtualProcessor_, &memoryManager_);
+    migrationManager_.Attach(virtualProcessor_, &memoryManager_, &snapshotManager_);
+    checkpointRing_.Attach(virtualProcessor_, &memoryManager_, &snapshotManager_);
+    eventRecorder_.Attach(&snapshotManager_);
+    virtualProcessor_->SetEventRecorder(&eventRecorder_);
+    interruptController_.SetEventRecorder(&eventRecorder_);
+    interruptController_.SetVirtualProcessor(0, virtualProcessor_);
+    virtualProcessor_->SetInterruptController(&interruptController_);
+    virtualProcessor_->SetIoBus(&ioBus_);
+    virtualProcessor_->SetIoFastPath(ioFastPath_);
+    interruptController_.RegisterIoPorts(ioBus_);
+    virtualProcessor_->SetMmioBus(&mmioBus_);
+    virtualProcessor_->SetMemoryManager(&memoryManager_);
+    interruptController_.RegisterMmioRanges(mmioBus_);
+    if (!console_.Open(serialOutputPath_))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to open the console output " + serialOutputPath_);
+    }
+    serial_.RegisterIoPorts(ioBus_);
+    serial_.StartConsole(&console_);
+    pvConsole_.Start(&console_);
+    for (UINT64 code : { PvConsole::HypercallSetup, PvConsole::HypercallNotify })
+    {
+        virtualProcessor_->RegisterHypercall(code,
+            [this](const WHV_HYPERCALL_CONTEXT& hypercall) { return pvConsole_.HandleHypercall(hypercall); });
+    }
+    if (!diskPath_.empty())
+    {
+        diskImage_ = SparseImageBackend::OpenImage(diskPath_, diskReadOnly_);
+        if (diskImage_ != nullptr && diskCache_)
+        {
+            diskImage_ = std::make_unique<CachedBlockBackend>(std::move(diskImage_), diskCacheConfig_);
+        }
+        if (diskImage_ != nullptr && disk_.Attach(diskImage_.get())
+            && disk_.RegisterMmioRange(mmioBus_, VirtioBlk::DefaultMmioBase))
+        {
+            snapshotManager_.RegisterDeviceState("virtio-blk0",
+                [this](std::vector<UINT8>& state) { disk_.SaveState(state); },
+                [this](const std::vector<UINT8>& state) { disk_.LoadState(state); });
+        }
+        else
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to attach the disk " + diskPath_);
+        }
+    }
+    if (!netBackendName_.empty())
+    {
+        // Locally administered MAC of the QEMU range, one NIC per process for now.
+        net_ = std::make_unique<VirtioNet>(&memoryManager_, &interruptController_, std::array<UINT8, 6>{ 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 },
+            netQueuePairs_);
+        NetBackend* backend = nullptr;
+        if (netBackendName_ == "switch")
+        {
+            backend = networkManager_.GetSwitch().AddPort("vm0");
+        }
+        else
+        {
+            netLoopback_ = std::make_unique<LoopbackNetBackend>();
+            backend = netLoopback_.get();
+        }
+        if (net_->Attach(backend) && net_->RegisterMmioRange(mmioBus_, VirtioNet::DefaultMmioBase))
+        {
+            snapshotManager_.RegisterDeviceState("virtio-net0",
+                [this](std::vector<UINT8>& state) { net_->SaveState(state); },
+                [this](const std::vector<UINT8>& state) { net_->LoadState(state); });
+            // Frames from other VMs on the switch arrive on their threads, they wait in the port while this one is paused.
+            virtualProcessor_->AddPauseCallback([this](bool paused) { net_->SetPaused(paused); });
+        }
+        else
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to attach the network");
+        }
+    }
+    snapshotManager_.RegisterDeviceState("pvconsole",
+        [this](std::vector<UINT8>& state) { pvConsole_.SaveState(state); },
+        [this](const std::vector<UINT8>& state) { pvConsole_.LoadState(state); });
+    snapshotManager_.RegisterDeviceState("uart0",
+        [this](std::vector<UINT8>& state) { serial_.SaveState(state); },
+        [this](const std::vector<UINT8>& state) { serial_.LoadState(state); });
+    snapshotManager_.RegisterDeviceState("lapic0",
+        [this](std::vector<UINT8>& state) { interruptController_.SaveApicState(0, state); },
+        [this](const std::vector<UINT8>& state) { interruptController_.LoadApicState(0, state); });
+    snapshotManager_.RegisterDeviceState("irqchip",
+        [this](std::vector<UINT8>& state) { interruptController_.SaveIrqChipState(state); },
+        [this](const std::vector<UINT8>& state) { interruptController_.LoadIrqChipState(state); });
+
     if (!interruptController_.Setup())
     {
         TransitionState(State::Error);
@@ -632,6 +934,75 @@ void HypervisorStateMachine::HandleMenuOption(MenuOption option)
     case MenuOption::RestoreSnapshot:
         snapshotManager_.RestoreSnapshot();
 		break;
+    case MenuOption::SaveLiveSnapshot:
+        std::thread([this]() { snapshotManager_.SaveLiveSnapshot(SnapshotManager::LiveSnapshotConfig()); }).detach();
+        break;
+    case MenuOption::CaptureResetPoint:
+        if (!snapshotManager_.CaptureResetPoint())
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to capture reset point.");
+        }
+        break;
+    case MenuOption::FastReset:
+        if (SUCCEEDED(snapshotManager_.FastReset()))
+        {
+            auto stats = snapshotManager_.GetResetStats();
+            logger_.Log(Logger::LogLevel::Info, "Fast reset restored " + std::to_string(stats.lastPagesRestored)
+                + " pages in " + std::to_string(stats.lastResetMicroseconds) + " us.");
+        }
+        break;
+    case MenuOption::ToggleCheckpoints:
+        if (checkpointRing_.IsRunning())
+        {
+            checkpointRing_.Stop();
+        }
+        else if (!checkpointRing_.Start(checkpointConfig_))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to start the checkpoint ring.");
+        }
+        break;
+    case MenuOption::Rewind:
+        checkpointRing_.Rewind(rewindMilliseconds_);
+        break;
+    case MenuOption::StartRecording:
+        if (!eventRecorder_.StartRecording(eventLogPath_))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to start recording to " + eventLogPath_);
+        }
+        break;
+    case MenuOption::StartReplay:
+        if (!eventRecorder_.StartReplay(eventLogPath_))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to start replay of " + eventLogPath_);
+        }
+        break;
+    case MenuOption::StopRecording:
+        eventRecorder_.Stop();
+        break;
+    case MenuOption::MigrateVM:
+    {
+        size_t separator = migrateTarget_.rfind(':');
+        if (separator == std::string::npos)
+        {
+            logger_.Log(Logger::LogLevel::Error, "No migration target, start with --migrate-to <ip:port>.");
+            break;
+        }
+        std::string ip = migrateTarget_.substr(0, separator);
+        UINT64 port = 0;
+        if (!ParseNumberArgument("--migrate-to", migrateTarget_.c_str() + separator + 1, 65535, port))
+        {
+            break;
+        }
+        std::thread([this, ip, port]()
+        {
+            if (migrationManager_.SendVM(ip, static_cast<int>(port), MigrationManager::MigrationConfig()))
+            {
+                running_ = false;
+                TransitionState(State::Stopped);
+            }
+        }).detach();
+        break;
+    }
     case MenuOption::DumpRegisters:
 		if (virtualProcessor_ != nullptr)
 		{
@@ -740,6 +1111,7 @@ void HypervisorStateMachine::HandleMenuOption(MenuOption option)
 bool HypervisorStateMachine::RunHypervisor()
 {
     running_ = true;
+    auto lastSample = std::chrono::steady_clock::time_point();
 
     while (running_)
     {
@@ -762,15 +1134,11 @@ bool HypervisorStateMachine::RunHypervisor()
             }
         }
 
-        HRESULT hr = virtualProcessor_->SaveState();
-        if (FAILED(hr))
-        {
-            TransitionState(State::Error);
-            logger_.Log(Logger::LogLevel::Error, "Failed to save the state of the virtual processor.");
-            return false;
-        }
-
+        // The usage queries log on every call, so the GUI figures are sampled instead of refreshed per exit.
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastSample >= std::chrono::milliseconds(100))
         {
+            lastSample = now;
             std::lock_guard<std::mutex> lock(dataMutex_);
             cpuUsage_ = virtualProcessor_->GetCPUUsage();
             activeThreadCount_ = virtualProcessor_->GetActiveThreadCount();
@@ -779,19 +1147,6 @@ bool HypervisorStateMachine::RunHypervisor()
 
         // Simulate hypervisor running
         virtualProcessor_->Run();
-        virtualProcessor_->DumpRegisters();
-        virtualProcessor_->DetailedDumpRegisters();
-
-        hr = virtualProcessor_->RestoreState();
-        if (FAILED(hr))
-        {
-            TransitionState(State::Error);
-            logger_.Log(Logger::LogLevel::Error, "Failed to restore the state of the virtual processor.");
-            return false;
-        }
-
-        // Add any additional operations
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
     TransitionState(State::Stopped);
@@ -878,6 +1233,25 @@ void HypervisorStateMachine::DisplayUsageAndMenu()
     std::cout << "Options:\n";
     std::cout << "  -m, --memory <size>   Set the memory size in bytes (default: 4194304)\n";
     std::cout << "  --gui                 Launch GUI mode\n";
+    std::cout << "  --migrate-listen <port>  Wait for an incoming migration before running\n";
+    std::cout << "  --migrate-to <ip:port>   Target of the migrate option\n";
+    std::cout << "  --checkpoint-interval <ms>     Interval of the time travel checkpoints (default: 250)\n";
+    std::cout << "  --checkpoint-budget <bytes>    Memory budget of the time travel checkpoints (default: 67108864)\n";
+    std::cout << "  --rewind <ms>                  How far the rewind option steps back (default: 1000)\n";
+    std::cout << "  --record <path>                Record the guest inputs to an event log from the start\n";
+    std::cout << "  --replay <path>                Replay the guest inputs of an event log from the start\n";
+    std::cout << "  --no-io-fast-path              Send every port IO exit through the instruction emulator\n";
+    std::cout << "  --serial <path>                Write the serial and PV console output to a file, - for stdout\n";
+    std::cout << "  --disk <path>                  Attach a raw disk image as virtio-blk, virtio_mmio.device=4K@0xd0000000:5\n";
+    std::cout << "  --disk-read-only               Open the disk image read only\n";
+    std::cout << "  --disk-cache <mode>            Host cache of the disk: writeback, writethrough or none (default: writeback)\n";
+    std::cout << "  --disk-cache-size <bytes>      Size of the host disk cache (default: 67108864)\n";
+    std::cout << "  --create-disk <path> <size>    Create an empty sparse disk image and exit\n";
+    std::cout << "  --create-overlay <path> <base> Create a sparse copy-on-write image over a base image and exit\n";
+    std::cout << "  --net <backend>                Attach a virtio-net NIC, virtio_mmio.device=4K@0xd0001000:6, backend: loopback or switch\n";
+    std::cout << "  --net-queues <count>           Number of queue pairs of the NIC (default: 1, max: 8)\n";
+    std::cout << "  --trace <path>                 Write the exit trace to a file on exit (MICROHYPERVISOR_TRACE builds)\n";
+    std::cout << "  --decode-trace <path>          Print a trace file as text and exit\n";
     std::cout << "  -h, --help            Show this help message\n\n";
     std::cout << "#######################################################################\n";
 
@@ -891,6 +1265,12 @@ void HypervisorStateMachine::DisplayUsageAndMenu()
         << "7. Set Registers\n"
         << "8. Get Registers\n"
         << "9. Set Memory Size\n"
+        << "m. Migrate VM\n"
+        << "t. Toggle Time Travel Checkpoints\n"
+        << "r. Rewind\n"
+        << "e. Start Recording\n"
+        << "p. Start Replay\n"
+        << "x. Stop Recording/Replay\n"
         << "q. Quit\n"
         << "Select an option: ";
 }
@@ -930,7 +1310,13 @@ bool HypervisorStateMachine::ParseArguments(int argc, char* argv[])
         {
             if (i + 1 < argc)
             {
-                memorySize_ = std::stoull(argv[++i]);
+                UINT64 value = 0;
+                if (!ParseNumberArgument(argv[i], argv[i + 1], SIZE_MAX, value))
+                {
+                    return false;
+                }
+                memorySize_ = static_cast<size_t>(value);
+                i++;
                 logger_.Log(Logger::LogLevel::Info, "Memory size set to " + std::to_string(memorySize_) + " bytes.");
             }
             else
@@ -943,6 +1329,211 @@ bool HypervisorStateMachine::ParseArguments(int argc, char* argv[])
         {
             guiMode_ = true;
         }
+        else if (strcmp(argv[i], "--migrate-listen") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                UINT64 port = 0;
+                if (!ParseNumberArgument(argv[i], argv[i + 1], 65535, port))
+                {
+                    return false;
+                }
+                migrateListenPort_ = static_cast<int>(port);
+                i++;
+            }
+            else
+            {
+                logger_.Log(Logger::LogLevel::Error, "--migrate-listen option requires a port argument.");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0 || strcmp(argv[i], "--checkpoint-budget") == 0
+            || strcmp(argv[i], "--rewind") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, std::string(argv[i]) + " option requires an argument.");
+                return false;
+            }
+            const char* option = argv[i++];
+            UINT64 value = 0;
+            const bool interval = strcmp(option, "--checkpoint-interval") == 0;
+            const bool budget = strcmp(option, "--checkpoint-budget") == 0;
+            if (!ParseNumberArgument(option, argv[i], interval ? UINT32_MAX : (budget ? SIZE_MAX : UINT64_MAX), value))
+            {
+                return false;
+            }
+            if (interval)
+            {
+                checkpointConfig_.intervalMilliseconds = static_cast<UINT32>(value);
+            }
+            else if (budget)
+            {
+                checkpointConfig_.memoryBudgetBytes = static_cast<size_t>(value);
+            }
+            else
+            {
+                rewindMilliseconds_ = value;
+            }
+        }
+        else if (strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--replay") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, std::string(argv[i]) + " option requires a path argument.");
+                return false;
+            }
+            startupRecorderMode_ = strcmp(argv[i], "--record") == 0 ? EventRecorder::Mode::Record : EventRecorder::Mode::Replay;
+            eventLogPath_ = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serial") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, "--serial option requires a path argument.");
+                return false;
+            }
+            serialOutputPath_ = argv[++i];
+        }
+        else if (strcmp(argv[i], "--disk") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, "--disk option requires a path argument.");
+                return false;
+            }
+            diskPath_ = argv[++i];
+        }
+        else if (strcmp(argv[i], "--disk-read-only") == 0)
+        {
+            diskReadOnly_ = true;
+        }
+        else if (strcmp(argv[i], "--disk-cache") == 0)
+        {
+            const std::string mode = i + 1 < argc ? argv[i + 1] : "";
+            if (mode != "writeback" && mode != "writethrough" && mode != "none")
+            {
+                logger_.Log(Logger::LogLevel::Error, "--disk-cache option requires writeback, writethrough or none.");
+                return false;
+            }
+            diskCache_ = mode != "none";
+            diskCacheConfig_.writePolicy = mode == "writethrough" ? CachedBlockBackend::WritePolicy::WriteThrough
+                : CachedBlockBackend::WritePolicy::WriteBack;
+            i++;
+        }
+        else if (strcmp(argv[i], "--disk-cache-size") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, "--disk-cache-size option requires a size argument.");
+                return false;
+            }
+            UINT64 capacity = 0;
+            if (!ParseNumberArgument(argv[i], argv[i + 1], SIZE_MAX, capacity))
+            {
+                return false;
+            }
+            diskCacheConfig_.capacityBytes = static_cast<size_t>(capacity);
+            i++;
+            diskCacheConfig_.dirtyLimitBytes = diskCacheConfig_.capacityBytes / 4;
+        }
+        else if (strcmp(argv[i], "--net") == 0)
+        {
+            if (i + 1 >= argc || (strcmp(argv[i + 1], "loopback") != 0 && strcmp(argv[i + 1], "switch") != 0))
+            {
+                logger_.Log(Logger::LogLevel::Error, "--net option requires a backend: loopback or switch.");
+                return false;
+            }
+            netBackendName_ = argv[++i];
+        }
+        else if (strcmp(argv[i], "--net-queues") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, "--net-queues option requires a count argument.");
+                return false;
+            }
+            UINT64 queuePairs = 0;
+            if (!ParseNumberArgument(argv[i], argv[i + 1], UINT32_MAX, queuePairs))
+            {
+                return false;
+            }
+            netQueuePairs_ = static_cast<UINT32>(queuePairs);
+            i++;
+        }
+        else if (strcmp(argv[i], "--create-disk") == 0 || strcmp(argv[i], "--create-overlay") == 0)
+        {
+            if (i + 2 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, std::string(argv[i]) + " option requires two arguments.");
+                return false;
+            }
+            const std::string path = argv[i + 1];
+            bool created = false;
+            if (strcmp(argv[i], "--create-disk") == 0)
+            {
+                UINT64 size = 0;
+                if (!ParseNumberArgument(argv[i], argv[i + 2], UINT64_MAX, size))
+                {
+                    return false;
+                }
+                created = SparseImageBackend::Create(path, size);
+            }
+            else if (auto base = SparseImageBackend::OpenImage(argv[i + 2], true))
+            {
+                created = SparseImageBackend::Create(path, base->GetSize(), argv[i + 2]);
+            }
+            std::cout << (created ? "Created " : "Failed to create ") << path << "\n";
+            return false;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--decode-trace") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                logger_.Log(Logger::LogLevel::Error, std::string(argv[i]) + " option requires a path argument.");
+                return false;
+            }
+            if (strcmp(argv[i], "--decode-trace") == 0)
+            {
+                if (!Trace::Decode(argv[++i], std::cout))
+                {
+                    logger_.Log(Logger::LogLevel::Error, "Failed to decode the trace " + std::string(argv[i]));
+                }
+                return false;
+            }
+            traceOutputPath_ = argv[++i];
+#ifndef MICROHYPERVISOR_TRACE
+            logger_.Log(Logger::LogLevel::Warning, "Trace points are compiled out, define MICROHYPERVISOR_TRACE to record them.");
+#endif
+        }
+        else if (strcmp(argv[i], "--no-io-fast-path") == 0)
+        {
+            ioFastPath_ = false;
+        }
+        else if (strcmp(argv[i], "--migrate-to") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                const std::string target = argv[i + 1];
+                const size_t separator = target.rfind(':');
+                if (separator == std::string::npos)
+                {
+                    logger_.Log(Logger::LogLevel::Error, "--migrate-to option requires an ip:port argument.");
+                    return false;
+                }
+                UINT64 port = 0;
+                if (!ParseNumberArgument(argv[i], target.c_str() + separator + 1, 65535, port))
+                {
+                    return false;
+                }
+                migrateTarget_ = argv[++i];
+            }
+            else
+            {
+                logger_.Log(Logger::LogLevel::Error, "--migrate-to option requires an ip:port argument.");
+                return false;
+            }
+        }
         else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
         {
             DisplayUsageAndMenu();
@@ -958,6 +1549,35 @@ bool HypervisorStateMachine::ParseArguments(int argc, char* argv[])
     return true;
 }
 
+bool HypervisorStateMachine::ParseNumberArgument(const char* option, const char* text, UINT64 maximum, UINT64& value)
+{
+    // std::stoull throws on malformed input and skips blanks and signs, a negative value would wrap around to a huge one.
+    size_t parsed = 0;
+    try
+    {
+        if (text[0] >= '0' && text[0] <= '9')
+        {
+            value = std::stoull(text, &parsed);
+        }
+    }
+    catch (const std::invalid_argument&)
+    {
+        parsed = 0;
+    }
+    catch (const std::out_of_range&)
+    {
+        parsed = 0;
+    }
+
+    if (parsed == 0 || text[parsed] != '\0' || value > maximum)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Invalid value " + std::string(text) + " for option " + option + ".");
+        DisplayUsageAndMenu();
+        return false;
+    }
+    return true;
+}
+
 bool HypervisorStateMachine::IsGuiMode() const
 {
 	return guiMode_;
@@ -17,14 +17,24 @@
 #include <backends/imgui_impl_dx11.h>
 #include "Partition.h"
 #include "VirtualProcessor.h"
-#include "Emulator.h"
 #include "InterruptController.h"
 #include "MemoryManager.h"
 #include "SnapshotManager.h"
+#include "MigrationManager.h"
+#include "CheckpointRing.h"
+#include "EventRecorder.h"
 #include "RpcBase.h"
 #include "Timer.h"
 #include "Logger.h"
 #include "NetworkManager.h"
+#include "Uart16550.h"
+#include "PvConsole.h"
+#include "ConsoleSink.h"
+#include "CachedBlockBackend.h"
+#include "SparseImageBackend.h"
+#include "VirtioBlk.h"
+#include "LoopbackNetBackend.h"
+#include "VirtioNet.h"
 
 class HypervisorGUI;
 
@@ -80,6 +90,15 @@ public:
         GetSpecificRegister,
         ConfigureVM,
         GetVMConfig,
+        CaptureResetPoint,
+        FastReset,
+        SaveLiveSnapshot,
+        MigrateVM,
+        ToggleCheckpoints,
+        Rewind,
+        StartRecording,
+        StartReplay,
+        StopRecording,
     };
 
     /**
@@ -95,7 +114,16 @@ public:
         {"dump registers", MenuOption::DumpRegisters},
         {"set registers", MenuOption::SetRegisters},
         {"get registers", MenuOption::GetRegisters},
-        {"set memory size", MenuOption::Continue}
+        {"set memory size", MenuOption::Continue},
+        {"capture reset point", MenuOption::CaptureResetPoint},
+        {"fast reset", MenuOption::FastReset},
+        {"save live snapshot", MenuOption::SaveLiveSnapshot},
+        {"migrate vm", MenuOption::MigrateVM},
+        {"toggle checkpoints", MenuOption::ToggleCheckpoints},
+        {"rewind", MenuOption::Rewind},
+        {"start recording", MenuOption::StartRecording},
+        {"start replay", MenuOption::StartReplay},
+        {"stop recording", MenuOption::StopRecording}
     };
 
     /**
@@ -217,6 +245,17 @@ public:
      */
     bool ParseArguments(int argc, char* argv[]);
 
+    /**
+     * @brief Parses the numeric value of an option, malformed and out of range values are reported with the usage
+     *
+     * @param option -> Name of the option for the error message
+     * @param text -> Value of the option
+     * @param maximum -> Largest accepted value
+     * @param value -> receives the parsed value
+     * @return true -> if the whole text is a decimal number not above maximum
+     */
+    bool ParseNumberArgument(const char* option, const char* text, UINT64 maximum, UINT64& value);
+
     /**
 	 * @brief Function to get the memory size of the Hypervisor
 	 * 
@@ -244,10 +283,22 @@ private:
 
     Partition partition_;
     VirtualProcessor* virtualProcessor_;
-    Emulator emulator_;
     InterruptController interruptController_;
+    IoBus ioBus_;
+    MmioBus mmioBus_;
+    ConsoleSink console_;
+    Uart16550 serial_;
     MemoryManager memoryManager_;
+    PvConsole pvConsole_;
+    std::unique_ptr<BlockBackend> diskImage_;
+    VirtioBlk disk_;
+    NetworkManager networkManager_;
+    std::unique_ptr<LoopbackNetBackend> netLoopback_;
+    std::unique_ptr<VirtioNet> net_;
     SnapshotManager snapshotManager_;
+    MigrationManager migrationManager_;
+    CheckpointRing checkpointRing_;
+    EventRecorder eventRecorder_;
     Logger logger_;
 
     HypervisorGUI* gui_;
@@ -259,6 +310,22 @@ private:
     HWND hwnd;
 
     bool guiMode_ = false;
+    int migrateListenPort_ = 0;
+    std::string migrateTarget_;
+    CheckpointRing::Config checkpointConfig_;
+    UINT64 rewindMilliseconds_ = 1000;
+    std::string eventLogPath_ = "events.mhrr";
+    EventRecorder::Mode startupRecorderMode_ = EventRecorder::Mode::Off;
+    bool ioFastPath_ = true;
+    std::string traceOutputPath_;
+    std::string serialOutputPath_;
+    char serialInput_[256] = {};
+    std::string diskPath_;
+    bool diskReadOnly_ = false;
+    bool diskCache_ = true;
+    CachedBlockBackend::Config diskCacheConfig_;
+    std::string netBackendName_;
+    UINT32 netQueuePairs_ = 1;
     volatile bool pendingInterrupt_ = false;
 
     std::atomic<UINT64> cpuUsage_{ 0 };
@@ -1,16 +1,67 @@
 #include "InterruptController.h"
 #include "Registers.h"
+#include "EventRecorder.h"
+#include "VirtualProcessor.h"
+#include <intrin.h>
 #include <iostream>
 
-InterruptController::InterruptController(WHV_PARTITION_HANDLE partitionHandle)
-    : partitionHandle_(partitionHandle), logger_("InterruptController.log")
+namespace
 {
+    constexpr UINT64 RflagsInterruptEnable = 1ull << 9;
+    constexpr UINT64 MsiAddressMask = 0xFFF00000;
+    constexpr UINT64 MsiAddressBase = 0xFEE00000;
+    constexpr auto ModerationPeriod = std::chrono::milliseconds(10);
 
+    UINT64 NowNanoseconds()
+    {
+        return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+}
+
+InterruptController::InterruptController(WHV_PARTITION_HANDLE partitionHandle, UINT32 vpCount)
+    : partitionHandle_(partitionHandle), eventRecorder_(nullptr), ioApic_(vpCount), routes_(IoApic::PinCount),
+    lowestPriorityNext_(0), msiCount_(0), picOutput_(false), timerStop_(false), timerKicked_(vpCount), moderationStop_(false), postedCount_(0), deliveredCount_(0), kickCount_(0),
+    totalLatencyNanoseconds_(0), maxLatencyNanoseconds_(0), windowRequests_(0), windowsOpened_(0), windowCoalesced_(0), logger_("InterruptController.log")
+{
+    for (UINT32 vpIndex = 0; vpIndex < vpCount; ++vpIndex)
+    {
+        localApics_.push_back(std::make_unique<LocalApic>(vpIndex));
+        localApics_.back()->SetEoiCallback([this](UINT32 vector) { OnEndOfInterrupt(vector); });
+        postedInterrupts_.push_back(std::make_unique<PostedInterrupts>());
+    }
+    for (auto& posted : postedInterrupts_)
+    {
+        for (auto& word : posted->pending) word = 0;
+        for (auto& word : posted->level) word = 0;
+        for (auto& raisedAt : posted->raisedAt) raisedAt = 0;
+        posted->virtualProcessor = nullptr;
+        posted->windowRequested = false;
+    }
+    RebuildRoutes();
 }
 
 InterruptController::~InterruptController()
 {
+    {
+        std::lock_guard<std::mutex> lock(moderationMutex_);
+        moderationStop_ = true;
+    }
+    moderationCv_.notify_all();
+    if (moderationThread_.joinable())
+    {
+        moderationThread_.join();
+    }
 
+    {
+        std::lock_guard<std::mutex> lock(apicMutex_);
+        timerStop_ = true;
+    }
+    timerCv_.notify_all();
+    if (timerThread_.joinable())
+    {
+        timerThread_.join();
+    }
 }
 
 bool InterruptController::Setup()
@@ -34,35 +85,803 @@ bool InterruptController::Setup()
     return true;
 }
 
-void InterruptController::InjectInterrupt(UINT32 interruptVector)
+void InterruptController::InjectInterrupt(UINT32 interruptVector, UINT32 vpIndex, bool levelTriggered)
+{
+    if (eventRecorder_ != nullptr)
+    {
+        if (eventRecorder_->GetMode() == EventRecorder::Mode::Replay)
+        {
+            // Live sources are ignored while replaying, the recorded interrupts are injected instead.
+            return;
+        }
+    }
+    DeliverInterrupt(interruptVector, vpIndex, levelTriggered);
+}
+
+void InterruptController::SetIrq(UINT32 gsi, bool level)
 {
-    WHV_INTERRUPT_CONTROL interruptControl = {};
-    interruptControl.Type = WHvX64PendingInterrupt;
-    interruptControl.Vector = interruptVector;
-    interruptControl.Reserved = 0;
-    interruptControl.TriggerMode = WHvX64InterruptTriggerModeEdge;
+    if (eventRecorder_ != nullptr && eventRecorder_->GetMode() == EventRecorder::Mode::Replay)
+    {
+        return;
+    }
+    if (gsi >= IoApic::PinCount)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Interrupt on unknown GSI " + std::to_string(gsi));
+        return;
+    }
+
+    bool picRaised = false;
+    {
+        std::lock_guard<std::mutex> lock(irqMutex_);
+        if (gsi < Pic::IrqCount && gsi != 2)
+        {
+            pic_.SetIrq(gsi, level);
+            bool output = pic_.HasInterrupt();
+            picRaised = output && !picOutput_;
+            picOutput_ = output;
+        }
+        if (ioApic_.SetIrq(gsi, level))
+        {
+            FireIoApicPins(1u << gsi);
+        }
+    }
 
-    logger_.Log(Logger::LogLevel::Error, "Injecting interrupt vector: " + std::to_string(interruptVector));
+    // The PIC vector is only chosen by the acknowledge cycle at injection, so the boot processor is just kicked.
+    if (picRaised && postedInterrupts_[0]->virtualProcessor != nullptr)
+    {
+        postedInterrupts_[0]->virtualProcessor->Kick();
+    }
+}
 
-    auto result = WHvSetVirtualProcessorInterruptControllerState(
-        partitionHandle_, 0, &interruptControl, sizeof(interruptControl)
-    );
+bool InterruptController::SignalMsi(UINT64 address, UINT32 data)
+{
+    if (eventRecorder_ != nullptr && eventRecorder_->GetMode() == EventRecorder::Mode::Replay)
+    {
+        return true;
+    }
+    if ((address & MsiAddressMask) != MsiAddressBase)
+    {
+        logger_.Log(Logger::LogLevel::Error, "MSI to invalid address " + std::to_string(address));
+        return false;
+    }
+
+    const UINT32 destination = static_cast<UINT32>(address >> 12) & 0xFF;
+    const bool logical = (address >> 2) & 1;
+    const UINT32 vector = data & 0xFF;
+    const UINT32 deliveryMode = (data >> 8) & 0x7;
+    if (deliveryMode != IoApic::Fixed && deliveryMode != IoApic::LowestPriority)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Unsupported MSI delivery mode " + std::to_string(deliveryMode)
+            + ", vector " + std::to_string(vector));
+        return false;
+    }
+
+    UINT64 destinations = (logical ? logicalDestinations_ : physicalDestinations_)[destination].load(std::memory_order_relaxed);
+    if (destinations == 0)
+    {
+        return false;
+    }
+
+    // Messages are always edge triggered, there is no EOI broadcast back to the device.
+    msiCount_++;
+    DeliverToDestinations(vector, destinations, deliveryMode == IoApic::LowestPriority, false);
+    return true;
+}
+
+void InterruptController::SetEventRecorder(EventRecorder* eventRecorder)
+{
+    eventRecorder_ = eventRecorder;
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    for (auto& localApic : localApics_)
+    {
+        localApic->SetEventRecorder(eventRecorder);
+    }
+}
+
+UINT32 InterruptController::AddModeratedSource(const std::string& name, const ModerationConfig& config, std::function<void()> deliver)
+{
+    std::lock_guard<std::mutex> lock(moderationMutex_);
+    auto source = std::make_unique<ModeratedSource>();
+    source->name = name;
+    source->config = config;
+    source->deliver = std::move(deliver);
+    source->raised = 0;
+    source->delivered = 0;
+    source->pending = false;
+    source->periodRaised = 0;
+    source->periodStart = std::chrono::steady_clock::now();
+    UpdateModerationInterval(*source, source->periodStart);
+    moderatedSources_.push_back(std::move(source));
+
+    if (!moderationThread_.joinable())
+    {
+        moderationThread_ = std::thread(&InterruptController::ModerationThread, this);
+    }
+    return static_cast<UINT32>(moderatedSources_.size() - 1);
+}
+
+void InterruptController::SetModeration(UINT32 sourceId, const ModerationConfig& config)
+{
+    std::lock_guard<std::mutex> lock(moderationMutex_);
+    if (sourceId < moderatedSources_.size())
+    {
+        moderatedSources_[sourceId]->config = config;
+        UpdateModerationInterval(*moderatedSources_[sourceId], std::chrono::steady_clock::now());
+    }
+    moderationCv_.notify_all();
+}
 
+void InterruptController::RaiseModerated(UINT32 sourceId)
+{
+    ModeratedSource* source = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(moderationMutex_);
+        if (sourceId >= moderatedSources_.size())
+        {
+            logger_.Log(Logger::LogLevel::Error, "Raise of unknown moderated source " + std::to_string(sourceId));
+            return;
+        }
+
+        source = moderatedSources_[sourceId].get();
+        auto now = std::chrono::steady_clock::now();
+        source->raised++;
+        source->periodRaised++;
+        if (now - source->periodStart >= ModerationPeriod)
+        {
+            UpdateModerationInterval(*source, now);
+        }
+
+        if (source->pending)
+        {
+            return;
+        }
+        if (now - source->lastDelivery < std::chrono::microseconds(source->intervalMicroseconds))
+        {
+            // Merged with everything raised until the interval ends, the moderation thread sends it.
+            source->pending = true;
+            moderationCv_.notify_all();
+            return;
+        }
+        source->lastDelivery = now;
+        source->delivered++;
+    }
+    source->deliver();
+}
+
+std::vector<InterruptController::ModerationStats> InterruptController::GetModerationStats()
+{
+    std::lock_guard<std::mutex> lock(moderationMutex_);
+    std::vector<ModerationStats> stats;
+    for (const auto& source : moderatedSources_)
+    {
+        stats.push_back({ source->name, source->raised, source->delivered, source->intervalMicroseconds });
+    }
+    return stats;
+}
+
+void InterruptController::SetVirtualProcessor(UINT32 vpIndex, VirtualProcessor* virtualProcessor)
+{
+    if (vpIndex < postedInterrupts_.size())
+    {
+        postedInterrupts_[vpIndex]->virtualProcessor = virtualProcessor;
+    }
+
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (virtualProcessor != nullptr && !timerThread_.joinable())
+    {
+        timerThread_ = std::thread(&InterruptController::TimerThread, this);
+    }
+}
+
+InterruptController::LatencyStats InterruptController::GetLatencyStats() const
+{
+    LatencyStats stats = {};
+    stats.posted = postedCount_;
+    stats.delivered = deliveredCount_;
+    stats.kicks = kickCount_;
+    stats.averageMicroseconds = stats.delivered > 0 ? totalLatencyNanoseconds_ / 1000.0 / stats.delivered : 0.0;
+    stats.maxMicroseconds = maxLatencyNanoseconds_ / 1000;
+    stats.msiSignaled = msiCount_;
+    return stats;
+}
+
+InterruptController::WindowStats InterruptController::GetWindowStats() const
+{
+    return { windowRequests_, windowsOpened_, windowCoalesced_ };
+}
+
+HRESULT InterruptController::DeliverPendingInterrupts(UINT32 vpIndex)
+{
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (vpIndex >= localApics_.size())
+    {
+        return E_INVALIDARG;
+    }
+
+    LocalApic& localApic = *localApics_[vpIndex];
+    UINT32 vector = 0;
+    bool fromPic = false;
+    bool levelTriggered = false;
+    const bool replaying = eventRecorder_ != nullptr && eventRecorder_->GetMode() == EventRecorder::Mode::Replay;
+    if (replaying)
+    {
+        // Interrupts are recorded where they are injected, so only the one due at this exit is considered.
+        if (!eventRecorder_->PeekReplayInterrupt(vpIndex, vector, levelTriggered, fromPic))
+        {
+            return S_OK;
+        }
+    }
+    else
+    {
+        DrainPostedInterrupts(vpIndex);
+        std::chrono::steady_clock::time_point before;
+        std::chrono::steady_clock::time_point after;
+        const bool wasArmed = localApic.GetTimerDeadline(before);
+        localApic.UpdateTimer(std::chrono::steady_clock::now());
+        if (localApic.GetTimerDeadline(after) && (!wasArmed || after != before))
+        {
+            // A periodic timer moved to its next period.
+            timerCv_.notify_all();
+        }
+
+        if (!localApic.GetDeliverableInterrupt(vector))
+        {
+            // The PIC pair drives the INTR pin of the boot processor and bypasses the local APIC.
+            if (vpIndex != 0 || !picOutput_)
+            {
+                return S_OK;
+            }
+            fromPic = true;
+        }
+    }
+
+    // One batched read tells whether the guest can take an interrupt now and whether a window is already armed.
+    static const WHV_REGISTER_NAME stateNames[] = {
+        WHvRegisterPendingInterruption,
+        WHvRegisterInterruptState,
+        WHvX64RegisterRflags,
+        WHvX64RegisterDeliverabilityNotifications
+    };
+    WHV_REGISTER_VALUE stateValues[4] = {};
+    HRESULT result = WHvGetVirtualProcessorRegisters(partitionHandle_, vpIndex, stateNames, 4, stateValues);
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to read interruptibility state: HRESULT " + std::to_string(result));
+        return result;
+    }
+
+    PostedInterrupts& posted = *postedInterrupts_[vpIndex];
+    WHV_X64_DELIVERABILITY_NOTIFICATIONS_REGISTER notifications = stateValues[3].DeliverabilityNotifications;
+    if (posted.windowRequested && !notifications.InterruptNotification)
+    {
+        // The hypervisor clears the notification when it reports the interrupt-window exit.
+        posted.windowRequested = false;
+        windowsOpened_++;
+    }
+
+    const bool blocked = stateValues[0].PendingInterruption.InterruptionPending
+        || stateValues[1].InterruptState.InterruptShadow
+        || (stateValues[2].Reg64 & RflagsInterruptEnable) == 0;
+    if (blocked)
+    {
+        // Everything raised until the window opens waits in the IRR and is delivered by priority behind one exit.
+        if (posted.windowRequested)
+        {
+            windowCoalesced_++;
+            return S_OK;
+        }
+
+        WHV_REGISTER_NAME name = WHvX64RegisterDeliverabilityNotifications;
+        WHV_REGISTER_VALUE value = {};
+        value.DeliverabilityNotifications = notifications;
+        value.DeliverabilityNotifications.InterruptNotification = 1;
+        result = WriteRegister(vpIndex, name, value);
+        if (FAILED(result))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to request an interrupt window: HRESULT " + std::to_string(result));
+            return result;
+        }
+        posted.windowRequested = true;
+        windowRequests_++;
+        return S_OK;
+    }
+
+    if (replaying)
+    {
+        eventRecorder_->ConsumeReplayInterrupt();
+        if (!fromPic)
+        {
+            // Goes through the IRR so the ISR and TMR match the recording when the guest sends its EOI.
+            localApic.AcceptInterrupt(vector, levelTriggered);
+        }
+    }
+    else if (fromPic)
+    {
+        std::lock_guard<std::mutex> irqLock(irqMutex_);
+        vector = pic_.AcknowledgeInterrupt();
+        picOutput_ = pic_.HasInterrupt();
+    }
+    else
+    {
+        levelTriggered = localApic.IsLevelTriggered(vector);
+    }
+
+    WHV_REGISTER_NAME name = WHvRegisterPendingInterruption;
+    WHV_REGISTER_VALUE value = {};
+    value.PendingInterruption.InterruptionPending = 1;
+    value.PendingInterruption.InterruptionType = WHvX64PendingInterrupt;
+    value.PendingInterruption.InterruptionVector = vector;
+    result = WriteRegister(vpIndex, name, value);
     if (FAILED(result))
     {
         logger_.Log(Logger::LogLevel::Error, "Failed to inject interrupt: HRESULT " + std::to_string(result) +
             ", partitionHandle_ = " + std::to_string(reinterpret_cast<uintptr_t>(partitionHandle_)) +
-            ", interruptControl.Type = " + std::to_string(interruptControl.Type) +
-            ", interruptControl.Vector = " + std::to_string(interruptControl.Vector));
+            ", vector = " + std::to_string(vector));
         logger_.LogStackTrace();
+        return result;
+    }
+
+    if (eventRecorder_ != nullptr)
+    {
+        eventRecorder_->RecordInterrupt(vector, vpIndex, levelTriggered, fromPic);
+    }
+    if (fromPic)
+    {
+        return S_OK;
+    }
+    localApic.AcknowledgeInterrupt(vector);
+
+    UINT64 raisedAt = posted.raisedAt[vector].exchange(0);
+    if (raisedAt != 0)
+    {
+        // Only the vCPU thread updates the latency totals, so plain load/store is enough for the maximum.
+        UINT64 latency = NowNanoseconds() - raisedAt;
+        deliveredCount_++;
+        totalLatencyNanoseconds_ += latency;
+        if (latency > maxLatencyNanoseconds_)
+        {
+            maxLatencyNanoseconds_ = latency;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT InterruptController::WriteRegister(UINT32 vpIndex, WHV_REGISTER_NAME name, const WHV_REGISTER_VALUE& value)
+{
+    // The vCPU serves register reads of the exit from its cache, so the write has to go through the cache.
+    VirtualProcessor* virtualProcessor = postedInterrupts_[vpIndex]->virtualProcessor;
+    if (virtualProcessor != nullptr)
+    {
+        return virtualProcessor->WriteRegisters(&name, 1, &value);
+    }
+    return WHvSetVirtualProcessorRegisters(partitionHandle_, vpIndex, &name, 1, &value);
+}
+
+void InterruptController::HandleApicAccess(UINT32 vpIndex, UINT32 offset, bool isWrite, UINT32& value)
+{
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (vpIndex >= localApics_.size())
+    {
+        return;
+    }
+
+    if (isWrite)
+    {
+        localApics_[vpIndex]->Write(offset, value);
+        if (offset == LocalApic::Ldr || offset == LocalApic::Dfr)
+        {
+            std::lock_guard<std::mutex> irqLock(irqMutex_);
+            RebuildRoutes();
+        }
+        else if (offset == LocalApic::TimerInitialCount)
+        {
+            timerCv_.notify_all();
+        }
+    }
+    else
+    {
+        value = localApics_[vpIndex]->Read(offset);
+    }
+}
+
+void InterruptController::HandleIoApicAccess(UINT32 offset, bool isWrite, UINT32& value)
+{
+    std::lock_guard<std::mutex> apicLock(apicMutex_);
+    std::lock_guard<std::mutex> irqLock(irqMutex_);
+    if (!isWrite)
+    {
+        value = ioApic_.Read(offset);
+        return;
+    }
+
+    if (ioApic_.Write(offset, value))
+    {
+        RebuildRoutes();
+    }
+    // An unmasked or re-armed level triggered pin that is still asserted fires again.
+    FireIoApicPins(ioApic_.CollectAssertedLevelPins());
+}
+
+void InterruptController::HandlePicAccess(UINT16 port, bool isWrite, UINT8& value)
+{
+    std::lock_guard<std::mutex> lock(irqMutex_);
+    if (isWrite)
+    {
+        pic_.Write(port, value);
+        picOutput_ = pic_.HasInterrupt();
+    }
+    else
+    {
+        value = pic_.Read(port);
+    }
+}
+
+LocalApic* InterruptController::GetLocalApic(UINT32 vpIndex)
+{
+    return vpIndex < localApics_.size() ? localApics_[vpIndex].get() : nullptr;
+}
+
+void InterruptController::SaveApicState(UINT32 vpIndex, std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (vpIndex < localApics_.size())
+    {
+        localApics_[vpIndex]->SaveState(state);
+    }
+}
+
+void InterruptController::LoadApicState(UINT32 vpIndex, const std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (vpIndex < localApics_.size())
+    {
+        localApics_[vpIndex]->LoadState(state);
+        timerCv_.notify_all();
+    }
+}
+
+bool InterruptController::RegisterIoPorts(IoBus& ioBus)
+{
+    return ioBus.Register(Pic::MasterCommand, 2, this, "pic-master")
+        && ioBus.Register(Pic::SlaveCommand, 2, this, "pic-slave")
+        && ioBus.Register(Pic::MasterElcr, 2, this, "pic-elcr");
+}
+
+UINT8 InterruptController::In8(UINT16 port)
+{
+    UINT8 value = 0;
+    HandlePicAccess(port, false, value);
+    return value;
+}
+
+void InterruptController::Out8(UINT16 port, UINT8 value)
+{
+    HandlePicAccess(port, true, value);
+}
+
+bool InterruptController::RegisterMmioRanges(MmioBus& mmioBus)
+{
+    return mmioBus.Register(LocalApic::DefaultBase, LocalApic::PageSize, this, "lapic")
+        && mmioBus.Register(IoApic::DefaultBase, IoApic::PageSize, this, "ioapic");
+}
+
+UINT64 InterruptController::MmioRead(UINT32 vpIndex, UINT64 gpa, UINT8 size)
+{
+    UINT32 value = 0;
+    if (gpa >= LocalApic::DefaultBase && gpa < LocalApic::DefaultBase + LocalApic::PageSize)
+    {
+        HandleApicAccess(vpIndex, static_cast<UINT32>(gpa - LocalApic::DefaultBase), false, value);
+    }
+    else
+    {
+        HandleIoApicAccess(static_cast<UINT32>(gpa - IoApic::DefaultBase), false, value);
+    }
+    return value;
+}
+
+void InterruptController::MmioWrite(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value)
+{
+    UINT32 dword = static_cast<UINT32>(value);
+    if (gpa >= LocalApic::DefaultBase && gpa < LocalApic::DefaultBase + LocalApic::PageSize)
+    {
+        HandleApicAccess(vpIndex, static_cast<UINT32>(gpa - LocalApic::DefaultBase), true, dword);
+    }
+    else
+    {
+        HandleIoApicAccess(static_cast<UINT32>(gpa - IoApic::DefaultBase), true, dword);
+    }
+}
+
+void InterruptController::SaveIrqChipState(std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(irqMutex_);
+    std::vector<UINT8> picState;
+    ioApic_.SaveState(state);
+    pic_.SaveState(picState);
+    state.insert(state.end(), picState.begin(), picState.end());
+}
+
+void InterruptController::LoadIrqChipState(const std::vector<UINT8>& state)
+{
+    std::vector<UINT8> ioApicState;
+    ioApic_.SaveState(ioApicState);
+    if (state.size() < ioApicState.size())
+    {
+        logger_.Log(Logger::LogLevel::Error, "Interrupt chip state has the wrong size " + std::to_string(state.size()));
+        return;
+    }
+
+    std::lock_guard<std::mutex> apicLock(apicMutex_);
+    std::lock_guard<std::mutex> irqLock(irqMutex_);
+    ioApicState.assign(state.begin(), state.begin() + ioApicState.size());
+    if (ioApic_.LoadState(ioApicState) && pic_.LoadState(std::vector<UINT8>(state.begin() + ioApicState.size(), state.end())))
+    {
+        picOutput_ = pic_.HasInterrupt();
+        RebuildRoutes();
+    }
+}
+
+void InterruptController::DeliverInterrupt(UINT32 interruptVector, UINT32 vpIndex, bool levelTriggered)
+{
+    if (vpIndex >= postedInterrupts_.size() || interruptVector > 255)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Interrupt vector " + std::to_string(interruptVector)
+            + " targets unknown virtual processor " + std::to_string(vpIndex));
+        return;
+    }
+
+    PostedInterrupts& posted = *postedInterrupts_[vpIndex];
+    const UINT64 bit = 1ull << (interruptVector & 63);
+    const UINT32 word = interruptVector >> 6;
+
+    // Coalesced raises of the same vector keep the earliest timestamp.
+    UINT64 expected = 0;
+    posted.raisedAt[interruptVector].compare_exchange_strong(expected, NowNanoseconds());
+    if (levelTriggered)
+    {
+        posted.level[word].fetch_or(bit);
     }
     else
     {
-        logger_.Log(Logger::LogLevel::Info, "Injected interrupt vector: " + std::to_string(interruptVector));
+        posted.level[word].fetch_and(~bit);
+    }
+    posted.pending[word].fetch_or(bit);
+    postedCount_++;
+
+    if (posted.virtualProcessor != nullptr)
+    {
+        if (posted.virtualProcessor->IsInGuest())
+        {
+            kickCount_++;
+        }
+        posted.virtualProcessor->Kick();
+    }
+}
+
+void InterruptController::DrainPostedInterrupts(UINT32 vpIndex)
+{
+    PostedInterrupts& posted = *postedInterrupts_[vpIndex];
+    LocalApic& localApic = *localApics_[vpIndex];
+    for (UINT32 word = 0; word < 4; ++word)
+    {
+        UINT64 bits = posted.pending[word].exchange(0);
+        unsigned long bit;
+        while (_BitScanForward64(&bit, bits))
+        {
+            bits &= bits - 1;
+            UINT32 vector = word * 64 + bit;
+            if (!localApic.AcceptInterrupt(vector, (posted.level[word].load() >> bit) & 1))
+            {
+                posted.raisedAt[vector] = 0;
+            }
+        }
+    }
+}
+
+void InterruptController::RebuildRoutes()
+{
+    for (UINT32 destination = 0; destination < 256; ++destination)
+    {
+        UINT64 physical = 0;
+        UINT64 logical = 0;
+        for (UINT32 vpIndex = 0; vpIndex < localApics_.size(); ++vpIndex)
+        {
+            if (localApics_[vpIndex]->MatchesDestination(destination, false))
+            {
+                physical |= 1ull << vpIndex;
+            }
+            if (localApics_[vpIndex]->MatchesDestination(destination, true))
+            {
+                logical |= 1ull << vpIndex;
+            }
+        }
+        physicalDestinations_[destination].store(physical, std::memory_order_relaxed);
+        logicalDestinations_[destination].store(logical, std::memory_order_relaxed);
+    }
+
+    for (UINT32 pin = 0; pin < IoApic::PinCount; ++pin)
+    {
+        IoApic::Redirection redirection = ioApic_.GetRedirection(pin);
+        GsiRoute& route = routes_[pin];
+        route = {};
+        if (redirection.masked
+            || (redirection.deliveryMode != IoApic::Fixed && redirection.deliveryMode != IoApic::LowestPriority))
+        {
+            continue;
+        }
+
+        route.vector = redirection.vector;
+        route.levelTriggered = redirection.levelTriggered;
+        route.lowestPriority = redirection.deliveryMode == IoApic::LowestPriority;
+        route.destinations = (redirection.logicalDestination ? logicalDestinations_ : physicalDestinations_)
+            [redirection.destination].load(std::memory_order_relaxed);
+    }
+}
+
+void InterruptController::FireIoApicPins(UINT32 pins)
+{
+    unsigned long pin;
+    while (_BitScanForward(&pin, pins))
+    {
+        pins &= pins - 1;
+        const GsiRoute& route = routes_[pin];
+        if (route.destinations != 0)
+        {
+            DeliverToDestinations(route.vector, route.destinations, route.lowestPriority, route.levelTriggered);
+        }
+    }
+}
+
+void InterruptController::DeliverToDestinations(UINT32 vector, UINT64 destinations, bool lowestPriority, bool levelTriggered)
+{
+    unsigned long vpIndex;
+    if (lowestPriority)
+    {
+        // Lowest priority arbitration rotates through the destination set so no other vCPU has to be inspected.
+        UINT32 previous = lowestPriorityNext_.load(std::memory_order_relaxed);
+        UINT64 rotated = destinations & ~((2ull << previous) - 1);
+        _BitScanForward64(&vpIndex, rotated != 0 ? rotated : destinations);
+        lowestPriorityNext_.store(vpIndex, std::memory_order_relaxed);
+        destinations = 1ull << vpIndex;
+    }
+
+    while (_BitScanForward64(&vpIndex, destinations))
+    {
+        destinations &= destinations - 1;
+        InjectInterrupt(vector, vpIndex, levelTriggered);
+    }
+}
+
+void InterruptController::OnEndOfInterrupt(UINT32 vector)
+{
+    std::lock_guard<std::mutex> lock(irqMutex_);
+    ioApic_.EndOfInterrupt(vector);
+    FireIoApicPins(ioApic_.CollectAssertedLevelPins());
+}
+
+void InterruptController::UpdateModerationInterval(ModeratedSource& source, std::chrono::steady_clock::time_point now)
+{
+    const ModerationConfig& config = source.config;
+    UINT64 window = config.coalesceMicroseconds;
+    if (config.adaptive)
+    {
+        // The load is the fraction of windows that would see a raise at the rate measured over the last period,
+        // a lightly loaded source gets its interrupts at once and a saturated one uses the full window.
+        double periodMicroseconds = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - source.periodStart).count());
+        double rate = periodMicroseconds > 0 ? source.periodRaised / periodMicroseconds : 0.0;
+        double load = rate * config.coalesceMicroseconds;
+        window = static_cast<UINT64>(config.coalesceMicroseconds * (load < 1.0 ? load : 1.0));
+    }
+
+    UINT64 rateInterval = config.maxRate > 0 ? 1000000ull / config.maxRate : 0;
+    source.intervalMicroseconds = static_cast<UINT32>(window > rateInterval ? window : rateInterval);
+    source.periodRaised = 0;
+    source.periodStart = now;
+}
+
+void InterruptController::ModerationThread()
+{
+    std::vector<ModeratedSource*> due;
+    std::unique_lock<std::mutex> lock(moderationMutex_);
+    while (!moderationStop_)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + ModerationPeriod;
+        for (auto& source : moderatedSources_)
+        {
+            if (!source->pending)
+            {
+                continue;
+            }
+            auto deadline = source->lastDelivery + std::chrono::microseconds(source->intervalMicroseconds);
+            if (deadline <= now)
+            {
+                source->pending = false;
+                source->lastDelivery = now;
+                source->delivered++;
+                due.push_back(source.get());
+            }
+            else if (deadline < next)
+            {
+                next = deadline;
+            }
+        }
+
+        if (!due.empty())
+        {
+            lock.unlock();
+            for (ModeratedSource* source : due)
+            {
+                source->deliver();
+            }
+            due.clear();
+            lock.lock();
+            continue;
+        }
+        moderationCv_.wait_until(lock, next);
+    }
+}
+
+void InterruptController::TimerThread()
+{
+    std::unique_lock<std::mutex> lock(apicMutex_);
+    while (!timerStop_)
+    {
+        auto now = std::chrono::steady_clock::now();
+        bool armed = false;
+        std::chrono::steady_clock::time_point next;
+        for (UINT32 vpIndex = 0; vpIndex < localApics_.size(); ++vpIndex)
+        {
+            std::chrono::steady_clock::time_point deadline;
+            if (!localApics_[vpIndex]->GetTimerDeadline(deadline) || deadline == timerKicked_[vpIndex])
+            {
+                continue;
+            }
+
+            if (deadline <= now)
+            {
+                // The vCPU evaluates the timer before its next entry, one kick per deadline is enough.
+                timerKicked_[vpIndex] = deadline;
+                if (postedInterrupts_[vpIndex]->virtualProcessor != nullptr)
+                {
+                    postedInterrupts_[vpIndex]->virtualProcessor->Kick();
+                }
+            }
+            else if (!armed || deadline < next)
+            {
+                next = deadline;
+                armed = true;
+            }
+        }
+
+        if (armed)
+        {
+            timerCv_.wait_until(lock, next);
+        }
+        else
+        {
+            timerCv_.wait(lock);
+        }
     }
 }
 
 bool InterruptController::InterruptObserver(InterruptInfo& interruptInfo)
 {
-    return false;
+    std::lock_guard<std::mutex> lock(apicMutex_);
+    if (interruptInfo.destination >= localApics_.size())
+    {
+        return false;
+    }
+
+    UINT32 vector = 0;
+    if (!localApics_[interruptInfo.destination]->GetDeliverableInterrupt(vector))
+    {
+        return false;
+    }
+
+    interruptInfo.interruptVector = vector;
+    interruptInfo.interruptType = WHvX64InterruptTypeFixed;
+    interruptInfo.destinationMode = WHvX64InterruptDestinationModePhysical;
+    return true;
 }
@@ -6,13 +6,29 @@
 #include <WinHvPlatformDefs.h>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 #include "Logger.h"
+#include "LocalApic.h"
+#include "IoApic.h"
+#include "Pic.h"
+#include "IoBus.h"
+#include "MmioBus.h"
+
+class EventRecorder;
+class VirtualProcessor;
 
 /// @brief Interrupt Controller class for the Hypervisor \class InterruptController
-class InterruptController
+class InterruptController : public IoDevice, public MmioDevice
 {
 public:
-    InterruptController(WHV_PARTITION_HANDLE partitionHandle);
+    InterruptController(WHV_PARTITION_HANDLE partitionHandle, UINT32 vpCount = 1);
     ~InterruptController();
 
     /**
@@ -24,11 +40,240 @@ public:
     bool Setup();
 
     /**
-     * @brief Injects a interrupt into the partition
+     * @brief Statistics of the raise to delivery latency of posted interrupts
+     *
+     */
+    struct LatencyStats
+    {
+        UINT64 posted;
+        UINT64 delivered;
+        UINT64 kicks;
+        double averageMicroseconds;
+        UINT64 maxMicroseconds;
+        UINT64 msiSignaled;
+    };
+
+    /**
+     * @brief Statistics of the interrupt-window exits used to defer injection while the guest is not interruptible
+     *
+     */
+    struct WindowStats
+    {
+        UINT64 requests;
+        UINT64 opened;
+        UINT64 coalesced;
+    };
+
+    /**
+     * @brief Moderation settings of an interrupt source
+     *
+     */
+    struct ModerationConfig
+    {
+        UINT32 maxRate;                 // interrupts per second, 0 for no limit
+        UINT32 coalesceMicroseconds;    // window in which raises are merged into one interrupt
+        bool adaptive;                  // scale the window with the measured raise rate
+    };
+
+    /**
+     * @brief Counters of a moderated interrupt source
+     *
+     */
+    struct ModerationStats
+    {
+        std::string name;
+        UINT64 raised;
+        UINT64 delivered;
+        UINT32 intervalMicroseconds;
+    };
+
+    /**
+     * @brief Registers a moderated interrupt source, typically one per device queue
+     *
+     * @param name -> Name shown in the statistics
+     * @param config -> Moderation settings
+     * @param deliver -> Sends the interrupt, e.g. an MSI-X notify or a line pulse, called without locks held
+     * @return UINT32 -> id of the source
+     */
+    UINT32 AddModeratedSource(const std::string& name, const ModerationConfig& config, std::function<void()> deliver);
+
+    /**
+     * @brief Changes the moderation settings of a source
+     *
+     * @param sourceId -> id returned by AddModeratedSource
+     * @param config -> Moderation settings
+     */
+    void SetModeration(UINT32 sourceId, const ModerationConfig& config);
+
+    /**
+     * @brief Raises a moderated source, the interrupt is sent at once if the source is idle long enough,
+     *        otherwise it is merged with the other raises of the current interval and sent when it ends
+     *
+     * @param sourceId -> id returned by AddModeratedSource
+     */
+    void RaiseModerated(UINT32 sourceId);
+
+    /**
+     * @brief Gets the raised vs. delivered counters of all moderated sources
+     *
+     */
+    std::vector<ModerationStats> GetModerationStats();
+
+    /**
+     * @brief Sets the Virtual Processor that is kicked when an interrupt is posted to it while it runs the guest
+     *
+     * @param vpIndex -> UINT32, index of the Virtual Processor
+     * @param virtualProcessor -> VirtualProcessor*, the Virtual Processor
+     */
+    void SetVirtualProcessor(UINT32 vpIndex, VirtualProcessor* virtualProcessor);
+
+    /**
+     * @brief Injects a interrupt into the partition, callable from any thread without taking a lock,
+     *        the interrupt is posted to the target, accepted by its local APIC on the next exit
+     *        and delivered by DeliverPendingInterrupts in priority order
      *
      * @param interruptVector -> UINT32, Interrupt Vector to inject
+     * @param vpIndex -> UINT32, index of the target Virtual Processor
+     * @param levelTriggered -> bool, true for level triggered interrupts
+     */
+    void InjectInterrupt(UINT32 interruptVector, UINT32 vpIndex = 0, bool levelTriggered = false);
+
+    /**
+     * @brief Sets the level of a device interrupt line, lines below 16 are ISA IRQs that reach both the PIC pair
+     *        and the IOAPIC, the others only the IOAPIC. Edge triggered devices pulse the line
+     *
+     * @param gsi -> UINT32, global system interrupt number of the line
+     * @param level -> bool, true if the line is asserted
+     */
+    void SetIrq(UINT32 gsi, bool level);
+
+    /**
+     * @brief Signals a message signaled interrupt, the address and data are decoded into destination, vector and
+     *        delivery mode and injected through the lock-free posting path, callable from any thread
+     *
+     * @param address -> UINT64, MSI address, 0xFEExxxxx with the destination ID in bits 19-12 and the destination mode in bit 2
+     * @param data -> UINT32, MSI data with the vector in bits 7-0 and the delivery mode in bits 10-8
+     * @return true -> if the interrupt reached at least one Virtual Processor
+     */
+    bool SignalMsi(UINT64 address, UINT32 data);
+
+    /**
+     * @brief Gets the raise to delivery latency statistics
+     *
+     */
+    LatencyStats GetLatencyStats() const;
+
+    /**
+     * @brief Gets the interrupt-window statistics
+     *
+     */
+    WindowStats GetWindowStats() const;
+
+    /**
+     * @brief Drains the posted interrupts into the local APIC and delivers the highest priority deliverable
+     *        interrupt of a Virtual Processor, called by VirtualProcessor::Run right before entry.
+     *        If the guest has interrupts masked, is in an interrupt shadow or has not taken the previous
+     *        event yet, an interrupt-window exit is requested instead and the interrupts wait in the IRR
+     *
+     * @param vpIndex -> UINT32, index of the Virtual Processor
+     * @return HRESULT -> S_OK if nothing failed, the error of the register write otherwise
+     */
+    HRESULT DeliverPendingInterrupts(UINT32 vpIndex);
+
+    /**
+     * @brief Handles a guest access to the local APIC page
+     *
+     * @param vpIndex -> UINT32, index of the accessing Virtual Processor
+     * @param offset -> UINT32, offset of the register in the APIC page
+     * @param isWrite -> bool, true for writes
+     * @param value -> UINT32&, value written, receives the value read
+     */
+    void HandleApicAccess(UINT32 vpIndex, UINT32 offset, bool isWrite, UINT32& value);
+
+    /**
+     * @brief Handles a guest access to the IOAPIC page
+     *
+     * @param offset -> UINT32, offset of the register in the IOAPIC page
+     * @param isWrite -> bool, true for writes
+     * @param value -> UINT32&, value written, receives the value read
+     */
+    void HandleIoApicAccess(UINT32 offset, bool isWrite, UINT32& value);
+
+    /**
+     * @brief Handles a guest access to a port of the PIC pair
+     *
+     * @param port -> UINT16, IO port
+     * @param isWrite -> bool, true for writes
+     * @param value -> UINT8&, value written, receives the value read
+     */
+    void HandlePicAccess(UINT16 port, bool isWrite, UINT8& value);
+
+    /**
+     * @brief Claims the ports of the PIC pair and its edge/level control registers on the IO bus
+     *
+     * @param ioBus -> IoBus&, the IO bus of the partition
+     * @return true -> if all ranges were claimed
+     */
+    bool RegisterIoPorts(IoBus& ioBus);
+
+    UINT8 In8(UINT16 port) override;
+    void Out8(UINT16 port, UINT8 value) override;
+
+    /**
+     * @brief Claims the local APIC and IOAPIC pages on the MMIO bus
+     *
+     * @param mmioBus -> MmioBus&, the MMIO bus of the partition
+     * @return true -> if both ranges were claimed
      */
-    void InjectInterrupt(UINT32 interruptVector);
+    bool RegisterMmioRanges(MmioBus& mmioBus);
+
+    UINT64 MmioRead(UINT32 vpIndex, UINT64 gpa, UINT8 size) override;
+    void MmioWrite(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value) override;
+
+    /**
+     * @brief Gets the local APIC of a Virtual Processor
+     *
+     * @param vpIndex -> UINT32, index of the Virtual Processor
+     * @return LocalApic* -> the local APIC, nullptr for an unknown index
+     */
+    LocalApic* GetLocalApic(UINT32 vpIndex);
+
+    /**
+     * @brief Serializes the local APIC state of a Virtual Processor
+     *
+     * @param vpIndex -> UINT32, index of the Virtual Processor
+     * @param state -> receives the serialized state
+     */
+    void SaveApicState(UINT32 vpIndex, std::vector<UINT8>& state);
+
+    /**
+     * @brief Loads the local APIC state of a Virtual Processor
+     *
+     * @param vpIndex -> UINT32, index of the Virtual Processor
+     * @param state -> the serialized state
+     */
+    void LoadApicState(UINT32 vpIndex, const std::vector<UINT8>& state);
+
+    /**
+     * @brief Serializes the state of the IOAPIC and the PIC pair
+     *
+     * @param state -> receives the serialized state
+     */
+    void SaveIrqChipState(std::vector<UINT8>& state);
+
+    /**
+     * @brief Loads the state of the IOAPIC and the PIC pair and rebuilds the routes
+     *
+     * @param state -> the serialized state
+     */
+    void LoadIrqChipState(const std::vector<UINT8>& state);
+
+    /**
+     * @brief Sets the event recorder, injected interrupts are recorded and in replay only the recorded ones are delivered
+     *
+     * @param eventRecorder -> EventRecorder*, the recorder, nullptr to detach
+     */
+    void SetEventRecorder(EventRecorder* eventRecorder);
 
 
     /**
@@ -45,19 +290,165 @@ public:
 
     std::map<UINT32, std::string> interruptTypeMap =
     {
+        { WHvX64InterruptTypeFixed, "Fixed" },
+        { WHvX64InterruptTypeLowestPriority, "LowestPriority" },
+        { WHvX64InterruptTypeNmi, "NMI" },
+        { WHvX64InterruptTypeInit, "INIT" },
+        { WHvX64InterruptTypeSipi, "SIPI" },
+        { WHvX64InterruptTypeLocalInt1, "LocalInt1" },
     };
 
     /**
-     * @brief Function to observe the interrupt
+     * @brief Function to observe the interrupt, reports the interrupt that would be delivered next
      * 
-     * @param interruptInfo -> struct with the interrupt information
+     * @param interruptInfo -> struct with the interrupt information, destination selects the Virtual Processor
      * 
      * @return -> true if the interrupt is observed, false otherwise
      */
     bool InterruptObserver(InterruptInfo& interruptInfo);
 
 private:
+    /**
+     * @brief Lock-free multi-producer mailbox of one Virtual Processor, producers set bits in the
+     *        posted bitmap and the vCPU thread is the only consumer
+     *
+     */
+    struct PostedInterrupts
+    {
+        std::atomic<UINT64> pending[4];
+        std::atomic<UINT64> level[4];
+        std::atomic<UINT64> raisedAt[256];
+        VirtualProcessor* virtualProcessor;
+        bool windowRequested;
+    };
+
+    /**
+     * @brief Posts the interrupt to the mailbox of the target and kicks it out of the guest
+     *
+     */
+    void DeliverInterrupt(UINT32 interruptVector, UINT32 vpIndex, bool levelTriggered);
+
+    /**
+     * @brief Moves the posted interrupts of a Virtual Processor into its local APIC, caller holds apicMutex_
+     *
+     */
+    void DrainPostedInterrupts(UINT32 vpIndex);
+
+    /**
+     * @brief Writes an interrupt register of a Virtual Processor through its register cache
+     *
+     * @return HRESULT -> S_OK if the register was written
+     */
+    HRESULT WriteRegister(UINT32 vpIndex, WHV_REGISTER_NAME name, const WHV_REGISTER_VALUE& value);
+
+    /**
+     * @brief Precomputed route of a GSI, the destinations are a bitmask of Virtual Processor indices
+     *
+     */
+    struct GsiRoute
+    {
+        UINT32 vector;
+        bool levelTriggered;
+        bool lowestPriority;
+        UINT64 destinations;
+    };
+
+    /**
+     * @brief Rebuilds the destination masks of all physical and logical destination IDs and the flat GSI
+     *        routing table from the redirection entries, caller holds apicMutex_ and irqMutex_
+     *
+     */
+    void RebuildRoutes();
+
+    /**
+     * @brief Posts a vector to a set of Virtual Processors, or to one of them for lowest priority delivery
+     *
+     */
+    void DeliverToDestinations(UINT32 vector, UINT64 destinations, bool lowestPriority, bool levelTriggered);
+
+    /**
+     * @brief Sends the interrupts of a set of IOAPIC pins along their routes, caller holds irqMutex_
+     *
+     */
+    void FireIoApicPins(UINT32 pins);
+
+    /**
+     * @brief Handles the EOI broadcast of a level triggered interrupt, caller holds apicMutex_
+     *
+     */
+    void OnEndOfInterrupt(UINT32 vector);
+
+    /**
+     * @brief State of a moderated interrupt source
+     *
+     */
+    struct ModeratedSource
+    {
+        std::string name;
+        ModerationConfig config;
+        std::function<void()> deliver;
+        UINT64 raised;
+        UINT64 delivered;
+        bool pending;
+        UINT32 intervalMicroseconds;
+        UINT64 periodRaised;
+        std::chrono::steady_clock::time_point periodStart;
+        std::chrono::steady_clock::time_point lastDelivery;
+    };
+
+    /**
+     * @brief Recomputes the minimum interval between two interrupts of a source, caller holds moderationMutex_
+     *
+     */
+    void UpdateModerationInterval(ModeratedSource& source, std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief Sends the coalesced interrupts of the sources whose interval ended
+     *
+     */
+    void ModerationThread();
+
+    /**
+     * @brief Kicks a Virtual Processor once its LAPIC timer expires, a halted guest has no exit that would
+     *        evaluate the timer before entry
+     *
+     */
+    void TimerThread();
+
     WHV_PARTITION_HANDLE partitionHandle_;
+    EventRecorder* eventRecorder_;
+    std::vector<std::unique_ptr<LocalApic>> localApics_;
+    std::vector<std::unique_ptr<PostedInterrupts>> postedInterrupts_;
+    std::mutex apicMutex_;
+    std::condition_variable timerCv_;
+    std::thread timerThread_;
+    bool timerStop_;
+    std::vector<std::chrono::steady_clock::time_point> timerKicked_;
+
+    IoApic ioApic_;
+    Pic pic_;
+    std::vector<GsiRoute> routes_;
+    std::atomic<UINT64> physicalDestinations_[256];
+    std::atomic<UINT64> logicalDestinations_[256];
+    std::atomic<UINT32> lowestPriorityNext_;
+    std::atomic<UINT64> msiCount_;
+    std::atomic<bool> picOutput_;
+    std::mutex irqMutex_;
+
+    std::vector<std::unique_ptr<ModeratedSource>> moderatedSources_;
+    std::mutex moderationMutex_;
+    std::condition_variable moderationCv_;
+    std::thread moderationThread_;
+    bool moderationStop_;
+
+    std::atomic<UINT64> postedCount_;
+    std::atomic<UINT64> deliveredCount_;
+    std::atomic<UINT64> kickCount_;
+    std::atomic<UINT64> totalLatencyNanoseconds_;
+    std::atomic<UINT64> maxLatencyNanoseconds_;
+    std::atomic<UINT64> windowRequests_;
+    std::atomic<UINT64> windowsOpened_;
+    std::atomic<UINT64> windowCoalesced_;
     std::vector<WHV_REGISTER_VALUE> interruptRegisters_;
     Logger logger_;
 };
@@ -0,0 +1,194 @@
+#include "IoApic.h"
+
+namespace
+{
+    constexpr UINT32 IoApicVersion = 0x11 | ((IoApic::PinCount - 1) << 16);
+    constexpr UINT32 IdIndex = 0x00;
+    constexpr UINT32 VersionIndex = 0x01;
+    constexpr UINT32 ArbitrationIndex = 0x02;
+    constexpr UINT32 RedirectionIndex = 0x10;
+
+    constexpr UINT64 EntryDestinationMode = 1ull << 11;
+    constexpr UINT64 EntryRemoteIrr = 1ull << 14;
+    constexpr UINT64 EntryTriggerMode = 1ull << 15;
+    constexpr UINT64 EntryMasked = 1ull << 16;
+    // Delivery status and remote IRR are read-only for the guest.
+    constexpr UINT64 EntryWritableMask = ~((1ull << 12) | EntryRemoteIrr);
+}
+
+IoApic::IoApic(UINT32 ioApicId) : state_(), logger_("IoApic.log")
+{
+    state_.ioApicId = ioApicId;
+    for (auto& entry : state_.redirection)
+    {
+        entry = EntryMasked;
+    }
+}
+
+IoApic::~IoApic() {}
+
+UINT32 IoApic::Read(UINT32 offset)
+{
+    if (offset == RegisterSelect)
+    {
+        return state_.registerSelect;
+    }
+    if (offset != Window)
+    {
+        return 0;
+    }
+
+    UINT32 index = state_.registerSelect;
+    switch (index)
+    {
+    case IdIndex: return state_.ioApicId << 24;
+    case VersionIndex: return IoApicVersion;
+    case ArbitrationIndex: return state_.ioApicId << 24;
+    default:
+        break;
+    }
+
+    if (index >= RedirectionIndex && index < RedirectionIndex + PinCount * 2)
+    {
+        UINT64 entry = state_.redirection[(index - RedirectionIndex) / 2];
+        return static_cast<UINT32>(index & 1 ? entry >> 32 : entry);
+    }
+    return 0;
+}
+
+bool IoApic::Write(UINT32 offset, UINT32 value)
+{
+    if (offset == RegisterSelect)
+    {
+        state_.registerSelect = value & 0xFF;
+        return false;
+    }
+    if (offset == Eoi)
+    {
+        EndOfInterrupt(value & 0xFF);
+        return false;
+    }
+    if (offset != Window)
+    {
+        return false;
+    }
+
+    UINT32 index = state_.registerSelect;
+    if (index == IdIndex)
+    {
+        state_.ioApicId = (value >> 24) & 0xF;
+        return false;
+    }
+    if (index < RedirectionIndex || index >= RedirectionIndex + PinCount * 2)
+    {
+        return false;
+    }
+
+    UINT64& entry = state_.redirection[(index - RedirectionIndex) / 2];
+    UINT64 written = index & 1
+        ? (entry & 0xFFFFFFFFull) | (static_cast<UINT64>(value) << 32)
+        : (entry & 0xFFFFFFFF00000000ull) | value;
+    UINT64 updated = (written & EntryWritableMask) | (entry & ~EntryWritableMask);
+    if ((updated & EntryTriggerMode) == 0)
+    {
+        updated &= ~EntryRemoteIrr;
+    }
+    if (updated == entry)
+    {
+        return false;
+    }
+    entry = updated;
+    return true;
+}
+
+bool IoApic::SetIrq(UINT32 pin, bool level)
+{
+    if (pin >= PinCount)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Interrupt on unknown IOAPIC pin " + std::to_string(pin));
+        return false;
+    }
+
+    const UINT32 mask = 1u << pin;
+    const bool wasAsserted = (state_.lineLevels & mask) != 0;
+    if (!level)
+    {
+        state_.lineLevels &= ~mask;
+        return false;
+    }
+    state_.lineLevels |= mask;
+
+    UINT64& entry = state_.redirection[pin];
+    if (entry & EntryMasked)
+    {
+        return false;
+    }
+
+    if (entry & EntryTriggerMode)
+    {
+        if (entry & EntryRemoteIrr)
+        {
+            return false;
+        }
+        entry |= EntryRemoteIrr;
+        return true;
+    }
+    return !wasAsserted;
+}
+
+void IoApic::EndOfInterrupt(UINT32 vector)
+{
+    for (auto& entry : state_.redirection)
+    {
+        if ((entry & 0xFF) == vector && (entry & EntryTriggerMode))
+        {
+            entry &= ~EntryRemoteIrr;
+        }
+    }
+}
+
+UINT32 IoApic::CollectAssertedLevelPins()
+{
+    UINT32 pins = 0;
+    for (UINT32 pin = 0; pin < PinCount; ++pin)
+    {
+        UINT64& entry = state_.redirection[pin];
+        if ((state_.lineLevels & (1u << pin)) && (entry & EntryTriggerMode)
+            && (entry & (EntryMasked | EntryRemoteIrr)) == 0)
+        {
+            entry |= EntryRemoteIrr;
+            pins |= 1u << pin;
+        }
+    }
+    return pins;
+}
+
+IoApic::Redirection IoApic::GetRedirection(UINT32 pin) const
+{
+    UINT64 entry = pin < PinCount ? state_.redirection[pin] : EntryMasked;
+    Redirection redirection;
+    redirection.vector = static_cast<UINT32>(entry & 0xFF);
+    redirection.deliveryMode = static_cast<DeliveryMode>((entry >> 8) & 0x7);
+    redirection.logicalDestination = (entry & EntryDestinationMode) != 0;
+    redirection.levelTriggered = (entry & EntryTriggerMode) != 0;
+    redirection.masked = (entry & EntryMasked) != 0;
+    redirection.destination = static_cast<UINT32>(entry >> 56);
+    return redirection;
+}
+
+void IoApic::SaveState(std::vector<UINT8>& state) const
+{
+    const UINT8* bytes = reinterpret_cast<const UINT8*>(&state_);
+    state.assign(bytes, bytes + sizeof(state_));
+}
+
+bool IoApic::LoadState(const std::vector<UINT8>& state)
+{
+    if (state.size() != sizeof(State))
+    {
+        logger_.Log(Logger::LogLevel::Error, "IOAPIC state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+    memcpy(&state_, state.data(), sizeof(state_));
+    return true;
+}
@@ -0,0 +1,138 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <Windows.h>
+#include <vector>
+#include "Logger.h"
+
+/// @brief Virtual IOAPIC with a 24-entry redirection table \class IoApic
+class IoApic
+{
+public:
+    IoApic(UINT32 ioApicId);
+    ~IoApic();
+
+    static constexpr UINT64 DefaultBase = 0xFEC00000;
+    static constexpr UINT64 PageSize = 0x1000;
+    static constexpr UINT32 PinCount = 24;
+
+    /**
+     * @brief Offsets of the directly addressable IOAPIC registers in the MMIO page
+     *
+     */
+    enum Register : UINT32
+    {
+        RegisterSelect = 0x00,
+        Window = 0x10,
+        Eoi = 0x40,
+    };
+
+    /**
+     * @brief Delivery modes of a redirection entry
+     *
+     */
+    enum DeliveryMode : UINT32
+    {
+        Fixed = 0,
+        LowestPriority = 1,
+        Smi = 2,
+        Nmi = 4,
+        Init = 5,
+        ExtInt = 7,
+    };
+
+    /**
+     * @brief Decoded redirection entry
+     *
+     */
+    struct Redirection
+    {
+        UINT32 vector;
+        DeliveryMode deliveryMode;
+        bool logicalDestination;
+        bool levelTriggered;
+        bool masked;
+        UINT32 destination;
+    };
+
+    /**
+     * @brief Reads an IOAPIC register through the MMIO page
+     *
+     * @param offset -> Register offset in the MMIO page
+     * @return UINT32 -> value of the register
+     */
+    UINT32 Read(UINT32 offset);
+
+    /**
+     * @brief Writes an IOAPIC register through the MMIO page
+     *
+     * @param offset -> Register offset in the MMIO page
+     * @param value -> Value to write
+     * @return true -> if a redirection entry changed and the routes must be rebuilt
+     */
+    bool Write(UINT32 offset, UINT32 value);
+
+    /**
+     * @brief Sets the level of an input pin
+     *
+     * @param pin -> Input pin
+     * @param level -> true if the line is asserted
+     * @return true -> if the pin fires an interrupt, a rising edge or an asserted level with the remote IRR clear
+     */
+    bool SetIrq(UINT32 pin, bool level);
+
+    /**
+     * @brief Clears the remote IRR of the level triggered pins that use a vector, called on the EOI broadcast
+     *
+     * @param vector -> Interrupt vector whose EOI was broadcast
+     */
+    void EndOfInterrupt(UINT32 vector);
+
+    /**
+     * @brief Collects the level triggered pins that are asserted, unmasked and have the remote IRR clear,
+     *        their remote IRR is set because the caller delivers them
+     *
+     * @return UINT32 -> bitmask of the pins
+     */
+    UINT32 CollectAssertedLevelPins();
+
+    /**
+     * @brief Gets the decoded redirection entry of a pin
+     *
+     * @param pin -> Input pin
+     */
+    Redirection GetRedirection(UINT32 pin) const;
+
+    /**
+     * @brief Serializes the IOAPIC state for snapshots and migration
+     *
+     * @param state -> receives the serialized state
+     */
+    void SaveState(std::vector<UINT8>& state) const;
+
+    /**
+     * @brief Loads an IOAPIC state produced by SaveState
+     *
+     * @param state -> the serialized state
+     * @return true -> if the state was loaded
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    /**
+     * @brief State of the IOAPIC as stored in snapshots
+     *
+     */
+    struct State
+    {
+        UINT64 redirection[PinCount];
+        UINT32 ioApicId;
+        UINT32 registerSelect;
+        UINT32 lineLevels;
+    };
+
+    State state_;
+    Logger logger_;
+};
+
+#endif // IOAPIC_H
\ No newline at end of file
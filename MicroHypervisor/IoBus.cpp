@@ -0,0 +1,122 @@
+#include "IoBus.h"
+
+namespace
+{
+    constexpr UINT32 PortCount = 0x10000;
+}
+
+UINT16 IoDevice::In16(UINT16 port)
+{
+    return static_cast<UINT16>(In8(port) | (In8(port + 1) << 8));
+}
+
+UINT32 IoDevice::In32(UINT16 port)
+{
+    return static_cast<UINT32>(In16(port)) | (static_cast<UINT32>(In16(port + 2)) << 16);
+}
+
+void IoDevice::Out16(UINT16 port, UINT16 value)
+{
+    Out8(port, static_cast<UINT8>(value));
+    Out8(port + 1, static_cast<UINT8>(value >> 8));
+}
+
+void IoDevice::Out32(UINT16 port, UINT32 value)
+{
+    Out16(port, static_cast<UINT16>(value));
+    Out16(port + 2, static_cast<UINT16>(value >> 16));
+}
+
+IoBus::IoBus() : portTable_(PortCount, 0), logger_("IoBus.log")
+{
+
+}
+
+IoBus::~IoBus() {}
+
+bool IoBus::Register(UINT16 basePort, UINT32 portCount, IoDevice* device, const std::string& name)
+{
+    if (device == nullptr || portCount == 0 || basePort + portCount > PortCount)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Invalid IO port range " + name);
+        return false;
+    }
+
+    for (UINT32 port = basePort; port < basePort + portCount; ++port)
+    {
+        if (portTable_[port] != 0)
+        {
+            logger_.Log(Logger::LogLevel::Error, "IO port range " + name + " overlaps " + ranges_[portTable_[port] - 1].name
+                + " at port " + std::to_string(port));
+            return false;
+        }
+    }
+
+    ranges_.push_back({ basePort, portCount, device, name });
+    const UINT16 index = static_cast<UINT16>(ranges_.size());
+    for (UINT32 port = basePort; port < basePort + portCount; ++port)
+    {
+        portTable_[port] = index;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Registered IO ports " + std::to_string(basePort) + "-"
+        + std::to_string(basePort + portCount - 1) + " for " + name);
+    return true;
+}
+
+void IoBus::Unregister(IoDevice* device)
+{
+    for (size_t index = 0; index < ranges_.size(); ++index)
+    {
+        Range& range = ranges_[index];
+        if (range.device != device)
+        {
+            continue;
+        }
+        for (UINT32 port = range.basePort; port < range.basePort + range.portCount; ++port)
+        {
+            portTable_[port] = 0;
+        }
+        // The slot stays so the indices of the other ranges remain valid.
+        range.device = nullptr;
+        range.portCount = 0;
+    }
+}
+
+UINT32 IoBus::Read(UINT16 port, UINT8 size)
+{
+    IoDevice* device = GetDevice(port);
+    if (device == nullptr)
+    {
+        return size >= 4 ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
+    }
+
+    switch (size)
+    {
+    case 1: return device->In8(port);
+    case 2: return device->In16(port);
+    default: return device->In32(port);
+    }
+}
+
+void IoBus::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+    IoDevice* device = GetDevice(port);
+    if (device == nullptr)
+    {
+        return;
+    }
+
+    switch (size)
+    {
+    case 1: device->Out8(port, static_cast<UINT8>(value)); break;
+    case 2: device->Out16(port, static_cast<UINT16>(value)); break;
+    default: device->Out32(port, value); break;
+    }
+}
+
+IoDevice* IoBus::GetDevice(UINT16 port) const
+{
+    UINT16 index = portTable_[port];
+    return index != 0 ? ranges_[index - 1].device : nullptr;
+}
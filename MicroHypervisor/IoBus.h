@@ -0,0 +1,127 @@
+#ifndef IOBUS_H
+#define IOBUS_H
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include "Logger.h"
+
+/// @brief Interface of an emulated device that claims IO ports \class IoDevice
+class IoDevice
+{
+public:
+    virtual ~IoDevice() = default;
+
+    /**
+     * @brief Byte wide port read
+     *
+     * @param port -> Port that was read
+     * @return UINT8 -> value of the port
+     */
+    virtual UINT8 In8(UINT16 port) = 0;
+
+    /**
+     * @brief Byte wide port write
+     *
+     * @param port -> Port that was written
+     * @param value -> Value written by the guest
+     */
+    virtual void Out8(UINT16 port, UINT8 value) = 0;
+
+    /**
+     * @brief Word wide port read, by default two byte reads of consecutive ports
+     *
+     */
+    virtual UINT16 In16(UINT16 port);
+
+    /**
+     * @brief Dword wide port read, by default four byte reads of consecutive ports
+     *
+     */
+    virtual UINT32 In32(UINT16 port);
+
+    /**
+     * @brief Word wide port write, by default two byte writes of consecutive ports
+     *
+     */
+    virtual void Out16(UINT16 port, UINT16 value);
+
+    /**
+     * @brief Dword wide port write, by default four byte writes of consecutive ports
+     *
+     */
+    virtual void Out32(UINT16 port, UINT32 value);
+};
+
+/// @brief IO port bus, devices register port ranges and accesses are dispatched with a direct 64K-entry table \class IoBus
+class IoBus
+{
+public:
+    IoBus();
+    ~IoBus();
+
+    /**
+     * @brief Claims a range of ports for a device, ranges are registered before the guest runs
+     *
+     * @param basePort -> First port of the range
+     * @param portCount -> Number of ports
+     * @param device -> IoDevice*, device that handles the accesses
+     * @param name -> Name of the range for the logs
+     * @return true -> if the range was claimed
+     * @return false -> if a port of the range is already claimed
+     */
+    bool Register(UINT16 basePort, UINT32 portCount, IoDevice* device, const std::string& name);
+
+    /**
+     * @brief Releases all ranges of a device
+     *
+     * @param device -> IoDevice*, the device
+     */
+    void Unregister(IoDevice* device);
+
+    /**
+     * @brief Dispatches a guest port read
+     *
+     * @param port -> Port that was read
+     * @param size -> Access size, 1, 2 or 4 bytes
+     * @return UINT32 -> value of the port, all ones for unclaimed ports
+     */
+    UINT32 Read(UINT16 port, UINT8 size);
+
+    /**
+     * @brief Dispatches a guest port write, writes to unclaimed ports are dropped
+     *
+     * @param port -> Port that was written
+     * @param size -> Access size, 1, 2 or 4 bytes
+     * @param value -> Value written by the guest
+     */
+    void Write(UINT16 port, UINT8 size, UINT32 value);
+
+    /**
+     * @brief Gets the device that claims a port
+     *
+     * @param port -> Port
+     * @return IoDevice* -> the device, nullptr if the port is unclaimed
+     */
+    IoDevice* GetDevice(UINT16 port) const;
+
+private:
+    /**
+     * @brief A claimed port range
+     *
+     */
+    struct Range
+    {
+        UINT16 basePort;
+        UINT32 portCount;
+        IoDevice* device;
+        std::string name;
+    };
+
+    // Index + 1 into ranges_ for every port, 0 for unclaimed ports.
+    std::vector<UINT16> portTable_;
+    std::vector<Range> ranges_;
+    Logger logger_;
+};
+
+#endif // IOBUS_H
\ No newline at end of file
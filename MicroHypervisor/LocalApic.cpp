@@ -0,0 +1,372 @@
+#include "LocalApic.h"
+#include "EventRecorder.h"
+#include <intrin.h>
+
+namespace
+{
+    constexpr UINT32 ApicVersion = 0x00050014;
+    constexpr UINT32 SvrSoftwareEnable = 1u << 8;
+    constexpr UINT32 LvtMasked = 1u << 16;
+    constexpr UINT32 LvtTimerPeriodic = 1u << 17;
+    constexpr UINT32 LvtVectorMask = 0xFF;
+    constexpr UINT64 BusTickNanoseconds = 10; // 100 MHz APIC bus clock
+}
+
+LocalApic::LocalApic(UINT32 apicId) : apicId_(apicId), irr_(), isr_(), tmr_(), tpr_(0), ldr_(0), dfr_(0xFFFFFFFF),
+    svr_(0xFF), esr_(0), lvtTimer_(LvtMasked), lvtLint0_(LvtMasked), lvtLint1_(LvtMasked), lvtError_(LvtMasked),
+    timerInitialCount_(0), timerDivideConfig_(0), timerArmed_(false), eventRecorder_(nullptr), logger_("LocalApic.log")
+{
+
+}
+
+LocalApic::~LocalApic() {}
+
+bool LocalApic::AcceptInterrupt(UINT32 vector, bool levelTriggered)
+{
+    if (vector < 16 || vector > 255)
+    {
+        esr_ |= 1u << 6; // Received illegal vector
+        logger_.Log(Logger::LogLevel::Warning, "Dropped illegal interrupt vector " + std::to_string(vector));
+        return false;
+    }
+
+    if ((svr_ & SvrSoftwareEnable) == 0)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Local APIC " + std::to_string(apicId_) + " is software disabled, dropped vector "
+            + std::to_string(vector));
+        return false;
+    }
+
+    SetBit(irr_, vector);
+    if (levelTriggered)
+    {
+        SetBit(tmr_, vector);
+    }
+    else
+    {
+        ClearBit(tmr_, vector);
+    }
+    return true;
+}
+
+bool LocalApic::GetDeliverableInterrupt(UINT32& vector) const
+{
+    int highest = HighestVector(irr_);
+    if (highest < 0 || static_cast<UINT32>(highest & 0xF0) <= (GetPpr() & 0xF0))
+    {
+        return false;
+    }
+    vector = static_cast<UINT32>(highest);
+    return true;
+}
+
+void LocalApic::AcknowledgeInterrupt(UINT32 vector)
+{
+    ClearBit(irr_, vector);
+    SetBit(isr_, vector);
+}
+
+bool LocalApic::IsLevelTriggered(UINT32 vector) const
+{
+    return TestBit(tmr_, vector);
+}
+
+void LocalApic::EndOfInterrupt()
+{
+    int highest = HighestVector(isr_);
+    if (highest < 0)
+    {
+        return;
+    }
+
+    UINT32 vector = static_cast<UINT32>(highest);
+    ClearBit(isr_, vector);
+    if (TestBit(tmr_, vector))
+    {
+        ClearBit(tmr_, vector);
+        if (eoiCallback_)
+        {
+            eoiCallback_(vector);
+        }
+    }
+}
+
+UINT32 LocalApic::Read(UINT32 offset)
+{
+    if (offset >= IsrBase && offset < IrrBase + 0x80)
+    {
+        const UINT64* bitmap = offset < TmrBase ? isr_ : (offset < IrrBase ? tmr_ : irr_);
+        UINT32 index = ((offset - IsrBase) & 0x7F) >> 4;
+        return static_cast<UINT32>(bitmap[index / 2] >> (32 * (index % 2)));
+    }
+
+    switch (offset)
+    {
+    case Id: return apicId_ << 24;
+    case Version: return ApicVersion;
+    case Tpr: return tpr_;
+    case Ppr: return GetPpr();
+    case Ldr: return ldr_;
+    case Dfr: return dfr_;
+    case Svr: return svr_;
+    case Esr: return esr_;
+    case LvtTimer: return lvtTimer_;
+    case LvtLint0: return lvtLint0_;
+    case LvtLint1: return lvtLint1_;
+    case LvtError: return lvtError_;
+    case TimerInitialCount: return timerInitialCount_;
+    case TimerDivideConfig: return timerDivideConfig_;
+    case TimerCurrentCount:
+    {
+        UINT64 count = 0;
+        if (timerArmed_)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                timerDeadline_ - std::chrono::steady_clock::now()).count();
+            count = remaining > 0 ? static_cast<UINT64>(remaining) / TimerTickNanoseconds() : 0;
+        }
+        if (eventRecorder_ != nullptr)
+        {
+            count = eventRecorder_->OnTimerRead(count);
+        }
+        return static_cast<UINT32>(count);
+    }
+    default:
+        return 0;
+    }
+}
+
+void LocalApic::Write(UINT32 offset, UINT32 value)
+{
+    switch (offset)
+    {
+    case Tpr:
+        tpr_ = value & 0xFF;
+        break;
+    case Eoi:
+        EndOfInterrupt();
+        break;
+    case Ldr:
+        ldr_ = value & 0xFF000000;
+        break;
+    case Dfr:
+        dfr_ = value | 0x0FFFFFFF;
+        break;
+    case Svr:
+        svr_ = value & 0x3FF;
+        if ((svr_ & SvrSoftwareEnable) == 0)
+        {
+            lvtTimer_ |= LvtMasked;
+            lvtLint0_ |= LvtMasked;
+            lvtLint1_ |= LvtMasked;
+            lvtError_ |= LvtMasked;
+        }
+        break;
+    case Esr:
+        esr_ = 0;
+        break;
+    case LvtTimer:
+        lvtTimer_ = value & (LvtVectorMask | LvtMasked | LvtTimerPeriodic);
+        break;
+    case LvtLint0:
+        lvtLint0_ = value;
+        break;
+    case LvtLint1:
+        lvtLint1_ = value;
+        break;
+    case LvtError:
+        lvtError_ = value;
+        break;
+    case TimerInitialCount:
+        timerInitialCount_ = value;
+        if (value == 0)
+        {
+            timerArmed_ = false;
+        }
+        else
+        {
+            StartTimer(std::chrono::steady_clock::now());
+        }
+        break;
+    case TimerDivideConfig:
+        timerDivideConfig_ = value & 0xB;
+        break;
+    default:
+        break;
+    }
+}
+
+void LocalApic::UpdateTimer(std::chrono::steady_clock::time_point now)
+{
+    if (!timerArmed_ || now < timerDeadline_)
+    {
+        return;
+    }
+
+    if ((lvtTimer_ & LvtMasked) == 0)
+    {
+        AcceptInterrupt(lvtTimer_ & LvtVectorMask, false);
+    }
+
+    if (lvtTimer_ & LvtTimerPeriodic)
+    {
+        // Periods missed while the vCPU was not scheduled collapse into the one interrupt above.
+        auto period = std::chrono::nanoseconds(static_cast<UINT64>(timerInitialCount_) * TimerTickNanoseconds());
+        while (timerDeadline_ <= now)
+        {
+            timerDeadline_ += period;
+        }
+    }
+    else
+    {
+        timerArmed_ = false;
+    }
+}
+
+bool LocalApic::GetTimerDeadline(std::chrono::steady_clock::time_point& deadline) const
+{
+    if (!timerArmed_)
+    {
+        return false;
+    }
+    deadline = timerDeadline_;
+    return true;
+}
+
+void LocalApic::SetEoiCallback(std::function<void(UINT32)> callback)
+{
+    eoiCallback_ = std::move(callback);
+}
+
+void LocalApic::SetEventRecorder(EventRecorder* eventRecorder)
+{
+    eventRecorder_ = eventRecorder;
+}
+
+UINT32 LocalApic::GetPpr() const
+{
+    int highestInService = HighestVector(isr_);
+    UINT32 isrClass = highestInService < 0 ? 0 : static_cast<UINT32>(highestInService) & 0xF0;
+    return (tpr_ & 0xF0) >= isrClass ? tpr_ : isrClass;
+}
+
+bool LocalApic::HasPendingInterrupt() const
+{
+    return (irr_[0] | irr_[1] | irr_[2] | irr_[3]) != 0;
+}
+
+bool LocalApic::MatchesDestination(UINT32 destination, bool logical) const
+{
+    destination &= 0xFF;
+    if (!logical)
+    {
+        return destination == 0xFF || destination == apicId_;
+    }
+
+    UINT32 logicalId = ldr_ >> 24;
+    if ((dfr_ >> 28) == 0xF)
+    {
+        return (logicalId & destination) != 0;
+    }
+    // Cluster model: the high nibble selects the cluster, the low nibble the members.
+    return (destination >> 4) == (logicalId >> 4) && (destination & logicalId & 0xF) != 0;
+}
+
+void LocalApic::SaveState(std::vector<UINT8>& state) const
+{
+    State saved = {};
+    memcpy(saved.irr, irr_, sizeof(irr_));
+    memcpy(saved.isr, isr_, sizeof(isr_));
+    memcpy(saved.tmr, tmr_, sizeof(tmr_));
+    saved.tpr = tpr_;
+    saved.ldr = ldr_;
+    saved.dfr = dfr_;
+    saved.svr = svr_;
+    saved.esr = esr_;
+    saved.lvtTimer = lvtTimer_;
+    saved.lvtLint0 = lvtLint0_;
+    saved.lvtLint1 = lvtLint1_;
+    saved.lvtError = lvtError_;
+    saved.timerInitialCount = timerInitialCount_;
+    saved.timerDivideConfig = timerDivideConfig_;
+    saved.timerArmed = timerArmed_ ? 1 : 0;
+    if (timerArmed_)
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            timerDeadline_ - std::chrono::steady_clock::now()).count();
+        saved.timerRemainingNanoseconds = remaining > 0 ? static_cast<UINT64>(remaining) : 0;
+    }
+
+    const UINT8* bytes = reinterpret_cast<const UINT8*>(&saved);
+    state.assign(bytes, bytes + sizeof(saved));
+}
+
+bool LocalApic::LoadState(const std::vector<UINT8>& state)
+{
+    if (state.size() != sizeof(State))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Local APIC state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+
+    State saved;
+    memcpy(&saved, state.data(), sizeof(saved));
+    memcpy(irr_, saved.irr, sizeof(irr_));
+    memcpy(isr_, saved.isr, sizeof(isr_));
+    memcpy(tmr_, saved.tmr, sizeof(tmr_));
+    tpr_ = saved.tpr;
+    ldr_ = saved.ldr;
+    dfr_ = saved.dfr;
+    svr_ = saved.svr;
+    esr_ = saved.esr;
+    lvtTimer_ = saved.lvtTimer;
+    lvtLint0_ = saved.lvtLint0;
+    lvtLint1_ = saved.lvtLint1;
+    lvtError_ = saved.lvtError;
+    timerInitialCount_ = saved.timerInitialCount;
+    timerDivideConfig_ = saved.timerDivideConfig;
+    timerArmed_ = saved.timerArmed != 0;
+    timerDeadline_ = std::chrono::steady_clock::now() + std::chrono::nanoseconds(saved.timerRemainingNanoseconds);
+    return true;
+}
+
+bool LocalApic::TestBit(const UINT64* bitmap, UINT32 vector)
+{
+    return (bitmap[vector >> 6] >> (vector & 63)) & 1;
+}
+
+void LocalApic::SetBit(UINT64* bitmap, UINT32 vector)
+{
+    bitmap[vector >> 6] |= 1ull << (vector & 63);
+}
+
+void LocalApic::ClearBit(UINT64* bitmap, UINT32 vector)
+{
+    bitmap[vector >> 6] &= ~(1ull << (vector & 63));
+}
+
+int LocalApic::HighestVector(const UINT64* bitmap)
+{
+    for (int word = 3; word >= 0; --word)
+    {
+        unsigned long bit;
+        if (_BitScanReverse64(&bit, bitmap[word]))
+        {
+            return word * 64 + static_cast<int>(bit);
+        }
+    }
+    return -1;
+}
+
+void LocalApic::StartTimer(std::chrono::steady_clock::time_point now)
+{
+    timerDeadline_ = now + std::chrono::nanoseconds(static_cast<UINT64>(timerInitialCount_) * TimerTickNanoseconds());
+    timerArmed_ = true;
+}
+
+UINT64 LocalApic::TimerTickNanoseconds() const
+{
+    UINT32 shift = ((timerDivideConfig_ & 0x8) >> 1) | (timerDivideConfig_ & 0x3);
+    UINT64 divide = shift == 7 ? 1 : 2ull << shift;
+    return BusTickNanoseconds * divide;
+}
@@ -0,0 +1,230 @@
+#ifndef LOCALAPIC_H
+#define LOCALAPIC_H
+
+#include <Windows.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "Logger.h"
+
+class EventRecorder;
+
+/// @brief Virtual local APIC of one virtual processor \class LocalApic
+class LocalApic
+{
+public:
+    LocalApic(UINT32 apicId);
+    ~LocalApic();
+
+    static constexpr UINT64 DefaultBase = 0xFEE00000;
+    static constexpr UINT64 PageSize = 0x1000;
+
+    /**
+     * @brief Offsets of the local APIC registers in the APIC page
+     *
+     */
+    enum Register : UINT32
+    {
+        Id = 0x20,
+        Version = 0x30,
+        Tpr = 0x80,
+        Ppr = 0xA0,
+        Eoi = 0xB0,
+        Ldr = 0xD0,
+        Dfr = 0xE0,
+        Svr = 0xF0,
+        IsrBase = 0x100,
+        TmrBase = 0x180,
+        IrrBase = 0x200,
+        Esr = 0x280,
+        LvtTimer = 0x320,
+        LvtLint0 = 0x350,
+        LvtLint1 = 0x360,
+        LvtError = 0x370,
+        TimerInitialCount = 0x380,
+        TimerCurrentCount = 0x390,
+        TimerDivideConfig = 0x3E0,
+    };
+
+    /**
+     * @brief Accepts an interrupt into the IRR
+     *
+     * @param vector -> Interrupt vector, vectors below 16 are illegal and dropped
+     * @param levelTriggered -> true for level triggered interrupts, sets the TMR bit to request an EOI broadcast
+     * @return true -> if the vector was accepted
+     */
+    bool AcceptInterrupt(UINT32 vector, bool levelTriggered);
+
+    /**
+     * @brief Gets the highest priority pending interrupt that the current PPR allows
+     *
+     * @param vector -> receives the interrupt vector
+     * @return true -> if an interrupt can be delivered
+     */
+    bool GetDeliverableInterrupt(UINT32& vector) const;
+
+    /**
+     * @brief Moves a delivered interrupt from the IRR to the ISR
+     *
+     * @param vector -> Interrupt vector that was delivered to the guest
+     */
+    void AcknowledgeInterrupt(UINT32 vector);
+
+    /**
+     * @brief Checks the trigger mode of an accepted interrupt
+     *
+     * @param vector -> Interrupt vector
+     * @return true -> if the TMR bit of the vector is set
+     */
+    bool IsLevelTriggered(UINT32 vector) const;
+
+    /**
+     * @brief Ends the highest priority in-service interrupt
+     *
+     */
+    void EndOfInterrupt();
+
+    /**
+     * @brief Reads a local APIC register
+     *
+     * @param offset -> Register offset in the APIC page
+     * @return UINT32 -> value of the register
+     */
+    UINT32 Read(UINT32 offset);
+
+    /**
+     * @brief Writes a local APIC register
+     *
+     * @param offset -> Register offset in the APIC page
+     * @param value -> Value to write
+     */
+    void Write(UINT32 offset, UINT32 value);
+
+    /**
+     * @brief Raises the timer interrupt if the LAPIC timer expired, re-arms a periodic timer
+     *
+     * @param now -> Current host time
+     */
+    void UpdateTimer(std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief Gets the time the LAPIC timer expires next
+     *
+     * @param deadline -> receives the deadline
+     * @return true -> if the timer is armed
+     */
+    bool GetTimerDeadline(std::chrono::steady_clock::time_point& deadline) const;
+
+    /**
+     * @brief Sets the callback for EOIs of level triggered interrupts, used by the IOAPIC
+     *
+     * @param callback -> Called with the vector whose EOI was broadcast
+     */
+    void SetEoiCallback(std::function<void(UINT32)> callback);
+
+    /**
+     * @brief Sets the event recorder that records or replays the timer current count
+     *
+     * @param eventRecorder -> EventRecorder*, the recorder, nullptr to detach
+     */
+    void SetEventRecorder(EventRecorder* eventRecorder);
+
+    /**
+     * @brief Gets the processor priority, the higher of the TPR and the highest in-service class
+     *
+     */
+    UINT32 GetPpr() const;
+
+    /**
+     * @brief Checks if any interrupt is pending in the IRR
+     *
+     */
+    bool HasPendingInterrupt() const;
+
+    /**
+     * @brief Checks if the local APIC is addressed by an interrupt destination
+     *
+     * @param destination -> APIC ID for physical mode, message destination address for logical mode
+     * @param logical -> true for logical destination mode, matched against the LDR in the flat or cluster model of the DFR
+     * @return true -> if the interrupt targets this local APIC
+     */
+    bool MatchesDestination(UINT32 destination, bool logical) const;
+
+    /**
+     * @brief Serializes the local APIC state for snapshots and migration
+     *
+     * @param state -> receives the serialized state
+     */
+    void SaveState(std::vector<UINT8>& state) const;
+
+    /**
+     * @brief Loads a local APIC state produced by SaveState
+     *
+     * @param state -> the serialized state
+     * @return true -> if the state was loaded
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    static bool TestBit(const UINT64* bitmap, UINT32 vector);
+    static void SetBit(UINT64* bitmap, UINT32 vector);
+    static void ClearBit(UINT64* bitmap, UINT32 vector);
+
+    /**
+     * @brief Gets the highest set vector of a 256-bit vector bitmap with bit-scan instructions
+     *
+     * @return int -> the vector, -1 if no bit is set
+     */
+    static int HighestVector(const UINT64* bitmap);
+
+    /**
+     * @brief Architectural state of the local APIC as stored in snapshots
+     *
+     */
+    struct State
+    {
+        UINT64 irr[4];
+        UINT64 isr[4];
+        UINT64 tmr[4];
+        UINT32 tpr;
+        UINT32 ldr;
+        UINT32 dfr;
+        UINT32 svr;
+        UINT32 esr;
+        UINT32 lvtTimer;
+        UINT32 lvtLint0;
+        UINT32 lvtLint1;
+        UINT32 lvtError;
+        UINT32 timerInitialCount;
+        UINT32 timerDivideConfig;
+        UINT32 timerArmed;
+        UINT64 timerRemainingNanoseconds;
+    };
+
+    void StartTimer(std::chrono::steady_clock::time_point now);
+    UINT64 TimerTickNanoseconds() const;
+
+    UINT32 apicId_;
+    UINT64 irr_[4];
+    UINT64 isr_[4];
+    UINT64 tmr_[4];
+    UINT32 tpr_;
+    UINT32 ldr_;
+    UINT32 dfr_;
+    UINT32 svr_;
+    UINT32 esr_;
+    UINT32 lvtTimer_;
+    UINT32 lvtLint0_;
+    UINT32 lvtLint1_;
+    UINT32 lvtError_;
+    UINT32 timerInitialCount_;
+    UINT32 timerDivideConfig_;
+    bool timerArmed_;
+    std::chrono::steady_clock::time_point timerDeadline_;
+
+    std::function<void(UINT32)> eoiCallback_;
+    EventRecorder* eventRecorder_;
+    Logger logger_;
+};
+
+#endif // LOCALAPIC_H
\ No newline at end of file
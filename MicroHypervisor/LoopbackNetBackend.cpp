@@ -0,0 +1,40 @@
+#include "LoopbackNetBackend.h"
+
+LoopbackNetBackend::LoopbackNetBackend() : peer_(this), receiver_(nullptr), transmitted_(0), delivered_(0)
+{
+
+}
+
+LoopbackNetBackend::~LoopbackNetBackend()
+{
+
+}
+
+void LoopbackNetBackend::Connect(LoopbackNetBackend& first, LoopbackNetBackend& second)
+{
+    first.peer_ = &second;
+    second.peer_ = &first;
+}
+
+LoopbackNetBackend::Stats LoopbackNetBackend::GetStats()
+{
+    Stats stats = {};
+    stats.transmitted = transmitted_;
+    stats.delivered = delivered_;
+    stats.dropped = stats.transmitted - stats.delivered;
+    return stats;
+}
+
+void LoopbackNetBackend::SetReceiver(NetReceiver* receiver)
+{
+    receiver_ = receiver;
+}
+
+size_t LoopbackNetBackend::Transmit(UINT32 queueIndex, const NetFrame* frames, size_t count)
+{
+    // The whole batch is copied once, from the guest buffers of the sender into those of the receiver.
+    const size_t delivered = peer_->receiver_ != nullptr ? peer_->receiver_->Receive(queueIndex, frames, count) : 0;
+    transmitted_ += count;
+    delivered_ += delivered;
+    return delivered;
+}
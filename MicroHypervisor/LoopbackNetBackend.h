@@ -0,0 +1,49 @@
+#ifndef LOOPBACKNETBACKEND_H
+#define LOOPBACKNETBACKEND_H
+
+#include <Windows.h>
+#include <atomic>
+#include "NetBackend.h"
+
+/// @brief In-process backend, frames go straight to the receiver of the peer, or back to its own receiver without one \class LoopbackNetBackend
+class LoopbackNetBackend : public NetBackend
+{
+public:
+    /**
+     * @brief Backend statistics, dropped counts the frames the receiver had no buffer for
+     *
+     */
+    struct Stats
+    {
+        UINT64 transmitted;
+        UINT64 delivered;
+        UINT64 dropped;
+    };
+
+    LoopbackNetBackend();
+    ~LoopbackNetBackend();
+
+    /**
+     * @brief Connects two backends, the frames each one transmits are received by the other, called before the guests run
+     *
+     */
+    static void Connect(LoopbackNetBackend& first, LoopbackNetBackend& second);
+
+    /**
+     * @brief Gets the backend statistics
+     *
+     */
+    Stats GetStats();
+
+    void SetReceiver(NetReceiver* receiver) override;
+    size_t Transmit(UINT32 queueIndex, const NetFrame* frames, size_t count) override;
+
+private:
+    LoopbackNetBackend* peer_;
+    NetReceiver* receiver_;
+
+    std::atomic<UINT64> transmitted_;
+    std::atomic<UINT64> delivered_;
+};
+
+#endif // LOOPBACKNETBACKEND_H
\ No newline at end of file
@@ -1,14 +1,20 @@
 #include "MemoryManager.h"
 #include <iostream>
 #include <cassert>
+#include <intrin.h>
+#include <algorithm>
 
 MemoryManager::MemoryManager(WHV_PARTITION_HANDLE partitionHandle, size_t memorySize)
-    : partitionHandle_(partitionHandle), memorySize_(memorySize), logger_("MemoryManager.log")
+    : partitionHandle_(partitionHandle), memorySize_(memorySize), guestMemory_(nullptr), guestMemorySize_(0),
+    hostDirtyWords_(0), logger_("MemoryManager.log")
 {
 
 }
 
-MemoryManager::~MemoryManager() {}
+MemoryManager::~MemoryManager()
+{
+    UnmapGuestMemory();
+}
 
 bool MemoryManager::Initialize()
 {
@@ -24,7 +30,7 @@ bool MemoryManager::Initialize()
         pageTable_[i] = i;
         std::cout << "Pagetable at: " << i << std::endl;
     }
-    return true;
+    return MapGuestMemory();
 }
 
 UINT64 MemoryManager::TranslateGvaToGpa(UINT64 gva)
@@ -63,4 +69,235 @@ UINT64 MemoryManager::GetCurrentUsage()
     logger_.Log(Logger::LogLevel::Info, "Current memory usage: " + std::to_string(currentMemoryUsage));
 
     return currentMemoryUsage;
-}
\ No newline at end of file
+}
+
+bool MemoryManager::MapGuestMemory()
+{
+    if (guestMemory_ != nullptr)
+    {
+        return true;
+    }
+
+    size_t size = (memorySize_ + GuestPageSize - 1) & ~(GuestPageSize - 1);
+    if (size == 0)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Cannot map guest memory of size 0.");
+        return false;
+    }
+
+    guestMemory_ = static_cast<UINT8*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    if (guestMemory_ == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to allocate guest memory of size " + std::to_string(size));
+        return false;
+    }
+
+    auto result = WHvMapGpaRange(partitionHandle_, guestMemory_, GuestMemoryBase, size,
+        WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite | WHvMapGpaRangeFlagExecute | WHvMapGpaRangeFlagTrackDirtyPages);
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to map guest memory: HRESULT " + std::to_string(result)
+            + ", size = " + std::to_string(size));
+        VirtualFree(guestMemory_, 0, MEM_RELEASE);
+        guestMemory_ = nullptr;
+        return false;
+    }
+
+    guestMemorySize_ = size;
+    {
+        std::lock_guard<std::mutex> lock(dirtyMutex_);
+        size_t words = (GetGuestPageCount() + 63) / 64;
+        dirtyBitmap_.assign(words, 0);
+        hostDirtyBitmap_.reset(new std::atomic<UINT64>[words]);
+        for (size_t i = 0; i < words; ++i)
+        {
+            hostDirtyBitmap_[i].store(0, std::memory_order_relaxed);
+        }
+        hostDirtyWords_ = words;
+        for (auto& log : dirtyLogs_)
+        {
+            log.assign(words, 0);
+        }
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Guest memory mapped at GPA " + std::to_string(GuestMemoryBase)
+        + ", size = " + std::to_string(size));
+    return true;
+}
+
+void MemoryManager::UnmapGuestMemory()
+{
+    if (guestMemory_ == nullptr)
+    {
+        return;
+    }
+
+    WHvUnmapGpaRange(partitionHandle_, GuestMemoryBase, guestMemorySize_);
+    VirtualFree(guestMemory_, 0, MEM_RELEASE);
+    guestMemory_ = nullptr;
+    guestMemorySize_ = 0;
+}
+
+int MemoryManager::CreateDirtyLog()
+{
+    std::lock_guard<std::mutex> lock(dirtyMutex_);
+    dirtyLogs_.emplace_back(dirtyBitmap_.size(), 0);
+    return static_cast<int>(dirtyLogs_.size() - 1);
+}
+
+bool MemoryManager::SyncDirtyBitmap()
+{
+    if (guestMemory_ == nullptr || dirtyBitmap_.empty())
+    {
+        return false;
+    }
+
+    // The query also resets the dirty bits in the hypervisor, so the result is fanned out to every log.
+    auto result = WHvQueryGpaRangeDirtyBitmap(partitionHandle_, GuestMemoryBase, guestMemorySize_,
+        dirtyBitmap_.data(), static_cast<UINT32>(dirtyBitmap_.size() * sizeof(UINT64)));
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to query dirty bitmap: HRESULT " + std::to_string(result));
+        return false;
+    }
+
+    // Host writes are not seen by the hypervisor, merge the ones reported through MarkDirty.
+    for (size_t i = 0; i < hostDirtyWords_; ++i)
+    {
+        if (hostDirtyBitmap_[i].load(std::memory_order_relaxed) != 0)
+        {
+            dirtyBitmap_[i] |= hostDirtyBitmap_[i].exchange(0, std::memory_order_acq_rel);
+        }
+    }
+
+    for (auto& log : dirtyLogs_)
+    {
+        for (size_t i = 0; i < dirtyBitmap_.size(); ++i)
+        {
+            log[i] |= dirtyBitmap_[i];
+        }
+    }
+    return true;
+}
+
+bool MemoryManager::CollectDirtyPages(int logId, std::vector<UINT64>& pageIndices)
+{
+    pageIndices.clear();
+
+    std::lock_guard<std::mutex> lock(dirtyMutex_);
+    if (logId < 0 || static_cast<size_t>(logId) >= dirtyLogs_.size())
+    {
+        return false;
+    }
+
+    if (!SyncDirtyBitmap())
+    {
+        return false;
+    }
+
+    auto& log = dirtyLogs_[logId];
+    for (size_t i = 0; i < log.size(); ++i)
+    {
+        UINT64 word = log[i];
+        while (word != 0)
+        {
+            unsigned long bit = 0;
+            _BitScanForward64(&bit, word);
+            pageIndices.push_back(i * 64 + bit);
+            word &= word - 1;
+        }
+        log[i] = 0;
+    }
+    return true;
+}
+
+void MemoryManager::MarkDirty(UINT64 gpa, size_t length)
+{
+    if (length == 0 || hostDirtyBitmap_ == nullptr || gpa < GuestMemoryBase || gpa - GuestMemoryBase >= guestMemorySize_)
+    {
+        return;
+    }
+
+    UINT64 offset = gpa - GuestMemoryBase;
+    UINT64 last = (std::min)(offset + length, static_cast<UINT64>(guestMemorySize_)) - 1;
+    for (UINT64 page = offset / GuestPageSize; page <= last / GuestPageSize; ++page)
+    {
+        UINT64 bit = 1ULL << (page % 64);
+        auto& word = hostDirtyBitmap_[page / 64];
+        // Most host writes hit a page that is already marked, skip the locked RMW for them.
+        if ((word.load(std::memory_order_relaxed) & bit) == 0)
+        {
+            word.fetch_or(bit, std::memory_order_release);
+        }
+    }
+}
+
+void MemoryManager::MarkHostRangeDirty(const void* host, size_t length)
+{
+    const UINT8* address = static_cast<const UINT8*>(host);
+    if (guestMemory_ == nullptr || address < guestMemory_ || address >= guestMemory_ + guestMemorySize_)
+    {
+        return;
+    }
+    MarkDirty(GuestMemoryBase + (address - guestMemory_), length);
+}
+
+void MemoryManager::MarkPagesDirty(const std::vector<UINT64>& pageIndices, int exceptLogId)
+{
+    std::lock_guard<std::mutex> lock(dirtyMutex_);
+    for (size_t logId = 0; logId < dirtyLogs_.size(); ++logId)
+    {
+        if (static_cast<int>(logId) == exceptLogId)
+        {
+            continue;
+        }
+
+        auto& log = dirtyLogs_[logId];
+        for (UINT64 page : pageIndices)
+        {
+            if (page / 64 < log.size())
+            {
+                log[page / 64] |= 1ULL << (page % 64);
+            }
+        }
+    }
+}
+
+UINT8* MemoryManager::GetHostAddress(UINT64 gpa) const
+{
+    if (guestMemory_ == nullptr || gpa < GuestMemoryBase || gpa - GuestMemoryBase >= guestMemorySize_)
+    {
+        return nullptr;
+    }
+    return guestMemory_ + (gpa - GuestMemoryBase);
+}
+
+UINT8* MemoryManager::GetHostRange(UINT64 gpa, size_t length) const
+{
+    if (guestMemory_ == nullptr || length == 0 || gpa < GuestMemoryBase || gpa - GuestMemoryBase > guestMemorySize_
+        || length > guestMemorySize_ - (gpa - GuestMemoryBase))
+    {
+        return nullptr;
+    }
+    return guestMemory_ + (gpa - GuestMemoryBase);
+}
+
+UINT8* MemoryManager::GetGuestMemory() const
+{
+    return guestMemory_;
+}
+
+UINT64 MemoryManager::GetGuestMemoryBase() const
+{
+    return GuestMemoryBase;
+}
+
+size_t MemoryManager::GetGuestMemorySize() const
+{
+    return guestMemorySize_;
+}
+
+size_t MemoryManager::GetGuestPageCount() const
+{
+    return guestMemorySize_ / GuestPageSize;
+}
@@ -4,6 +4,10 @@
 #include <Windows.h>
 #include <WinHvEmulation.h>
 #include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include "Logger.h"
 
 /// @brief Memory Manager class for the Hypervisor \class MemoryManager
@@ -42,10 +46,126 @@ public:
      */
     UINT64 GetCurrentUsage();
 
+    /**
+     * @brief Allocates the guest RAM and maps it into the partition with dirty page tracking
+     *
+     * @return true -> if the guest RAM is mapped (or was already mapped)
+     * @return false -> if the allocation or the mapping fails
+     */
+    bool MapGuestMemory();
+
+    /**
+     * @brief Unmaps and frees the guest RAM
+     *
+     */
+    void UnmapGuestMemory();
+
+    /**
+     * @brief Creates a new dirty log, every consumer of dirty pages owns its own log
+     *
+     * @return int -> Id of the dirty log
+     */
+    int CreateDirtyLog();
+
+    /**
+     * @brief Collects the pages dirtied since the last collection of the given log and clears the log
+     *
+     * @param logId -> int, Id of the dirty log
+     * @param pageIndices -> std::vector<UINT64>&, receives the indices of the dirty guest pages
+     * @return true -> if the dirty bitmap was collected successfully
+     * @return false -> if the dirty bitmap query fails
+     */
+    bool CollectDirtyPages(int logId, std::vector<UINT64>& pageIndices);
+
+    /**
+     * @brief Marks a guest physical range as dirty after the host wrote it, the hypervisor only tracks
+     *        guest writes so every host writer (devices, restores) must report its writes here
+     *
+     * @param gpa -> UINT64, first Guest Physical Address written
+     * @param length -> size_t, number of bytes written
+     */
+    void MarkDirty(UINT64 gpa, size_t length);
+
+    /**
+     * @brief Marks a range dirty by its host address, for device models that write through GetHostRange pointers
+     *
+     * @param host -> const void*, first host byte written, ignored if it is not in guest RAM
+     * @param length -> size_t, number of bytes written
+     */
+    void MarkHostRangeDirty(const void* host, size_t length);
+
+    /**
+     * @brief Marks pages dirty in every log but one, used by a consumer that rewrote the pages to match its
+     *        own log, so its next collection does not see them again
+     *
+     * @param pageIndices -> const std::vector<UINT64>&, indices of the rewritten guest pages
+     * @param exceptLogId -> int, log that is left untouched
+     */
+    void MarkPagesDirty(const std::vector<UINT64>& pageIndices, int exceptLogId);
+
+    /**
+     * @brief Gets the host address backing a guest physical address
+     *
+     * @param gpa -> UINT64, Guest Physical Address
+     * @return UINT8* -> Host address, nullptr if the GPA is not backed by guest RAM
+     */
+    UINT8* GetHostAddress(UINT64 gpa) const;
+
+    /**
+     * @brief Gets the host address of a guest physical range, device models use it for zero-copy access
+     *
+     * @param gpa -> UINT64, first Guest Physical Address of the range
+     * @param length -> size_t, length of the range in bytes
+     * @return UINT8* -> Host address, nullptr if any byte of the range is not backed by guest RAM
+     */
+    UINT8* GetHostRange(UINT64 gpa, size_t length) const;
+
+    /**
+     * @brief Gets the host address of the guest RAM
+     *
+     */
+    UINT8* GetGuestMemory() const;
+
+    /**
+     * @brief Gets the guest physical base address of the guest RAM
+     *
+     */
+    UINT64 GetGuestMemoryBase() const;
+
+    /**
+     * @brief Gets the size of the mapped guest RAM in bytes
+     *
+     */
+    size_t GetGuestMemorySize() const;
+
+    /**
+     * @brief Gets the number of guest pages of the mapped guest RAM
+     *
+     */
+    size_t GetGuestPageCount() const;
+
+    static constexpr size_t GuestPageSize = 0x1000;
+    static constexpr UINT64 GuestMemoryBase = 0x100000;
+
 private:
+    /**
+     * @brief Pulls the dirty bitmap from the hypervisor and merges it into every dirty log
+     *
+     * @return true -> if the dirty bitmap was queried successfully
+     * @return false -> if the dirty bitmap query fails
+     */
+    bool SyncDirtyBitmap();
+
     WHV_PARTITION_HANDLE partitionHandle_;
     size_t memorySize_;
     std::unordered_map<UINT64, UINT64> pageTable_;
+    UINT8* guestMemory_;
+    size_t guestMemorySize_;
+    std::vector<UINT64> dirtyBitmap_;
+    std::vector<std::vector<UINT64>> dirtyLogs_;
+    std::unique_ptr<std::atomic<UINT64>[]> hostDirtyBitmap_;
+    size_t hostDirtyWords_;
+    std::mutex dirtyMutex_;
     Logger logger_;
 };
 
@@ -0,0 +1,706 @@
+#define NOMINMAX
+#include "MigrationManager.h"
+#include <thread>
+#include <chrono>
+
+namespace
+{
+    constexpr UINT32 StreamMagic = 0x4D56484D; // "MHVM"
+    constexpr UINT32 StreamVersion = 1;
+    constexpr UINT64 MaxRecordPayload = 64ull * 1024 * 1024;
+
+    enum RecordType : UINT32
+    {
+        PageBatch = 1,
+        RoundEnd = 2,
+        Registers = 3,
+        DeviceState = 4,
+        Complete = 5,
+        Ack = 6,
+    };
+
+    enum PageEncoding : UINT16
+    {
+        ZeroPage = 0,
+        RawPage = 1,
+        WordRlePage = 2,
+    };
+
+#pragma pack(push, 1)
+    struct StreamHeader
+    {
+        UINT32 magic;
+        UINT32 version;
+        UINT64 guestMemorySize;
+        UINT32 pageSize;
+        UINT32 registerCount;
+    };
+
+    struct RecordHeader
+    {
+        UINT32 type;
+        UINT32 count;
+        UINT64 payloadSize;
+    };
+
+    struct PageHeader
+    {
+        UINT64 pageIndex;
+        UINT16 encoding;
+        UINT16 reserved;
+        UINT32 length;
+    };
+
+    struct WordRun
+    {
+        UINT16 length;
+        UINT64 value;
+    };
+#pragma pack(pop)
+
+    // Run-length encodes the page as runs of identical 64-bit words, gives up once it is no smaller than raw.
+    bool EncodeWordRle(const UINT8* page, size_t pageSize, std::vector<char>& out)
+    {
+        const size_t words = pageSize / sizeof(UINT64);
+        const size_t start = out.size();
+        size_t i = 0;
+        while (i < words)
+        {
+            UINT64 value;
+            memcpy(&value, page + i * sizeof(UINT64), sizeof(value));
+            size_t run = 1;
+            while (i + run < words && memcmp(page + (i + run) * sizeof(UINT64), &value, sizeof(value)) == 0)
+            {
+                run++;
+            }
+
+            if (out.size() - start + sizeof(WordRun) >= pageSize)
+            {
+                out.resize(start);
+                return false;
+            }
+
+            WordRun wordRun = { static_cast<UINT16>(run), value };
+            const char* bytes = reinterpret_cast<const char*>(&wordRun);
+            out.insert(out.end(), bytes, bytes + sizeof(wordRun));
+            i += run;
+        }
+        return true;
+    }
+
+    bool DecodeWordRle(const char* data, size_t length, UINT8* page, size_t pageSize)
+    {
+        const size_t words = pageSize / sizeof(UINT64);
+        size_t word = 0;
+        for (size_t offset = 0; offset + sizeof(WordRun) <= length; offset += sizeof(WordRun))
+        {
+            WordRun wordRun;
+            memcpy(&wordRun, data + offset, sizeof(wordRun));
+            if (word + wordRun.length > words)
+            {
+                return false;
+            }
+            for (UINT16 r = 0; r < wordRun.length; ++r, ++word)
+            {
+                memcpy(page + word * sizeof(UINT64), &wordRun.value, sizeof(UINT64));
+            }
+        }
+        return word == words;
+    }
+
+    bool IsZeroPage(const UINT8* page, size_t pageSize)
+    {
+        const UINT64* words = reinterpret_cast<const UINT64*>(page);
+        for (size_t i = 0; i < pageSize / sizeof(UINT64); ++i)
+        {
+            if (words[i] != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    UINT64 ElapsedMicroseconds(std::chrono::steady_clock::time_point since)
+    {
+        return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - since).count());
+    }
+}
+
+MigrationManager::RecordQueue::RecordQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+bool MigrationManager::RecordQueue::Push(Record&& record)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return records_.size() < capacity_ || closed_; });
+    if (closed_)
+    {
+        return false;
+    }
+    records_.push_back(std::move(record));
+    cv_.notify_all();
+    return true;
+}
+
+bool MigrationManager::RecordQueue::Pop(Record& record)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !records_.empty() || closed_; });
+    if (records_.empty())
+    {
+        return false;
+    }
+    record = std::move(records_.front());
+    records_.pop_front();
+    cv_.notify_all();
+    return true;
+}
+
+void MigrationManager::RecordQueue::Close()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+}
+
+MigrationManager::MigrationManager() : virtualProcessor_(nullptr), memoryManager_(nullptr), snapshotManager_(nullptr),
+    dirtyLog_(-1), wsaStarted_(false), sendFailed_(false), stats_(), logger_("MigrationManager.log")
+{
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        logger_.Log(Logger::LogLevel::Error, "WSAStartup failed, migration unavailable.");
+    }
+    else
+    {
+        wsaStarted_ = true;
+    }
+}
+
+MigrationManager::~MigrationManager()
+{
+    if (wsaStarted_)
+    {
+        WSACleanup();
+    }
+}
+
+void MigrationManager::Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager, SnapshotManager* snapshotManager)
+{
+    virtualProcessor_ = virtualProcessor;
+    memoryManager_ = memoryManager;
+    snapshotManager_ = snapshotManager;
+}
+
+bool MigrationManager::SendVM(const std::string& ip, int port, const MigrationConfig& config)
+{
+    if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Cannot migrate, virtual processor or guest memory not attached.");
+        return false;
+    }
+
+    SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket == INVALID_SOCKET)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration socket creation failed: " + std::to_string(WSAGetLastError()));
+        return false;
+    }
+
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&bufferSize), sizeof(bufferSize));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<u_short>(port));
+    address.sin_addr.s_addr = inet_addr(ip.c_str());
+    if (connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration connect to " + ip + ":" + std::to_string(port)
+            + " failed: " + std::to_string(WSAGetLastError()));
+        closesocket(socket);
+        return false;
+    }
+
+    StreamHeader header = { StreamMagic, StreamVersion, memoryManager_->GetGuestMemorySize(),
+        static_cast<UINT32>(MemoryManager::GuestPageSize), static_cast<UINT32>(std::size(regNames)) };
+    if (!SendAll(socket, reinterpret_cast<const char*>(&header), sizeof(header)))
+    {
+        closesocket(socket);
+        return false;
+    }
+
+    if (dirtyLog_ < 0)
+    {
+        dirtyLog_ = memoryManager_->CreateDirtyLog();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    MigrationStats stats = {};
+    std::atomic<UINT64> wireBytes(sizeof(header));
+    sendFailed_ = false;
+
+    // Encoding runs on this thread while the socket thread drains finished batches.
+    RecordQueue queue(config.maxBatchesInFlight);
+    std::thread sender([this, socket, &queue, &wireBytes]()
+    {
+        Record record;
+        while (queue.Pop(record))
+        {
+            if (!SendRecord(socket, record))
+            {
+                sendFailed_ = true;
+                queue.Close();
+                return;
+            }
+            wireBytes += sizeof(RecordHeader) + record.payload.size();
+        }
+    });
+
+    // Pauses nest, so only a pause taken here may be released on failure.
+    bool paused = false;
+    auto finish = [&](bool success)
+    {
+        queue.Close();
+        sender.join();
+        closesocket(socket);
+        if (!success && paused)
+        {
+            virtualProcessor_->Resume();
+        }
+        return success;
+    };
+
+    std::vector<UINT64> dirty;
+    memoryManager_->CollectDirtyPages(dirtyLog_, dirty);
+    std::vector<UINT64> allPages(memoryManager_->GetGuestPageCount());
+    for (size_t i = 0; i < allPages.size(); ++i)
+    {
+        allPages[i] = i;
+    }
+
+    if (!QueuePages(allPages, queue, config.pagesPerBatch) || !queue.Push({ RoundEnd, 0, {} }))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration failed while sending the initial memory round.");
+        return finish(false);
+    }
+    stats.pagesSent = allPages.size();
+    stats.rounds = 1;
+
+    size_t previousDirty = SIZE_MAX;
+    dirty.clear();
+    while (stats.rounds < config.maxRounds)
+    {
+        if (!memoryManager_->CollectDirtyPages(dirtyLog_, dirty))
+        {
+            return finish(false);
+        }
+        if (dirty.size() <= config.convergedDirtyPages || dirty.size() >= previousDirty)
+        {
+            break;
+        }
+
+        if (!QueuePages(dirty, queue, config.pagesPerBatch) || !queue.Push({ RoundEnd, 0, {} }))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Migration failed in pre-copy round " + std::to_string(stats.rounds));
+            return finish(false);
+        }
+        stats.pagesSent += dirty.size();
+        stats.rounds++;
+        previousDirty = dirty.size();
+        dirty.clear();
+    }
+
+    auto blackoutStart = std::chrono::steady_clock::now();
+    HRESULT hr = virtualProcessor_->Pause();
+    paused = true;
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration failed to pause the virtual processor: HRESULT " + std::to_string(hr));
+        return finish(false);
+    }
+
+    std::vector<UINT64> finalDirty;
+    memoryManager_->CollectDirtyPages(dirtyLog_, finalDirty);
+    std::vector<WHV_REGISTER_VALUE> registers;
+    hr = virtualProcessor_->SaveState(registers);
+    if (FAILED(hr) || !QueuePages(dirty, queue, config.pagesPerBatch) || !QueuePages(finalDirty, queue, config.pagesPerBatch))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration failed while sending the final dirty pages.");
+        return finish(false);
+    }
+    stats.finalDirtyPages = dirty.size() + finalDirty.size();
+    stats.pagesSent += stats.finalDirtyPages;
+
+    Record registerRecord = { Registers, static_cast<UINT32>(registers.size()), {} };
+    registerRecord.payload.assign(reinterpret_cast<const char*>(registers.data()),
+        reinterpret_cast<const char*>(registers.data() + registers.size()));
+    if (!queue.Push(std::move(registerRecord)))
+    {
+        return finish(false);
+    }
+
+    if (snapshotManager_ != nullptr)
+    {
+        std::vector<std::pair<std::string, std::vector<UINT8>>> devices;
+        snapshotManager_->SaveDeviceStates(devices);
+        for (const auto& [name, state] : devices)
+        {
+            Record deviceRecord = { DeviceState, 1, {} };
+            UINT32 nameLength = static_cast<UINT32>(name.size());
+            const char* nameLengthBytes = reinterpret_cast<const char*>(&nameLength);
+            deviceRecord.payload.insert(deviceRecord.payload.end(), nameLengthBytes, nameLengthBytes + sizeof(nameLength));
+            deviceRecord.payload.insert(deviceRecord.payload.end(), name.begin(), name.end());
+            deviceRecord.payload.insert(deviceRecord.payload.end(), state.begin(), state.end());
+            if (!queue.Push(std::move(deviceRecord)))
+            {
+                return finish(false);
+            }
+        }
+    }
+
+    if (!queue.Push({ Complete, 0, {} }))
+    {
+        return finish(false);
+    }
+    queue.Close();
+    sender.join();
+
+    Record ack;
+    bool acknowledged = !sendFailed_ && ReceiveRecord(socket, ack) && ack.type == Ack;
+    stats.blackoutMicroseconds = ElapsedMicroseconds(blackoutStart);
+    stats.totalMicroseconds = ElapsedMicroseconds(start);
+    stats.rawBytes = static_cast<UINT64>(stats.pagesSent) * MemoryManager::GuestPageSize;
+    stats.wireBytes = wireBytes;
+    closesocket(socket);
+
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        stats_ = stats;
+    }
+
+    if (!acknowledged)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration was not acknowledged by the receiver, resuming locally.");
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Migration to " + ip + ":" + std::to_string(port) + " completed after "
+        + std::to_string(stats.rounds) + " rounds, " + std::to_string(stats.pagesSent) + " pages, "
+        + std::to_string(stats.wireBytes) + " / " + std::to_string(stats.rawBytes) + " bytes on the wire, blackout = "
+        + std::to_string(stats.blackoutMicroseconds) + " us, total = " + std::to_string(stats.totalMicroseconds) + " us");
+    return true;
+}
+
+bool MigrationManager::ReceiveVM(int port)
+{
+    if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Cannot receive migration, virtual processor or guest memory not attached.");
+        return false;
+    }
+
+    SOCKET listenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket == INVALID_SOCKET)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration socket creation failed: " + std::to_string(WSAGetLastError()));
+        return false;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<u_short>(port));
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+        || listen(listenSocket, 1) == SOCKET_ERROR)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration listen on port " + std::to_string(port)
+            + " failed: " + std::to_string(WSAGetLastError()));
+        closesocket(listenSocket);
+        return false;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Waiting for incoming migration on port " + std::to_string(port));
+    SOCKET socket = accept(listenSocket, nullptr, nullptr);
+    closesocket(listenSocket);
+    if (socket == INVALID_SOCKET)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Migration accept failed: " + std::to_string(WSAGetLastError()));
+        return false;
+    }
+
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&bufferSize), sizeof(bufferSize));
+
+    StreamHeader header = {};
+    if (!ReceiveAll(socket, reinterpret_cast<char*>(&header), sizeof(header))
+        || header.magic != StreamMagic || header.version != StreamVersion
+        || header.guestMemorySize != memoryManager_->GetGuestMemorySize()
+        || header.pageSize != MemoryManager::GuestPageSize
+        || header.registerCount != std::size(regNames))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Incoming migration stream does not match the local VM.");
+        closesocket(socket);
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    virtualProcessor_->Pause();
+
+    // The socket thread keeps reading while this thread decodes pages into guest memory.
+    RecordQueue queue(16);
+    std::thread receiver([this, socket, &queue]()
+    {
+        Record record;
+        while (ReceiveRecord(socket, record))
+        {
+            bool last = record.type == Complete;
+            if (!queue.Push(std::move(record)) || last)
+            {
+                break;
+            }
+        }
+        queue.Close();
+    });
+
+    MigrationStats stats = {};
+    bool complete = false;
+    bool failed = false;
+    Record record;
+    while (!failed && queue.Pop(record))
+    {
+        switch (record.type)
+        {
+        case PageBatch:
+            failed = !ApplyPages(record);
+            if (!failed)
+            {
+                stats.pagesSent += record.count;
+            }
+            break;
+        case RoundEnd:
+            stats.rounds++;
+            break;
+        case Registers:
+        {
+            std::vector<WHV_REGISTER_VALUE> registers(record.count);
+            if (record.payload.size() != registers.size() * sizeof(WHV_REGISTER_VALUE))
+            {
+                failed = true;
+                break;
+            }
+            memcpy(registers.data(), record.payload.data(), record.payload.size());
+            failed = FAILED(virtualProcessor_->LoadState(registers));
+            break;
+        }
+        case DeviceState:
+        {
+            UINT32 nameLength = 0;
+            if (record.payload.size() < sizeof(nameLength))
+            {
+                failed = true;
+                break;
+            }
+            memcpy(&nameLength, record.payload.data(), sizeof(nameLength));
+            if (record.payload.size() < sizeof(nameLength) + nameLength)
+            {
+                failed = true;
+                break;
+            }
+            std::string name(record.payload.data() + sizeof(nameLength), nameLength);
+            std::vector<UINT8> state(record.payload.begin() + sizeof(nameLength) + nameLength, record.payload.end());
+            if (snapshotManager_ != nullptr)
+            {
+                snapshotManager_->LoadDeviceState(name, state);
+            }
+            break;
+        }
+        case Complete:
+            complete = true;
+            break;
+        default:
+            logger_.Log(Logger::LogLevel::Error, "Unknown migration record type " + std::to_string(record.type));
+            failed = true;
+            break;
+        }
+    }
+
+    queue.Close();
+    receiver.join();
+
+    if (!complete || failed)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Incoming migration aborted before the final state was received.");
+        closesocket(socket);
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    SendRecord(socket, { Ack, 0, {} });
+    closesocket(socket);
+    virtualProcessor_->Resume();
+
+    stats.totalMicroseconds = ElapsedMicroseconds(start);
+    stats.rawBytes = static_cast<UINT64>(stats.pagesSent) * MemoryManager::GuestPageSize;
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        stats_ = stats;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Incoming migration completed after " + std::to_string(stats.rounds)
+        + " rounds, " + std::to_string(stats.pagesSent) + " pages in " + std::to_string(stats.totalMicroseconds) + " us");
+    return true;
+}
+
+MigrationManager::MigrationStats MigrationManager::GetStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    return stats_;
+}
+
+bool MigrationManager::QueuePages(const std::vector<UINT64>& pageIndices, RecordQueue& queue, size_t pagesPerBatch)
+{
+    const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    const size_t pageSize = MemoryManager::GuestPageSize;
+
+    for (size_t first = 0; first < pageIndices.size(); first += pagesPerBatch)
+    {
+        size_t last = std::min(first + pagesPerBatch, pageIndices.size());
+        Record record = { PageBatch, static_cast<UINT32>(last - first), {} };
+        record.payload.reserve((last - first) * (sizeof(PageHeader) + pageSize / 4));
+
+        for (size_t i = first; i < last; ++i)
+        {
+            const UINT8* page = guestMemory + pageIndices[i] * pageSize;
+            size_t headerOffset = record.payload.size();
+            record.payload.resize(headerOffset + sizeof(PageHeader));
+
+            PageHeader pageHeader = { pageIndices[i], ZeroPage, 0, 0 };
+            if (!IsZeroPage(page, pageSize))
+            {
+                if (EncodeWordRle(page, pageSize, record.payload))
+                {
+                    pageHeader.encoding = WordRlePage;
+                }
+                else
+                {
+                    pageHeader.encoding = RawPage;
+                    record.payload.insert(record.payload.end(), page, page + pageSize);
+                }
+                pageHeader.length = static_cast<UINT32>(record.payload.size() - headerOffset - sizeof(PageHeader));
+            }
+            memcpy(record.payload.data() + headerOffset, &pageHeader, sizeof(pageHeader));
+        }
+
+        if (!queue.Push(std::move(record)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MigrationManager::ApplyPages(const Record& record)
+{
+    const size_t pageSize = MemoryManager::GuestPageSize;
+    const size_t pageCount = memoryManager_->GetGuestPageCount();
+    UINT8* guestMemory = memoryManager_->GetGuestMemory();
+
+    size_t offset = 0;
+    for (UINT32 i = 0; i < record.count; ++i)
+    {
+        PageHeader pageHeader;
+        if (offset + sizeof(pageHeader) > record.payload.size())
+        {
+            return false;
+        }
+        memcpy(&pageHeader, record.payload.data() + offset, sizeof(pageHeader));
+        offset += sizeof(pageHeader);
+
+        if (pageHeader.pageIndex >= pageCount || offset + pageHeader.length > record.payload.size())
+        {
+            return false;
+        }
+
+        UINT8* page = guestMemory + pageHeader.pageIndex * pageSize;
+        const char* data = record.payload.data() + offset;
+        switch (pageHeader.encoding)
+        {
+        case ZeroPage:
+            memset(page, 0, pageSize);
+            break;
+        case RawPage:
+            if (pageHeader.length != pageSize)
+            {
+                return false;
+            }
+            memcpy(page, data, pageSize);
+            break;
+        case WordRlePage:
+            if (!DecodeWordRle(data, pageHeader.length, page, pageSize))
+            {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        memoryManager_->MarkDirty(MemoryManager::GuestMemoryBase + pageHeader.pageIndex * pageSize, pageSize);
+        offset += pageHeader.length;
+    }
+    return true;
+}
+
+bool MigrationManager::SendRecord(SOCKET socket, const Record& record)
+{
+    RecordHeader header = { record.type, record.count, record.payload.size() };
+    return SendAll(socket, reinterpret_cast<const char*>(&header), sizeof(header))
+        && SendAll(socket, record.payload.data(), record.payload.size());
+}
+
+bool MigrationManager::ReceiveRecord(SOCKET socket, Record& record)
+{
+    RecordHeader header = {};
+    if (!ReceiveAll(socket, reinterpret_cast<char*>(&header), sizeof(header)) || header.payloadSize > MaxRecordPayload)
+    {
+        return false;
+    }
+
+    record.type = header.type;
+    record.count = header.count;
+    record.payload.resize(static_cast<size_t>(header.payloadSize));
+    return ReceiveAll(socket, record.payload.data(), record.payload.size());
+}
+
+bool MigrationManager::SendAll(SOCKET socket, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        int sent = send(socket, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+        if (sent == SOCKET_ERROR || sent == 0)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Migration send failed: " + std::to_string(WSAGetLastError()));
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool MigrationManager::ReceiveAll(SOCKET socket, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        int received = recv(socket, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+        if (received == SOCKET_ERROR || received == 0)
+        {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
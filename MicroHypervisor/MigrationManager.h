@@ -0,0 +1,158 @@
+#ifndef MIGRATIONMANAGER_H
+#define MIGRATIONMANAGER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <Windows.h>
+#include <winsock.h>
+#include "Logger.h"
+#include "VirtualProcessor.h"
+#include "MemoryManager.h"
+#include "SnapshotManager.h"
+
+/// @brief Live migration of a VM to another MicroHypervisor process over TCP \class MigrationManager
+class MigrationManager
+{
+public:
+    MigrationManager();
+    ~MigrationManager();
+
+    /**
+     * @brief Configuration of an outgoing migration
+     *
+     */
+    struct MigrationConfig
+    {
+        UINT32 maxRounds = 8;
+        size_t convergedDirtyPages = 64;
+        size_t pagesPerBatch = 256;
+        size_t maxBatchesInFlight = 8;
+    };
+
+    /**
+     * @brief Statistics of the last migration
+     *
+     */
+    struct MigrationStats
+    {
+        UINT32 rounds;
+        size_t pagesSent;
+        size_t finalDirtyPages;
+        UINT64 rawBytes;
+        UINT64 wireBytes;
+        UINT64 blackoutMicroseconds;
+        UINT64 totalMicroseconds;
+    };
+
+    /**
+     * @brief Attaches the components whose state is migrated
+     *
+     * @param virtualProcessor -> VirtualProcessor*, the virtual processor to migrate
+     * @param memoryManager -> MemoryManager*, the memory manager owning the guest RAM
+     * @param snapshotManager -> SnapshotManager*, provides the device state serializers
+     */
+    void Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager, SnapshotManager* snapshotManager);
+
+    /**
+     * @brief Migrates the running VM to a receiver, memory is pre-copied while the guest runs,
+     *        on success the local virtual processor stays paused
+     *
+     * @param ip -> IP address of the receiver
+     * @param port -> Port of the receiver
+     * @param config -> MigrationConfig, convergence and pipelining settings
+     * @return true -> if the receiver acknowledged the final state
+     * @return false -> if the migration failed, the local virtual processor is resumed
+     */
+    bool SendVM(const std::string& ip, int port, const MigrationConfig& config);
+
+    /**
+     * @brief Waits for one incoming migration and loads it into the local VM
+     *
+     * @param port -> Port to listen on
+     * @return true -> if the VM was received completely
+     * @return false -> if the migration stream failed or does not match the local VM
+     */
+    bool ReceiveVM(int port);
+
+    /**
+     * @brief Gets the statistics of the last migration
+     *
+     */
+    MigrationStats GetStats();
+
+private:
+    /**
+     * @brief A framed record of the migration stream
+     *
+     */
+    struct Record
+    {
+        UINT32 type;
+        UINT32 count;
+        std::vector<char> payload;
+    };
+
+    /**
+     * @brief Bounded queue between the encoding/decoding thread and the socket thread
+     *
+     */
+    class RecordQueue
+    {
+    public:
+        RecordQueue(size_t capacity);
+        bool Push(Record&& record);
+        bool Pop(Record& record);
+        void Close();
+
+    private:
+        std::deque<Record> records_;
+        size_t capacity_;
+        bool closed_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+    };
+
+    /**
+     * @brief Encodes the given pages into page batch records and queues them
+     *
+     */
+    bool QueuePages(const std::vector<UINT64>& pageIndices, RecordQueue& queue, size_t pagesPerBatch);
+
+    /**
+     * @brief Decodes a page batch record into guest memory
+     *
+     */
+    bool ApplyPages(const Record& record);
+
+    /**
+     * @brief Writes a record to the socket
+     *
+     */
+    bool SendRecord(SOCKET socket, const Record& record);
+
+    /**
+     * @brief Reads a record from the socket
+     *
+     */
+    bool ReceiveRecord(SOCKET socket, Record& record);
+
+    bool SendAll(SOCKET socket, const char* data, size_t size);
+    bool ReceiveAll(SOCKET socket, char* data, size_t size);
+
+    VirtualProcessor* virtualProcessor_;
+    MemoryManager* memoryManager_;
+    SnapshotManager* snapshotManager_;
+    int dirtyLog_;
+    bool wsaStarted_;
+
+    std::atomic<bool> sendFailed_;
+    std::mutex statsMutex_;
+    MigrationStats stats_;
+    Logger logger_;
+};
+
+#endif // MIGRATIONMANAGER_H
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "MmioBus.h"
+#include <algorithm>
+
+MmioBus::MmioBus(UINT32 vpCount) : lastHits_(vpCount), logger_("MmioBus.log")
+{
+    for (auto& lastHit : lastHits_)
+    {
+        lastHit.index = 0;
+    }
+}
+
+MmioBus::~MmioBus() {}
+
+bool MmioBus::Register(UINT64 base, UINT64 length, MmioDevice* device, const std::string& name)
+{
+    if (device == nullptr || length == 0 || base + length < base)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Invalid MMIO range " + name);
+        return false;
+    }
+
+    const UINT64 end = base + length;
+    auto next = std::upper_bound(ranges_.begin(), ranges_.end(), base,
+        [](UINT64 address, const Range& range) { return address < range.base; });
+    if ((next != ranges_.end() && next->base < end) || (next != ranges_.begin() && std::prev(next)->end > base))
+    {
+        const Range& other = next != ranges_.end() && next->base < end ? *next : *std::prev(next);
+        logger_.Log(Logger::LogLevel::Error, "MMIO range " + name + " overlaps " + other.name);
+        return false;
+    }
+
+    ranges_.insert(next, { base, end, device, name });
+    // Indices shifted, the caches are refilled on the next miss.
+    for (auto& lastHit : lastHits_)
+    {
+        lastHit.index = 0;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Registered MMIO range " + std::to_string(base) + "+" + std::to_string(length)
+        + " for " + name);
+    return true;
+}
+
+void MmioBus::Unregister(MmioDevice* device)
+{
+    ranges_.erase(std::remove_if(ranges_.begin(), ranges_.end(),
+        [device](const Range& range) { return range.device == device; }), ranges_.end());
+    for (auto& lastHit : lastHits_)
+    {
+        lastHit.index = 0;
+    }
+}
+
+bool MmioBus::Read(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64& value)
+{
+    MmioDevice* device = Find(vpIndex, gpa, size);
+    if (device == nullptr)
+    {
+        value = ~0ull;
+        return false;
+    }
+    value = device->MmioRead(vpIndex, gpa, size);
+    return true;
+}
+
+bool MmioBus::Write(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value)
+{
+    MmioDevice* device = Find(vpIndex, gpa, size);
+    if (device == nullptr)
+    {
+        return false;
+    }
+    device->MmioWrite(vpIndex, gpa, size, value);
+    return true;
+}
+
+MmioDevice* MmioBus::Find(UINT32 vpIndex, UINT64 gpa, UINT8 size)
+{
+    if (ranges_.empty())
+    {
+        return nullptr;
+    }
+
+    LastHit* lastHit = vpIndex < lastHits_.size() ? &lastHits_[vpIndex] : nullptr;
+    if (lastHit != nullptr && lastHit->index < ranges_.size())
+    {
+        const Range& cached = ranges_[lastHit->index];
+        if (gpa >= cached.base && gpa + size <= cached.end)
+        {
+            return cached.device;
+        }
+    }
+
+    auto next = std::upper_bound(ranges_.begin(), ranges_.end(), gpa,
+        [](UINT64 address, const Range& range) { return address < range.base; });
+    if (next == ranges_.begin())
+    {
+        return nullptr;
+    }
+
+    auto range = std::prev(next);
+    if (gpa + size > range->end)
+    {
+        return nullptr;
+    }
+    if (lastHit != nullptr)
+    {
+        lastHit->index = static_cast<size_t>(range - ranges_.begin());
+    }
+    return range->device;
+}
@@ -0,0 +1,117 @@
+#ifndef MMIOBUS_H
+#define MMIOBUS_H
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include "Logger.h"
+
+/// @brief Interface of an emulated device that claims guest physical address ranges \class MmioDevice
+class MmioDevice
+{
+public:
+    virtual ~MmioDevice() = default;
+
+    /**
+     * @brief Guest read of a claimed range
+     *
+     * @param vpIndex -> Index of the accessing Virtual Processor
+     * @param gpa -> Guest physical address that was read
+     * @param size -> Access size, 1, 2, 4 or 8 bytes
+     * @return UINT64 -> the value, the low size bytes are used
+     */
+    virtual UINT64 MmioRead(UINT32 vpIndex, UINT64 gpa, UINT8 size) = 0;
+
+    /**
+     * @brief Guest write of a claimed range
+     *
+     * @param vpIndex -> Index of the accessing Virtual Processor
+     * @param gpa -> Guest physical address that was written
+     * @param size -> Access size, 1, 2, 4 or 8 bytes
+     * @param value -> Value written by the guest
+     */
+    virtual void MmioWrite(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value) = 0;
+};
+
+/// @brief MMIO bus, devices register GPA ranges that are looked up in a sorted table behind a per-vCPU last-hit cache \class MmioBus
+class MmioBus
+{
+public:
+    MmioBus(UINT32 vpCount = 1);
+    ~MmioBus();
+
+    /**
+     * @brief Claims a GPA range for a device, ranges are registered before the guest runs
+     *
+     * @param base -> First guest physical address of the range
+     * @param length -> Length of the range in bytes
+     * @param device -> MmioDevice*, device that handles the accesses
+     * @param name -> Name of the range for the logs
+     * @return true -> if the range was claimed
+     * @return false -> if the range overlaps a claimed one
+     */
+    bool Register(UINT64 base, UINT64 length, MmioDevice* device, const std::string& name);
+
+    /**
+     * @brief Releases all ranges of a device
+     *
+     * @param device -> MmioDevice*, the device
+     */
+    void Unregister(MmioDevice* device);
+
+    /**
+     * @brief Dispatches a guest read
+     *
+     * @param vpIndex -> Index of the accessing Virtual Processor
+     * @param gpa -> Guest physical address that was read
+     * @param size -> Access size, 1, 2, 4 or 8 bytes
+     * @param value -> receives the value, all ones for unclaimed addresses
+     * @return true -> if a device claims the address
+     */
+    bool Read(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64& value);
+
+    /**
+     * @brief Dispatches a guest write, writes to unclaimed addresses are dropped
+     *
+     * @param vpIndex -> Index of the accessing Virtual Processor
+     * @param gpa -> Guest physical address that was written
+     * @param size -> Access size, 1, 2, 4 or 8 bytes
+     * @param value -> Value written by the guest
+     * @return true -> if a device claims the address
+     */
+    bool Write(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value);
+
+private:
+    /**
+     * @brief A claimed GPA range, end is exclusive
+     *
+     */
+    struct Range
+    {
+        UINT64 base;
+        UINT64 end;
+        MmioDevice* device;
+        std::string name;
+    };
+
+    /**
+     * @brief Last range hit by a Virtual Processor, on its own cache line because every vCPU updates its slot
+     *
+     */
+    struct alignas(64) LastHit
+    {
+        size_t index;
+    };
+
+    /**
+     * @brief Finds the device of an address, first in the last-hit cache of the vCPU, then by binary search
+     *
+     */
+    MmioDevice* Find(UINT32 vpIndex, UINT64 gpa, UINT8 size);
+
+    std::vector<Range> ranges_;
+    std::vector<LastHit> lastHits_;
+    Logger logger_;
+};
+
+#endif // MMIOBUS_H
\ No newline at end of file
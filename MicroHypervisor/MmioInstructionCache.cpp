@@ -0,0 +1,203 @@
+#define NOMINMAX
+#include "MmioInstructionCache.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    constexpr UINT8 RexW = 0x08;
+    constexpr UINT8 RexR = 0x04;
+
+    size_t GetSlot(UINT64 rip)
+    {
+        return static_cast<size_t>(rip ^ (rip >> 6) ^ (rip >> 12));
+    }
+}
+
+MmioInstructionCache::MmioInstructionCache() : hits_(0), misses_(0), unsupported_(0)
+{
+    Invalidate();
+}
+
+MmioInstructionCache::~MmioInstructionCache() {}
+
+const MmioInstructionCache::Operation* MmioInstructionCache::Find(UINT64 cr3, UINT64 rip, const WHV_X64_SEGMENT_REGISTER& cs,
+    const UINT8* bytes, UINT8 count)
+{
+    const UINT8 mode = static_cast<UINT8>((cs.Long ? 1 : 0) | (cs.Default ? 2 : 0));
+    Entry& entry = entries_[GetSlot(rip) % EntryCount];
+
+    // The bytes are part of the key, so rewritten code misses instead of replaying a stale decode.
+    if (entry.valid && entry.rip == rip && entry.cr3 == cr3 && entry.mode == mode && entry.byteCount <= count
+        && memcmp(entry.bytes, bytes, entry.byteCount) == 0)
+    {
+        hits_++;
+        return entry.supported ? &entry.operation : nullptr;
+    }
+
+    misses_++;
+    Operation operation = {};
+    const bool supported = Decode(bytes, count, cs.Long != 0, cs.Long || cs.Default, operation);
+    if (!supported)
+    {
+        unsupported_++;
+    }
+
+    entry.valid = true;
+    entry.supported = supported;
+    entry.mode = mode;
+    entry.cr3 = cr3;
+    entry.rip = rip;
+    // Unsupported instructions are keyed by every reported byte, their length is unknown.
+    entry.byteCount = supported ? operation.length : std::min<UINT8>(count, static_cast<UINT8>(MaxInstructionLength));
+    memcpy(entry.bytes, bytes, entry.byteCount);
+    entry.operation = operation;
+    return supported ? &entry.operation : nullptr;
+}
+
+void MmioInstructionCache::Invalidate()
+{
+    for (auto& entry : entries_)
+    {
+        entry.valid = false;
+    }
+}
+
+MmioInstructionCache::Stats MmioInstructionCache::GetStats() const
+{
+    return { hits_, misses_, unsupported_ };
+}
+
+bool MmioInstructionCache::Decode(const UINT8* bytes, UINT8 count, bool longMode, bool defaultOperand32, Operation& operation)
+{
+    // 16-bit addressing uses a different ModRM layout, it is left to the emulator.
+    if (!longMode && !defaultOperand32)
+    {
+        return false;
+    }
+
+    size_t position = 0;
+    bool operandSizeOverride = false;
+    UINT8 rex = 0;
+    for (; position < count; ++position)
+    {
+        const UINT8 prefix = bytes[position];
+        if (prefix == 0x66)
+        {
+            operandSizeOverride = true;
+        }
+        else if (prefix == 0x26 || prefix == 0x2E || prefix == 0x36 || prefix == 0x3E || prefix == 0x64 || prefix == 0x65)
+        {
+            // Segment overrides do not change the GPA the exit already reports.
+        }
+        else
+        {
+            break;
+        }
+    }
+    // REX has to be the last prefix.
+    if (longMode && position < count && (bytes[position] & 0xF0) == 0x40)
+    {
+        rex = bytes[position++];
+    }
+    if (position >= count)
+    {
+        return false;
+    }
+
+    UINT8 operandSize = (rex & RexW) ? 8 : (operandSizeOverride ? 2 : 4);
+    operation = {};
+
+    UINT8 opcode = bytes[position++];
+    bool movzx = false;
+    if (opcode == 0x0F)
+    {
+        if (position >= count || (bytes[position] != 0xB6 && bytes[position] != 0xB7))
+        {
+            return false;
+        }
+        movzx = true;
+        opcode = bytes[position++];
+    }
+
+    switch (opcode)
+    {
+    case 0x88: operation.isWrite = true; operation.accessSize = 1; break;
+    case 0x89: operation.isWrite = true; operation.accessSize = operandSize; break;
+    case 0x8A: operation.accessSize = 1; break;
+    case 0x8B: operation.accessSize = operandSize; break;
+    case 0xC6: operation.isWrite = true; operation.hasImmediate = true; operation.accessSize = 1; break;
+    case 0xC7: operation.isWrite = true; operation.hasImmediate = true; operation.accessSize = operandSize; break;
+    case 0xB6: operation.accessSize = 1; break;
+    case 0xB7: operation.accessSize = 2; break;
+    default: return false;
+    }
+    if ((opcode == 0xB6 || opcode == 0xB7) != movzx)
+    {
+        return false;
+    }
+    operation.registerSize = movzx ? operandSize : operation.accessSize;
+
+    if (position >= count)
+    {
+        return false;
+    }
+    const UINT8 modrm = bytes[position++];
+    const UINT8 mod = modrm >> 6;
+    const UINT8 reg = (modrm >> 3) & 7;
+    const UINT8 rm = modrm & 7;
+    if (mod == 3 || (operation.hasImmediate && reg != 0))
+    {
+        return false;
+    }
+
+    size_t displacement = mod == 1 ? 1 : (mod == 2 ? 4 : 0);
+    if (rm == 4)
+    {
+        if (position >= count)
+        {
+            return false;
+        }
+        const UINT8 sib = bytes[position++];
+        if (mod == 0 && (sib & 7) == 5)
+        {
+            displacement = 4;
+        }
+    }
+    else if (mod == 0 && rm == 5)
+    {
+        displacement = 4;
+    }
+    position += displacement;
+
+    if (operation.hasImmediate)
+    {
+        const size_t immediateSize = operation.accessSize == 1 ? 1 : (operation.accessSize == 2 ? 2 : 4);
+        if (position + immediateSize > count)
+        {
+            return false;
+        }
+        UINT32 immediate = 0;
+        memcpy(&immediate, bytes + position, immediateSize);
+        position += immediateSize;
+        // The 32-bit immediate of a 64-bit store is sign extended.
+        operation.immediate = operation.accessSize == 8 ? static_cast<UINT64>(static_cast<INT64>(static_cast<INT32>(immediate))) : immediate;
+    }
+    else
+    {
+        operation.registerIndex = static_cast<UINT8>(reg | ((rex & RexR) ? 8 : 0));
+        // Without REX, byte registers 4-7 are AH, CH, DH and BH.
+        if (operation.accessSize == 1 && !movzx && rex == 0 && reg >= 4)
+        {
+            operation.highByte = true;
+            operation.registerIndex = reg - 4;
+        }
+    }
+
+    if (position > count || position > MaxInstructionLength)
+    {
+        return false;
+    }
+    operation.length = static_cast<UINT8>(position);
+    return true;
+}
@@ -0,0 +1,108 @@
+#ifndef MMIOINSTRUCTIONCACHE_H
+#define MMIOINSTRUCTIONCACHE_H
+
+#include <Windows.h>
+#include <WinHvPlatform.h>
+#include <array>
+#include <atomic>
+
+/// @brief Per-vCPU cache of decoded MMIO instructions keyed by CR3, RIP and the instruction bytes \class MmioInstructionCache
+class MmioInstructionCache
+{
+public:
+    /**
+     * @brief A decoded MOV/MOVZX between a general purpose register or an immediate and memory
+     *
+     */
+    struct Operation
+    {
+        UINT8 length;
+        UINT8 accessSize;
+        // Size written to the register by a read, larger than accessSize for MOVZX.
+        UINT8 registerSize;
+        // 0-15 for RAX-R15.
+        UINT8 registerIndex;
+        bool isWrite;
+        // AH, CH, DH or BH.
+        bool highByte;
+        bool hasImmediate;
+        UINT64 immediate;
+    };
+
+    /**
+     * @brief Lookup statistics
+     *
+     */
+    struct Stats
+    {
+        UINT64 hits;
+        UINT64 misses;
+        UINT64 unsupported;
+    };
+
+    MmioInstructionCache();
+    ~MmioInstructionCache();
+
+    /**
+     * @brief Gets the decoded operation of an instruction, decoding and caching it on a miss
+     *
+     * @param cr3 -> CR3 of the vCPU at the exit
+     * @param rip -> RIP of the instruction
+     * @param cs -> CS of the vCPU at the exit, selects the operating mode
+     * @param bytes -> Instruction bytes reported by the exit
+     * @param count -> Number of instruction bytes
+     * @return const Operation* -> the operation, nullptr if the instruction must go through the emulator
+     */
+    const Operation* Find(UINT64 cr3, UINT64 rip, const WHV_X64_SEGMENT_REGISTER& cs, const UINT8* bytes, UINT8 count);
+
+    /**
+     * @brief Drops every entry, used when guest memory is replaced as a whole
+     *
+     */
+    void Invalidate();
+
+    /**
+     * @brief Gets the lookup statistics
+     *
+     */
+    Stats GetStats() const;
+
+    /**
+     * @brief Decodes the supported subset: MOV 88/89/8A/8B/C6/C7 and MOVZX 0F B6/B7 with a memory operand
+     *
+     * @param bytes -> Instruction bytes
+     * @param count -> Number of instruction bytes
+     * @param longMode -> true for 64-bit code
+     * @param defaultOperand32 -> true if the default operand size is 32 bits
+     * @param operation -> receives the decoded operation
+     * @return true -> if the instruction is supported
+     */
+    static bool Decode(const UINT8* bytes, UINT8 count, bool longMode, bool defaultOperand32, Operation& operation);
+
+private:
+    static constexpr size_t EntryCount = 64;
+    static constexpr size_t MaxInstructionLength = 15;
+
+    /**
+     * @brief A cached instruction, unsupported instructions are cached too so they are not decoded again
+     *
+     */
+    struct Entry
+    {
+        bool valid;
+        bool supported;
+        UINT8 mode;
+        UINT64 cr3;
+        UINT64 rip;
+        UINT8 bytes[MaxInstructionLength];
+        UINT8 byteCount;
+        Operation operation;
+    };
+
+    std::array<Entry, EntryCount> entries_;
+    std::atomic<UINT64> hits_;
+    std::atomic<UINT64> misses_;
+    std::atomic<UINT64> unsupported_;
+};
+
+#endif // MMIOINSTRUCTIONCACHE_H
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include "MsixTable.h"
+#include "InterruptController.h"
+
+namespace
+{
+    constexpr UINT32 VectorControlMasked = 1;
+}
+
+MsixTable::MsixTable(InterruptController* interruptController, UINT32 vectorCount)
+    : interruptController_(interruptController), entries_(vectorCount), pending_((vectorCount + 63) / 64),
+    enabled_(false), functionMasked_(false), logger_("MsixTable.log")
+{
+    // Entries come out of reset masked.
+    for (auto& entry : entries_)
+    {
+        entry = { 0, 0, 0, VectorControlMasked };
+    }
+}
+
+MsixTable::~MsixTable() {}
+
+UINT32 MsixTable::GetVectorCount() const
+{
+    return static_cast<UINT32>(entries_.size());
+}
+
+UINT32 MsixTable::GetTableSize() const
+{
+    return static_cast<UINT32>(entries_.size()) * EntrySize;
+}
+
+UINT32 MsixTable::GetPbaSize() const
+{
+    return static_cast<UINT32>(pending_.size()) * sizeof(UINT64);
+}
+
+UINT32 MsixTable::ReadTable(UINT32 offset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset >= GetTableSize())
+    {
+        return 0;
+    }
+    const UINT32* dwords = reinterpret_cast<const UINT32*>(&entries_[offset / EntrySize]);
+    return dwords[(offset % EntrySize) / 4];
+}
+
+void MsixTable::WriteTable(UINT32 offset, UINT32 value)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset >= GetTableSize())
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Write outside of the MSI-X table at offset " + std::to_string(offset));
+        return;
+    }
+
+    UINT32* dwords = reinterpret_cast<UINT32*>(&entries_[offset / EntrySize]);
+    UINT32 index = (offset % EntrySize) / 4;
+    if (index == 3)
+    {
+        value &= VectorControlMasked;
+    }
+    dwords[index] = value;
+
+    if (index == 3 && value == 0)
+    {
+        FlushPending();
+    }
+}
+
+UINT32 MsixTable::ReadPba(UINT32 offset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset >= GetPbaSize())
+    {
+        return 0;
+    }
+    return static_cast<UINT32>(pending_[offset / 8] >> (offset & 4 ? 32 : 0));
+}
+
+void MsixTable::SetControl(bool enabled, bool functionMasked)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    enabled_ = enabled;
+    functionMasked_ = functionMasked;
+    FlushPending();
+}
+
+bool MsixTable::Notify(UINT32 vector)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_ || vector >= entries_.size())
+    {
+        return false;
+    }
+
+    if (IsMasked(vector))
+    {
+        pending_[vector / 64] |= 1ull << (vector % 64);
+        return false;
+    }
+
+    const Entry& entry = entries_[vector];
+    return interruptController_->SignalMsi((static_cast<UINT64>(entry.addressHigh) << 32) | entry.addressLow, entry.data);
+}
+
+void MsixTable::SaveState(std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const UINT8* table = reinterpret_cast<const UINT8*>(entries_.data());
+    const UINT8* pending = reinterpret_cast<const UINT8*>(pending_.data());
+    state.assign(table, table + entries_.size() * sizeof(Entry));
+    state.insert(state.end(), pending, pending + pending_.size() * sizeof(UINT64));
+    state.push_back(enabled_ ? 1 : 0);
+    state.push_back(functionMasked_ ? 1 : 0);
+}
+
+bool MsixTable::LoadState(const std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t tableBytes = entries_.size() * sizeof(Entry);
+    const size_t pendingBytes = pending_.size() * sizeof(UINT64);
+    if (state.size() != tableBytes + pendingBytes + 2)
+    {
+        logger_.Log(Logger::LogLevel::Error, "MSI-X state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+
+    memcpy(entries_.data(), state.data(), tableBytes);
+    memcpy(pending_.data(), state.data() + tableBytes, pendingBytes);
+    enabled_ = state[tableBytes + pendingBytes] != 0;
+    functionMasked_ = state[tableBytes + pendingBytes + 1] != 0;
+    return true;
+}
+
+bool MsixTable::IsMasked(UINT32 vector) const
+{
+    return functionMasked_ || (entries_[vector].vectorControl & VectorControlMasked);
+}
+
+void MsixTable::FlushPending()
+{
+    if (!enabled_ || functionMasked_)
+    {
+        return;
+    }
+
+    for (UINT32 vector = 0; vector < entries_.size(); ++vector)
+    {
+        UINT64& word = pending_[vector / 64];
+        const UINT64 bit = 1ull << (vector % 64);
+        if ((word & bit) && !IsMasked(vector))
+        {
+            word &= ~bit;
+            const Entry& entry = entries_[vector];
+            interruptController_->SignalMsi((static_cast<UINT64>(entry.addressHigh) << 32) | entry.addressLow, entry.data);
+        }
+    }
+}
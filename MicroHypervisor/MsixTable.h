@@ -0,0 +1,123 @@
+#ifndef MSIXTABLE_H
+#define MSIXTABLE_H
+
+#include <Windows.h>
+#include <vector>
+#include <mutex>
+#include "Logger.h"
+
+class InterruptController;
+
+/// @brief MSI-X table and pending bit array of a virtual device \class MsixTable
+class MsixTable
+{
+public:
+    MsixTable(InterruptController* interruptController, UINT32 vectorCount);
+    ~MsixTable();
+
+    static constexpr UINT32 EntrySize = 16;
+
+    /**
+     * @brief Gets the number of table entries
+     *
+     */
+    UINT32 GetVectorCount() const;
+
+    /**
+     * @brief Gets the size of the table region in bytes
+     *
+     */
+    UINT32 GetTableSize() const;
+
+    /**
+     * @brief Gets the size of the pending bit array region in bytes
+     *
+     */
+    UINT32 GetPbaSize() const;
+
+    /**
+     * @brief Reads a dword of the table region
+     *
+     * @param offset -> Offset in the table region
+     * @return UINT32 -> value of the dword
+     */
+    UINT32 ReadTable(UINT32 offset);
+
+    /**
+     * @brief Writes a dword of the table region, unmasking an entry with its pending bit set sends the message
+     *
+     * @param offset -> Offset in the table region
+     * @param value -> Value to write
+     */
+    void WriteTable(UINT32 offset, UINT32 value);
+
+    /**
+     * @brief Reads a dword of the pending bit array
+     *
+     * @param offset -> Offset in the pending bit array region
+     * @return UINT32 -> value of the dword
+     */
+    UINT32 ReadPba(UINT32 offset);
+
+    /**
+     * @brief Sets the MSI-X enable and function mask bits of the message control register
+     *
+     * @param enabled -> MSI-X enable
+     * @param functionMasked -> Function mask, all vectors are masked while set
+     */
+    void SetControl(bool enabled, bool functionMasked);
+
+    /**
+     * @brief Signals a vector of the device, a masked vector only sets its pending bit
+     *
+     * @param vector -> Index of the table entry, typically one per queue
+     * @return true -> if the message was sent
+     */
+    bool Notify(UINT32 vector);
+
+    /**
+     * @brief Serializes the table, the pending bits and the control bits for snapshots and migration
+     *
+     * @param state -> receives the serialized state
+     */
+    void SaveState(std::vector<UINT8>& state);
+
+    /**
+     * @brief Loads a state produced by SaveState
+     *
+     * @param state -> the serialized state
+     * @return true -> if the state was loaded
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    /**
+     * @brief One entry of the MSI-X table as laid out in the table region
+     *
+     */
+    struct Entry
+    {
+        UINT32 addressLow;
+        UINT32 addressHigh;
+        UINT32 data;
+        UINT32 vectorControl;
+    };
+
+    bool IsMasked(UINT32 vector) const;
+
+    /**
+     * @brief Sends the messages of the unmasked vectors whose pending bit is set, caller holds mutex_
+     *
+     */
+    void FlushPending();
+
+    InterruptController* interruptController_;
+    std::vector<Entry> entries_;
+    std::vector<UINT64> pending_;
+    bool enabled_;
+    bool functionMasked_;
+    std::mutex mutex_;
+    Logger logger_;
+};
+
+#endif // MSIXTABLE_H
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef NETBACKEND_H
+#define NETBACKEND_H
+
+#include <Windows.h>
+
+/**
+ * @brief An Ethernet frame without the virtio header, valid only for the duration of the call it is passed to
+ *
+ */
+struct NetFrame
+{
+    const UINT8* data;
+    size_t length;
+};
+
+/// @brief Receiving side of a network device, backends deliver their frames to it \class NetReceiver
+class NetReceiver
+{
+public:
+    virtual ~NetReceiver() = default;
+
+    /**
+     * @brief Delivers a batch of frames, callable from any thread
+     *
+     * @param queueIndex -> Queue pair the backend picked, the device maps it onto the pairs the driver enabled
+     * @param frames -> Frames to deliver
+     * @param count -> Number of frames
+     * @return size_t -> number of frames the device took, the rest found no receive buffer
+     */
+    virtual size_t Receive(UINT32 queueIndex, const NetFrame* frames, size_t count) = 0;
+};
+
+/// @brief Interface of the network behind a virtual NIC, the device transmits batches and the backend delivers to its receiver \class NetBackend
+class NetBackend
+{
+public:
+    virtual ~NetBackend() = default;
+
+    /**
+     * @brief Sets the device the received frames go to, called before the guest runs
+     *
+     */
+    virtual void SetReceiver(NetReceiver* receiver) = 0;
+
+    /**
+     * @brief Transmits a batch of frames, the frames are copied or delivered before the call returns
+     *
+     * @param queueIndex -> Queue pair the frames were sent on
+     * @param frames -> Frames to transmit
+     * @param count -> Number of frames
+     * @return size_t -> number of frames sent, the rest are dropped
+     */
+    virtual size_t Transmit(UINT32 queueIndex, const NetFrame* frames, size_t count) = 0;
+
+    /**
+     * @brief Called when the driver posted receive buffers on a queue pair, backends holding frames back deliver them
+     *
+     */
+    virtual void OnReceiveBuffers(UINT32 queueIndex) {}
+};
+
+#endif // NETBACKEND_H
\ No newline at end of file
@@ -11,6 +11,11 @@ NetworkManager::NetworkManager() {}
 
 NetworkManager::~NetworkManager() {}
 
+VirtualSwitch& NetworkManager::GetSwitch()
+{
+    return switch_;
+}
+
 std::string NetworkManager::GetHypervisorIPAddress()
 {
     ULONG bufferSize = 0;
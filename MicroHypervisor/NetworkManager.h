@@ -2,6 +2,7 @@
 #define NETWORKMANAGER_H
 
 #include <iostream>
+#include "VirtualSwitch.h"
 
 class NetworkManager
 {
@@ -16,8 +17,15 @@ public:
 	 */
 	static std::string GetHypervisorIPAddress();
 
+	/**
+	 * @brief Function to get the switch connecting the NICs of the VMs in this process
+	 * 
+	 * @return VirtualSwitch&
+	 */
+	VirtualSwitch& GetSwitch();
 
 private:
+	VirtualSwitch switch_;
 };
 
 #endif // NETWORKMANAGER_H
@@ -0,0 +1,266 @@
+#define NOMINMAX
+#include "PageStore.h"
+#include <intrin.h>
+#include <emmintrin.h>
+#include <thread>
+#include <algorithm>
+
+namespace
+{
+    constexpr UINT64 Prime32_1 = 0x9E3779B1ULL;
+    constexpr UINT64 Prime32_2 = 0x85EBCA77ULL;
+    constexpr UINT64 Prime32_3 = 0xC2B2AE3DULL;
+    constexpr UINT64 Prime64_1 = 0x9E3779B185EBCA87ULL;
+    constexpr UINT64 Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr UINT64 Prime64_3 = 0x165667B19E3779F9ULL;
+    constexpr UINT64 Prime64_4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr UINT64 Prime64_5 = 0x27D4EB2F165667C5ULL;
+
+    constexpr size_t StripeSize = 64;
+    constexpr size_t StripesPerBlock = 16;
+    constexpr size_t SecretSize = 192;
+    constexpr size_t MinPagesPerThread = 256;
+
+    alignas(16) const UINT64 secret[SecretSize / sizeof(UINT64)] = {
+        0x09641205AAE81033ULL, 0xD21B0E09CE2D426EULL, 0xBD7AE7B2BEB36285ULL, 0x91B2D2C7D9B46D92ULL,
+        0x5908BF31CF01AA70ULL, 0xE3DEAA5D2BE68C12ULL, 0x31C1176B54D022B3ULL, 0x58241B64CCF8C76BULL,
+        0x1F66EAA7D469502CULL, 0xB8F05B8657F2D05CULL, 0x2E8FB3F967523130ULL, 0xFD77D7AE1B6D04CEULL,
+        0x5833076D4135F591ULL, 0xAE105C20F5EC7D3CULL, 0x0933D9AC3C7A7F10ULL, 0x2B607F52ED4566C9ULL,
+        0x8D14D386CDE70162ULL, 0x6104145183E38F29ULL, 0xFEB4BAF7806F3B3FULL, 0x0C9198521F587D16ULL,
+        0x06D50D9998F628F2ULL, 0xBB27C885AF32537CULL, 0xAD660D4E5E72C656ULL, 0xC11161952DF72C4FULL,
+    };
+
+    inline const UINT8* SecretAt(size_t offset)
+    {
+        return reinterpret_cast<const UINT8*>(secret) + offset;
+    }
+
+    inline UINT64 Read64(const UINT8* p)
+    {
+        UINT64 value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline UINT64 Avalanche(UINT64 h)
+    {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ULL;
+        h ^= h >> 32;
+        return h;
+    }
+
+    inline UINT64 MulFold64(UINT64 a, UINT64 b)
+    {
+        UINT64 high = 0;
+        UINT64 low = _umul128(a, b, &high);
+        return low ^ high;
+    }
+
+    inline UINT64 Mix2Accs(const UINT64* acc, const UINT8* key)
+    {
+        return MulFold64(acc[0] ^ Read64(key), acc[1] ^ Read64(key + 8));
+    }
+
+    // Accumulates one 64 byte stripe into the 8 lanes, 2 lanes per SSE2 register.
+    inline void AccumulateStripe(__m128i* acc, const UINT8* data, const UINT8* key)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            __m128i dataVec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+            __m128i keyVec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i);
+            __m128i dataKey = _mm_xor_si128(dataVec, keyVec);
+            __m128i dataKeyHigh = _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i product = _mm_mul_epu32(dataKey, dataKeyHigh);
+            __m128i dataSwap = _mm_shuffle_epi32(dataVec, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, dataSwap));
+        }
+    }
+
+    inline void ScrambleAccs(__m128i* acc, const UINT8* key)
+    {
+        const __m128i prime = _mm_set1_epi32(static_cast<int>(Prime32_1));
+        for (int i = 0; i < 4; ++i)
+        {
+            __m128i value = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+            value = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i));
+            __m128i productLow = _mm_mul_epu32(value, prime);
+            __m128i productHigh = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+            acc[i] = _mm_add_epi64(productLow, _mm_slli_epi64(productHigh, 32));
+        }
+    }
+}
+
+PageStore::PageStore(size_t pageSize) : pageSize_(pageSize), logicalPages_(0), logger_("PageStore.log")
+{
+
+}
+
+PageStore::~PageStore() {}
+
+PageHash PageStore::HashPage(const UINT8* data, size_t size)
+{
+    alignas(16) UINT64 lanes[8] = { Prime32_3, Prime64_1, Prime64_2, Prime64_3, Prime64_4, Prime32_2, Prime64_5, Prime32_1 };
+    __m128i acc[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        acc[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(lanes) + i);
+    }
+
+    const size_t stripes = size / StripeSize;
+    for (size_t s = 0; s < stripes; ++s)
+    {
+        size_t stripeInBlock = s % StripesPerBlock;
+        AccumulateStripe(acc, data + s * StripeSize, SecretAt(stripeInBlock * 8));
+        if (stripeInBlock == StripesPerBlock - 1)
+        {
+            ScrambleAccs(acc, SecretAt(SecretSize - StripeSize));
+        }
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes) + i, acc[i]);
+    }
+
+    const UINT64 length = static_cast<UINT64>(size);
+    UINT64 low = length * Prime64_1;
+    UINT64 high = ~(length * Prime64_2);
+    for (int i = 0; i < 4; ++i)
+    {
+        low += Mix2Accs(lanes + 2 * i, SecretAt(11 + 16 * i));
+        high += Mix2Accs(lanes + 2 * i, SecretAt(SecretSize - StripeSize - 11 - 16 * i));
+    }
+
+    return { Avalanche(low), Avalanche(high) };
+}
+
+void PageStore::HashPages(const UINT8* data, size_t pageCount, std::vector<PageHash>& hashes) const
+{
+    hashes.resize(pageCount);
+
+    size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+        std::max<size_t>(1, pageCount / MinPagesPerThread));
+
+    auto hashRange = [this, data, &hashes](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            hashes[i] = HashPage(data + i * pageSize_, pageSize_);
+        }
+    };
+
+    if (threadCount <= 1)
+    {
+        hashRange(0, pageCount);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    size_t chunk = (pageCount + threadCount - 1) / threadCount;
+    for (size_t first = chunk; first < pageCount; first += chunk)
+    {
+        workers.emplace_back(hashRange, first, std::min(first + chunk, pageCount));
+    }
+    hashRange(0, std::min(chunk, pageCount));
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void PageStore::StorePages(const UINT8* data, size_t pageCount, std::vector<PageHash>& hashes)
+{
+    HashPages(data, pageCount, hashes);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < pageCount; ++i)
+    {
+        hashes[i] = Insert(hashes[i], data + i * pageSize_);
+    }
+    logicalPages_ += pageCount;
+}
+
+PageHash PageStore::StorePage(const PageHash& hash, const UINT8* data)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    logicalPages_++;
+    return Insert(hash, data);
+}
+
+PageHash PageStore::Insert(PageHash hash, const UINT8* data)
+{
+    // The hash is not cryptographic, an entry is only shared when the bytes match, a colliding page probes for a free key.
+    while (true)
+    {
+        auto& entry = pages_[hash];
+        if (entry.refCount == 0)
+        {
+            entry.data.assign(data, data + pageSize_);
+            entry.refCount = 1;
+            return hash;
+        }
+        if (memcmp(entry.data.data(), data, pageSize_) == 0)
+        {
+            entry.refCount++;
+            return hash;
+        }
+
+        logger_.Log(Logger::LogLevel::Warning, "Page hash collision on " + std::to_string(hash.low) + ", re-keying the page");
+        hash.high++;
+    }
+}
+
+bool PageStore::AddRef(const PageHash& hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pages_.find(hash);
+    if (it == pages_.end())
+    {
+        return false;
+    }
+    it->second.refCount++;
+    logicalPages_++;
+    return true;
+}
+
+void PageStore::Release(const PageHash& hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pages_.find(hash);
+    if (it == pages_.end())
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Release of unknown page hash " + std::to_string(hash.low));
+        return;
+    }
+
+    logicalPages_--;
+    if (--it->second.refCount == 0)
+    {
+        pages_.erase(it);
+    }
+}
+
+const UINT8* PageStore::Lookup(const PageHash& hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pages_.find(hash);
+    return it != pages_.end() ? it->second.data.data() : nullptr;
+}
+
+PageStore::Stats PageStore::GetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = {};
+    stats.logicalPages = logicalPages_;
+    stats.uniquePages = pages_.size();
+    stats.bytesStored = pages_.size() * pageSize_;
+    stats.dedupRatio = stats.uniquePages > 0 ? static_cast<double>(stats.logicalPages) / stats.uniquePages : 1.0;
+    return stats;
+}
+
+size_t PageStore::GetPageSize() const
+{
+    return pageSize_;
+}
@@ -0,0 +1,150 @@
+#ifndef PAGESTORE_H
+#define PAGESTORE_H
+
+#include <Windows.h>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "Logger.h"
+
+/**
+ * @brief 128-bit content hash of a guest page
+ *
+ */
+struct PageHash
+{
+    UINT64 low;
+    UINT64 high;
+
+    bool operator==(const PageHash& other) const
+    {
+        return low == other.low && high == other.high;
+    }
+};
+
+/**
+ * @brief Hasher to use a PageHash as key of an unordered container
+ *
+ */
+struct PageHashHasher
+{
+    size_t operator()(const PageHash& hash) const
+    {
+        return static_cast<size_t>(hash.low ^ (hash.high >> 7));
+    }
+};
+
+/// @brief Content-addressed, reference counted store of guest pages \class PageStore
+class PageStore
+{
+public:
+    PageStore(size_t pageSize);
+    ~PageStore();
+
+    /**
+     * @brief Statistics of the page store
+     *
+     */
+    struct Stats
+    {
+        size_t logicalPages;
+        size_t uniquePages;
+        size_t bytesStored;
+        double dedupRatio;
+    };
+
+    /**
+     * @brief Hashes one page with the vectorised 128-bit page hash
+     *
+     * @param data -> Pointer to the page, must be pageSize bytes long
+     * @param size -> Size of the page in bytes, must be a multiple of 64
+     * @return PageHash -> the 128-bit hash of the page
+     */
+    static PageHash HashPage(const UINT8* data, size_t size);
+
+    /**
+     * @brief Hashes a contiguous range of pages, spread over the available host cores
+     *
+     * @param data -> Pointer to the first page
+     * @param pageCount -> Number of pages to hash
+     * @param hashes -> receives one hash per page
+     */
+    void HashPages(const UINT8* data, size_t pageCount, std::vector<PageHash>& hashes) const;
+
+    /**
+     * @brief Stores a contiguous range of pages, identical pages are stored once
+     *
+     * @param data -> Pointer to the first page
+     * @param pageCount -> Number of pages to store
+     * @param hashes -> receives the key of every stored page, a page whose hash collides with a
+     *                  different stored page gets a re-keyed hash
+     */
+    void StorePages(const UINT8* data, size_t pageCount, std::vector<PageHash>& hashes);
+
+    /**
+     * @brief Stores a single page whose hash is already known, takes a reference
+     *
+     * @param hash -> Hash of the page
+     * @param data -> Pointer to the page
+     * @return PageHash -> key of the stored page, differs from hash if the hash collides with a different page
+     */
+    PageHash StorePage(const PageHash& hash, const UINT8* data);
+
+    /**
+     * @brief Takes an additional reference on a stored page
+     *
+     * @param hash -> Hash of the page
+     * @return true -> if the page is stored
+     * @return false -> if the page is unknown
+     */
+    bool AddRef(const PageHash& hash);
+
+    /**
+     * @brief Drops a reference on a stored page, the page is freed with the last reference
+     *
+     * @param hash -> Hash of the page
+     */
+    void Release(const PageHash& hash);
+
+    /**
+     * @brief Looks up the content of a stored page
+     *
+     * @param hash -> Hash of the page
+     * @return const UINT8* -> the page content, nullptr if the page is unknown
+     */
+    const UINT8* Lookup(const PageHash& hash);
+
+    /**
+     * @brief Gets the statistics of the page store
+     *
+     * @return Stats -> the current statistics
+     */
+    Stats GetStats();
+
+    /**
+     * @brief Gets the page size of the store
+     *
+     */
+    size_t GetPageSize() const;
+
+private:
+    struct Entry
+    {
+        std::vector<UINT8> data;
+        UINT32 refCount;
+    };
+
+    /**
+     * @brief Takes a reference on the entry holding the page, called with mutex_ held
+     *
+     */
+    PageHash Insert(PageHash hash, const UINT8* data);
+
+    size_t pageSize_;
+    size_t logicalPages_;
+    std::unordered_map<PageHash, Entry, PageHashHasher> pages_;
+    std::mutex mutex_;
+    Logger logger_;
+};
+
+#endif // PAGESTORE_H
\ No newline at end of file
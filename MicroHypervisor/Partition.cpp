@@ -16,6 +16,15 @@ bool Partition::Setup() const
     WHV_PARTITION_PROPERTY property = {};
     property.ProcessorCount = 1;
     HRESULT result = WHvSetPartitionProperty(handle_, WHvPartitionPropertyCodeProcessorCount, &property, sizeof(property));
+    if (result != S_OK)
+    {
+        return false;
+    }
+
+    // VMCALL exits carry the paravirtual device hypercalls.
+    property = {};
+    property.ExtendedVmExits.HypercallExit = 1;
+    result = WHvSetPartitionProperty(handle_, WHvPartitionPropertyCodeExtendedVmExits, &property, sizeof(property));
     return result == S_OK && WHvSetupPartition(handle_) == S_OK;
 }
 
@@ -0,0 +1,253 @@
+#include "Pic.h"
+
+namespace
+{
+    constexpr UINT32 CascadeIrq = 2;
+    constexpr UINT32 SpuriousIrq = 7;
+
+    constexpr UINT8 Icw1 = 0x10;
+    constexpr UINT8 Icw1NeedIcw4 = 0x01;
+    constexpr UINT8 Icw1Single = 0x02;
+    constexpr UINT8 Icw4AutoEoi = 0x02;
+    constexpr UINT8 Ocw3 = 0x08;
+    constexpr UINT8 Ocw3ReadRegister = 0x02;
+    constexpr UINT8 Ocw3ReadIsr = 0x01;
+
+    // IRQ 0, 1, 2 of the master and IRQ 8 and 13 of the slave are always edge triggered.
+    constexpr UINT8 MasterElcrMask = 0xF8;
+    constexpr UINT8 SlaveElcrMask = 0xDE;
+}
+
+Pic::Pic() : chips_(), logger_("Pic.log")
+{
+
+}
+
+Pic::~Pic() {}
+
+UINT8 Pic::Read(UINT16 port)
+{
+    switch (port)
+    {
+    case MasterCommand: return chips_[0].readIsr ? chips_[0].isr : chips_[0].irr;
+    case SlaveCommand: return chips_[1].readIsr ? chips_[1].isr : chips_[1].irr;
+    case MasterData: return chips_[0].imr;
+    case SlaveData: return chips_[1].imr;
+    case MasterElcr: return chips_[0].elcr;
+    case SlaveElcr: return chips_[1].elcr;
+    default:
+        return 0xFF;
+    }
+}
+
+void Pic::Write(UINT16 port, UINT8 value)
+{
+    switch (port)
+    {
+    case MasterCommand: WriteCommand(chips_[0], value); break;
+    case SlaveCommand: WriteCommand(chips_[1], value); break;
+    case MasterData: WriteData(chips_[0], value); break;
+    case SlaveData: WriteData(chips_[1], value); break;
+    case MasterElcr: chips_[0].elcr = value & MasterElcrMask; break;
+    case SlaveElcr: chips_[1].elcr = value & SlaveElcrMask; break;
+    default:
+        return;
+    }
+    UpdateCascade();
+}
+
+void Pic::SetIrq(UINT32 irq, bool level)
+{
+    if (irq >= IrqCount || irq == CascadeIrq)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Interrupt on unusable PIC line " + std::to_string(irq));
+        return;
+    }
+    SetChipIrq(chips_[irq >> 3], irq & 7, level);
+    UpdateCascade();
+}
+
+bool Pic::HasInterrupt() const
+{
+    return GetRequest(chips_[0]) >= 0;
+}
+
+UINT32 Pic::AcknowledgeInterrupt()
+{
+    int irq = GetRequest(chips_[0]);
+    if (irq < 0)
+    {
+        return chips_[0].vectorBase + SpuriousIrq;
+    }
+
+    UINT32 vector = 0;
+    if (irq == CascadeIrq)
+    {
+        int slaveIrq = GetRequest(chips_[1]);
+        vector = slaveIrq < 0 ? chips_[1].vectorBase + SpuriousIrq : Acknowledge(chips_[1], slaveIrq);
+    }
+    Acknowledge(chips_[0], irq);
+    if (irq != CascadeIrq)
+    {
+        vector = chips_[0].vectorBase + irq;
+    }
+    UpdateCascade();
+    return vector;
+}
+
+void Pic::SaveState(std::vector<UINT8>& state) const
+{
+    const UINT8* bytes = reinterpret_cast<const UINT8*>(chips_);
+    state.assign(bytes, bytes + sizeof(chips_));
+}
+
+bool Pic::LoadState(const std::vector<UINT8>& state)
+{
+    if (state.size() != sizeof(chips_))
+    {
+        logger_.Log(Logger::LogLevel::Error, "PIC state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+    memcpy(chips_, state.data(), sizeof(chips_));
+    return true;
+}
+
+void Pic::SetChipIrq(Chip& chip, UINT32 irq, bool level)
+{
+    const UINT8 mask = static_cast<UINT8>(1u << irq);
+    if (chip.elcr & mask)
+    {
+        // Level triggered requests follow the line.
+        chip.irr = level ? chip.irr | mask : chip.irr & ~mask;
+    }
+    else if (level && (chip.lineLevels & mask) == 0)
+    {
+        chip.irr |= mask;
+    }
+    chip.lineLevels = level ? chip.lineLevels | mask : chip.lineLevels & ~mask;
+}
+
+UINT32 Pic::GetPriority(const Chip& chip, UINT8 mask)
+{
+    for (UINT32 priority = 0; priority < 8; ++priority)
+    {
+        if (mask & (1u << ((priority + chip.priorityAdd) & 7)))
+        {
+            return priority;
+        }
+    }
+    return 8;
+}
+
+int Pic::GetRequest(const Chip& chip)
+{
+    UINT32 requestPriority = GetPriority(chip, chip.irr & ~chip.imr);
+    if (requestPriority == 8 || requestPriority >= GetPriority(chip, chip.isr))
+    {
+        return -1;
+    }
+    return static_cast<int>((requestPriority + chip.priorityAdd) & 7);
+}
+
+UINT32 Pic::Acknowledge(Chip& chip, UINT32 irq)
+{
+    const UINT8 mask = static_cast<UINT8>(1u << irq);
+    if ((chip.elcr & mask) == 0)
+    {
+        chip.irr &= ~mask;
+    }
+    if (!chip.autoEoi)
+    {
+        chip.isr |= mask;
+    }
+    return chip.vectorBase + irq;
+}
+
+void Pic::WriteCommand(Chip& chip, UINT8 value)
+{
+    if (value & Icw1)
+    {
+        UINT8 elcr = chip.elcr;
+        UINT8 lineLevels = chip.lineLevels;
+        chip = Chip();
+        chip.elcr = elcr;
+        chip.lineLevels = lineLevels;
+        chip.initStep = 1;
+        chip.icw4Needed = value & Icw1NeedIcw4;
+        chip.singleMode = (value & Icw1Single) != 0;
+        return;
+    }
+
+    if (value & Ocw3)
+    {
+        if (value & Ocw3ReadRegister)
+        {
+            chip.readIsr = value & Ocw3ReadIsr;
+        }
+        return;
+    }
+
+    // OCW2, bits 7-5 select the EOI and rotation command.
+    UINT32 highest = GetPriority(chip, chip.isr);
+    UINT32 highestIrq = (highest + chip.priorityAdd) & 7;
+    switch (value >> 5)
+    {
+    case 1: // Non-specific EOI
+    case 5: // Rotate on non-specific EOI
+        if (highest < 8)
+        {
+            chip.isr &= ~(1u << highestIrq);
+            if (value >> 5 == 5)
+            {
+                chip.priorityAdd = (highestIrq + 1) & 7;
+            }
+        }
+        break;
+    case 3: // Specific EOI
+        chip.isr &= ~(1u << (value & 7));
+        break;
+    case 6: // Set priority
+        chip.priorityAdd = (value + 1) & 7;
+        break;
+    case 7: // Rotate on specific EOI
+        chip.isr &= ~(1u << (value & 7));
+        chip.priorityAdd = (value + 1) & 7;
+        break;
+    default:
+        break;
+    }
+}
+
+void Pic::WriteData(Chip& chip, UINT8 value)
+{
+    switch (chip.initStep)
+    {
+    case 1: // ICW2
+        chip.vectorBase = value & 0xF8;
+        chip.initStep = chip.singleMode ? (chip.icw4Needed ? 3 : 0) : 2;
+        break;
+    case 2: // ICW3
+        chip.initStep = chip.icw4Needed ? 3 : 0;
+        break;
+    case 3: // ICW4
+        chip.autoEoi = (value & Icw4AutoEoi) != 0;
+        chip.initStep = 0;
+        break;
+    default: // OCW1
+        chip.imr = value;
+        break;
+    }
+}
+
+void Pic::UpdateCascade()
+{
+    // The slave INTR output is wired to IRQ 2 of the master.
+    if (GetRequest(chips_[1]) >= 0)
+    {
+        chips_[0].irr |= 1u << CascadeIrq;
+    }
+    else
+    {
+        chips_[0].irr &= ~(1u << CascadeIrq);
+    }
+}
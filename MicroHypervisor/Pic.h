@@ -0,0 +1,129 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include <Windows.h>
+#include <vector>
+#include "Logger.h"
+
+/// @brief Cascaded pair of 8259 programmable interrupt controllers for legacy guests \class Pic
+class Pic
+{
+public:
+    Pic();
+    ~Pic();
+
+    static constexpr UINT32 IrqCount = 16;
+
+    /**
+     * @brief IO ports of the PIC pair and its edge/level control registers
+     *
+     */
+    enum Port : UINT16
+    {
+        MasterCommand = 0x20,
+        MasterData = 0x21,
+        SlaveCommand = 0xA0,
+        SlaveData = 0xA1,
+        MasterElcr = 0x4D0,
+        SlaveElcr = 0x4D1,
+    };
+
+    /**
+     * @brief Reads a PIC port
+     *
+     * @param port -> IO port
+     * @return UINT8 -> value of the port
+     */
+    UINT8 Read(UINT16 port);
+
+    /**
+     * @brief Writes a PIC port, handles the initialization and operation command words
+     *
+     * @param port -> IO port
+     * @param value -> Value to write
+     */
+    void Write(UINT16 port, UINT8 value);
+
+    /**
+     * @brief Sets the level of an IRQ line, edge triggered lines latch on the rising edge
+     *
+     * @param irq -> IRQ line, 8-15 are on the slave
+     * @param level -> true if the line is asserted
+     */
+    void SetIrq(UINT32 irq, bool level);
+
+    /**
+     * @brief Checks the INTR output of the master
+     *
+     */
+    bool HasInterrupt() const;
+
+    /**
+     * @brief Runs the interrupt acknowledge cycle, moves the highest priority request to the ISR
+     *
+     * @return UINT32 -> the vector, the spurious IRQ 7 vector if the request went away
+     */
+    UINT32 AcknowledgeInterrupt();
+
+    /**
+     * @brief Serializes the state of both chips for snapshots and migration
+     *
+     * @param state -> receives the serialized state
+     */
+    void SaveState(std::vector<UINT8>& state) const;
+
+    /**
+     * @brief Loads a state produced by SaveState
+     *
+     * @param state -> the serialized state
+     * @return true -> if the state was loaded
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    /**
+     * @brief State of one 8259
+     *
+     */
+    struct Chip
+    {
+        UINT8 irr;
+        UINT8 isr;
+        UINT8 imr;
+        UINT8 elcr;
+        UINT8 lineLevels;
+        UINT8 vectorBase;
+        UINT8 priorityAdd;
+        UINT8 initStep;
+        UINT8 icw4Needed;
+        UINT8 singleMode;
+        UINT8 autoEoi;
+        UINT8 readIsr;
+    };
+
+    static void SetChipIrq(Chip& chip, UINT32 irq, bool level);
+
+    /**
+     * @brief Gets the priority of the highest priority bit of a mask under the current rotation
+     *
+     * @return UINT32 -> 0 for the highest priority, 8 if no bit is set
+     */
+    static UINT32 GetPriority(const Chip& chip, UINT8 mask);
+
+    /**
+     * @brief Gets the IRQ of the chip that should be raised on its output
+     *
+     * @return int -> the IRQ, -1 if none
+     */
+    static int GetRequest(const Chip& chip);
+
+    static UINT32 Acknowledge(Chip& chip, UINT32 irq);
+    void WriteCommand(Chip& chip, UINT8 value);
+    void WriteData(Chip& chip, UINT8 value);
+    void UpdateCascade();
+
+    Chip chips_[2];
+    Logger logger_;
+};
+
+#endif // PIC_H
\ No newline at end of file
@@ -0,0 +1,252 @@
+#define NOMINMAX
+#include "PvConsole.h"
+#include <algorithm>
+#include "MemoryManager.h"
+#include "ConsoleSink.h"
+
+namespace
+{
+    constexpr size_t DrainChunk = 64 * 1024;
+    constexpr auto PollWindow = std::chrono::microseconds(200);
+
+    // The ring is shared with the guest, plain loads and stores ordered with fences.
+    UINT32 LoadAcquire(const UINT32* value)
+    {
+        UINT32 result = *static_cast<const volatile UINT32*>(value);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return result;
+    }
+
+    void StoreRelease(UINT32* value, UINT32 newValue)
+    {
+        std::atomic_thread_fence(std::memory_order_release);
+        *static_cast<volatile UINT32*>(value) = newValue;
+    }
+}
+
+PvConsole::PvConsole(MemoryManager* memoryManager)
+    : memoryManager_(memoryManager), sink_(nullptr), ring_(nullptr), ringGpa_(0), ringDataSize_(0), running_(false),
+    doorbell_(false), bytes_(0), doorbells_(0), startTime_(std::chrono::steady_clock::now()), logger_("PvConsole.log")
+{
+
+}
+
+PvConsole::~PvConsole()
+{
+    Stop();
+}
+
+UINT64 PvConsole::HandleHypercall(const WHV_HYPERCALL_CONTEXT& hypercall)
+{
+    switch (hypercall.Rax)
+    {
+    case HypercallSetup:
+        return Attach(hypercall.Rbx, static_cast<UINT32>(hypercall.Rcx)) ? 0 : ~0ull;
+    case HypercallNotify:
+    {
+        doorbells_++;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            doorbell_ = true;
+        }
+        doorbellCv_.notify_one();
+        return 0;
+    }
+    default:
+        return ~0ull;
+    }
+}
+
+bool PvConsole::Start(ConsoleSink* sink)
+{
+    if (running_)
+    {
+        return true;
+    }
+    if (sink == nullptr)
+    {
+        return false;
+    }
+
+    sink_ = sink;
+    startTime_ = std::chrono::steady_clock::now();
+    running_ = true;
+    drainThread_ = std::thread(&PvConsole::DrainRing, this);
+    return true;
+}
+
+void PvConsole::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    doorbellCv_.notify_one();
+    if (drainThread_.joinable())
+    {
+        drainThread_.join();
+    }
+}
+
+PvConsole::Stats PvConsole::GetStats()
+{
+    Stats stats = {};
+    stats.bytes = bytes_;
+    stats.doorbells = doorbells_;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    stats.bytesPerSecond = seconds > 0.0 ? static_cast<double>(stats.bytes) / seconds : 0.0;
+    stats.bytesPerDoorbell = stats.doorbells > 0 ? static_cast<double>(stats.bytes) / static_cast<double>(stats.doorbells) : 0.0;
+    return stats;
+}
+
+void PvConsole::SaveState(std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const UINT32 dataSize = ringDataSize_;
+    state.resize(sizeof(ringGpa_) + sizeof(dataSize));
+    memcpy(state.data(), &ringGpa_, sizeof(ringGpa_));
+    memcpy(state.data() + sizeof(ringGpa_), &dataSize, sizeof(dataSize));
+}
+
+bool PvConsole::LoadState(const std::vector<UINT8>& state)
+{
+    UINT64 gpa = 0;
+    UINT32 dataSize = 0;
+    if (state.size() != sizeof(gpa) + sizeof(dataSize))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Console state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+    memcpy(&gpa, state.data(), sizeof(gpa));
+    memcpy(&dataSize, state.data() + sizeof(gpa), sizeof(dataSize));
+    return Attach(gpa, dataSize);
+}
+
+bool PvConsole::Attach(UINT64 gpa, UINT32 dataSize)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (gpa == 0)
+    {
+        ring_ = nullptr;
+        ringGpa_ = 0;
+        ringDataSize_ = 0;
+        return true;
+    }
+
+    if ((gpa & 7) != 0 || dataSize < MinDataSize || dataSize > MaxDataSize || (dataSize & (dataSize - 1)) != 0)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Invalid console ring at GPA " + std::to_string(gpa) + " with "
+            + std::to_string(dataSize) + " bytes");
+        return false;
+    }
+
+    UINT8* first = memoryManager_->GetHostRange(gpa, sizeof(RingHeader) + dataSize);
+    if (first == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Console ring at GPA " + std::to_string(gpa) + " is not in guest RAM");
+        return false;
+    }
+
+    RingHeader* ring = reinterpret_cast<RingHeader*>(first);
+    if (ring->magic != RingMagic || ring->dataSize != dataSize)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Console ring at GPA " + std::to_string(gpa) + " has a bad header");
+        return false;
+    }
+
+    ringGpa_ = gpa;
+    ringDataSize_ = dataSize;
+    ring_ = ring;
+    logger_.Log(Logger::LogLevel::Info, "Console ring attached at GPA " + std::to_string(gpa) + ", "
+        + std::to_string(dataSize) + " bytes");
+    return true;
+}
+
+size_t PvConsole::Consume(RingHeader* ring, std::vector<char>& buffer)
+{
+    const UINT32 dataSize = ringDataSize_;
+    const UINT8* data = reinterpret_cast<const UINT8*>(ring + 1);
+    UINT32 head = LoadAcquire(&ring->head);
+    const UINT32 tail = LoadAcquire(&ring->tail);
+    UINT32 available = tail - head;
+    if (available == 0)
+    {
+        return 0;
+    }
+    if (available > dataSize)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Console ring indices are corrupt, dropping " + std::to_string(available) + " bytes");
+        StoreHeader(&ring->head, tail);
+        return 0;
+    }
+
+    size_t consumed = 0;
+    while (available > 0)
+    {
+        const UINT32 offset = head & (dataSize - 1);
+        const UINT32 chunk = std::min({ available, dataSize - offset, static_cast<UINT32>(buffer.size()) });
+        memcpy(buffer.data(), data + offset, chunk);
+        sink_->Write(buffer.data(), chunk);
+        head += chunk;
+        available -= chunk;
+        consumed += chunk;
+    }
+    StoreHeader(&ring->head, head);
+    bytes_ += consumed;
+    return consumed;
+}
+
+void PvConsole::StoreHeader(UINT32* field, UINT32 value)
+{
+    StoreRelease(field, value);
+    memoryManager_->MarkHostRangeDirty(field, sizeof(*field));
+}
+
+void PvConsole::DrainRing()
+{
+    std::vector<char> buffer(DrainChunk);
+    auto lastOutput = std::chrono::steady_clock::now();
+    while (running_)
+    {
+        RingHeader* ring = ring_;
+        if (ring != nullptr)
+        {
+            if (Consume(ring, buffer) > 0)
+            {
+                lastOutput = std::chrono::steady_clock::now();
+                continue;
+            }
+            // A guest that is logging refills the ring within the poll window, so only a real pause costs it a doorbell.
+            if (std::chrono::steady_clock::now() - lastOutput < PollWindow)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Idle: ask for a doorbell, then look again so output published before the guest saw the flag is not missed.
+            StoreHeader(&ring->notify, 1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (LoadAcquire(&ring->tail) != LoadAcquire(&ring->head))
+            {
+                StoreHeader(&ring->notify, 0);
+                continue;
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // The timeout covers a ring attached while sleeping and guests that never ring the doorbell.
+            doorbellCv_.wait_for(lock, std::chrono::milliseconds(100), [this] { return doorbell_ || !running_; });
+            doorbell_ = false;
+        }
+        if (ring != nullptr && ring == ring_)
+        {
+            StoreHeader(&ring->notify, 0);
+        }
+    }
+
+    if (RingHeader* ring = ring_)
+    {
+        Consume(ring, buffer);
+    }
+}
@@ -0,0 +1,156 @@
+#ifndef PVCONSOLE_H
+#define PVCONSOLE_H
+
+#include <Windows.h>
+#include <WinHvPlatform.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Logger.h"
+
+class MemoryManager;
+class ConsoleSink;
+
+/// @brief Paravirtual console, the guest writes into a ring in its own RAM that a host thread drains without exits \class PvConsole
+class PvConsole
+{
+public:
+    /**
+     * @brief VMCALL function codes, passed in RAX
+     *
+     * Setup: RBX = GPA of the RingHeader, RCX = size of the data area, 0 in RBX detaches the ring. Returns 0 in RAX.
+     * Notify: doorbell after publishing output while RingHeader::notify is set. Returns 0 in RAX.
+     */
+    static constexpr UINT64 HypercallSetup = 0x4D480001;
+    static constexpr UINT64 HypercallNotify = 0x4D480002;
+    static constexpr UINT32 RingMagic = 0x4E435650;
+
+    /**
+     * @brief Layout of the ring in guest RAM, the data area follows the header
+     *
+     * The guest copies its output to data[tail % dataSize], then stores tail. The host consumes up to tail and
+     * stores head. The guest never lets tail - head exceed dataSize. Once idle, the host sets notify and
+     * sleeps. After a guest stores tail, it issues the Notify hypercall only if notify is set.
+     */
+    struct RingHeader
+    {
+        UINT32 magic;
+        UINT32 dataSize;
+        UINT32 head;
+        UINT32 tail;
+        UINT32 notify;
+        UINT32 reserved[3];
+    };
+
+    /**
+     * @brief Console statistics
+     *
+     */
+    struct Stats
+    {
+        UINT64 bytes;
+        UINT64 doorbells;
+        double bytesPerSecond;
+        double bytesPerDoorbell;
+    };
+
+    PvConsole(MemoryManager* memoryManager);
+    ~PvConsole();
+
+    /**
+     * @brief Handles the console hypercalls
+     *
+     * @param hypercall -> Register state of the VMCALL exit
+     * @return UINT64 -> status returned to the guest, 0 on success
+     */
+    UINT64 HandleHypercall(const WHV_HYPERCALL_CONTEXT& hypercall);
+
+    /**
+     * @brief Starts the host thread that drains the ring
+     *
+     * @param sink -> ConsoleSink*, receives the output
+     * @return true -> if the console started
+     */
+    bool Start(ConsoleSink* sink);
+
+    /**
+     * @brief Stops the host thread after draining the remaining output
+     *
+     */
+    void Stop();
+
+    /**
+     * @brief Gets the console statistics
+     *
+     */
+    Stats GetStats();
+
+    /**
+     * @brief Serializes the ring location, the ring contents live in guest RAM
+     *
+     * @param state -> receives the state
+     */
+    void SaveState(std::vector<UINT8>& state);
+
+    /**
+     * @brief Restores the state written by SaveState
+     *
+     * @param state -> the state
+     * @return true -> if the state was restored
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    static constexpr UINT32 MinDataSize = 64;
+    static constexpr UINT32 MaxDataSize = 16 * 1024 * 1024;
+
+    /**
+     * @brief Validates a ring and maps it to its host address
+     *
+     * @return true -> if the ring is attached, or detached for GPA 0
+     */
+    bool Attach(UINT64 gpa, UINT32 dataSize);
+
+    /**
+     * @brief Copies the published output to the sink and releases it to the guest
+     *
+     * @return size_t -> number of bytes consumed
+     */
+    size_t Consume(RingHeader* ring, std::vector<char>& buffer);
+
+    /**
+     * @brief Stores a ring header field with release semantics and reports the write to the dirty logs
+     *
+     */
+    void StoreHeader(UINT32* field, UINT32 value);
+
+    /**
+     * @brief Host thread, drains the ring while it has output and sleeps on the doorbell when it is idle
+     *
+     */
+    void DrainRing();
+
+    MemoryManager* memoryManager_;
+    ConsoleSink* sink_;
+
+    std::atomic<RingHeader*> ring_;
+    UINT64 ringGpa_;
+    std::atomic<UINT32> ringDataSize_;
+
+    std::thread drainThread_;
+    std::atomic<bool> running_;
+    std::mutex mutex_;
+    std::condition_variable doorbellCv_;
+    bool doorbell_;
+
+    std::atomic<UINT64> bytes_;
+    std::atomic<UINT64> doorbells_;
+    std::chrono::steady_clock::time_point startTime_;
+
+    Logger logger_;
+};
+
+#endif // PVCONSOLE_H
\ No newline at end of file
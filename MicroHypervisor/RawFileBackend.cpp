@@ -0,0 +1,124 @@
+#define NOMINMAX
+#include "RawFileBackend.h"
+#include <algorithm>
+
+namespace
+{
+    // ReadFile and WriteFile take a DWORD length.
+    constexpr size_t MaxTransfer = 1u << 30;
+}
+
+RawFileBackend::RawFileBackend() : file_(INVALID_HANDLE_VALUE), size_(0), readOnly_(true), logger_("RawFileBackend.log")
+{
+
+}
+
+RawFileBackend::~RawFileBackend()
+{
+    Close();
+}
+
+bool RawFileBackend::Open(const std::string& path, bool readOnly)
+{
+    Close();
+    file_ = CreateFileA(path.c_str(), readOnly ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | (readOnly ? FILE_SHARE_WRITE : 0), nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to open the disk image " + path + ", error " + std::to_string(GetLastError()));
+        return false;
+    }
+
+    LARGE_INTEGER size = {};
+    if (!GetFileSizeEx(file_, &size))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to get the size of the disk image " + path);
+        Close();
+        return false;
+    }
+
+    size_ = static_cast<UINT64>(size.QuadPart) & ~static_cast<UINT64>(SectorSize - 1);
+    readOnly_ = readOnly;
+    logger_.Log(Logger::LogLevel::Info, "Opened the disk image " + path + ", " + std::to_string(size_) + " bytes"
+        + (readOnly ? " read only" : ""));
+    return true;
+}
+
+void RawFileBackend::Close()
+{
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+    size_ = 0;
+}
+
+UINT64 RawFileBackend::GetSize() const
+{
+    return size_;
+}
+
+bool RawFileBackend::IsReadOnly() const
+{
+    return readOnly_;
+}
+
+bool RawFileBackend::Read(UINT64 offset, void* buffer, size_t length)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return false;
+    }
+
+    UINT8* data = static_cast<UINT8*>(buffer);
+    while (length > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD transferred = 0;
+        if (!ReadFile(file_, data, static_cast<DWORD>(std::min(length, MaxTransfer)), &transferred, &overlapped) || transferred == 0)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Disk read at offset " + std::to_string(offset) + " failed, error "
+                + std::to_string(GetLastError()));
+            return false;
+        }
+        data += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+    return true;
+}
+
+bool RawFileBackend::Write(UINT64 offset, const void* buffer, size_t length)
+{
+    if (readOnly_ || offset > size_ || length > size_ - offset)
+    {
+        return false;
+    }
+
+    const UINT8* data = static_cast<const UINT8*>(buffer);
+    while (length > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD transferred = 0;
+        if (!WriteFile(file_, data, static_cast<DWORD>(std::min(length, MaxTransfer)), &transferred, &overlapped) || transferred == 0)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Disk write at offset " + std::to_string(offset) + " failed, error "
+                + std::to_string(GetLastError()));
+            return false;
+        }
+        data += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+    return true;
+}
+
+bool RawFileBackend::Flush()
+{
+    return readOnly_ || FlushFileBuffers(file_) != FALSE;
+}
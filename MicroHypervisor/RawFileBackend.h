@@ -0,0 +1,44 @@
+#ifndef RAWFILEBACKEND_H
+#define RAWFILEBACKEND_H
+
+#include <Windows.h>
+#include <string>
+#include "BlockBackend.h"
+#include "Logger.h"
+
+/// @brief Raw disk image in a host file, positioned reads and writes so the IO threads never share a file pointer \class RawFileBackend
+class RawFileBackend : public BlockBackend
+{
+public:
+    RawFileBackend();
+    ~RawFileBackend();
+
+    /**
+     * @brief Opens the image, the disk size is the file size rounded down to whole sectors
+     *
+     * @param path -> Path of the image
+     * @param readOnly -> true to open the image read only
+     * @return true -> if the image was opened
+     */
+    bool Open(const std::string& path, bool readOnly);
+
+    /**
+     * @brief Closes the image
+     *
+     */
+    void Close();
+
+    UINT64 GetSize() const override;
+    bool IsReadOnly() const override;
+    bool Read(UINT64 offset, void* buffer, size_t length) override;
+    bool Write(UINT64 offset, const void* buffer, size_t length) override;
+    bool Flush() override;
+
+private:
+    HANDLE file_;
+    UINT64 size_;
+    bool readOnly_;
+    Logger logger_;
+};
+
+#endif // RAWFILEBACKEND_H
\ No newline at end of file
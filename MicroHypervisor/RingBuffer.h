@@ -0,0 +1,121 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/// @brief Lock-free single producer, single consumer ring of trivially copyable elements \class RingBuffer
+template <typename T>
+class RingBuffer
+{
+public:
+    /**
+     * @brief Creates the ring, the capacity is rounded up to a power of two
+     *
+     * @param capacity -> Minimum number of elements the ring holds
+     */
+    explicit RingBuffer(size_t capacity) : head_(0), tail_(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        buffer_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /**
+     * @brief Appends elements, producer side only
+     *
+     * @param items -> Elements to append
+     * @param count -> Number of elements
+     * @return size_t -> number of elements appended, less than count when the ring is full
+     */
+    size_t Push(const T* items, size_t count)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t free = buffer_.size() - (tail - head_.load(std::memory_order_acquire));
+        const size_t pushed = count < free ? count : free;
+        for (size_t i = 0; i < pushed; ++i)
+        {
+            buffer_[(tail + i) & mask_] = items[i];
+        }
+        tail_.store(tail + pushed, std::memory_order_release);
+        return pushed;
+    }
+
+    /**
+     * @brief Removes the oldest elements, consumer side only
+     *
+     * @param items -> receives the elements
+     * @param count -> Maximum number of elements
+     * @return size_t -> number of elements removed
+     */
+    size_t Pop(T* items, size_t count)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        const size_t used = tail_.load(std::memory_order_acquire) - head;
+        const size_t popped = count < used ? count : used;
+        for (size_t i = 0; i < popped; ++i)
+        {
+            items[i] = buffer_[(head + i) & mask_];
+        }
+        head_.store(head + popped, std::memory_order_release);
+        return popped;
+    }
+
+    /**
+     * @brief Gets a queued element without removing it, consumer side only
+     *
+     * @param index -> Position counted from the oldest element, below Size()
+     */
+    const T& Peek(size_t index) const
+    {
+        return buffer_[(head_.load(std::memory_order_relaxed) + index) & mask_];
+    }
+
+    /**
+     * @brief Removes the oldest elements after they were read with Peek, consumer side only
+     *
+     * @param count -> Number of elements, at most Size()
+     */
+    void Discard(size_t count)
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    bool TryPush(const T& item)
+    {
+        return Push(&item, 1) == 1;
+    }
+
+    bool TryPop(T& item)
+    {
+        return Pop(&item, 1) == 1;
+    }
+
+    /**
+     * @brief Number of queued elements, exact only on the producer or consumer side
+     *
+     */
+    size_t Size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity() const
+    {
+        return buffer_.size();
+    }
+
+private:
+    std::vector<T> buffer_;
+    size_t mask_;
+    // Consumer and producer indices on their own cache lines.
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+#endif // RINGBUFFER_H
\ No newline at end of file
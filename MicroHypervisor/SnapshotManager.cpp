@@ -1,33 +1,198 @@
+#define NOMINMAX
 #include "SnapshotManager.h"
 #include <iostream>
+#include <algorithm>
 
-SnapshotManager::SnapshotManager(WHV_PARTITION_HANDLE partitionHandle) : partitionHandle_(partitionHandle), logger_("SnapshotManager.log")
+SnapshotManager::SnapshotManager(WHV_PARTITION_HANDLE partitionHandle) : partitionHandle_(partitionHandle),
+    virtualProcessor_(nullptr), memoryManager_(nullptr), logger_("SnapshotManager.log"),
+    pageStore_(std::make_shared<PageStore>(MemoryManager::GuestPageSize)), nextSnapshotId_(0),
+    liveDirtyLog_(-1), resetDirtyLog_(-1), resetPointValid_(false), resetStats_(), windowResets_(0),
+    windowStart_(std::chrono::steady_clock::now())
 {
 
 }
 
-SnapshotManager::~SnapshotManager() {}
+SnapshotManager::~SnapshotManager()
+{
+    for (size_t i = snapshots_.size(); i > 0; --i)
+    {
+        DeleteSnapshot(i - 1);
+    }
+}
+
+UINT64 SnapshotManager::SaveSnapshot()
+{
+    if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Cannot save snapshot, virtual processor or guest memory not attached.");
+        return InvalidSnapshotId;
+    }
+
+    // The vCPU thread owns the register cache and guest memory while it runs, so it is parked for the copy.
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for a snapshot: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return InvalidSnapshotId;
+    }
+
+    Snapshot snapshot = {};
+    hr = virtualProcessor_->SaveState(snapshot.registers);
+    if (FAILED(hr))
+    {
+        virtualProcessor_->Resume();
+        logger_.Log(Logger::LogLevel::Error, "Failed to save snapshot registers: HRESULT " + std::to_string(hr));
+        return InvalidSnapshotId;
+    }
+
+    SaveDeviceStates(snapshot.devices);
+    pageStore_->StorePages(memoryManager_->GetGuestMemory(), memoryManager_->GetGuestPageCount(), snapshot.pages);
+    virtualProcessor_->Resume();
+    size_t registerCount = snapshot.registers.size();
+    size_t pageCount = snapshot.pages.size();
+    size_t index = 0;
+    UINT64 id = 0;
+    {
+        std::lock_guard<std::mutex> lock(snapshotsMutex_);
+        id = nextSnapshotId_++;
+        snapshot.id = id;
+        snapshots_.push_back(std::move(snapshot));
+        index = snapshots_.size() - 1;
+    }
+
+    auto stats = pageStore_->GetStats();
+    logger_.Log(Logger::LogLevel::Info, "Snapshot " + std::to_string(index) + " (id " + std::to_string(id) + ") saved with "
+        + std::to_string(registerCount) + " registers and "
+        + std::to_string(pageCount) + " pages, unique pages = "
+        + std::to_string(stats.uniquePages) + ", dedup ratio = " + std::to_string(stats.dedupRatio));
+    return id;
+}
+
+bool SnapshotManager::SaveLiveSnapshot(const LiveSnapshotConfig& config)
+{
+    if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Cannot save live snapshot, virtual processor or guest memory not attached.");
+        return false;
+    }
+
+    if (liveDirtyLog_ < 0)
+    {
+        liveDirtyLog_ = memoryManager_->CreateDirtyLog();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    LiveSnapshotStats stats = {};
+    std::vector<UINT64> dirty;
+
+    // Round 0 copies everything, pages torn by concurrent guest writes show up dirty in the next round.
+    memoryManager_->CollectDirtyPages(liveDirtyLog_, dirty);
+    const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    std::vector<UINT8> staging(guestMemory, guestMemory + memoryManager_->GetGuestMemorySize());
+    stats.pagesCopied = memoryManager_->GetGuestPageCount();
+    stats.rounds = 1;
+
+    size_t previousDirty = SIZE_MAX;
+    while (stats.rounds < config.maxRounds)
+    {
+        if (!memoryManager_->CollectDirtyPages(liveDirtyLog_, dirty))
+        {
+            return false;
+        }
+        if (dirty.size() <= config.convergedDirtyPages || dirty.size() >= previousDirty)
+        {
+            break;
+        }
+
+        CopyPages(dirty, staging);
+        stats.pagesCopied += dirty.size();
+        stats.rounds++;
+        previousDirty = dirty.size();
+        dirty.clear();
+    }
+
+    auto pauseStart = std::chrono::steady_clock::now();
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Live snapshot failed to pause the virtual processor: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    // Pages collected in the last round were not copied yet, merge them with the final dirty set.
+    std::vector<UINT64> finalDirty;
+    memoryManager_->CollectDirtyPages(liveDirtyLog_, finalDirty);
+    CopyPages(dirty, staging);
+    CopyPages(finalDirty, staging);
+    std::vector<WHV_REGISTER_VALUE> registers;
+    hr = virtualProcessor_->SaveState(registers);
+    std::vector<std::pair<std::string, std::vector<UINT8>>> devices;
+    SaveDeviceStates(devices);
+
+    virtualProcessor_->Resume();
+    auto pauseEnd = std::chrono::steady_clock::now();
+
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Live snapshot failed to save registers: HRESULT " + std::to_string(hr));
+        return false;
+    }
+
+    stats.finalDirtyPages = dirty.size() + finalDirty.size();
+    stats.pagesCopied += stats.finalDirtyPages;
+    stats.pauseMicroseconds = static_cast<UINT64>(
+        std::chrono::duration_cast<std::chrono::microseconds>(pauseEnd - pauseStart).count());
+
+    Snapshot snapshot = {};
+    snapshot.registers = std::move(registers);
+    snapshot.devices = std::move(devices);
+    pageStore_->StorePages(staging.data(), memoryManager_->GetGuestPageCount(), snapshot.pages);
+    stats.totalMicroseconds = static_cast<UINT64>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    snapshot.liveStats = stats;
+    size_t index = 0;
+    {
+        std::lock_guard<std::mutex> lock(snapshotsMutex_);
+        snapshot.id = nextSnapshotId_++;
+        snapshots_.push_back(std::move(snapshot));
+        index = snapshots_.size() - 1;
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Live snapshot " + std::to_string(index) + " saved after "
+        + std::to_string(stats.rounds) + " rounds, " + std::to_string(stats.pagesCopied) + " pages copied, "
+        + std::to_string(stats.finalDirtyPages) + " pages in the pause window, pause = "
+        + std::to_string(stats.pauseMicroseconds) + " us, total = " + std::to_string(stats.totalMicroseconds) + " us");
+    return true;
+}
 
-void SnapshotManager::SaveSnapshot()
+SnapshotManager::LiveSnapshotStats SnapshotManager::GetLiveSnapshotStats(size_t index) const
 {
-    const int registerCount = 16;
-    WHV_REGISTER_VALUE registerValues[registerCount];
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    if (index >= snapshots_.size())
+    {
+        return LiveSnapshotStats();
+    }
+    return snapshots_[index].liveStats;
+}
 
-    savedRegisters_.assign(registerValues, registerValues + registerCount);
-    logger_.Log(Logger::LogLevel::Info, "Snapshot saved with " + std::to_string(registerCount) + " registers.");
+void SnapshotManager::CopyPages(const std::vector<UINT64>& pageIndices, std::vector<UINT8>& staging)
+{
+    const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    for (UINT64 page : pageIndices)
+    {
+        size_t offset = static_cast<size_t>(page) * MemoryManager::GuestPageSize;
+        memcpy(staging.data() + offset, guestMemory + offset, MemoryManager::GuestPageSize);
+    }
 }
 
 void SnapshotManager::RestoreSnapshot()
 {
-    if (!savedRegisters_.empty())
+    size_t count = GetSnapshotCount();
+    if (count > 0)
     {
-        auto result = WHvSetVirtualProcessorRegisters(
-			partitionHandle_, 0, nullptr, 0, savedRegisters_.data()
-		);
-        logger_.Log(Logger::LogLevel::Info, "Restoring snapshot." 
-            + std::to_string(result) + ", partitionHandle = "
-            + std::to_string(reinterpret_cast<uintptr_t>(partitionHandle_)) + ", registerCount = "
-            + std::to_string(savedRegisters_.size()));
+        RestoreSnapshot(count - 1);
     }
     else
     {
@@ -35,6 +200,108 @@ void SnapshotManager::RestoreSnapshot()
     }
 }
 
+bool SnapshotManager::RestoreSnapshot(size_t index)
+{
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    return RestoreSnapshotLocked(index);
+}
+
+bool SnapshotManager::RestoreSnapshotById(UINT64 id)
+{
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    for (size_t index = 0; index < snapshots_.size(); ++index)
+    {
+        if (snapshots_[index].id == id)
+        {
+            return RestoreSnapshotLocked(index);
+        }
+    }
+
+    logger_.Log(Logger::LogLevel::Warning, "No snapshot with id " + std::to_string(id) + " available to restore.");
+    return false;
+}
+
+bool SnapshotManager::RestoreSnapshotLocked(size_t index)
+{
+    if (index >= snapshots_.size() || virtualProcessor_ == nullptr || memoryManager_ == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "No snapshot " + std::to_string(index) + " available to restore.");
+        return false;
+    }
+
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for a restore: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    const auto& snapshot = snapshots_[index];
+    UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    size_t pageCount = std::min(snapshot.pages.size(), memoryManager_->GetGuestPageCount());
+    for (size_t i = 0; i < pageCount; ++i)
+    {
+        const UINT8* page = pageStore_->Lookup(snapshot.pages[i]);
+        if (page != nullptr)
+        {
+            memcpy(guestMemory + i * MemoryManager::GuestPageSize, page, MemoryManager::GuestPageSize);
+            memoryManager_->MarkDirty(MemoryManager::GuestMemoryBase + i * MemoryManager::GuestPageSize, MemoryManager::GuestPageSize);
+        }
+    }
+
+    for (const auto& [name, state] : snapshot.devices)
+    {
+        LoadDeviceState(name, state);
+    }
+
+    auto result = virtualProcessor_->LoadState(snapshot.registers);
+    virtualProcessor_->Resume();
+    logger_.Log(Logger::LogLevel::Info, "Restoring snapshot " + std::to_string(index) + ". "
+        + std::to_string(result) + ", partitionHandle = "
+        + std::to_string(reinterpret_cast<uintptr_t>(partitionHandle_)) + ", registerCount = "
+        + std::to_string(snapshot.registers.size()) + ", pageCount = "
+        + std::to_string(pageCount));
+    return SUCCEEDED(result);
+}
+
+void SnapshotManager::DeleteSnapshot(size_t index)
+{
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    if (index >= snapshots_.size())
+    {
+        return;
+    }
+
+    for (const auto& hash : snapshots_[index].pages)
+    {
+        pageStore_->Release(hash);
+    }
+    snapshots_.erase(snapshots_.begin() + index);
+}
+
+size_t SnapshotManager::GetSnapshotCount() const
+{
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    return snapshots_.size();
+}
+
+void SnapshotManager::SetPageStore(std::shared_ptr<PageStore> pageStore)
+{
+    std::lock_guard<std::mutex> lock(snapshotsMutex_);
+    if (!snapshots_.empty())
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Page store cannot be replaced while snapshots exist.");
+        return;
+    }
+    pageStore_ = std::move(pageStore);
+}
+
+PageStore::Stats SnapshotManager::GetPageStoreStats()
+{
+    return pageStore_->GetStats();
+}
+
 bool SnapshotManager::Initialize()
 {
     auto result = WHvGetVirtualProcessorRegisters(
@@ -57,3 +324,197 @@ bool SnapshotManager::Initialize()
 		return true;
     }
 }
+
+void SnapshotManager::Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager)
+{
+    virtualProcessor_ = virtualProcessor;
+    memoryManager_ = memoryManager;
+    resetPointValid_ = false;
+}
+
+void SnapshotManager::RegisterDeviceReset(const std::string& name, std::function<void()> reset)
+{
+    for (auto& device : deviceResets_)
+    {
+        if (device.name == name)
+        {
+            device.reset = std::move(reset);
+            return;
+        }
+    }
+    deviceResets_.push_back({ name, std::move(reset) });
+    logger_.Log(Logger::LogLevel::Info, "Device reset handler registered: " + name);
+}
+
+void SnapshotManager::RegisterDeviceState(const std::string& name, std::function<void(std::vector<UINT8>&)> save,
+    std::function<void(const std::vector<UINT8>&)> load)
+{
+    for (auto& device : deviceStates_)
+    {
+        if (device.name == name)
+        {
+            device.save = std::move(save);
+            device.load = std::move(load);
+            return;
+        }
+    }
+    deviceStates_.push_back({ name, std::move(save), std::move(load) });
+    logger_.Log(Logger::LogLevel::Info, "Device state serializers registered: " + name);
+}
+
+void SnapshotManager::SaveDeviceStates(std::vector<std::pair<std::string, std::vector<UINT8>>>& states)
+{
+    states.clear();
+    for (auto& device : deviceStates_)
+    {
+        std::vector<UINT8> state;
+        device.save(state);
+        states.emplace_back(device.name, std::move(state));
+    }
+}
+
+bool SnapshotManager::LoadDeviceState(const std::string& name, const std::vector<UINT8>& state)
+{
+    for (auto& device : deviceStates_)
+    {
+        if (device.name == name)
+        {
+            device.load(state);
+            return true;
+        }
+    }
+    logger_.Log(Logger::LogLevel::Warning, "No device registered for state: " + name);
+    return false;
+}
+
+bool SnapshotManager::CaptureResetPoint()
+{
+    if (virtualProcessor_ == nullptr || memoryManager_ == nullptr || memoryManager_->GetGuestMemory() == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Cannot capture reset point, virtual processor or guest memory not attached.");
+        return false;
+    }
+
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to pause the virtual processor for the reset point: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return false;
+    }
+
+    hr = virtualProcessor_->SaveState(resetRegisters_);
+    if (FAILED(hr))
+    {
+        virtualProcessor_->Resume();
+        logger_.Log(Logger::LogLevel::Error, "Failed to capture reset point registers: HRESULT " + std::to_string(hr));
+        return false;
+    }
+
+    SaveDeviceStates(resetDevices_);
+
+    if (resetDirtyLog_ < 0)
+    {
+        resetDirtyLog_ = memoryManager_->CreateDirtyLog();
+    }
+
+    // Drain the log first so that only writes after the copy count as dirty.
+    memoryManager_->CollectDirtyPages(resetDirtyLog_, dirtyPages_);
+
+    const UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    pristineMemory_.assign(guestMemory, guestMemory + memoryManager_->GetGuestMemorySize());
+    virtualProcessor_->Resume();
+    dirtyPages_.reserve(memoryManager_->GetGuestPageCount());
+    resetPointValid_ = true;
+
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        resetStats_ = ResetStats();
+        resetStats_.pristinePages = memoryManager_->GetGuestPageCount();
+        windowResets_ = 0;
+        windowStart_ = std::chrono::steady_clock::now();
+    }
+
+    logger_.Log(Logger::LogLevel::Info, "Reset point captured with "
+        + std::to_string(memoryManager_->GetGuestPageCount()) + " pristine pages.");
+    return true;
+}
+
+HRESULT SnapshotManager::FastReset()
+{
+    if (!resetPointValid_)
+    {
+        logger_.Log(Logger::LogLevel::Warning, "No reset point captured, fast reset skipped.");
+        return E_FAIL;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    HRESULT hr = virtualProcessor_->Pause();
+    if (FAILED(hr))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Fast reset failed to pause the virtual processor: HRESULT " + std::to_string(hr));
+        virtualProcessor_->Resume();
+        return hr;
+    }
+
+    if (!memoryManager_->CollectDirtyPages(resetDirtyLog_, dirtyPages_))
+    {
+        virtualProcessor_->Resume();
+        logger_.Log(Logger::LogLevel::Error, "Fast reset failed to collect dirty pages.");
+        return E_FAIL;
+    }
+
+    UINT8* guestMemory = memoryManager_->GetGuestMemory();
+    for (UINT64 page : dirtyPages_)
+    {
+        size_t offset = static_cast<size_t>(page) * MemoryManager::GuestPageSize;
+        memcpy(guestMemory + offset, pristineMemory_.data() + offset, MemoryManager::GuestPageSize);
+    }
+    // The restored pages match the reset point again, only the other logs must see them.
+    memoryManager_->MarkPagesDirty(dirtyPages_, resetDirtyLog_);
+
+    hr = virtualProcessor_->LoadState(resetRegisters_);
+    if (FAILED(hr))
+    {
+        virtualProcessor_->Resume();
+        return hr;
+    }
+
+    for (const auto& [name, state] : resetDevices_)
+    {
+        LoadDeviceState(name, state);
+    }
+
+    for (auto& device : deviceResets_)
+    {
+        device.reset();
+    }
+    virtualProcessor_->Resume();
+
+    auto end = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        resetStats_.resetCount++;
+        resetStats_.lastPagesRestored = dirtyPages_.size();
+        resetStats_.lastResetMicroseconds = static_cast<UINT64>(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+
+        windowResets_++;
+        auto window = std::chrono::duration<double>(end - windowStart_).count();
+        if (window >= 1.0)
+        {
+            resetStats_.resetsPerSecond = windowResets_ / window;
+            windowResets_ = 0;
+            windowStart_ = end;
+        }
+    }
+
+    return S_OK;
+}
+
+SnapshotManager::ResetStats SnapshotManager::GetResetStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    return resetStats_;
+}
@@ -2,10 +2,18 @@
 #define SNAPSHOTMANAGER_H
 
 #include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <memory>
 #include <Windows.h>
 #include <WinHvPlatform.h>
 #include <WinHvEmulation.h>
 #include "Logger.h"
+#include "VirtualProcessor.h"
+#include "MemoryManager.h"
+#include "PageStore.h"
 
 /// @brief Snapshot Manager class for the Hypervisor \class SnapshotManager
 class SnapshotManager
@@ -15,27 +23,257 @@ public:
     ~SnapshotManager();
 
     /**
-     * @brief Saves a snapshot of the current state of the partition
+     * @brief Statistics of the fast reset path
+     *
+     */
+    struct ResetStats
+    {
+        UINT64 resetCount;
+        double resetsPerSecond;
+        UINT64 lastResetMicroseconds;
+        size_t lastPagesRestored;
+        size_t pristinePages;
+    };
+
+    /**
+     * @brief Configuration of a live snapshot
+     *
+     */
+    struct LiveSnapshotConfig
+    {
+        UINT32 maxRounds = 8;
+        size_t convergedDirtyPages = 64;
+    };
+
+    /**
+     * @brief Statistics of one live snapshot
+     *
+     */
+    struct LiveSnapshotStats
+    {
+        UINT32 rounds;
+        size_t pagesCopied;
+        size_t finalDirtyPages;
+        UINT64 pauseMicroseconds;
+        UINT64 totalMicroseconds;
+    };
+
+    /**
+     * @brief ID returned when no snapshot was saved
+     *
+     */
+    static constexpr UINT64 InvalidSnapshotId = ~0ull;
+
+    /**
+     * @brief Saves a snapshot of the current state of the partition, the guest pages are
+     *        deduplicated in the content-addressed page store
      * 
+     * @return UINT64 -> ID of the snapshot, stays valid when other snapshots are deleted,
+     *                   InvalidSnapshotId if the snapshot was not saved
+     */
+    UINT64 SaveSnapshot();
+
+    /**
+     * @brief Saves a snapshot while the virtual processor keeps running, memory is pre-copied in
+     *        rounds until the dirty set converges and the guest is only paused for the registers
+     *        and the final dirty pages
+     *
+     * @param config -> LiveSnapshotConfig, convergence settings
+     * @return true -> if the snapshot was saved
+     * @return false -> if the virtual processor or guest memory is not available
+     */
+    bool SaveLiveSnapshot(const LiveSnapshotConfig& config);
+
+    /**
+     * @brief Gets the live snapshot statistics of a snapshot
+     *
+     * @param index -> size_t, index of the snapshot
+     * @return LiveSnapshotStats -> rounds and pause window, all zero for snapshots taken while paused
      */
-    void SaveSnapshot();
+    LiveSnapshotStats GetLiveSnapshotStats(size_t index) const;
 
     /**
-     * @brief Restores the snapshot of the partition
+     * @brief Restores the latest snapshot of the partition
      * 
      */
     void RestoreSnapshot();
 
+    /**
+     * @brief Restores the snapshot with the given index
+     *
+     * @param index -> size_t, index of the snapshot
+     * @return true -> if the snapshot was restored
+     * @return false -> if the snapshot does not exist or the restore fails
+     */
+    bool RestoreSnapshot(size_t index);
+
+    /**
+     * @brief Restores the snapshot with the given ID
+     *
+     * @param id -> UINT64, ID returned by SaveSnapshot
+     * @return true -> if the snapshot was restored
+     * @return false -> if the snapshot does not exist anymore or the restore fails
+     */
+    bool RestoreSnapshotById(UINT64 id);
+
+    /**
+     * @brief Deletes the snapshot with the given index and drops its page references
+     *
+     * @param index -> size_t, index of the snapshot
+     */
+    void DeleteSnapshot(size_t index);
+
+    /**
+     * @brief Gets the number of saved snapshots
+     *
+     */
+    size_t GetSnapshotCount() const;
+
+    /**
+     * @brief Shares a page store between several snapshot managers (e.g. sibling VMs),
+     *        must be called before the first snapshot is saved
+     *
+     * @param pageStore -> the page store to use
+     */
+    void SetPageStore(std::shared_ptr<PageStore> pageStore);
+
+    /**
+     * @brief Gets the statistics of the page store, including the dedup ratio
+     *
+     */
+    PageStore::Stats GetPageStoreStats();
+
     /**
      * @brief Initializes the Snapshot Manager
      *
      */
     bool Initialize();
 
+    /**
+     * @brief Attaches the virtual processor and the memory manager the snapshots are taken from
+     *
+     * @param virtualProcessor -> VirtualProcessor*, the virtual processor to snapshot
+     * @param memoryManager -> MemoryManager*, the memory manager owning the guest RAM
+     */
+    void Attach(VirtualProcessor* virtualProcessor, MemoryManager* memoryManager);
+
+    /**
+     * @brief Registers a device reset handler which is invoked on every fast reset
+     *
+     * @param name -> Name of the device
+     * @param reset -> Function resetting the device state
+     */
+    void RegisterDeviceReset(const std::string& name, std::function<void()> reset);
+
+    /**
+     * @brief Registers the serializers of a device, used to carry device state across snapshots and migration
+     *
+     * @param name -> Unique name of the device
+     * @param save -> Function serializing the device state into a byte buffer
+     * @param load -> Function restoring the device state from a byte buffer
+     */
+    void RegisterDeviceState(const std::string& name, std::function<void(std::vector<UINT8>&)> save,
+        std::function<void(const std::vector<UINT8>&)> load);
+
+    /**
+     * @brief Serializes the state of every registered device
+     *
+     * @param states -> receives (name, state) pairs
+     */
+    void SaveDeviceStates(std::vector<std::pair<std::string, std::vector<UINT8>>>& states);
+
+    /**
+     * @brief Restores the state of a registered device
+     *
+     * @param name -> Name of the device
+     * @param state -> Serialized device state
+     * @return true -> if the device is known and the state was loaded
+     * @return false -> if no device with that name is registered
+     */
+    bool LoadDeviceState(const std::string& name, const std::vector<UINT8>& state);
+
+    /**
+     * @brief Captures the pristine state (registers, device states and a full copy of guest RAM) the fast reset returns to
+     *
+     * @return true -> if the reset point was captured
+     * @return false -> if the virtual processor state or the guest memory is not available
+     */
+    bool CaptureResetPoint();
+
+    /**
+     * @brief Resets the guest to the captured reset point, only the pages dirtied since the
+     *        last reset are copied back while the virtual processor is paused
+     *
+     * @return HRESULT -> S_OK if successful
+     */
+    HRESULT FastReset();
+
+    /**
+     * @brief Gets the statistics of the fast reset path
+     *
+     * @return ResetStats -> the current statistics
+     */
+    ResetStats GetResetStats();
+
 private:
-    std::vector<WHV_REGISTER_VALUE> savedRegisters_;
+    struct DeviceReset
+    {
+        std::string name;
+        std::function<void()> reset;
+    };
+
+    struct DeviceState
+    {
+        std::string name;
+        std::function<void(std::vector<UINT8>&)> save;
+        std::function<void(const std::vector<UINT8>&)> load;
+    };
+
+    struct Snapshot
+    {
+        UINT64 id;
+        std::vector<WHV_REGISTER_VALUE> registers;
+        std::vector<PageHash> pages;
+        std::vector<std::pair<std::string, std::vector<UINT8>>> devices;
+        LiveSnapshotStats liveStats;
+    };
+
+    /**
+     * @brief Copies the given guest pages into the staging buffer
+     *
+     */
+    void CopyPages(const std::vector<UINT64>& pageIndices, std::vector<UINT8>& staging);
+
+    /**
+     * @brief Restores the snapshot with the given index, snapshotsMutex_ must be held
+     *
+     */
+    bool RestoreSnapshotLocked(size_t index);
+
     WHV_PARTITION_HANDLE partitionHandle_;
+    VirtualProcessor* virtualProcessor_;
+    MemoryManager* memoryManager_;
     Logger logger_;
+
+    std::shared_ptr<PageStore> pageStore_;
+    std::vector<Snapshot> snapshots_;
+    UINT64 nextSnapshotId_;
+    mutable std::mutex snapshotsMutex_;
+
+    std::vector<DeviceReset> deviceResets_;
+    std::vector<DeviceState> deviceStates_;
+    std::vector<WHV_REGISTER_VALUE> resetRegisters_;
+    std::vector<std::pair<std::string, std::vector<UINT8>>> resetDevices_;
+    std::vector<UINT8> pristineMemory_;
+    std::vector<UINT64> dirtyPages_;
+    int liveDirtyLog_;
+    int resetDirtyLog_;
+    bool resetPointValid_;
+
+    std::mutex statsMutex_;
+    ResetStats resetStats_;
+    UINT64 windowResets_;
+    std::chrono::steady_clock::time_point windowStart_;
 };
 
 #endif // SNAPSHOTMANAGER_H
\ No newline at end of file
@@ -0,0 +1,487 @@
+#define NOMINMAX
+#include "SparseImageBackend.h"
+#include <algorithm>
+#include "RawFileBackend.h"
+
+namespace
+{
+    // ReadFile and WriteFile take a DWORD length.
+    constexpr size_t MaxTransfer = 1u << 30;
+    constexpr UINT32 MinClusterBits = 12;
+    constexpr UINT32 MaxClusterBits = 21;
+
+    std::string ResolveBackingPath(const std::string& imagePath, const std::string& backingPath)
+    {
+        const bool absolute = backingPath.empty() || backingPath[0] == '/' || backingPath[0] == '\\'
+            || (backingPath.size() > 1 && backingPath[1] == ':');
+        const size_t separator = imagePath.find_last_of("/\\");
+        if (absolute || separator == std::string::npos)
+        {
+            return backingPath;
+        }
+        return imagePath.substr(0, separator + 1) + backingPath;
+    }
+}
+
+SparseImageBackend::SparseImageBackend(size_t l2CacheTables)
+    : file_(INVALID_HANDLE_VALUE), readOnly_(true), size_(0), clusterBits_(0), clusterSize_(0), l2Bits_(0), l1Offset_(0),
+    l2CacheTables_(std::max<size_t>(l2CacheTables, 1)), fileEnd_(0), l2Hits_(0), l2Misses_(0), allocatedClusters_(0),
+    copiedClusters_(0), logger_("SparseImageBackend.log")
+{
+
+}
+
+SparseImageBackend::~SparseImageBackend()
+{
+    Close();
+}
+
+bool SparseImageBackend::Create(const std::string& path, UINT64 size, const std::string& backingPath, UINT32 clusterBits)
+{
+    const UINT64 clusterSize = 1ull << clusterBits;
+    if (clusterBits < MinClusterBits || clusterBits > MaxClusterBits || size == 0
+        || sizeof(Header) + backingPath.size() > clusterSize)
+    {
+        return false;
+    }
+
+    Header header = {};
+    header.magic = Magic;
+    header.version = Version;
+    header.clusterBits = clusterBits;
+    header.backingPathLength = static_cast<UINT32>(backingPath.size());
+    header.size = (size + SectorSize - 1) & ~static_cast<UINT64>(SectorSize - 1);
+    header.l1Offset = clusterSize;
+    const UINT64 l2Coverage = clusterSize * (clusterSize / sizeof(UINT64));
+    header.l1Entries = static_cast<UINT32>((header.size + l2Coverage - 1) / l2Coverage);
+
+    // Cluster 0 holds the header and the backing path, the zeroed L1 table follows it.
+    const UINT64 l1Bytes = (header.l1Entries * sizeof(UINT64) + clusterSize - 1) & ~(clusterSize - 1);
+    std::vector<UINT8> metadata(static_cast<size_t>(clusterSize + l1Bytes), 0);
+    memcpy(metadata.data(), &header, sizeof(header));
+    memcpy(metadata.data() + sizeof(header), backingPath.data(), backingPath.size());
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    DWORD written = 0;
+    const bool created = WriteFile(file, metadata.data(), static_cast<DWORD>(metadata.size()), &written, nullptr)
+        && written == metadata.size() && FlushFileBuffers(file);
+    CloseHandle(file);
+    return created;
+}
+
+bool SparseImageBackend::IsSparseImage(const std::string& path)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    UINT32 magic = 0;
+    DWORD transferred = 0;
+    const bool sparse = ReadFile(file, &magic, sizeof(magic), &transferred, nullptr) && transferred == sizeof(magic) && magic == Magic;
+    CloseHandle(file);
+    return sparse;
+}
+
+std::unique_ptr<BlockBackend> SparseImageBackend::OpenImage(const std::string& path, bool readOnly, UINT32 chainDepth)
+{
+    if (IsSparseImage(path))
+    {
+        auto image = std::make_unique<SparseImageBackend>();
+        if (!image->Open(path, readOnly, chainDepth))
+        {
+            return nullptr;
+        }
+        return image;
+    }
+
+    auto image = std::make_unique<RawFileBackend>();
+    if (!image->Open(path, readOnly))
+    {
+        return nullptr;
+    }
+    return image;
+}
+
+bool SparseImageBackend::Open(const std::string& path, bool readOnly, UINT32 chainDepth)
+{
+    Close();
+    if (chainDepth >= MaxChainLength)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Backing chain of " + path + " is longer than " + std::to_string(MaxChainLength));
+        return false;
+    }
+
+    file_ = CreateFileA(path.c_str(), readOnly ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to open the disk image " + path + ", error " + std::to_string(GetLastError()));
+        return false;
+    }
+
+    Header header = {};
+    LARGE_INTEGER fileSize = {};
+    if (!ReadAt(0, &header, sizeof(header)) || !GetFileSizeEx(file_, &fileSize) || header.magic != Magic || header.version != Version
+        || header.clusterBits < MinClusterBits || header.clusterBits > MaxClusterBits
+        || sizeof(Header) + header.backingPathLength > (1ull << header.clusterBits))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Disk image " + path + " has a bad header");
+        Close();
+        return false;
+    }
+
+    clusterBits_ = header.clusterBits;
+    clusterSize_ = 1ull << clusterBits_;
+    l2Bits_ = clusterBits_ - 3;
+    size_ = header.size;
+    l1Offset_ = header.l1Offset;
+    const UINT64 clusters = (size_ + clusterSize_ - 1) >> clusterBits_;
+    if (header.l1Entries < (clusters + (1ull << l2Bits_) - 1) >> l2Bits_)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Disk image " + path + " has a short L1 table");
+        Close();
+        return false;
+    }
+    l1_.resize(header.l1Entries);
+    std::string backingPath(header.backingPathLength, '\0');
+    if (!ReadAt(l1Offset_, l1_.data(), l1_.size() * sizeof(UINT64))
+        || !ReadAt(sizeof(Header), &backingPath[0], backingPath.size()))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to read the metadata of " + path);
+        Close();
+        return false;
+    }
+
+    if (!backingPath.empty())
+    {
+        backing_ = OpenImage(ResolveBackingPath(path, backingPath), true, chainDepth + 1);
+        if (backing_ == nullptr)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to open the backing image " + backingPath + " of " + path);
+            Close();
+            return false;
+        }
+    }
+
+    readOnly_ = readOnly;
+    fileEnd_ = (static_cast<UINT64>(fileSize.QuadPart) + clusterSize_ - 1) & ~(clusterSize_ - 1);
+    logger_.Log(Logger::LogLevel::Info, "Opened the sparse disk image " + path + ", " + std::to_string(size_) + " bytes, "
+        + std::to_string(clusterSize_) + " byte clusters" + (backingPath.empty() ? "" : ", backed by " + backingPath));
+    return true;
+}
+
+void SparseImageBackend::Close()
+{
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+    backing_.reset();
+    l1_.clear();
+    l2Cache_.clear();
+    l2Index_.clear();
+    size_ = 0;
+}
+
+SparseImageBackend::Stats SparseImageBackend::GetStats()
+{
+    Stats stats = {};
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex_);
+        stats.l2Hits = l2Hits_;
+        stats.l2Misses = l2Misses_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(allocationMutex_);
+        stats.allocatedClusters = allocatedClusters_;
+        stats.copiedClusters = copiedClusters_;
+    }
+    const UINT64 lookups = stats.l2Hits + stats.l2Misses;
+    stats.l2HitRatio = lookups > 0 ? static_cast<double>(stats.l2Hits) / static_cast<double>(lookups) : 0.0;
+    return stats;
+}
+
+UINT64 SparseImageBackend::GetSize() const
+{
+    return size_;
+}
+
+bool SparseImageBackend::IsReadOnly() const
+{
+    return readOnly_;
+}
+
+bool SparseImageBackend::Read(UINT64 offset, void* buffer, size_t length)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return false;
+    }
+
+    UINT8* data = static_cast<UINT8*>(buffer);
+    while (length > 0)
+    {
+        UINT64 fileOffset = 0;
+        const size_t run = MapRun(offset, length, fileOffset);
+        if (run == 0 || !(fileOffset != 0 ? ReadAt(fileOffset, data, run) : ReadBacking(offset, data, run)))
+        {
+            return false;
+        }
+        data += run;
+        offset += run;
+        length -= run;
+    }
+    return true;
+}
+
+bool SparseImageBackend::Write(UINT64 offset, const void* buffer, size_t length)
+{
+    if (readOnly_ || offset > size_ || length > size_ - offset)
+    {
+        return false;
+    }
+
+    const UINT8* data = static_cast<const UINT8*>(buffer);
+    while (length > 0)
+    {
+        UINT64 fileOffset = 0;
+        size_t run = MapRun(offset, length, fileOffset);
+        if (run == 0)
+        {
+            return false;
+        }
+        if (fileOffset != 0)
+        {
+            if (!WriteAt(fileOffset, data, run))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            // Unallocated clusters are allocated one at a time, a concurrent writer may have won the race for this one.
+            const UINT64 cluster = offset >> clusterBits_;
+            const size_t inCluster = static_cast<size_t>(offset & (clusterSize_ - 1));
+            run = static_cast<size_t>(std::min<UINT64>(length, clusterSize_ - inCluster));
+            std::lock_guard<std::mutex> lock(allocationMutex_);
+            if (!LookupCluster(cluster, fileOffset))
+            {
+                return false;
+            }
+            const bool written = fileOffset != 0 ? WriteAt(fileOffset + inCluster, data, run) : AllocateCluster(cluster, inCluster, data, run);
+            if (!written)
+            {
+                return false;
+            }
+        }
+        data += run;
+        offset += run;
+        length -= run;
+    }
+    return true;
+}
+
+bool SparseImageBackend::Flush()
+{
+    return readOnly_ || FlushFileBuffers(file_) != FALSE;
+}
+
+bool SparseImageBackend::LookupCluster(UINT64 cluster, UINT64& fileOffset)
+{
+    const UINT64 l1Index = cluster >> l2Bits_;
+    std::lock_guard<std::mutex> lock(cacheMutex_);
+    if (l1Index >= l1_.size())
+    {
+        return false;
+    }
+    if (l1_[l1Index] == 0)
+    {
+        fileOffset = 0;
+        return true;
+    }
+    L2Table* table = GetL2Table(l1Index);
+    if (table == nullptr)
+    {
+        return false;
+    }
+    fileOffset = table->entries[cluster & ((1ull << l2Bits_) - 1)];
+    return true;
+}
+
+size_t SparseImageBackend::MapRun(UINT64 offset, size_t length, UINT64& fileOffset)
+{
+    UINT64 cluster = offset >> clusterBits_;
+    const size_t inCluster = static_cast<size_t>(offset & (clusterSize_ - 1));
+    UINT64 clusterOffset = 0;
+    if (!LookupCluster(cluster, clusterOffset))
+    {
+        return 0;
+    }
+    fileOffset = clusterOffset != 0 ? clusterOffset + inCluster : 0;
+
+    // Sequential allocations leave neighbouring clusters next to each other, one IO covers all of them.
+    size_t run = static_cast<size_t>(std::min<UINT64>(length, clusterSize_ - inCluster));
+    while (run < length)
+    {
+        UINT64 nextOffset = 0;
+        if (!LookupCluster(++cluster, nextOffset) || (nextOffset == 0) != (clusterOffset == 0)
+            || (nextOffset != 0 && nextOffset != fileOffset + run))
+        {
+            break;
+        }
+        run += static_cast<size_t>(std::min<UINT64>(length - run, clusterSize_));
+    }
+    return run;
+}
+
+SparseImageBackend::L2Table* SparseImageBackend::GetL2Table(UINT64 l1Index)
+{
+    auto found = l2Index_.find(l1Index);
+    if (found != l2Index_.end())
+    {
+        l2Hits_++;
+        l2Cache_.splice(l2Cache_.begin(), l2Cache_, found->second);
+        return &l2Cache_.front();
+    }
+
+    l2Misses_++;
+    std::vector<UINT64> entries(static_cast<size_t>(1ull << l2Bits_));
+    if (!ReadAt(l1_[l1Index], entries.data(), entries.size() * sizeof(UINT64)))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to read the L2 table " + std::to_string(l1Index));
+        return nullptr;
+    }
+    if (l2Cache_.size() >= l2CacheTables_)
+    {
+        l2Index_.erase(l2Cache_.back().l1Index);
+        l2Cache_.pop_back();
+    }
+    l2Cache_.push_front({ l1Index, std::move(entries) });
+    l2Index_[l1Index] = l2Cache_.begin();
+    return &l2Cache_.front();
+}
+
+bool SparseImageBackend::AllocateCluster(UINT64 cluster, size_t offset, const UINT8* data, size_t length)
+{
+    // Only a partial first write needs the old contents, a full one replaces the whole cluster.
+    std::vector<UINT8> contents(static_cast<size_t>(clusterSize_), 0);
+    const UINT64 diskOffset = cluster << clusterBits_;
+    if ((offset != 0 || length != clusterSize_) && backing_ != nullptr)
+    {
+        if (!ReadBacking(diskOffset, contents.data(), static_cast<size_t>(std::min(clusterSize_, size_ - diskOffset))))
+        {
+            return false;
+        }
+        copiedClusters_++;
+    }
+    memcpy(contents.data() + offset, data, length);
+
+    const UINT64 l1Index = cluster >> l2Bits_;
+    const size_t l2Index = static_cast<size_t>(cluster & ((1ull << l2Bits_) - 1));
+    UINT64 l2Offset = 0;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex_);
+        l2Offset = l1_[l1Index];
+    }
+    const bool newTable = l2Offset == 0;
+    if (newTable)
+    {
+        std::vector<UINT8> emptyTable(static_cast<size_t>(clusterSize_), 0);
+        if (!WriteAt(fileEnd_, emptyTable.data(), emptyTable.size()))
+        {
+            return false;
+        }
+        l2Offset = fileEnd_;
+        fileEnd_ += clusterSize_;
+    }
+
+    // The data reaches the file before the tables point at it.
+    const UINT64 dataOffset = fileEnd_;
+    if (!WriteAt(dataOffset, contents.data(), contents.size()))
+    {
+        return false;
+    }
+    fileEnd_ += clusterSize_;
+    allocatedClusters_++;
+
+    std::lock_guard<std::mutex> lock(cacheMutex_);
+    if (!WriteAt(l2Offset + l2Index * sizeof(UINT64), &dataOffset, sizeof(dataOffset)))
+    {
+        return false;
+    }
+    if (newTable)
+    {
+        if (!WriteAt(l1Offset_ + l1Index * sizeof(UINT64), &l2Offset, sizeof(l2Offset)))
+        {
+            return false;
+        }
+        l1_[l1Index] = l2Offset;
+    }
+    L2Table* table = GetL2Table(l1Index);
+    if (table == nullptr)
+    {
+        return false;
+    }
+    table->entries[l2Index] = dataOffset;
+    return true;
+}
+
+bool SparseImageBackend::ReadBacking(UINT64 offset, UINT8* buffer, size_t length)
+{
+    const UINT64 backingSize = backing_ != nullptr ? backing_->GetSize() : 0;
+    const size_t covered = offset < backingSize ? static_cast<size_t>(std::min<UINT64>(length, backingSize - offset)) : 0;
+    if (covered > 0 && !backing_->Read(offset, buffer, covered))
+    {
+        return false;
+    }
+    memset(buffer + covered, 0, length - covered);
+    return true;
+}
+
+bool SparseImageBackend::ReadAt(UINT64 offset, void* buffer, size_t length)
+{
+    UINT8* data = static_cast<UINT8*>(buffer);
+    while (length > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD transferred = 0;
+        if (!ReadFile(file_, data, static_cast<DWORD>(std::min(length, MaxTransfer)), &transferred, &overlapped) || transferred == 0)
+        {
+            return false;
+        }
+        data += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+    return true;
+}
+
+bool SparseImageBackend::WriteAt(UINT64 offset, const void* buffer, size_t length)
+{
+    const UINT8* data = static_cast<const UINT8*>(buffer);
+    while (length > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD transferred = 0;
+        if (!WriteFile(file_, data, static_cast<DWORD>(std::min(length, MaxTransfer)), &transferred, &overlapped) || transferred == 0)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Image write at offset " + std::to_string(offset) + " failed, error "
+                + std::to_string(GetLastError()));
+            return false;
+        }
+        data += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+    return true;
+}
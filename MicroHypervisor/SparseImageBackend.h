@@ -0,0 +1,199 @@
+#ifndef SPARSEIMAGEBACKEND_H
+#define SPARSEIMAGEBACKEND_H
+
+#include <Windows.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "BlockBackend.h"
+#include "Logger.h"
+
+/// @brief Sparse copy-on-write disk image, a two-level table maps disk clusters to clusters of the file \class SparseImageBackend
+class SparseImageBackend : public BlockBackend
+{
+public:
+    static constexpr UINT32 Magic = 0x4B44484D;
+    static constexpr UINT32 Version = 1;
+    static constexpr UINT32 DefaultClusterBits = 16;
+    static constexpr size_t DefaultL2CacheTables = 64;
+    static constexpr UINT32 MaxChainLength = 16;
+
+    /**
+     * @brief Image statistics, L2 hits count table lookups served from the cache
+     *
+     */
+    struct Stats
+    {
+        UINT64 l2Hits;
+        UINT64 l2Misses;
+        UINT64 allocatedClusters;
+        UINT64 copiedClusters;
+        double l2HitRatio;
+    };
+
+    SparseImageBackend(size_t l2CacheTables = DefaultL2CacheTables);
+    ~SparseImageBackend();
+
+    /**
+     * @brief Creates an empty image
+     *
+     * @param path -> Path of the new image, an existing file is replaced
+     * @param size -> Size of the disk in bytes, rounded up to whole sectors
+     * @param backingPath -> Image the new one is an overlay of, empty for none, relative paths are relative to the new image
+     * @param clusterBits -> log2 of the cluster size, 12 to 21
+     * @return true -> if the image was created
+     */
+    static bool Create(const std::string& path, UINT64 size, const std::string& backingPath = "", UINT32 clusterBits = DefaultClusterBits);
+
+    /**
+     * @brief Checks if a file starts with the header of a sparse image
+     *
+     */
+    static bool IsSparseImage(const std::string& path);
+
+    /**
+     * @brief Opens a disk image of either format, sparse images by their header and raw images otherwise
+     *
+     * @param path -> Path of the image
+     * @param readOnly -> true to open the image read only
+     * @param chainDepth -> Number of images above this one in a backing chain
+     * @return std::unique_ptr<BlockBackend> -> the opened image, nullptr on failure
+     */
+    static std::unique_ptr<BlockBackend> OpenImage(const std::string& path, bool readOnly, UINT32 chainDepth = 0);
+
+    /**
+     * @brief Opens a sparse image and its backing chain, backing images are always read only
+     *
+     * @param path -> Path of the image
+     * @param readOnly -> true to open the image read only
+     * @param chainDepth -> Number of images above this one in a backing chain
+     * @return true -> if the image and its backing chain were opened
+     */
+    bool Open(const std::string& path, bool readOnly, UINT32 chainDepth = 0);
+
+    /**
+     * @brief Closes the image and its backing chain
+     *
+     */
+    void Close();
+
+    /**
+     * @brief Gets the image statistics
+     *
+     */
+    Stats GetStats();
+
+    UINT64 GetSize() const override;
+    bool IsReadOnly() const override;
+    bool Read(UINT64 offset, void* buffer, size_t length) override;
+    bool Write(UINT64 offset, const void* buffer, size_t length) override;
+    bool Flush() override;
+
+private:
+    /**
+     * @brief On-disk header at offset 0, the backing file path follows it
+     *
+     */
+    struct Header
+    {
+        UINT32 magic;
+        UINT32 version;
+        UINT32 clusterBits;
+        UINT32 backingPathLength;
+        UINT64 size;
+        UINT64 l1Offset;
+        UINT32 l1Entries;
+        UINT32 reserved;
+    };
+
+    /**
+     * @brief A cached L2 table, l1Index identifies it
+     *
+     */
+    struct L2Table
+    {
+        UINT64 l1Index;
+        std::vector<UINT64> entries;
+    };
+
+    /**
+     * @brief Gets the file offset of a disk cluster
+     *
+     * @param cluster -> Index of the disk cluster
+     * @param fileOffset -> receives the offset of the cluster in the file, 0 if it is not allocated
+     * @return true -> if the mapping was read
+     */
+    bool LookupCluster(UINT64 cluster, UINT64& fileOffset);
+
+    /**
+     * @brief Maps the start of a range to a run of clusters that are either all unallocated or contiguous in the file
+     *
+     * @param offset -> Disk offset of the range
+     * @param length -> Length of the range
+     * @param fileOffset -> receives the file offset of the run, 0 if the run is not allocated
+     * @return size_t -> length of the run, 0 if the mapping could not be read
+     */
+    size_t MapRun(UINT64 offset, size_t length, UINT64& fileOffset);
+
+    /**
+     * @brief Gets an L2 table from the cache, reading it on a miss and evicting the least recently used table,
+     *        called with cacheMutex_ held
+     *
+     * @return L2Table* -> the table, nullptr if it could not be read
+     */
+    L2Table* GetL2Table(UINT64 l1Index);
+
+    /**
+     * @brief Allocates a disk cluster and writes its first data, called with allocationMutex_ held
+     *
+     * @param cluster -> Index of the disk cluster
+     * @param offset -> Offset of the data in the cluster
+     * @param data -> Data to write
+     * @param length -> Length of the data, the rest of the cluster comes from the backing image
+     * @return true -> if the cluster was allocated
+     */
+    bool AllocateCluster(UINT64 cluster, size_t offset, const UINT8* data, size_t length);
+
+    /**
+     * @brief Reads the part of a range covered by the backing image, zeros elsewhere
+     *
+     */
+    bool ReadBacking(UINT64 offset, UINT8* buffer, size_t length);
+
+    /**
+     * @brief Positioned IO on the image file
+     *
+     */
+    bool ReadAt(UINT64 offset, void* buffer, size_t length);
+    bool WriteAt(UINT64 offset, const void* buffer, size_t length);
+
+    HANDLE file_;
+    bool readOnly_;
+    UINT64 size_;
+    UINT32 clusterBits_;
+    UINT64 clusterSize_;
+    UINT32 l2Bits_;
+    UINT64 l1Offset_;
+    std::vector<UINT64> l1_;
+    std::unique_ptr<BlockBackend> backing_;
+
+    std::mutex cacheMutex_;
+    size_t l2CacheTables_;
+    std::list<L2Table> l2Cache_;
+    std::unordered_map<UINT64, std::list<L2Table>::iterator> l2Index_;
+
+    std::mutex allocationMutex_;
+    UINT64 fileEnd_;
+
+    UINT64 l2Hits_;
+    UINT64 l2Misses_;
+    UINT64 allocatedClusters_;
+    UINT64 copiedClusters_;
+
+    Logger logger_;
+};
+
+#endif // SPARSEIMAGEBACKEND_H
\ No newline at end of file
@@ -0,0 +1,171 @@
+#define NOMINMAX
+#include "Trace.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    constexpr char Magic[4] = { 'M', 'H', 'T', 'R' };
+    constexpr UINT32 Version = 1;
+
+    const char* const EventNames[] = { "Exit", "IoFastPath", "IoCallback", "MmioFastPath", "MmioCallback", "TranslateGva" };
+    static_assert(std::size(EventNames) == static_cast<size_t>(Trace::EventId::Count), "Every trace event needs a name");
+
+    /**
+     * @brief TSC and QPC read together, two of them convert TSC timestamps to time when decoding
+     *
+     */
+    struct ClockPair
+    {
+        UINT64 tsc;
+        UINT64 qpc;
+    };
+
+    struct FileHeader
+    {
+        char magic[4];
+        UINT32 version;
+        UINT32 threadCount;
+        UINT32 recordSize;
+        ClockPair start;
+        ClockPair end;
+        UINT64 qpcFrequency;
+    };
+
+    struct ThreadHeader
+    {
+        UINT32 threadId;
+        UINT32 recordCount;
+    };
+
+    ClockPair ReadClocks()
+    {
+        LARGE_INTEGER qpc;
+        QueryPerformanceCounter(&qpc);
+        return { __rdtsc(), static_cast<UINT64>(qpc.QuadPart) };
+    }
+
+    // Rings are never freed, a thread that exited still has its events dumped.
+    std::mutex& GetRegistryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    std::vector<Trace::ThreadBuffer*>& GetRegistry()
+    {
+        static std::vector<Trace::ThreadBuffer*> buffers;
+        return buffers;
+    }
+
+    ClockPair& GetStartClocks()
+    {
+        static ClockPair start = ReadClocks();
+        return start;
+    }
+}
+
+Trace::ThreadBuffer* Trace::AcquireThreadBuffer()
+{
+    GetStartClocks();
+    ThreadBuffer* buffer = new ThreadBuffer();
+    buffer->threadId = GetCurrentThreadId();
+    buffer->head = 0;
+
+    std::lock_guard<std::mutex> lock(GetRegistryMutex());
+    GetRegistry().push_back(buffer);
+    return buffer;
+}
+
+bool Trace::Dump(const std::string& path)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(GetRegistryMutex());
+    const auto& buffers = GetRegistry();
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    FileHeader header = {};
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.threadCount = static_cast<UINT32>(buffers.size());
+    header.recordSize = sizeof(Record);
+    header.start = GetStartClocks();
+    header.end = ReadClocks();
+    header.qpcFrequency = static_cast<UINT64>(frequency.QuadPart);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (const ThreadBuffer* buffer : buffers)
+    {
+        const UINT64 head = buffer->head.load(std::memory_order_acquire);
+        const UINT64 count = std::min<UINT64>(head, Capacity);
+        ThreadHeader threadHeader = { buffer->threadId, static_cast<UINT32>(count) };
+        file.write(reinterpret_cast<const char*>(&threadHeader), sizeof(threadHeader));
+        // Oldest first, the ring may have wrapped.
+        for (UINT64 i = head - count; i < head; ++i)
+        {
+            file.write(reinterpret_cast<const char*>(&buffer->records[i & (Capacity - 1)]), sizeof(Record));
+        }
+    }
+    return file.good();
+}
+
+bool Trace::Decode(const std::string& path, std::ostream& output)
+{
+    std::ifstream file(path, std::ios::binary);
+    FileHeader header = {};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, Magic, sizeof(Magic)) != 0
+        || header.version != Version || header.recordSize != sizeof(Record))
+    {
+        return false;
+    }
+
+    struct Event
+    {
+        UINT32 threadId;
+        Record record;
+    };
+    std::vector<Event> events;
+    for (UINT32 thread = 0; thread < header.threadCount; ++thread)
+    {
+        ThreadHeader threadHeader = {};
+        if (!file.read(reinterpret_cast<char*>(&threadHeader), sizeof(threadHeader)))
+        {
+            return false;
+        }
+        for (UINT32 i = 0; i < threadHeader.recordCount; ++i)
+        {
+            Event event = { threadHeader.threadId, {} };
+            if (!file.read(reinterpret_cast<char*>(&event.record), sizeof(Record)))
+            {
+                return false;
+            }
+            events.push_back(event);
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+        [](const Event& left, const Event& right) { return left.record.timestamp < right.record.timestamp; });
+
+    // TSC ticks per microsecond, from the clock pairs taken at the first event and at the dump.
+    const double seconds = header.qpcFrequency != 0 ? double(header.end.qpc - header.start.qpc) / double(header.qpcFrequency) : 0.0;
+    const double ticksPerMicrosecond = seconds > 0.0 ? double(header.end.tsc - header.start.tsc) / (seconds * 1e6) : 1.0;
+
+    for (const Event& event : events)
+    {
+        const Record& record = event.record;
+        const UINT32 id = static_cast<UINT32>(record.id);
+        const double microseconds = double(INT64(record.timestamp - header.start.tsc)) / ticksPerMicrosecond;
+        output << std::fixed << std::setprecision(3) << std::setw(14) << microseconds << " us  tid " << std::dec << event.threadId
+            << "  " << (id < std::size(EventNames) ? EventNames[id] : "Unknown") << std::hex
+            << "  0x" << record.arg0 << " 0x" << record.arg1 << " 0x" << record.arg2 << std::dec << "\n";
+    }
+    return true;
+}
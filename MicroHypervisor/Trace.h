@@ -0,0 +1,104 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Windows.h>
+#include <intrin.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+
+/// @brief Binary tracing of the exit hot path into per-thread rings, compiled in with MICROHYPERVISOR_TRACE \class Trace
+class Trace
+{
+public:
+    /**
+     * @brief Trace points, the meaning of the arguments is listed per event
+     *
+     */
+    enum class EventId : UINT32
+    {
+        Exit,           // exit reason, RIP, vCPU index
+        IoFastPath,     // port | size << 16 | write << 24, value
+        IoCallback,     // port | size << 16 | write << 24, value
+        MmioFastPath,   // size | write << 8, GPA, value
+        MmioCallback,   // size | write << 8, GPA, value
+        TranslateGva,   // result code, GVA, GPA
+        Count
+    };
+
+    /**
+     * @brief One fixed-size event, the timestamp is the TSC
+     *
+     */
+    struct Record
+    {
+        UINT64 timestamp;
+        EventId id;
+        UINT32 arg0;
+        UINT64 arg1;
+        UINT64 arg2;
+    };
+
+    static constexpr size_t Capacity = 1 << 14;
+
+    /**
+     * @brief Ring of one thread, only the owning thread writes it
+     *
+     */
+    struct ThreadBuffer
+    {
+        UINT32 threadId;
+        std::atomic<UINT64> head;
+        Record records[Capacity];
+    };
+
+    /**
+     * @brief Appends an event to the ring of the calling thread, the oldest events are overwritten
+     *
+     */
+    static void Emit(EventId id, UINT32 arg0, UINT64 arg1, UINT64 arg2)
+    {
+        thread_local ThreadBuffer* buffer = nullptr;
+        if (buffer == nullptr)
+        {
+            buffer = AcquireThreadBuffer();
+        }
+        const UINT64 head = buffer->head.load(std::memory_order_relaxed);
+        buffer->records[head & (Capacity - 1)] = { __rdtsc(), id, arg0, arg1, arg2 };
+        buffer->head.store(head + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Writes the rings of all threads to a binary trace file, call it once the vCPUs are stopped
+     *
+     * @param path -> Path of the trace file
+     * @return true -> if the file was written
+     */
+    static bool Dump(const std::string& path);
+
+    /**
+     * @brief Decodes a trace file into one text line per event, ordered by time
+     *
+     * @param path -> Path of the trace file
+     * @param output -> Stream that receives the text
+     * @return true -> if the file was decoded
+     */
+    static bool Decode(const std::string& path, std::ostream& output);
+
+private:
+    /**
+     * @brief Allocates and registers the ring of the calling thread
+     *
+     */
+    static ThreadBuffer* AcquireThreadBuffer();
+};
+
+#ifdef MICROHYPERVISOR_TRACE
+#define MH_TRACE(id, arg0, arg1, arg2) \
+    Trace::Emit(Trace::EventId::id, static_cast<UINT32>(arg0), static_cast<UINT64>(arg1), static_cast<UINT64>(arg2))
+#else
+// The arguments are not evaluated when tracing is compiled out.
+#define MH_TRACE(id, arg0, arg1, arg2) ((void)0)
+#endif
+
+#endif // TRACE_H
\ No newline at end of file
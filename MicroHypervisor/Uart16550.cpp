@@ -0,0 +1,360 @@
+#include "Uart16550.h"
+#include "InterruptController.h"
+#include "ConsoleSink.h"
+
+namespace
+{
+    constexpr UINT8 LineControlDlab = 0x80;
+
+    constexpr UINT8 InterruptEnableReceive = 0x01;
+    constexpr UINT8 InterruptEnableTransmit = 0x02;
+
+    constexpr UINT8 IdentificationNone = 0x01;
+    constexpr UINT8 IdentificationTransmitEmpty = 0x02;
+    constexpr UINT8 IdentificationReceiveData = 0x04;
+    constexpr UINT8 IdentificationCharacterTimeout = 0x0C;
+    constexpr UINT8 IdentificationFifoEnabled = 0xC0;
+
+    constexpr UINT8 FifoControlEnable = 0x01;
+    constexpr UINT8 FifoControlClearReceive = 0x02;
+
+    constexpr UINT8 ModemControlOut2 = 0x08;
+    constexpr UINT8 ModemControlLoopback = 0x10;
+
+    constexpr UINT8 LineStatusDataReady = 0x01;
+    constexpr UINT8 LineStatusTransmitEmpty = 0x20;
+    constexpr UINT8 LineStatusTransmitterIdle = 0x40;
+
+    // DCD, DSR and CTS asserted, the host side is always ready.
+    constexpr UINT8 ModemStatusConnected = 0xB0;
+
+    constexpr size_t TriggerLevels[] = { 1, 4, 8, 14 };
+}
+
+Uart16550::Uart16550(InterruptController* interruptController, UINT16 basePort, UINT32 irq)
+    : interruptController_(interruptController), basePort_(basePort), irq_(irq), interruptEnable_(0), lineControl_(0x03),
+    modemControl_(0), fifoControl_(0), scratch_(0), divisor_(1), transmitInterruptPending_(false), irqLevel_(false),
+    outputRing_(RingSize), inputRing_(RingSize), outputBlocked_(false), draining_(false), sink_(nullptr),
+    txBytes_(0), rxBytes_(0), ioExits_(0), startTime_(std::chrono::steady_clock::now()), logger_("Uart16550.log")
+{
+
+}
+
+Uart16550::~Uart16550()
+{
+    StopConsole();
+}
+
+bool Uart16550::RegisterIoPorts(IoBus& ioBus)
+{
+    return ioBus.Register(basePort_, 8, this, "uart16550");
+}
+
+UINT8 Uart16550::In8(UINT16 port)
+{
+    ioExits_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    UINT8 value = 0xFF;
+    switch (static_cast<Register>(port - basePort_))
+    {
+    case Data:
+        if (lineControl_ & LineControlDlab)
+        {
+            value = static_cast<UINT8>(divisor_);
+            break;
+        }
+        FillReceiveFifo();
+        value = 0;
+        if (!receiveFifo_.empty())
+        {
+            value = receiveFifo_.front();
+            receiveFifo_.pop_front();
+            rxBytes_++;
+            FillReceiveFifo();
+        }
+        UpdateInterrupt();
+        break;
+    case InterruptEnable:
+        value = (lineControl_ & LineControlDlab) ? static_cast<UINT8>(divisor_ >> 8) : interruptEnable_;
+        break;
+    case InterruptIdentification:
+        FillReceiveFifo();
+        value = GetInterruptIdentification();
+        // Reading the IIR acknowledges a transmitter empty interrupt.
+        if (value == IdentificationTransmitEmpty)
+        {
+            transmitInterruptPending_ = false;
+            UpdateInterrupt();
+        }
+        if (fifoControl_ & FifoControlEnable)
+        {
+            value |= IdentificationFifoEnabled;
+        }
+        break;
+    case LineControl:
+        value = lineControl_;
+        break;
+    case ModemControl:
+        value = modemControl_;
+        break;
+    case LineStatus:
+        FillReceiveFifo();
+        value = receiveFifo_.empty() ? 0 : LineStatusDataReady;
+        if (outputRing_.Size() < outputRing_.Capacity())
+        {
+            value |= LineStatusTransmitEmpty | LineStatusTransmitterIdle;
+        }
+        break;
+    case ModemStatus:
+        if (modemControl_ & ModemControlLoopback)
+        {
+            // RTS -> CTS, DTR -> DSR, OUT1 -> RI, OUT2 -> DCD.
+            value = static_cast<UINT8>(((modemControl_ & 0x02) << 3) | ((modemControl_ & 0x01) << 5)
+                | ((modemControl_ & 0x04) << 4) | ((modemControl_ & 0x08) << 4));
+        }
+        else
+        {
+            value = ModemStatusConnected;
+        }
+        break;
+    case Scratch:
+        value = scratch_;
+        break;
+    }
+    return value;
+}
+
+void Uart16550::Out8(UINT16 port, UINT8 value)
+{
+    ioExits_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    switch (static_cast<Register>(port - basePort_))
+    {
+    case Data:
+        if (lineControl_ & LineControlDlab)
+        {
+            divisor_ = static_cast<UINT16>((divisor_ & 0xFF00) | value);
+            break;
+        }
+        Transmit(value);
+        UpdateInterrupt();
+        break;
+    case InterruptEnable:
+        if (lineControl_ & LineControlDlab)
+        {
+            divisor_ = static_cast<UINT16>((divisor_ & 0x00FF) | (value << 8));
+            break;
+        }
+        // Enabling the transmitter interrupt with an empty THR raises it right away.
+        if ((value & InterruptEnableTransmit) && !(interruptEnable_ & InterruptEnableTransmit))
+        {
+            transmitInterruptPending_ = outputRing_.Size() < outputRing_.Capacity();
+        }
+        interruptEnable_ = value & 0x0F;
+        UpdateInterrupt();
+        break;
+    case InterruptIdentification:
+        if ((value & FifoControlClearReceive) || ((value ^ fifoControl_) & FifoControlEnable))
+        {
+            receiveFifo_.clear();
+        }
+        fifoControl_ = value & 0xC9;
+        FillReceiveFifo();
+        UpdateInterrupt();
+        break;
+    case LineControl:
+        lineControl_ = value;
+        break;
+    case ModemControl:
+        modemControl_ = value & 0x1F;
+        UpdateInterrupt();
+        break;
+    case Scratch:
+        scratch_ = value;
+        break;
+    default:
+        break;
+    }
+}
+
+bool Uart16550::StartConsole(ConsoleSink* sink)
+{
+    if (draining_)
+    {
+        return true;
+    }
+    if (sink == nullptr)
+    {
+        return false;
+    }
+
+    sink_ = sink;
+    startTime_ = std::chrono::steady_clock::now();
+    draining_ = true;
+    drainThread_ = std::thread(&Uart16550::DrainOutput, this);
+    logger_.Log(Logger::LogLevel::Info, "Serial console started on port " + std::to_string(basePort_));
+    return true;
+}
+
+void Uart16550::StopConsole()
+{
+    draining_ = false;
+    if (drainThread_.joinable())
+    {
+        drainThread_.join();
+    }
+}
+
+size_t Uart16550::SendInput(const UINT8* data, size_t size)
+{
+    size_t queued = inputRing_.Push(data, size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    FillReceiveFifo();
+    UpdateInterrupt();
+    return queued;
+}
+
+Uart16550::Stats Uart16550::GetStats()
+{
+    Stats stats = {};
+    stats.txBytes = txBytes_;
+    stats.rxBytes = rxBytes_;
+    stats.ioExits = ioExits_;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    stats.txBytesPerSecond = seconds > 0.0 ? static_cast<double>(stats.txBytes) / seconds : 0.0;
+    UINT64 bytes = stats.txBytes + stats.rxBytes;
+    stats.exitsPerByte = bytes > 0 ? static_cast<double>(stats.ioExits) / static_cast<double>(bytes) : 0.0;
+    return stats;
+}
+
+void Uart16550::SaveState(std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    state = { interruptEnable_, lineControl_, modemControl_, fifoControl_, scratch_,
+        static_cast<UINT8>(divisor_), static_cast<UINT8>(divisor_ >> 8), static_cast<UINT8>(transmitInterruptPending_ ? 1 : 0),
+        static_cast<UINT8>(receiveFifo_.size()) };
+    state.insert(state.end(), receiveFifo_.begin(), receiveFifo_.end());
+}
+
+bool Uart16550::LoadState(const std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state.size() < 9 || state.size() != 9u + state[8] || state[8] > FifoSize)
+    {
+        logger_.Log(Logger::LogLevel::Error, "UART state has the wrong size " + std::to_string(state.size()));
+        return false;
+    }
+
+    interruptEnable_ = state[0];
+    lineControl_ = state[1];
+    modemControl_ = state[2];
+    fifoControl_ = state[3];
+    scratch_ = state[4];
+    divisor_ = static_cast<UINT16>(state[5] | (state[6] << 8));
+    transmitInterruptPending_ = state[7] != 0;
+    receiveFifo_.assign(state.begin() + 9, state.end());
+    UpdateInterrupt();
+    return true;
+}
+
+void Uart16550::FillReceiveFifo()
+{
+    // Loopback mode only receives what the guest transmits.
+    if (modemControl_ & ModemControlLoopback)
+    {
+        return;
+    }
+
+    const size_t limit = (fifoControl_ & FifoControlEnable) ? FifoSize : 1;
+    UINT8 value;
+    while (receiveFifo_.size() < limit && inputRing_.TryPop(value))
+    {
+        receiveFifo_.push_back(value);
+    }
+}
+
+UINT8 Uart16550::GetInterruptIdentification()
+{
+    if ((interruptEnable_ & InterruptEnableReceive) && !receiveFifo_.empty())
+    {
+        // Below the trigger level the data is reported as a character timeout, the host ring has no line timing.
+        const bool fifoEnabled = (fifoControl_ & FifoControlEnable) != 0;
+        return fifoEnabled && receiveFifo_.size() < TriggerLevels[fifoControl_ >> 6]
+            ? IdentificationCharacterTimeout : IdentificationReceiveData;
+    }
+    if ((interruptEnable_ & InterruptEnableTransmit) && transmitInterruptPending_)
+    {
+        return IdentificationTransmitEmpty;
+    }
+    return IdentificationNone;
+}
+
+void Uart16550::UpdateInterrupt()
+{
+    const bool level = GetInterruptIdentification() != IdentificationNone && (modemControl_ & ModemControlOut2);
+    if (level != irqLevel_)
+    {
+        irqLevel_ = level;
+        if (interruptController_ != nullptr)
+        {
+            interruptController_->SetIrq(irq_, level);
+        }
+    }
+}
+
+void Uart16550::Transmit(UINT8 value)
+{
+    if (modemControl_ & ModemControlLoopback)
+    {
+        const size_t limit = (fifoControl_ & FifoControlEnable) ? FifoSize : 1;
+        if (receiveFifo_.size() < limit)
+        {
+            receiveFifo_.push_back(value);
+        }
+        transmitInterruptPending_ = true;
+        return;
+    }
+
+    // A full output ring keeps THRE clear, the drain thread raises the interrupt once there is room again.
+    if (!outputRing_.TryPush(value))
+    {
+        outputBlocked_ = true;
+        return;
+    }
+    txBytes_++;
+    transmitInterruptPending_ = true;
+}
+
+void Uart16550::DrainOutput()
+{
+    std::vector<UINT8> buffer(4096);
+    while (true)
+    {
+        size_t count = outputRing_.Pop(buffer.data(), buffer.size());
+        if (count == 0)
+        {
+            // Transmit may flag a full ring after the last pop saw it clear, the empty ring has room for it.
+            if (outputBlocked_.exchange(false))
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                transmitInterruptPending_ = true;
+                UpdateInterrupt();
+            }
+            if (!draining_)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        sink_->Write(reinterpret_cast<const char*>(buffer.data()), count);
+
+        if (outputBlocked_.exchange(false))
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            transmitInterruptPending_ = true;
+            UpdateInterrupt();
+        }
+    }
+}
@@ -0,0 +1,178 @@
+#ifndef UART16550_H
+#define UART16550_H
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "IoBus.h"
+#include "RingBuffer.h"
+#include "Logger.h"
+
+class InterruptController;
+class ConsoleSink;
+
+/// @brief 16550A UART on the IO bus, the host side of the console is a pair of lock-free rings \class Uart16550
+class Uart16550 : public IoDevice
+{
+public:
+    static constexpr UINT16 Com1Port = 0x3F8;
+    static constexpr UINT32 Com1Irq = 4;
+
+    /**
+     * @brief Register offsets from the base port, RBR/THR/IER are the divisor latch when LCR.DLAB is set
+     *
+     */
+    enum Register : UINT16
+    {
+        Data = 0,
+        InterruptEnable = 1,
+        InterruptIdentification = 2,
+        LineControl = 3,
+        ModemControl = 4,
+        LineStatus = 5,
+        ModemStatus = 6,
+        Scratch = 7
+    };
+
+    /**
+     * @brief Console statistics, IO exits per byte compares the UART with a paravirtual console
+     *
+     */
+    struct Stats
+    {
+        UINT64 txBytes;
+        UINT64 rxBytes;
+        UINT64 ioExits;
+        double txBytesPerSecond;
+        double exitsPerByte;
+    };
+
+    Uart16550(InterruptController* interruptController, UINT16 basePort = Com1Port, UINT32 irq = Com1Irq);
+    ~Uart16550();
+
+    /**
+     * @brief Claims the 8 ports of the UART
+     *
+     * @param ioBus -> Bus of the guest
+     * @return true -> if the ports were claimed
+     */
+    bool RegisterIoPorts(IoBus& ioBus);
+
+    UINT8 In8(UINT16 port) override;
+    void Out8(UINT16 port, UINT8 value) override;
+
+    /**
+     * @brief Starts the host thread that drains the guest output
+     *
+     * @param sink -> ConsoleSink*, receives the output
+     * @return true -> if the console started
+     */
+    bool StartConsole(ConsoleSink* sink);
+
+    /**
+     * @brief Stops the host thread after draining the remaining output
+     *
+     */
+    void StopConsole();
+
+    /**
+     * @brief Queues host input for the guest, called from one host thread
+     *
+     * @param data -> Bytes to send
+     * @param size -> Number of bytes
+     * @return size_t -> number of bytes queued, less than size when the input ring is full
+     */
+    size_t SendInput(const UINT8* data, size_t size);
+
+    /**
+     * @brief Gets the console statistics
+     *
+     */
+    Stats GetStats();
+
+    /**
+     * @brief Serializes the registers and the receive FIFO
+     *
+     * @param state -> receives the state
+     */
+    void SaveState(std::vector<UINT8>& state);
+
+    /**
+     * @brief Restores the state written by SaveState
+     *
+     * @param state -> the state
+     * @return true -> if the state was restored
+     */
+    bool LoadState(const std::vector<UINT8>& state);
+
+private:
+    static constexpr size_t FifoSize = 16;
+    static constexpr size_t RingSize = 64 * 1024;
+
+    /**
+     * @brief Refills the receive FIFO from the host input ring, the ring holds back what does not fit
+     *
+     */
+    void FillReceiveFifo();
+
+    /**
+     * @brief Gets the highest priority pending interrupt as an IIR value
+     *
+     */
+    UINT8 GetInterruptIdentification();
+
+    /**
+     * @brief Drives the IRQ line from the pending interrupts, gated by MCR.OUT2
+     *
+     */
+    void UpdateInterrupt();
+
+    /**
+     * @brief Transmits a byte, into the receive FIFO in loopback mode and into the output ring otherwise
+     *
+     */
+    void Transmit(UINT8 value);
+
+    /**
+     * @brief Host thread, moves the output ring into the console sink
+     *
+     */
+    void DrainOutput();
+
+    InterruptController* interruptController_;
+    UINT16 basePort_;
+    UINT32 irq_;
+
+    std::mutex mutex_;
+    UINT8 interruptEnable_;
+    UINT8 lineControl_;
+    UINT8 modemControl_;
+    UINT8 fifoControl_;
+    UINT8 scratch_;
+    UINT16 divisor_;
+    bool transmitInterruptPending_;
+    bool irqLevel_;
+    std::deque<UINT8> receiveFifo_;
+
+    RingBuffer<UINT8> outputRing_;
+    RingBuffer<UINT8> inputRing_;
+    std::atomic<bool> outputBlocked_;
+
+    std::thread drainThread_;
+    std::atomic<bool> draining_;
+    ConsoleSink* sink_;
+
+    std::atomic<UINT64> txBytes_;
+    std::atomic<UINT64> rxBytes_;
+    std::atomic<UINT64> ioExits_;
+    std::chrono::steady_clock::time_point startTime_;
+
+    Logger logger_;
+};
+
+#endif // UART16550_H
\ No newline at end of file
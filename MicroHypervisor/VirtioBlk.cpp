@@ -0,0 +1,420 @@
+#define NOMINMAX
+#include "VirtioBlk.h"
+#include <algorithm>
+#include "MemoryManager.h"
+
+namespace
+{
+    constexpr UINT32 DeviceIdBlock = 2;
+
+    constexpr UINT64 FeatureSegMax = 1ull << 2;
+    constexpr UINT64 FeatureReadOnly = 1ull << 5;
+    constexpr UINT64 FeatureBlockSize = 1ull << 6;
+    constexpr UINT64 FeatureFlush = 1ull << 9;
+
+    constexpr UINT32 RequestIn = 0;
+    constexpr UINT32 RequestOut = 1;
+    constexpr UINT32 RequestFlush = 4;
+    constexpr UINT32 RequestGetId = 8;
+
+    constexpr UINT8 StatusOk = 0;
+    constexpr UINT8 StatusIoError = 1;
+    constexpr UINT8 StatusUnsupported = 2;
+
+    constexpr size_t HeaderSize = 16;
+    constexpr size_t IdSize = 20;
+    constexpr char DiskId[] = "microhv-vblk";
+
+    // The used ring is published at the latest every CompletionBatch completions, sooner when the disk goes idle.
+    constexpr UINT32 CompletionBatch = 16;
+}
+
+VirtioBlk::VirtioBlk(MemoryManager* memoryManager, InterruptController* interruptController, UINT32 gsi, UINT32 ioThreads)
+    : VirtioMmioDevice(memoryManager, interruptController, DeviceIdBlock, 1, QueueSize, gsi, "VirtioBlk"),
+    backend_(nullptr), ioThreadCount_(std::max(ioThreads, 1u)), stopping_(false), inFlight_(0), unpublished_(0), active_(0), requests_(0),
+    bytes_(0), interrupts_(0), errors_(0), submitted_(0), depthSum_(0), maxInFlight_(0), startTime_(std::chrono::steady_clock::now())
+{
+
+}
+
+VirtioBlk::~VirtioBlk()
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        stopping_ = true;
+    }
+    pendingCv_.notify_all();
+    for (std::thread& thread : ioThreads_)
+    {
+        thread.join();
+    }
+}
+
+bool VirtioBlk::Attach(BlockBackend* backend)
+{
+    if (backend == nullptr || !ioThreads_.empty())
+    {
+        return false;
+    }
+    backend_ = backend;
+
+    // capacity, size_max, seg_max, geometry and blk_size of struct virtio_blk_config.
+    std::vector<UINT8> config(24, 0);
+    const UINT64 capacity = backend_->GetSize() / BlockBackend::SectorSize;
+    const UINT32 segMax = QueueSize - 2;
+    const UINT32 blockSize = BlockBackend::SectorSize;
+    memcpy(config.data(), &capacity, sizeof(capacity));
+    memcpy(config.data() + 12, &segMax, sizeof(segMax));
+    memcpy(config.data() + 20, &blockSize, sizeof(blockSize));
+    SetConfig(config);
+
+    for (UINT32 i = 0; i < ioThreadCount_; i++)
+    {
+        ioThreads_.emplace_back(&VirtioBlk::IoThread, this);
+    }
+    startTime_ = std::chrono::steady_clock::now();
+    logger_.Log(Logger::LogLevel::Info, "Disk attached, " + std::to_string(capacity) + " sectors, "
+        + std::to_string(ioThreadCount_) + " IO threads");
+    return true;
+}
+
+VirtioBlk::Stats VirtioBlk::GetStats()
+{
+    Stats stats = {};
+    stats.requests = requests_;
+    stats.bytes = bytes_;
+    stats.interrupts = interrupts_;
+    stats.errors = errors_;
+    stats.queueDepth = inFlight_;
+    stats.maxQueueDepth = maxInFlight_;
+    const UINT64 submitted = submitted_;
+    stats.averageQueueDepth = submitted > 0 ? static_cast<double>(depthSum_) / static_cast<double>(submitted) : 0.0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    stats.iops = seconds > 0.0 ? static_cast<double>(stats.requests) / seconds : 0.0;
+    stats.bytesPerSecond = seconds > 0.0 ? static_cast<double>(stats.bytes) / seconds : 0.0;
+    stats.requestsPerInterrupt = stats.interrupts > 0 ? static_cast<double>(stats.requests) / static_cast<double>(stats.interrupts) : 0.0;
+    return stats;
+}
+
+void VirtioBlk::SaveState(std::vector<UINT8>& state)
+{
+    WaitIdle();
+    VirtioMmioDevice::SaveState(state);
+}
+
+bool VirtioBlk::LoadState(const std::vector<UINT8>& state)
+{
+    WaitIdle();
+    return VirtioMmioDevice::LoadState(state);
+}
+
+UINT64 VirtioBlk::GetDeviceFeatures() const
+{
+    UINT64 features = FeatureSegMax | FeatureBlockSize | FeatureFlush;
+    if (backend_ != nullptr && backend_->IsReadOnly())
+    {
+        features |= FeatureReadOnly;
+    }
+    return features;
+}
+
+void VirtioBlk::OnQueueNotify(UINT32 queueIndex)
+{
+    if (backend_ == nullptr)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(submitMutex_);
+    ProcessQueue();
+}
+
+void VirtioBlk::OnReset()
+{
+    WaitIdle();
+}
+
+bool VirtioBlk::ParseRequest(const Virtqueue::Chain& chain, Request& request)
+{
+    request.head = chain.head;
+    request.segments.clear();
+    request.dataLength = 0;
+    request.status = nullptr;
+
+    // The status byte is the last byte of the chain.
+    if (chain.buffers.empty() || !chain.buffers.back().deviceWritable || chain.buffers.back().length == 0)
+    {
+        return false;
+    }
+    request.status = chain.buffers.back().data + chain.buffers.back().length - 1;
+
+    // The header may span descriptors, the driver is free to lay the request out as it likes.
+    UINT8 header[HeaderSize];
+    size_t headerBytes = 0;
+    bool writable = false;
+    for (size_t i = 0; i < chain.buffers.size(); i++)
+    {
+        const Virtqueue::Buffer& buffer = chain.buffers[i];
+        size_t length = buffer.length - (i + 1 == chain.buffers.size() ? 1 : 0);
+        size_t offset = 0;
+        if (headerBytes < HeaderSize)
+        {
+            if (buffer.deviceWritable)
+            {
+                return false;
+            }
+            offset = std::min(length, HeaderSize - headerBytes);
+            memcpy(header + headerBytes, buffer.data, offset);
+            headerBytes += offset;
+        }
+        if (offset == length)
+        {
+            continue;
+        }
+
+        // Every data buffer moves in the same direction, and adjacent guest buffers are adjacent on the host.
+        UINT8* data = buffer.data + offset;
+        length -= offset;
+        if (request.segments.empty())
+        {
+            writable = buffer.deviceWritable;
+        }
+        else if (buffer.deviceWritable != writable)
+        {
+            return false;
+        }
+        if (!request.segments.empty() && request.segments.back().data + request.segments.back().length == data)
+        {
+            request.segments.back().length += length;
+        }
+        else
+        {
+            request.segments.push_back({ data, length });
+        }
+        request.dataLength += length;
+    }
+    if (headerBytes < HeaderSize)
+    {
+        return false;
+    }
+
+    memcpy(&request.type, header, sizeof(request.type));
+    memcpy(&request.sector, header + 8, sizeof(request.sector));
+    switch (request.type)
+    {
+    case RequestIn:
+    case RequestGetId:
+        return request.dataLength == 0 || writable;
+    case RequestOut:
+        return request.dataLength == 0 || !writable;
+    default:
+        return true;
+    }
+}
+
+void VirtioBlk::ProcessQueue()
+{
+    Virtqueue& queue = GetQueue(0);
+    Virtqueue::Chain chain;
+    std::vector<Request> batch;
+    UINT32 rejected = 0;
+    while (true)
+    {
+        queue.SetNotification(false);
+        while (queue.Pop(chain))
+        {
+            // Counted from the dequeue, the chain is off the ring from here on.
+            active_++;
+            Request request;
+            if (ParseRequest(chain, request))
+            {
+                batch.push_back(std::move(request));
+                continue;
+            }
+            logger_.Log(Logger::LogLevel::Warning, "Malformed request at head " + std::to_string(chain.head));
+            if (request.status != nullptr)
+            {
+                *request.status = StatusIoError;
+                memoryManager_->MarkHostRangeDirty(request.status, 1);
+            }
+            queue.Push(chain.head, request.status != nullptr ? 1 : 0);
+            errors_++;
+            rejected++;
+        }
+
+        if (!batch.empty())
+        {
+            const UINT32 depth = inFlight_ += static_cast<UINT32>(batch.size());
+            submitted_ += batch.size();
+            depthSum_ += static_cast<UINT64>(depth) * batch.size();
+            UINT32 maxDepth = maxInFlight_;
+            while (depth > maxDepth && !maxInFlight_.compare_exchange_weak(maxDepth, depth))
+            {
+            }
+            {
+                std::lock_guard<std::mutex> lock(pendingMutex_);
+                for (Request& request : batch)
+                {
+                    pending_.push_back(std::move(request));
+                }
+            }
+            if (batch.size() > 1)
+            {
+                pendingCv_.notify_all();
+            }
+            else
+            {
+                pendingCv_.notify_one();
+            }
+            batch.clear();
+        }
+
+        // A completion will look at the ring again, the driver does not need to notify until the disk is idle.
+        if (inFlight_ > 0)
+        {
+            break;
+        }
+        queue.SetNotification(true);
+        if (!queue.HasAvailable())
+        {
+            break;
+        }
+    }
+
+    if (rejected > 0)
+    {
+        if (PublishUsed(0))
+        {
+            interrupts_++;
+        }
+        Retire(rejected);
+    }
+}
+
+UINT8 VirtioBlk::Execute(const Request& request)
+{
+    const UINT64 offset = request.sector * BlockBackend::SectorSize;
+    switch (request.type)
+    {
+    case RequestIn:
+    case RequestOut:
+    {
+        if ((request.dataLength & (BlockBackend::SectorSize - 1)) != 0 || request.sector > backend_->GetSize() / BlockBackend::SectorSize
+            || request.dataLength > backend_->GetSize() - offset)
+        {
+            return StatusIoError;
+        }
+        if (request.type == RequestOut && backend_->IsReadOnly())
+        {
+            return StatusIoError;
+        }
+
+        UINT64 position = offset;
+        for (const Segment& segment : request.segments)
+        {
+            const bool done = request.type == RequestIn ? backend_->Read(position, segment.data, segment.length)
+                : backend_->Write(position, segment.data, segment.length);
+            if (!done)
+            {
+                return StatusIoError;
+            }
+            if (request.type == RequestIn)
+            {
+                memoryManager_->MarkHostRangeDirty(segment.data, segment.length);
+            }
+            position += segment.length;
+        }
+        bytes_ += request.dataLength;
+        return StatusOk;
+    }
+    case RequestFlush:
+        return backend_->Flush() ? StatusOk : StatusIoError;
+    case RequestGetId:
+    {
+        char id[IdSize] = {};
+        memcpy(id, DiskId, sizeof(DiskId) - 1);
+        size_t copied = 0;
+        for (const Segment& segment : request.segments)
+        {
+            const size_t chunk = std::min(segment.length, IdSize - copied);
+            memcpy(segment.data, id + copied, chunk);
+            memoryManager_->MarkHostRangeDirty(segment.data, chunk);
+            copied += chunk;
+        }
+        return StatusOk;
+    }
+    default:
+        return StatusUnsupported;
+    }
+}
+
+void VirtioBlk::Complete(const Request& request, UINT8 status)
+{
+    *request.status = status;
+    memoryManager_->MarkHostRangeDirty(request.status, 1);
+    const bool toGuest = request.type == RequestIn || request.type == RequestGetId;
+    GetQueue(0).Push(request.head, static_cast<UINT32>((toGuest && status == StatusOk ? request.dataLength : 0) + 1));
+    requests_++;
+    if (status != StatusOk)
+    {
+        errors_++;
+    }
+
+    const UINT32 remaining = --inFlight_;
+    if (remaining == 0 || unpublished_.fetch_add(1) + 1 >= CompletionBatch)
+    {
+        unpublished_ = 0;
+        if (PublishUsed(0))
+        {
+            interrupts_++;
+        }
+    }
+
+    if (remaining == 0)
+    {
+        // The last completion re-enables notifications, a submitter that saw requests in flight relies on it.
+        std::lock_guard<std::mutex> lock(submitMutex_);
+        ProcessQueue();
+    }
+    else if (submitMutex_.try_lock())
+    {
+        ProcessQueue();
+        submitMutex_.unlock();
+    }
+
+    // Only now is the used entry published and signalled, so a snapshot taken after WaitIdle sees it.
+    Retire(1);
+}
+
+void VirtioBlk::Retire(UINT32 count)
+{
+    if ((active_ -= count) == 0)
+    {
+        std::lock_guard<std::mutex> lock(idleMutex_);
+        idleCv_.notify_all();
+    }
+}
+
+void VirtioBlk::IoThread()
+{
+    while (true)
+    {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex_);
+            pendingCv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (pending_.empty())
+            {
+                return;
+            }
+            request = std::move(pending_.front());
+            pending_.pop_front();
+        }
+        Complete(request, Execute(request));
+    }
+}
+
+void VirtioBlk::WaitIdle()
+{
+    std::unique_lock<std::mutex> lock(idleMutex_);
+    idleCv_.wait(lock, [this] { return active_ == 0; });
+}
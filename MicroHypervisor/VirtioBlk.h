@@ -0,0 +1,170 @@
+#ifndef VIRTIOBLK_H
+#define VIRTIOBLK_H
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "VirtioMmioDevice.h"
+#include "BlockBackend.h"
+
+/// @brief Virtio block device, requests are read in place from guest RAM and served by a pool of host IO threads \class VirtioBlk
+class VirtioBlk : public VirtioMmioDevice
+{
+public:
+    static constexpr UINT64 DefaultMmioBase = 0xD0000000;
+    static constexpr UINT32 DefaultGsi = 5;
+    static constexpr UINT16 QueueSize = 256;
+    static constexpr UINT32 DefaultIoThreads = 4;
+
+    /**
+     * @brief Disk statistics, the rates are averaged since the disk was attached
+     *
+     */
+    struct Stats
+    {
+        UINT64 requests;
+        UINT64 bytes;
+        UINT64 interrupts;
+        UINT64 errors;
+        UINT32 queueDepth;
+        UINT32 maxQueueDepth;
+        double averageQueueDepth;
+        double iops;
+        double bytesPerSecond;
+        double requestsPerInterrupt;
+    };
+
+    VirtioBlk(MemoryManager* memoryManager, InterruptController* interruptController, UINT32 gsi = DefaultGsi,
+        UINT32 ioThreads = DefaultIoThreads);
+    ~VirtioBlk();
+
+    /**
+     * @brief Attaches the storage of the disk and starts the IO threads, called before the guest runs
+     *
+     * @param backend -> BlockBackend*, storage of the disk
+     * @return true -> if the disk is ready
+     */
+    bool Attach(BlockBackend* backend);
+
+    /**
+     * @brief Gets the disk statistics
+     *
+     */
+    Stats GetStats();
+
+    /**
+     * @brief Waits for the outstanding requests, then serializes the transport
+     *
+     */
+    void SaveState(std::vector<UINT8>& state) override;
+    bool LoadState(const std::vector<UINT8>& state) override;
+
+protected:
+    UINT64 GetDeviceFeatures() const override;
+    void OnQueueNotify(UINT32 queueIndex) override;
+    void OnReset() override;
+
+private:
+    /**
+     * @brief Guest data buffer of a request, adjacent descriptors are merged into one segment
+     *
+     */
+    struct Segment
+    {
+        UINT8* data;
+        size_t length;
+    };
+
+    /**
+     * @brief A parsed request, the segments and the status byte point into guest RAM
+     *
+     */
+    struct Request
+    {
+        UINT16 head;
+        UINT32 type;
+        UINT64 sector;
+        std::vector<Segment> segments;
+        size_t dataLength;
+        UINT8* status;
+    };
+
+    /**
+     * @brief Splits a chain into the request header, the data segments and the status byte
+     *
+     * @return true -> if the chain is a well formed request, status is set whenever the chain has a status byte
+     */
+    bool ParseRequest(const Virtqueue::Chain& chain, Request& request);
+
+    /**
+     * @brief Takes the available chains and hands them to the IO threads, called with submitMutex_ held
+     *
+     * While requests are outstanding the driver is told not to notify, the completions look for new chains instead.
+     */
+    void ProcessQueue();
+
+    /**
+     * @brief Performs a request against the backend
+     *
+     * @return UINT8 -> virtio status of the request
+     */
+    UINT8 Execute(const Request& request);
+
+    /**
+     * @brief Returns a finished request to the driver, the used ring is published and the interrupt raised once per batch
+     *
+     */
+    void Complete(const Request& request, UINT8 status);
+
+    /**
+     * @brief IO thread, executes the queued requests
+     *
+     */
+    void IoThread();
+
+    /**
+     * @brief Ends the device's work on requests taken off the ring, after their used entries are published
+     *
+     * @param count -> Number of requests
+     */
+    void Retire(UINT32 count);
+
+    /**
+     * @brief Blocks until every request taken off the ring has been completed and signalled to the driver
+     *
+     */
+    void WaitIdle();
+
+    BlockBackend* backend_;
+    UINT32 ioThreadCount_;
+
+    std::mutex submitMutex_;
+
+    std::mutex pendingMutex_;
+    std::condition_variable pendingCv_;
+    std::deque<Request> pending_;
+    std::vector<std::thread> ioThreads_;
+    bool stopping_;
+
+    std::atomic<UINT32> inFlight_;
+    std::atomic<UINT32> unpublished_;
+    std::atomic<UINT32> active_;
+    std::mutex idleMutex_;
+    std::condition_variable idleCv_;
+
+    std::atomic<UINT64> requests_;
+    std::atomic<UINT64> bytes_;
+    std::atomic<UINT64> interrupts_;
+    std::atomic<UINT64> errors_;
+    std::atomic<UINT64> submitted_;
+    std::atomic<UINT64> depthSum_;
+    std::atomic<UINT32> maxInFlight_;
+    std::chrono::steady_clock::time_point startTime_;
+};
+
+#endif // VIRTIOBLK_H
\ No newline at end of file
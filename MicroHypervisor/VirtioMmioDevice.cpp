@@ -0,0 +1,353 @@
+#include "VirtioMmioDevice.h"
+#include "InterruptController.h"
+
+namespace
+{
+    constexpr UINT32 VirtioMagic = 0x74726976;
+    constexpr UINT32 VirtioVersion = 2;
+    constexpr UINT32 VirtioVendor = 0x554D4551;
+
+    constexpr UINT32 InterruptUsedBuffer = 1;
+
+    template <typename T>
+    void Append(std::vector<UINT8>& state, T value)
+    {
+        const UINT8* bytes = reinterpret_cast<const UINT8*>(&value);
+        state.insert(state.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    bool Extract(const std::vector<UINT8>& state, size_t& offset, T& value)
+    {
+        if (state.size() - offset < sizeof(T))
+        {
+            return false;
+        }
+        memcpy(&value, state.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
+}
+
+VirtioMmioDevice::VirtioMmioDevice(MemoryManager* memoryManager, InterruptController* interruptController, UINT32 deviceId,
+    UINT32 queueCount, UINT16 queueSizeMax, UINT32 gsi, const std::string& name)
+    : memoryManager_(memoryManager), logger_(name + ".log"), interruptController_(interruptController), deviceId_(deviceId),
+    queueSizeMax_(queueSizeMax), gsi_(gsi), name_(name), status_(0), deviceFeaturesSel_(0), driverFeaturesSel_(0),
+    driverFeatures_(0), queueSel_(0), queues_(queueCount), configGeneration_(0), interruptStatus_(0)
+{
+    for (QueueState& queue : queues_)
+    {
+        queue.size = queueSizeMax_;
+        queue.ready = false;
+        queue.descGpa = 0;
+        queue.driverGpa = 0;
+        queue.deviceGpa = 0;
+    }
+}
+
+VirtioMmioDevice::~VirtioMmioDevice() {}
+
+bool VirtioMmioDevice::RegisterMmioRange(MmioBus& mmioBus, UINT64 base)
+{
+    if (!mmioBus.Register(base, RegionSize, this, name_))
+    {
+        return false;
+    }
+    logger_.Log(Logger::LogLevel::Info, "Registered " + name_ + " at GPA " + std::to_string(base) + ", GSI " + std::to_string(gsi_));
+    return true;
+}
+
+UINT64 VirtioMmioDevice::MmioRead(UINT32 vpIndex, UINT64 gpa, UINT8 size)
+{
+    const UINT32 offset = static_cast<UINT32>(gpa & (RegionSize - 1));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset >= Config)
+    {
+        UINT64 value = 0;
+        if (offset - Config < config_.size() && size <= config_.size() - (offset - Config))
+        {
+            memcpy(&value, config_.data() + (offset - Config), size);
+        }
+        return value;
+    }
+
+    switch (offset)
+    {
+    case MagicValue:
+        return VirtioMagic;
+    case Version:
+        return VirtioVersion;
+    case DeviceId:
+        return deviceId_;
+    case VendorId:
+        return VirtioVendor;
+    case DeviceFeatures:
+    {
+        const UINT64 features = GetDeviceFeatures() | FeatureVersion1;
+        return deviceFeaturesSel_ == 0 ? static_cast<UINT32>(features) : deviceFeaturesSel_ == 1 ? static_cast<UINT32>(features >> 32) : 0;
+    }
+    case QueueNumMax:
+        return queueSel_ < queues_.size() ? queueSizeMax_ : 0;
+    case QueueReady:
+        return queueSel_ < queues_.size() && queues_[queueSel_].ready ? 1 : 0;
+    case InterruptStatus:
+    {
+        std::lock_guard<std::mutex> interruptLock(interruptMutex_);
+        return interruptStatus_;
+    }
+    case Status:
+        return status_;
+    case ConfigGeneration:
+        return configGeneration_;
+    default:
+        return 0;
+    }
+}
+
+void VirtioMmioDevice::MmioWrite(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value)
+{
+    const UINT32 offset = static_cast<UINT32>(gpa & (RegionSize - 1));
+    UINT32 value32 = static_cast<UINT32>(value);
+    if (offset == QueueNotify)
+    {
+        // The notify path runs without the transport lock, the queue stays configured while the driver uses it.
+        bool ready = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ready = value32 < queues_.size() && queues_[value32].ready && (status_ & StatusDriverOk);
+        }
+        if (ready)
+        {
+            OnQueueNotify(value32);
+        }
+        return;
+    }
+
+    if (offset == Status && value32 == 0)
+    {
+        Reset();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueState* queue = queueSel_ < queues_.size() ? &queues_[queueSel_] : nullptr;
+    switch (offset)
+    {
+    case DeviceFeaturesSel:
+        deviceFeaturesSel_ = value32;
+        break;
+    case DriverFeatures:
+        if (!(status_ & StatusFeaturesOk) && driverFeaturesSel_ < 2)
+        {
+            const UINT32 shift = driverFeaturesSel_ * 32;
+            driverFeatures_ = (driverFeatures_ & ~(0xFFFFFFFFull << shift)) | (static_cast<UINT64>(value32) << shift);
+        }
+        break;
+    case DriverFeaturesSel:
+        driverFeaturesSel_ = value32;
+        break;
+    case QueueSel:
+        queueSel_ = value32;
+        break;
+    case QueueNum:
+        if (queue != nullptr && !queue->ready && value32 <= queueSizeMax_)
+        {
+            queue->size = static_cast<UINT16>(value32);
+        }
+        break;
+    case QueueReady:
+        if (queue == nullptr)
+        {
+            break;
+        }
+        if ((value32 & 1) && !queue->ready)
+        {
+            queue->ready = queue->queue.Configure(memoryManager_, queue->size, queue->descGpa, queue->driverGpa, queue->deviceGpa);
+        }
+        else if (!(value32 & 1))
+        {
+            queue->ready = false;
+            queue->queue.Reset();
+        }
+        break;
+    case InterruptAck:
+    {
+        std::lock_guard<std::mutex> interruptLock(interruptMutex_);
+        interruptStatus_ &= ~value32;
+        if (interruptStatus_ == 0 && interruptController_ != nullptr)
+        {
+            interruptController_->SetIrq(gsi_, false);
+        }
+        break;
+    }
+    case Status:
+        // FEATURES_OK only sticks when the driver accepted a subset of the offered features that includes VERSION_1.
+        if ((value32 & StatusFeaturesOk) && !(status_ & StatusFeaturesOk)
+            && ((driverFeatures_ & ~(GetDeviceFeatures() | FeatureVersion1)) != 0 || !(driverFeatures_ & FeatureVersion1)))
+        {
+            logger_.Log(Logger::LogLevel::Warning, "Driver features " + std::to_string(driverFeatures_) + " rejected");
+            value32 &= ~StatusFeaturesOk;
+        }
+        status_ = value32;
+        break;
+    case QueueDescLow:
+    case QueueDescHigh:
+    case QueueDriverLow:
+    case QueueDriverHigh:
+    case QueueDeviceLow:
+    case QueueDeviceHigh:
+    {
+        if (queue == nullptr || queue->ready)
+        {
+            break;
+        }
+        UINT64& address = offset < QueueDriverLow ? queue->descGpa : offset < QueueDeviceLow ? queue->driverGpa : queue->deviceGpa;
+        const UINT32 shift = (offset & 4) ? 32 : 0;
+        address = (address & ~(0xFFFFFFFFull << shift)) | (static_cast<UINT64>(value32) << shift);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void VirtioMmioDevice::SaveState(std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    state.clear();
+    Append(state, status_);
+    Append(state, deviceFeaturesSel_);
+    Append(state, driverFeaturesSel_);
+    Append(state, driverFeatures_);
+    Append(state, queueSel_);
+    {
+        std::lock_guard<std::mutex> interruptLock(interruptMutex_);
+        Append(state, interruptStatus_);
+    }
+    Append(state, static_cast<UINT32>(queues_.size()));
+    for (QueueState& queue : queues_)
+    {
+        UINT16 lastAvail = 0;
+        UINT16 used = 0;
+        queue.queue.GetIndices(lastAvail, used);
+        Append(state, queue.size);
+        Append(state, static_cast<UINT8>(queue.ready ? 1 : 0));
+        Append(state, queue.descGpa);
+        Append(state, queue.driverGpa);
+        Append(state, queue.deviceGpa);
+        Append(state, lastAvail);
+        Append(state, used);
+    }
+}
+
+bool VirtioMmioDevice::LoadState(const std::vector<UINT8>& state)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t offset = 0;
+    UINT32 interruptStatus = 0;
+    UINT32 queueCount = 0;
+    if (!Extract(state, offset, status_) || !Extract(state, offset, deviceFeaturesSel_) || !Extract(state, offset, driverFeaturesSel_)
+        || !Extract(state, offset, driverFeatures_) || !Extract(state, offset, queueSel_) || !Extract(state, offset, interruptStatus)
+        || !Extract(state, offset, queueCount) || queueCount != queues_.size())
+    {
+        logger_.Log(Logger::LogLevel::Error, name_ + " state is malformed");
+        return false;
+    }
+
+    for (QueueState& queue : queues_)
+    {
+        UINT8 ready = 0;
+        UINT16 lastAvail = 0;
+        UINT16 used = 0;
+        if (!Extract(state, offset, queue.size) || !Extract(state, offset, ready) || !Extract(state, offset, queue.descGpa)
+            || !Extract(state, offset, queue.driverGpa) || !Extract(state, offset, queue.deviceGpa)
+            || !Extract(state, offset, lastAvail) || !Extract(state, offset, used))
+        {
+            logger_.Log(Logger::LogLevel::Error, name_ + " queue state is malformed");
+            return false;
+        }
+        queue.ready = ready != 0 && queue.queue.Configure(memoryManager_, queue.size, queue.descGpa, queue.driverGpa, queue.deviceGpa);
+        if (queue.ready)
+        {
+            queue.queue.SetIndices(lastAvail, used);
+        }
+        else
+        {
+            queue.queue.Reset();
+        }
+    }
+
+    std::lock_guard<std::mutex> interruptLock(interruptMutex_);
+    interruptStatus_ = interruptStatus;
+    if (interruptController_ != nullptr)
+    {
+        interruptController_->SetIrq(gsi_, interruptStatus_ != 0);
+    }
+    return true;
+}
+
+Virtqueue& VirtioMmioDevice::GetQueue(UINT32 queueIndex)
+{
+    return queues_[queueIndex].queue;
+}
+
+UINT64 VirtioMmioDevice::GetDriverFeatures()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return driverFeatures_;
+}
+
+void VirtioMmioDevice::SetConfig(const std::vector<UINT8>& config)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    config_ = config;
+    configGeneration_++;
+}
+
+bool VirtioMmioDevice::PublishUsed(UINT32 queueIndex)
+{
+    if (!queues_[queueIndex].queue.Publish())
+    {
+        return false;
+    }
+    RaiseInterrupt(InterruptUsedBuffer);
+    return true;
+}
+
+void VirtioMmioDevice::Reset()
+{
+    OnReset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    status_ = 0;
+    deviceFeaturesSel_ = 0;
+    driverFeaturesSel_ = 0;
+    driverFeatures_ = 0;
+    queueSel_ = 0;
+    for (QueueState& queue : queues_)
+    {
+        queue.size = queueSizeMax_;
+        queue.ready = false;
+        queue.descGpa = 0;
+        queue.driverGpa = 0;
+        queue.deviceGpa = 0;
+        queue.queue.Reset();
+    }
+
+    std::lock_guard<std::mutex> interruptLock(interruptMutex_);
+    interruptStatus_ = 0;
+    if (interruptController_ != nullptr)
+    {
+        interruptController_->SetIrq(gsi_, false);
+    }
+}
+
+void VirtioMmioDevice::RaiseInterrupt(UINT32 bits)
+{
+    std::lock_guard<std::mutex> lock(interruptMutex_);
+    const bool wasPending = interruptStatus_ != 0;
+    interruptStatus_ |= bits;
+    if (!wasPending && interruptController_ != nullptr)
+    {
+        interruptController_->SetIrq(gsi_, true);
+    }
+}
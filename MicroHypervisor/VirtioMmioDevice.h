@@ -0,0 +1,198 @@
+#ifndef VIRTIOMMIODEVICE_H
+#define VIRTIOMMIODEVICE_H
+
+#include <Windows.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "MmioBus.h"
+#include "Virtqueue.h"
+#include "Logger.h"
+
+class MemoryManager;
+class InterruptController;
+
+/// @brief Virtio over MMIO transport, version 2 register layout, devices derive from it and serve their queues \class VirtioMmioDevice
+class VirtioMmioDevice : public MmioDevice
+{
+public:
+    static constexpr UINT64 RegionSize = 0x1000;
+    static constexpr UINT64 FeatureVersion1 = 1ull << 32;
+
+    static constexpr UINT32 StatusAcknowledge = 1;
+    static constexpr UINT32 StatusDriver = 2;
+    static constexpr UINT32 StatusDriverOk = 4;
+    static constexpr UINT32 StatusFeaturesOk = 8;
+    static constexpr UINT32 StatusFailed = 0x80;
+
+    /**
+     * @brief Register offsets, the device configuration space starts at Config
+     *
+     */
+    enum Register : UINT32
+    {
+        MagicValue = 0x000,
+        Version = 0x004,
+        DeviceId = 0x008,
+        VendorId = 0x00C,
+        DeviceFeatures = 0x010,
+        DeviceFeaturesSel = 0x014,
+        DriverFeatures = 0x020,
+        DriverFeaturesSel = 0x024,
+        QueueSel = 0x030,
+        QueueNumMax = 0x034,
+        QueueNum = 0x038,
+        QueueReady = 0x044,
+        QueueNotify = 0x050,
+        InterruptStatus = 0x060,
+        InterruptAck = 0x064,
+        Status = 0x070,
+        QueueDescLow = 0x080,
+        QueueDescHigh = 0x084,
+        QueueDriverLow = 0x090,
+        QueueDriverHigh = 0x094,
+        QueueDeviceLow = 0x0A0,
+        QueueDeviceHigh = 0x0A4,
+        ConfigGeneration = 0x0FC,
+        Config = 0x100
+    };
+
+    /**
+     * @brief Creates the transport of a device
+     *
+     * @param memoryManager -> MemoryManager*, owner of guest RAM
+     * @param interruptController -> InterruptController*, receives the interrupt line
+     * @param deviceId -> Virtio device type
+     * @param queueCount -> Number of virtqueues
+     * @param queueSizeMax -> Largest queue size the driver may choose
+     * @param gsi -> Interrupt line of the device
+     * @param name -> Name of the device for the logs
+     */
+    VirtioMmioDevice(MemoryManager* memoryManager, InterruptController* interruptController, UINT32 deviceId,
+        UINT32 queueCount, UINT16 queueSizeMax, UINT32 gsi, const std::string& name);
+    virtual ~VirtioMmioDevice();
+
+    /**
+     * @brief Claims the register region of the device, Linux finds it with virtio_mmio.device=4K@<base>:<gsi>
+     *
+     * @param mmioBus -> Bus of the guest
+     * @param base -> GPA of the region
+     * @return true -> if the region was claimed
+     */
+    bool RegisterMmioRange(MmioBus& mmioBus, UINT64 base);
+
+    UINT64 MmioRead(UINT32 vpIndex, UINT64 gpa, UINT8 size) override;
+    void MmioWrite(UINT32 vpIndex, UINT64 gpa, UINT8 size, UINT64 value) override;
+
+    /**
+     * @brief Serializes the transport registers and the ring indices, the rings live in guest RAM
+     *
+     * @param state -> receives the state
+     */
+    virtual void SaveState(std::vector<UINT8>& state);
+
+    /**
+     * @brief Restores the state written by SaveState
+     *
+     * @param state -> the state
+     * @return true -> if the state was restored
+     */
+    virtual bool LoadState(const std::vector<UINT8>& state);
+
+protected:
+    /**
+     * @brief Gets the feature bits offered by the device, FeatureVersion1 is added by the transport
+     *
+     */
+    virtual UINT64 GetDeviceFeatures() const = 0;
+
+    /**
+     * @brief Called on the vCPU thread when the driver notifies a ready queue
+     *
+     * @param queueIndex -> Index of the queue
+     */
+    virtual void OnQueueNotify(UINT32 queueIndex) = 0;
+
+    /**
+     * @brief Called before the queues are reset, the device finishes its outstanding requests
+     *
+     */
+    virtual void OnReset() {}
+
+    /**
+     * @brief Gets a queue of the device
+     *
+     */
+    Virtqueue& GetQueue(UINT32 queueIndex);
+
+    /**
+     * @brief Gets the feature bits accepted by the driver
+     *
+     */
+    UINT64 GetDriverFeatures();
+
+    /**
+     * @brief Sets the device configuration space and bumps the configuration generation
+     *
+     */
+    void SetConfig(const std::vector<UINT8>& config);
+
+    /**
+     * @brief Publishes the pushed chains of a queue and raises the interrupt if the driver wants one, callable from any thread
+     *
+     * @param queueIndex -> Index of the queue
+     * @return true -> if the interrupt was raised
+     */
+    bool PublishUsed(UINT32 queueIndex);
+
+    MemoryManager* memoryManager_;
+    Logger logger_;
+
+private:
+    /**
+     * @brief Transport registers of a queue
+     *
+     */
+    struct QueueState
+    {
+        UINT16 size;
+        bool ready;
+        UINT64 descGpa;
+        UINT64 driverGpa;
+        UINT64 deviceGpa;
+        Virtqueue queue;
+    };
+
+    /**
+     * @brief Returns the device to its initial state, the driver writes 0 to Status
+     *
+     */
+    void Reset();
+
+    /**
+     * @brief Sets bits of InterruptStatus and drives the line, the line stays asserted until the driver acknowledges
+     *
+     */
+    void RaiseInterrupt(UINT32 bits);
+
+    InterruptController* interruptController_;
+    UINT32 deviceId_;
+    UINT16 queueSizeMax_;
+    UINT32 gsi_;
+    std::string name_;
+
+    std::mutex mutex_;
+    UINT32 status_;
+    UINT32 deviceFeaturesSel_;
+    UINT32 driverFeaturesSel_;
+    UINT64 driverFeatures_;
+    UINT32 queueSel_;
+    std::vector<QueueState> queues_;
+    std::vector<UINT8> config_;
+    UINT32 configGeneration_;
+
+    std::mutex interruptMutex_;
+    UINT32 interruptStatus_;
+};
+
+#endif // VIRTIOMMIODEVICE_H
\ No newline at end of file
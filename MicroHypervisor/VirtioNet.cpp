@@ -0,0 +1,443 @@
+#define NOMINMAX
+#include "VirtioNet.h"
+#include <algorithm>
+#include "MemoryManager.h"
+
+namespace
+{
+    constexpr UINT32 DeviceIdNet = 1;
+
+    constexpr UINT64 FeatureMac = 1ull << 5;
+    constexpr UINT64 FeatureStatus = 1ull << 16;
+    constexpr UINT64 FeatureControlQueue = 1ull << 17;
+    constexpr UINT64 FeatureMultiQueue = 1ull << 22;
+
+    constexpr UINT16 StatusLinkUp = 1;
+
+    constexpr UINT8 ControlRxMode = 0;
+    constexpr UINT8 ControlMac = 1;
+    constexpr UINT8 ControlMultiQueue = 4;
+    constexpr UINT8 ControlMultiQueuePairsSet = 0;
+    constexpr UINT8 ControlOk = 0;
+    constexpr UINT8 ControlError = 1;
+
+    // Chains taken per transmit batch, the backend gets them in one call and the driver one interrupt.
+    constexpr size_t TxBatch = 64;
+
+    UINT32 ClampQueuePairs(UINT32 queuePairs)
+    {
+        return std::min(std::max(queuePairs, 1u), VirtioNet::MaxQueuePairs);
+    }
+}
+
+VirtioNet::VirtioNet(MemoryManager* memoryManager, InterruptController* interruptController, const std::array<UINT8, 6>& mac,
+    UINT32 queuePairs, UINT32 gsi)
+    : VirtioMmioDevice(memoryManager, interruptController, DeviceIdNet, ClampQueuePairs(queuePairs) * 2 + 1, QueueSize, gsi, "VirtioNet"),
+    mac_(mac), queuePairCount_(ClampQueuePairs(queuePairs)), activeQueuePairs_(1), backend_(nullptr), paused_(false),
+    startTime_(std::chrono::steady_clock::now())
+{
+    for (UINT32 i = 0; i < queuePairCount_; i++)
+    {
+        queuePairs_.push_back(std::make_unique<QueuePair>());
+        queuePairs_.back()->txCopies.resize(TxBatch);
+    }
+
+    // mac, status and max_virtqueue_pairs of struct virtio_net_config.
+    std::vector<UINT8> config(10, 0);
+    const UINT16 status = StatusLinkUp;
+    const UINT16 maxPairs = static_cast<UINT16>(queuePairCount_);
+    memcpy(config.data(), mac_.data(), mac_.size());
+    memcpy(config.data() + 6, &status, sizeof(status));
+    memcpy(config.data() + 8, &maxPairs, sizeof(maxPairs));
+    SetConfig(config);
+}
+
+VirtioNet::~VirtioNet()
+{
+    if (backend_ != nullptr)
+    {
+        backend_->SetReceiver(nullptr);
+    }
+}
+
+bool VirtioNet::Attach(NetBackend* backend)
+{
+    if (backend == nullptr || backend_ != nullptr)
+    {
+        return false;
+    }
+    backend_ = backend;
+    backend_->SetReceiver(this);
+    startTime_ = std::chrono::steady_clock::now();
+    logger_.Log(Logger::LogLevel::Info, "Network attached, " + std::to_string(queuePairCount_) + " queue pairs");
+    return true;
+}
+
+VirtioNet::Stats VirtioNet::GetStats()
+{
+    Stats stats = {};
+    stats.activeQueuePairs = activeQueuePairs_;
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    for (const std::unique_ptr<QueuePair>& queuePair : queuePairs_)
+    {
+        QueueStats queue = {};
+        queue.txPackets = queuePair->txPackets;
+        queue.txBytes = queuePair->txBytes;
+        queue.txDropped = queuePair->txDropped;
+        queue.rxPackets = queuePair->rxPackets;
+        queue.rxBytes = queuePair->rxBytes;
+        queue.rxDropped = queuePair->rxDropped;
+        queue.interrupts = queuePair->interrupts;
+        queue.txPacketsPerSecond = seconds > 0.0 ? static_cast<double>(queue.txPackets) / seconds : 0.0;
+        queue.rxPacketsPerSecond = seconds > 0.0 ? static_cast<double>(queue.rxPackets) / seconds : 0.0;
+        queue.packetsPerInterrupt = queue.interrupts > 0
+            ? static_cast<double>(queue.txPackets + queue.rxPackets) / static_cast<double>(queue.interrupts) : 0.0;
+        stats.queues.push_back(queue);
+    }
+    return stats;
+}
+
+size_t VirtioNet::Receive(UINT32 queueIndex, const NetFrame* frames, size_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    const UINT32 pair = queueIndex % activeQueuePairs_;
+    QueuePair& queuePair = *queuePairs_[pair];
+    std::lock_guard<std::mutex> lock(queuePair.rxMutex);
+    if (!queuePair.receiving || paused_)
+    {
+        return 0;
+    }
+
+    Virtqueue& queue = GetQueue(pair * 2);
+    size_t taken = 0;
+    size_t delivered = 0;
+    UINT64 bytes = 0;
+    while (taken < count && queue.Pop(queuePair.rxChain))
+    {
+        const UINT32 written = WriteRx(queuePair.rxChain, frames[taken]);
+        queue.Push(queuePair.rxChain.head, written);
+        if (written > 0)
+        {
+            bytes += frames[taken].length;
+            delivered++;
+        }
+        taken++;
+    }
+
+    queuePair.rxPackets += delivered;
+    queuePair.rxBytes += bytes;
+    queuePair.rxDropped += taken - delivered;
+    if (taken > 0 && PublishUsed(pair * 2))
+    {
+        queuePair.interrupts++;
+    }
+    return taken;
+}
+
+void VirtioNet::SaveState(std::vector<UINT8>& state)
+{
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const std::unique_ptr<QueuePair>& queuePair : queuePairs_)
+    {
+        locks.emplace_back(queuePair->rxMutex);
+    }
+    VirtioMmioDevice::SaveState(state);
+    const UINT32 activeQueuePairs = activeQueuePairs_;
+    const UINT8* bytes = reinterpret_cast<const UINT8*>(&activeQueuePairs);
+    state.insert(state.end(), bytes, bytes + sizeof(activeQueuePairs));
+}
+
+bool VirtioNet::LoadState(const std::vector<UINT8>& state)
+{
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const std::unique_ptr<QueuePair>& queuePair : queuePairs_)
+    {
+        locks.emplace_back(queuePair->rxMutex);
+    }
+    UINT32 activeQueuePairs = 0;
+    if (state.size() < sizeof(activeQueuePairs) || !VirtioMmioDevice::LoadState(state))
+    {
+        return false;
+    }
+    memcpy(&activeQueuePairs, state.data() + state.size() - sizeof(activeQueuePairs), sizeof(activeQueuePairs));
+    activeQueuePairs_ = std::min(std::max(activeQueuePairs, 1u), queuePairCount_);
+
+    // The driver posted its receive buffers before the snapshot, it will not notify for them again.
+    for (UINT32 pair = 0; pair < queuePairCount_; pair++)
+    {
+        queuePairs_[pair]->receiving = GetQueue(pair * 2).IsReady();
+    }
+    return true;
+}
+
+void VirtioNet::SetPaused(bool paused)
+{
+    {
+        // Every receive path holds its pair's lock, so none is still writing guest memory once these are taken.
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (const std::unique_ptr<QueuePair>& queuePair : queuePairs_)
+        {
+            locks.emplace_back(queuePair->rxMutex);
+        }
+        paused_ = paused;
+    }
+
+    if (!paused && backend_ != nullptr)
+    {
+        for (UINT32 pair = 0; pair < activeQueuePairs_; pair++)
+        {
+            backend_->OnReceiveBuffers(pair);
+        }
+    }
+}
+
+UINT64 VirtioNet::GetDeviceFeatures() const
+{
+    UINT64 features = FeatureMac | FeatureStatus | FeatureControlQueue;
+    if (queuePairCount_ > 1)
+    {
+        features |= FeatureMultiQueue;
+    }
+    return features;
+}
+
+void VirtioNet::OnQueueNotify(UINT32 queueIndex)
+{
+    if (queueIndex == queuePairCount_ * 2)
+    {
+        ProcessControl();
+    }
+    else if (queueIndex % 2 == 1)
+    {
+        ProcessTx(queueIndex / 2);
+    }
+    else
+    {
+        // Receiving starts once the driver has posted buffers, frames arriving before that are dropped.
+        QueuePair& queuePair = *queuePairs_[queueIndex / 2];
+        {
+            std::lock_guard<std::mutex> lock(queuePair.rxMutex);
+            queuePair.receiving = true;
+        }
+        if (backend_ != nullptr)
+        {
+            backend_->OnReceiveBuffers(queueIndex / 2);
+        }
+    }
+}
+
+void VirtioNet::OnReset()
+{
+    for (const std::unique_ptr<QueuePair>& queuePair : queuePairs_)
+    {
+        std::lock_guard<std::mutex> txLock(queuePair->txMutex);
+        std::lock_guard<std::mutex> rxLock(queuePair->rxMutex);
+        queuePair->receiving = false;
+    }
+    activeQueuePairs_ = 1;
+}
+
+void VirtioNet::ProcessTx(UINT32 pair)
+{
+    QueuePair& queuePair = *queuePairs_[pair];
+    std::lock_guard<std::mutex> lock(queuePair.txMutex);
+    Virtqueue& queue = GetQueue(pair * 2 + 1);
+    while (true)
+    {
+        queue.SetNotification(false);
+        queuePair.txFrames.clear();
+        queuePair.txHeads.clear();
+        size_t malformed = 0;
+        while (queuePair.txHeads.size() < TxBatch && queue.Pop(queuePair.txChain))
+        {
+            NetFrame frame;
+            if (ParseTx(queuePair, queuePair.txFrames.size(), frame))
+            {
+                queuePair.txFrames.push_back(frame);
+            }
+            else
+            {
+                malformed++;
+            }
+            queuePair.txHeads.push_back(queuePair.txChain.head);
+        }
+
+        if (queuePair.txHeads.empty())
+        {
+            queue.SetNotification(true);
+            if (!queue.HasAvailable())
+            {
+                break;
+            }
+            continue;
+        }
+
+        const size_t count = queuePair.txFrames.size();
+        const size_t sent = backend_ != nullptr && count > 0 ? backend_->Transmit(pair, queuePair.txFrames.data(), count) : 0;
+        UINT64 bytes = 0;
+        for (const NetFrame& frame : queuePair.txFrames)
+        {
+            bytes += frame.length;
+        }
+        for (UINT16 head : queuePair.txHeads)
+        {
+            queue.Push(head, 0);
+        }
+        queuePair.txPackets += count;
+        queuePair.txBytes += bytes;
+        queuePair.txDropped += count - sent + malformed;
+        if (PublishUsed(pair * 2 + 1))
+        {
+            queuePair.interrupts++;
+        }
+    }
+}
+
+void VirtioNet::ProcessControl()
+{
+    std::lock_guard<std::mutex> lock(controlMutex_);
+    Virtqueue& queue = GetQueue(queuePairCount_ * 2);
+    while (queue.Pop(controlChain_))
+    {
+        // class, command and data in the readable buffers, the ack byte is the last writable one.
+        std::vector<UINT8> command;
+        UINT8* ack = nullptr;
+        for (const Virtqueue::Buffer& buffer : controlChain_.buffers)
+        {
+            if (buffer.deviceWritable)
+            {
+                ack = buffer.length > 0 ? buffer.data + buffer.length - 1 : ack;
+            }
+            else
+            {
+                command.insert(command.end(), buffer.data, buffer.data + buffer.length);
+            }
+        }
+
+        UINT8 result = ControlError;
+        if (command.size() >= 2 && (command[0] == ControlRxMode || command[0] == ControlMac))
+        {
+            result = ControlOk;
+        }
+        else if (command.size() >= 4 && command[0] == ControlMultiQueue && command[1] == ControlMultiQueuePairsSet)
+        {
+            UINT16 pairs = 0;
+            memcpy(&pairs, command.data() + 2, sizeof(pairs));
+            if (pairs >= 1 && pairs <= queuePairCount_)
+            {
+                activeQueuePairs_ = pairs;
+                result = ControlOk;
+                logger_.Log(Logger::LogLevel::Info, std::to_string(pairs) + " queue pairs active");
+            }
+        }
+        if (ack != nullptr)
+        {
+            *ack = result;
+            memoryManager_->MarkHostRangeDirty(ack, 1);
+        }
+        queue.Push(controlChain_.head, ack != nullptr ? 1 : 0);
+    }
+    PublishUsed(queuePairCount_ * 2);
+}
+
+bool VirtioNet::ParseTx(QueuePair& queuePair, size_t index, NetFrame& frame)
+{
+    // The virtio header may share a buffer with the frame, the frame may span buffers.
+    size_t skip = HeaderSize;
+    const UINT8* data = nullptr;
+    size_t length = 0;
+    bool contiguous = true;
+    for (const Virtqueue::Buffer& buffer : queuePair.txChain.buffers)
+    {
+        if (buffer.deviceWritable)
+        {
+            return false;
+        }
+        const size_t offset = std::min<size_t>(skip, buffer.length);
+        skip -= offset;
+        if (offset == buffer.length)
+        {
+            continue;
+        }
+        if (data == nullptr)
+        {
+            data = buffer.data + offset;
+        }
+        else if (data + length != buffer.data + offset)
+        {
+            contiguous = false;
+        }
+        length += buffer.length - offset;
+    }
+    if (length == 0 || length > MaxFrameSize)
+    {
+        return false;
+    }
+    if (contiguous)
+    {
+        frame = { data, length };
+        return true;
+    }
+
+    std::vector<UINT8>& copy = queuePair.txCopies[index];
+    copy.clear();
+    skip = HeaderSize;
+    for (const Virtqueue::Buffer& buffer : queuePair.txChain.buffers)
+    {
+        const size_t offset = std::min<size_t>(skip, buffer.length);
+        skip -= offset;
+        copy.insert(copy.end(), buffer.data + offset, buffer.data + buffer.length);
+    }
+    frame = { copy.data(), copy.size() };
+    return true;
+}
+
+UINT32 VirtioNet::WriteRx(const Virtqueue::Chain& chain, const NetFrame& frame)
+{
+    size_t capacity = 0;
+    for (const Virtqueue::Buffer& buffer : chain.buffers)
+    {
+        capacity += buffer.deviceWritable ? buffer.length : 0;
+    }
+    if (capacity < HeaderSize + frame.length)
+    {
+        return 0;
+    }
+
+    // struct virtio_net_hdr without offloads, num_buffers is 1.
+    UINT8 header[HeaderSize] = {};
+    header[10] = 1;
+    const UINT8* sources[2] = { header, frame.data };
+    const size_t lengths[2] = { HeaderSize, frame.length };
+    size_t part = 0;
+    size_t copied = 0;
+    for (const Virtqueue::Buffer& buffer : chain.buffers)
+    {
+        if (!buffer.deviceWritable)
+        {
+            continue;
+        }
+        size_t offset = 0;
+        while (offset < buffer.length && part < 2)
+        {
+            const size_t chunk = std::min<size_t>(buffer.length - offset, lengths[part] - copied);
+            memcpy(buffer.data + offset, sources[part] + copied, chunk);
+            offset += chunk;
+            copied += chunk;
+            if (copied == lengths[part])
+            {
+                part++;
+                copied = 0;
+            }
+        }
+        memoryManager_->MarkHostRangeDirty(buffer.data, offset);
+        if (part == 2)
+        {
+            break;
+        }
+    }
+    return static_cast<UINT32>(HeaderSize + frame.length);
+}
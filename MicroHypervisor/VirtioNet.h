@@ -0,0 +1,169 @@
+#ifndef VIRTIONET_H
+#define VIRTIONET_H
+
+#include <Windows.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "VirtioMmioDevice.h"
+#include "NetBackend.h"
+
+/// @brief Virtio network device with multiple queue pairs, each notification and each received batch is served as a whole \class VirtioNet
+class VirtioNet : public VirtioMmioDevice, public NetReceiver
+{
+public:
+    static constexpr UINT64 DefaultMmioBase = 0xD0001000;
+    static constexpr UINT32 DefaultGsi = 6;
+    static constexpr UINT16 QueueSize = 256;
+    static constexpr UINT32 MaxQueuePairs = 8;
+    static constexpr size_t HeaderSize = 12;
+    static constexpr size_t MaxFrameSize = 65550;
+
+    /**
+     * @brief Statistics of a queue pair, the rates are averaged since the device was attached, rxDropped counts the frames
+     *        larger than their receive buffer, frames finding no buffer are left to the backend
+     *
+     */
+    struct QueueStats
+    {
+        UINT64 txPackets;
+        UINT64 txBytes;
+        UINT64 txDropped;
+        UINT64 rxPackets;
+        UINT64 rxBytes;
+        UINT64 rxDropped;
+        UINT64 interrupts;
+        double txPacketsPerSecond;
+        double rxPacketsPerSecond;
+        double packetsPerInterrupt;
+    };
+
+    /**
+     * @brief Device statistics
+     *
+     */
+    struct Stats
+    {
+        UINT32 activeQueuePairs;
+        std::vector<QueueStats> queues;
+    };
+
+    /**
+     * @brief Creates the device
+     *
+     * @param memoryManager -> MemoryManager*, owner of guest RAM
+     * @param interruptController -> InterruptController*, receives the interrupt line
+     * @param mac -> MAC address reported to the driver
+     * @param queuePairs -> Number of receive and transmit queue pairs, 1 to MaxQueuePairs
+     * @param gsi -> Interrupt line of the device
+     */
+    VirtioNet(MemoryManager* memoryManager, InterruptController* interruptController, const std::array<UINT8, 6>& mac,
+        UINT32 queuePairs = 1, UINT32 gsi = DefaultGsi);
+    ~VirtioNet();
+
+    /**
+     * @brief Attaches the network of the device, called before the guest runs
+     *
+     * @param backend -> NetBackend*, receives the transmitted frames and delivers the received ones
+     * @return true -> if the device is ready
+     */
+    bool Attach(NetBackend* backend);
+
+    /**
+     * @brief Gets the device statistics
+     *
+     */
+    Stats GetStats();
+
+    /**
+     * @brief Copies a batch of frames into the receive buffers of a queue, one interrupt for the whole batch
+     *
+     */
+    size_t Receive(UINT32 queueIndex, const NetFrame* frames, size_t count) override;
+
+    /**
+     * @brief Stops the receive path while the transport is serialized, the number of active pairs follows it
+     *
+     */
+    void SaveState(std::vector<UINT8>& state) override;
+    bool LoadState(const std::vector<UINT8>& state) override;
+
+    /**
+     * @brief Holds received frames back while the VM is paused, the backend keeps them until the device resumes
+     *
+     * @param paused -> true once deliveries in progress have finished and guest memory must not change
+     */
+    void SetPaused(bool paused);
+
+protected:
+    UINT64 GetDeviceFeatures() const override;
+    void OnQueueNotify(UINT32 queueIndex) override;
+    void OnReset() override;
+
+private:
+    /**
+     * @brief Receive and transmit state of a queue pair, the receive side is entered by the backend threads
+     *
+     */
+    struct QueuePair
+    {
+        std::mutex txMutex;
+        Virtqueue::Chain txChain;
+        std::vector<NetFrame> txFrames;
+        std::vector<UINT16> txHeads;
+        std::vector<std::vector<UINT8>> txCopies;
+
+        std::mutex rxMutex;
+        Virtqueue::Chain rxChain;
+        bool receiving = false;
+
+        std::atomic<UINT64> txPackets{ 0 };
+        std::atomic<UINT64> txBytes{ 0 };
+        std::atomic<UINT64> txDropped{ 0 };
+        std::atomic<UINT64> rxPackets{ 0 };
+        std::atomic<UINT64> rxBytes{ 0 };
+        std::atomic<UINT64> rxDropped{ 0 };
+        std::atomic<UINT64> interrupts{ 0 };
+    };
+
+    /**
+     * @brief Transmits the available chains of a pair in batches, the driver is not notified while a batch is served
+     *
+     */
+    void ProcessTx(UINT32 pair);
+
+    /**
+     * @brief Serves the control queue, only the number of active queue pairs is configurable
+     *
+     */
+    void ProcessControl();
+
+    /**
+     * @brief Gets the frame of a transmit chain, in place when it is contiguous in guest RAM and copied otherwise
+     *
+     * @return true -> if the chain is a well formed packet
+     */
+    bool ParseTx(QueuePair& queuePair, size_t index, NetFrame& frame);
+
+    /**
+     * @brief Copies a frame behind the virtio header into a receive chain
+     *
+     * @return UINT32 -> number of bytes written, 0 if the frame does not fit
+     */
+    UINT32 WriteRx(const Virtqueue::Chain& chain, const NetFrame& frame);
+
+    std::array<UINT8, 6> mac_;
+    UINT32 queuePairCount_;
+    std::vector<std::unique_ptr<QueuePair>> queuePairs_;
+    std::atomic<UINT32> activeQueuePairs_;
+    NetBackend* backend_;
+    bool paused_;
+    std::mutex controlMutex_;
+    Virtqueue::Chain controlChain_;
+    std::chrono::steady_clock::time_point startTime_;
+};
+
+#endif // VIRTIONET_H
\ No newline at end of file
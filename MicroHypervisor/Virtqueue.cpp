@@ -0,0 +1,200 @@
+#include "Virtqueue.h"
+#include <atomic>
+#include "MemoryManager.h"
+
+namespace
+{
+    // The rings are shared with the guest, plain loads and stores ordered with fences.
+    UINT16 LoadAcquire(const UINT16* value)
+    {
+        UINT16 result = *static_cast<const volatile UINT16*>(value);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return result;
+    }
+
+    void StoreRelease(UINT16* value, UINT16 newValue)
+    {
+        std::atomic_thread_fence(std::memory_order_release);
+        *static_cast<volatile UINT16*>(value) = newValue;
+    }
+
+    // Offsets in UINT16 units of the fields of the available and used rings.
+    constexpr size_t RingFlags = 0;
+    constexpr size_t RingIndex = 1;
+    constexpr size_t RingEntries = 2;
+}
+
+Virtqueue::Virtqueue()
+    : memoryManager_(nullptr), size_(0), descriptors_(nullptr), avail_(nullptr), used_(nullptr), lastAvail_(0),
+    usedIndex_(0), publishedIndex_(0), logger_("Virtqueue.log")
+{
+
+}
+
+Virtqueue::~Virtqueue() {}
+
+bool Virtqueue::Configure(MemoryManager* memoryManager, UINT16 size, UINT64 descGpa, UINT64 availGpa, UINT64 usedGpa)
+{
+    Reset();
+    if (size == 0 || (size & (size - 1)) != 0 || (descGpa & 15) != 0 || (availGpa & 1) != 0 || (usedGpa & 3) != 0)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Invalid virtqueue layout, " + std::to_string(size) + " descriptors");
+        return false;
+    }
+
+    UINT8* descriptors = memoryManager->GetHostRange(descGpa, sizeof(Descriptor) * size);
+    UINT8* avail = memoryManager->GetHostRange(availGpa, sizeof(UINT16) * (3 + size));
+    UINT8* used = memoryManager->GetHostRange(usedGpa, sizeof(UINT16) * 3 + sizeof(UINT32) * 2 * size);
+    if (descriptors == nullptr || avail == nullptr || used == nullptr)
+    {
+        logger_.Log(Logger::LogLevel::Error, "Virtqueue rings at GPA " + std::to_string(descGpa) + " are not in guest RAM");
+        return false;
+    }
+
+    memoryManager_ = memoryManager;
+    size_ = size;
+    descriptors_ = reinterpret_cast<Descriptor*>(descriptors);
+    avail_ = reinterpret_cast<UINT16*>(avail);
+    used_ = reinterpret_cast<UINT16*>(used);
+    lastAvail_ = 0;
+    usedIndex_ = 0;
+    publishedIndex_ = 0;
+    return true;
+}
+
+void Virtqueue::Reset()
+{
+    std::lock_guard<std::mutex> lock(usedMutex_);
+    size_ = 0;
+    descriptors_ = nullptr;
+    avail_ = nullptr;
+    used_ = nullptr;
+    lastAvail_ = 0;
+    usedIndex_ = 0;
+    publishedIndex_ = 0;
+}
+
+bool Virtqueue::IsReady() const
+{
+    return size_ != 0;
+}
+
+bool Virtqueue::HasAvailable()
+{
+    return size_ != 0 && LoadAcquire(&avail_[RingIndex]) != lastAvail_;
+}
+
+bool Virtqueue::Pop(Chain& chain)
+{
+    while (HasAvailable())
+    {
+        const UINT16 published = LoadAcquire(&avail_[RingIndex]);
+        if (static_cast<UINT16>(published - lastAvail_) > size_)
+        {
+            logger_.Log(Logger::LogLevel::Error, "Available ring index " + std::to_string(published) + " is corrupt");
+            lastAvail_ = published;
+            return false;
+        }
+
+        chain.head = avail_[RingEntries + (lastAvail_ & (size_ - 1))];
+        lastAvail_++;
+        if (ReadChain(chain))
+        {
+            return true;
+        }
+        logger_.Log(Logger::LogLevel::Error, "Malformed descriptor chain at head " + std::to_string(chain.head));
+        Push(chain.head, 0);
+    }
+    return false;
+}
+
+bool Virtqueue::ReadChain(Chain& chain)
+{
+    chain.buffers.clear();
+
+    // A chain never has more descriptors than the table, a longer walk is a loop.
+    UINT16 index = chain.head;
+    for (UINT16 count = 0; count < size_; count++)
+    {
+        if (index >= size_)
+        {
+            break;
+        }
+        const Descriptor descriptor = descriptors_[index];
+        if (descriptor.flags & DescriptorIndirect)
+        {
+            break;
+        }
+
+        UINT8* data = descriptor.length > 0 ? memoryManager_->GetHostRange(descriptor.address, descriptor.length) : nullptr;
+        if (descriptor.length > 0 && data == nullptr)
+        {
+            break;
+        }
+        chain.buffers.push_back({ data, descriptor.length, (descriptor.flags & DescriptorWrite) != 0 });
+
+        if (!(descriptor.flags & DescriptorNext))
+        {
+            return true;
+        }
+        index = descriptor.next;
+    }
+
+    return false;
+}
+
+void Virtqueue::Push(UINT16 head, UINT32 written)
+{
+    std::lock_guard<std::mutex> lock(usedMutex_);
+    if (size_ == 0)
+    {
+        return;
+    }
+    UINT32* element = reinterpret_cast<UINT32*>(used_ + RingEntries) + 2 * (usedIndex_ & (size_ - 1));
+    element[0] = head;
+    element[1] = written;
+    memoryManager_->MarkHostRangeDirty(element, 2 * sizeof(UINT32));
+    usedIndex_++;
+}
+
+bool Virtqueue::Publish()
+{
+    std::lock_guard<std::mutex> lock(usedMutex_);
+    if (size_ == 0 || usedIndex_ == publishedIndex_)
+    {
+        return false;
+    }
+    StoreRelease(&used_[RingIndex], usedIndex_);
+    memoryManager_->MarkHostRangeDirty(&used_[RingIndex], sizeof(UINT16));
+    publishedIndex_ = usedIndex_;
+
+    // Orders the index store before reading the flags, or a driver that just cleared NO_INTERRUPT could be missed.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return !(LoadAcquire(&avail_[RingFlags]) & AvailNoInterrupt);
+}
+
+void Virtqueue::SetNotification(bool enabled)
+{
+    if (size_ == 0)
+    {
+        return;
+    }
+    StoreRelease(&used_[RingFlags], enabled ? 0 : UsedNoNotify);
+    memoryManager_->MarkHostRangeDirty(&used_[RingFlags], sizeof(UINT16));
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Virtqueue::GetIndices(UINT16& lastAvail, UINT16& used)
+{
+    std::lock_guard<std::mutex> lock(usedMutex_);
+    lastAvail = lastAvail_;
+    used = usedIndex_;
+}
+
+void Virtqueue::SetIndices(UINT16 lastAvail, UINT16 used)
+{
+    std::lock_guard<std::mutex> lock(usedMutex_);
+    lastAvail_ = lastAvail;
+    usedIndex_ = used;
+    publishedIndex_ = used;
+}
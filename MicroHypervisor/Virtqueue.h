@@ -0,0 +1,151 @@
+#ifndef VIRTQUEUE_H
+#define VIRTQUEUE_H
+
+#include <Windows.h>
+#include <mutex>
+#include <vector>
+#include "Logger.h"
+
+class MemoryManager;
+
+/// @brief Split virtqueue in guest RAM, descriptors are translated to host pointers so devices access the buffers in place \class Virtqueue
+class Virtqueue
+{
+public:
+    static constexpr UINT16 DescriptorNext = 1;
+    static constexpr UINT16 DescriptorWrite = 2;
+    static constexpr UINT16 DescriptorIndirect = 4;
+    static constexpr UINT16 AvailNoInterrupt = 1;
+    static constexpr UINT16 UsedNoNotify = 1;
+
+    /**
+     * @brief A guest buffer of a descriptor chain, mapped to its host address
+     *
+     */
+    struct Buffer
+    {
+        UINT8* data;
+        UINT32 length;
+        bool deviceWritable;
+    };
+
+    /**
+     * @brief A descriptor chain taken from the available ring, head identifies it when it is returned
+     *
+     */
+    struct Chain
+    {
+        UINT16 head;
+        std::vector<Buffer> buffers;
+    };
+
+    Virtqueue();
+    ~Virtqueue();
+
+    /**
+     * @brief Maps the rings of the queue, all three must lie in guest RAM
+     *
+     * @param memoryManager -> MemoryManager*, owner of guest RAM
+     * @param size -> Number of descriptors, a power of two
+     * @param descGpa -> GPA of the descriptor table
+     * @param availGpa -> GPA of the available ring
+     * @param usedGpa -> GPA of the used ring
+     * @return true -> if the queue is ready
+     */
+    bool Configure(MemoryManager* memoryManager, UINT16 size, UINT64 descGpa, UINT64 availGpa, UINT64 usedGpa);
+
+    /**
+     * @brief Unmaps the queue and clears the ring indices
+     *
+     */
+    void Reset();
+
+    /**
+     * @brief Checks if the queue is mapped
+     *
+     */
+    bool IsReady() const;
+
+    /**
+     * @brief Checks if the driver has published chains that were not taken yet
+     *
+     */
+    bool HasAvailable();
+
+    /**
+     * @brief Takes the next chain from the available ring, called from one thread at a time
+     *
+     * @param chain -> receives the chain
+     * @return true -> if a chain was taken
+     * @return false -> if the ring is empty, malformed chains are pushed back with length 0 and skipped
+     */
+    bool Pop(Chain& chain);
+
+    /**
+     * @brief Places a finished chain in the used ring without making it visible to the driver, callable from any thread
+     *
+     * @param head -> Head of the chain
+     * @param written -> Number of bytes the device wrote into the chain
+     */
+    void Push(UINT16 head, UINT32 written);
+
+    /**
+     * @brief Makes the pushed chains visible to the driver with one index update
+     *
+     * @return true -> if chains were published and the driver wants an interrupt for them
+     */
+    bool Publish();
+
+    /**
+     * @brief Asks the driver to notify, or not to notify, when it adds chains
+     *
+     */
+    void SetNotification(bool enabled);
+
+    /**
+     * @brief Gets the ring indices of the device for the snapshots
+     *
+     */
+    void GetIndices(UINT16& lastAvail, UINT16& used);
+
+    /**
+     * @brief Sets the ring indices of the device after Configure, when a snapshot is restored
+     *
+     */
+    void SetIndices(UINT16 lastAvail, UINT16 used);
+
+private:
+    /**
+     * @brief Walks the descriptors of chain.head and maps their buffers
+     *
+     * @return true -> if every descriptor is direct and backed by guest RAM
+     */
+    bool ReadChain(Chain& chain);
+
+    /**
+     * @brief Descriptor table entry, the layout is fixed by the virtio specification
+     *
+     */
+    struct Descriptor
+    {
+        UINT64 address;
+        UINT32 length;
+        UINT16 flags;
+        UINT16 next;
+    };
+
+    MemoryManager* memoryManager_;
+    UINT16 size_;
+    Descriptor* descriptors_;
+    UINT16* avail_;
+    UINT16* used_;
+
+    UINT16 lastAvail_;
+    std::mutex usedMutex_;
+    UINT16 usedIndex_;
+    UINT16 publishedIndex_;
+
+    Logger logger_;
+};
+
+#endif // VIRTQUEUE_H
\ No newline at end of file
@@ -2,15 +2,25 @@
 #include <iostream>
 #include <iomanip>
 #include "InterruptController.h"
+#include "EventRecorder.h"
+#include "IoBus.h"
+#include "MmioBus.h"
+#include "Trace.h"
 #include <cassert>
 #include <cstdlib>
+#include <chrono>
 
 VirtualProcessor::VirtualProcessor(WHV_PARTITION_HANDLE partitionHandle, UINT index)
     : partitionHandle_(partitionHandle), index_(index), registers_(std::size(regNames)), 
     isRunning_(false), savedRegisters_(), vmConfig_({1, 4194304, "none"}),
-    logger_("VirtualProcessor.log")
+    logger_("VirtualProcessor.log"), inGuest_(false), busy_(false), pauseCount_(0), kickPending_(false), eventRecorder_(nullptr), interruptController_(nullptr), ioBus_(nullptr), mmioBus_(nullptr), memoryManager_(nullptr),
+    registersCached_(false), ioFastPath_(true), fastIoExits_(0), fastIoNanoseconds_(0), emulatedIoExits_(0),
+    emulatedIoNanoseconds_(0), fastMmioExits_(0), fastMmioNanoseconds_(0), mmioExits_(0), mmioNanoseconds_(0)
 {
-
+    if (!emulator_.Initialize())
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to create the instruction emulator of virtual processor " + std::to_string(index));
+    }
 }
 
 VirtualProcessor::~VirtualProcessor()
@@ -181,6 +191,13 @@ void VirtualProcessor::DetailedDumpRegisters()
 
 HRESULT VirtualProcessor::SaveState()
 {
+    std::vector<WHV_REGISTER_VALUE> registers;
+    return SaveState(registers);
+}
+
+HRESULT VirtualProcessor::SaveState(std::vector<WHV_REGISTER_VALUE>& registers)
+{
+    std::lock_guard<std::mutex> lock(stateMutex_);
     HRESULT hr = GetRegisters();
     if (FAILED(hr)) return hr;
 
@@ -204,14 +221,18 @@ HRESULT VirtualProcessor::SaveState()
             + std::to_string(reinterpret_cast<uintptr_t>(partitionHandle_)));
     }
 
+    registers = savedRegisters_;
     return S_OK;
 }
 
 HRESULT VirtualProcessor::RestoreState()
 {
+    std::lock_guard<std::mutex> lock(stateMutex_);
     if (!isRunning_) return E_FAIL;
 
     registers_ = savedRegisters_;
+    // Guest memory was rolled back with the registers.
+    mmioInstructionCache_.Invalidate();
 
     auto result = WHvSetVirtualProcessorRegisters(partitionHandle_, index_, regNames, static_cast<UINT32>(std::size(regNames)), registers_.data());
     if (FAILED(result))
@@ -233,6 +254,39 @@ HRESULT VirtualProcessor::RestoreState()
     return SetRegisters();
 }
 
+HRESULT VirtualProcessor::FastRestoreState()
+{
+    if (!isRunning_) return E_FAIL;
+
+    auto result = WHvSetVirtualProcessorRegisters(partitionHandle_, index_, regNames, static_cast<UINT32>(std::size(regNames)), savedRegisters_.data());
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to fast restore state: HRESULT "
+            + std::to_string(result) + ", index = "
+            + std::to_string(index_));
+        return result;
+    }
+
+    registers_ = savedRegisters_;
+    mmioInstructionCache_.Invalidate();
+    return S_OK;
+}
+
+HRESULT VirtualProcessor::LoadState(const std::vector<WHV_REGISTER_VALUE>& registers)
+{
+    if (registers.size() != std::size(regNames))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to load state: register count mismatch, got "
+            + std::to_string(registers.size()));
+        return E_INVALIDARG;
+    }
+
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    savedRegisters_ = registers;
+    isRunning_ = true;
+    return FastRestoreState();
+}
+
 HRESULT VirtualProcessor::ConfigureVM(const VMConfig& config)
 {
     vmConfig_ = config;
@@ -378,6 +432,25 @@ bool VirtualProcessor::MapUserSpace()
 
 
 void VirtualProcessor::Run()
+{
+    // Parks the whole iteration, Pause() returns only when the exit handling is done with the register cache too.
+    {
+        std::unique_lock<std::mutex> lock(pauseMutex_);
+        pauseCv_.wait(lock, [this]() { return pauseCount_ == 0; });
+        busy_ = true;
+        runThread_ = std::this_thread::get_id();
+    }
+
+    RunOnce();
+
+    {
+        std::lock_guard<std::mutex> lock(pauseMutex_);
+        busy_ = false;
+    }
+    pauseCv_.notify_all();
+}
+
+void VirtualProcessor::RunOnce()
 {
     if (partitionHandle_ == nullptr)
     {
@@ -397,27 +470,91 @@ void VirtualProcessor::Run()
         return;
     }
 
-    SetRegisters();
+    // Every register writer goes through to the vCPU, so the cache is not loaded here; a stale cache would
+    // rewind the exit completions and overwrite the injected interruption.
+    if (interruptController_ != nullptr)
+    {
+        interruptController_->DeliverPendingInterrupts(index_);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pauseMutex_);
+        if (pauseCount_ > 0)
+        {
+            // Paused while preparing the entry, the next Run() picks up from here after Resume().
+            return;
+        }
+        inGuest_ = true;
+    }
+
+    // Pairs with Kick(): either the kicker sees inGuest_ and cancels the run, or the kick is seen here.
+    if (kickPending_.exchange(false))
+    {
+        inGuest_ = false;
+        return;
+    }
 
     WHV_RUN_VP_EXIT_CONTEXT context;
     auto result = WHvRunVirtualProcessor(partitionHandle_, index_, &context, sizeof(context));
 
-    if (SUCCEEDED(result))
+    // Work posted before this exit is picked up before the next entry, so an outstanding kick is satisfied.
+    kickPending_ = false;
+    registersCached_ = false;
+    inGuest_ = false;
+
+    // Cancel and interrupt-window exits depend on host timing, counting them would shift the replayed inputs.
+    if (eventRecorder_ != nullptr && SUCCEEDED(result) && context.ExitReason != WHvRunVpExitReasonCanceled
+        && context.ExitReason != WHvRunVpExitReasonX64InterruptWindow)
     {
-        logger_.Log(Logger::LogLevel::Info, "Virtual Processor is running.");
+        eventRecorder_->OnExit();
+    }
 
-        UINT64 rip = GetSpecificRegister(WHvX64RegisterRip);
-        logger_.Log(Logger::LogLevel::Info, "Instruction Pointer (RIP): " + std::to_string(rip));
+    if (SUCCEEDED(result))
+    {
+        MH_TRACE(Exit, context.ExitReason, context.VpContext.Rip, index_);
 
         switch (context.ExitReason)
         {
+        case WHvRunVpExitReasonCanceled:
+            // Kicks and pauses cancel the run, the exit trace above is enough on this hot path.
+            break;
+        case WHvRunVpExitReasonX64InterruptWindow:
+            // The interrupt controller injects the deferred interrupts before the next entry.
+            break;
         case WHvRunVpExitReasonHypercall:
-            logger_.Log(Logger::LogLevel::Info, "The vmcall instruction executed.");
-            //auto interruptController = InterruptController(partitionHandle_);
+            CompleteHypercall(context);
             break;
+        case WHvRunVpExitReasonX64IoPortAccess:
+        {
+            auto start = std::chrono::steady_clock::now();
+            const auto& accessInfo = context.IoPortAccess.AccessInfo;
+            if (ioFastPath_ && !accessInfo.StringOp && !accessInfo.RepPrefix && SUCCEEDED(CompleteIoFastPath(context)))
+            {
+                fastIoExits_++;
+                fastIoNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                break;
+            }
+            emulator_.EmulateIo(this, context);
+            emulatedIoExits_++;
+            emulatedIoNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        break;
         case WHvRunVpExitReasonMemoryAccess:
         {
-            // TODO: FIX THIS!!!
+            auto start = std::chrono::steady_clock::now();
+            if (SUCCEEDED(CompleteMmioFastPath(context)))
+            {
+                fastMmioExits_++;
+                fastMmioNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                break;
+            }
+            HRESULT emulated = emulator_.EmulateMmio(this, context);
+            mmioExits_++;
+            mmioNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            if (SUCCEEDED(emulated))
+            {
+                break;
+            }
             const auto& memoryAccessContext = context.MemoryAccess;
 
             logger_.Log(Logger::LogLevel::Info, "Memory Access Exit Reason:");
@@ -451,6 +588,365 @@ void VirtualProcessor::Run()
     }
 }
 
+HRESULT VirtualProcessor::Pause()
+{
+    std::unique_lock<std::mutex> lock(pauseMutex_);
+    if (pauseCount_++ == 0)
+    {
+        for (const auto& callback : pauseCallbacks_)
+        {
+            callback(true);
+        }
+    }
+    if (runThread_ == std::this_thread::get_id())
+    {
+        // Called from an exit handler, the iteration parks when it returns.
+        return S_OK;
+    }
+
+    // A cancel issued just before the vCPU enters the guest may be missed, so keep kicking until the iteration is over.
+    while (busy_)
+    {
+        if (inGuest_)
+        {
+            auto result = WHvCancelRunVirtualProcessor(partitionHandle_, index_, 0);
+            if (FAILED(result))
+            {
+                logger_.Log(Logger::LogLevel::Error, "Failed to kick virtual processor: HRESULT "
+                    + std::to_string(result) + ", index = " + std::to_string(index_));
+                return result;
+            }
+        }
+        pauseCv_.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    return S_OK;
+}
+
+void VirtualProcessor::Resume()
+{
+    {
+        std::lock_guard<std::mutex> lock(pauseMutex_);
+        if (pauseCount_ > 0 && --pauseCount_ == 0)
+        {
+            for (const auto& callback : pauseCallbacks_)
+            {
+                callback(false);
+            }
+        }
+    }
+    pauseCv_.notify_all();
+}
+
+void VirtualProcessor::AddPauseCallback(std::function<void(bool)> callback)
+{
+    std::lock_guard<std::mutex> lock(pauseMutex_);
+    pauseCallbacks_.push_back(std::move(callback));
+}
+
+bool VirtualProcessor::IsInGuest() const
+{
+    return inGuest_;
+}
+
+void VirtualProcessor::Kick()
+{
+    kickPending_ = true;
+
+    // A cancel issued between the entry check and WHvRunVirtualProcessor is lost, so keep cancelling until the
+    // exit (or the entry check) consumes the kick.
+    while (inGuest_ && kickPending_)
+    {
+        WHvCancelRunVirtualProcessor(partitionHandle_, index_, 0);
+        if (!kickPending_)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+void VirtualProcessor::SetEventRecorder(EventRecorder* eventRecorder)
+{
+    eventRecorder_ = eventRecorder;
+}
+
+EventRecorder* VirtualProcessor::GetEventRecorder() const
+{
+    return eventRecorder_;
+}
+
+void VirtualProcessor::SetInterruptController(InterruptController* interruptController)
+{
+    interruptController_ = interruptController;
+}
+
+void VirtualProcessor::SetIoBus(IoBus* ioBus)
+{
+    ioBus_ = ioBus;
+}
+
+IoBus* VirtualProcessor::GetIoBus() const
+{
+    return ioBus_;
+}
+
+void VirtualProcessor::SetMmioBus(MmioBus* mmioBus)
+{
+    mmioBus_ = mmioBus;
+}
+
+MmioBus* VirtualProcessor::GetMmioBus() const
+{
+    return mmioBus_;
+}
+
+void VirtualProcessor::SetMemoryManager(MemoryManager* memoryManager)
+{
+    memoryManager_ = memoryManager;
+}
+
+MemoryManager* VirtualProcessor::GetMemoryManager() const
+{
+    return memoryManager_;
+}
+
+UINT VirtualProcessor::GetIndex() const
+{
+    return index_;
+}
+
+HRESULT VirtualProcessor::ReadRegisters(const WHV_REGISTER_NAME* names, UINT32 count, WHV_REGISTER_VALUE* values)
+{
+    if (!registersCached_)
+    {
+        // One batched read per exit serves every register the emulator asks for.
+        HRESULT result = WHvGetVirtualProcessorRegisters(partitionHandle_, index_, regNames,
+            static_cast<UINT32>(std::size(regNames)), registers_.data());
+        if (FAILED(result))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to refresh the register cache: HRESULT " + std::to_string(result));
+            return result;
+        }
+        registersCached_ = true;
+    }
+
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        int cacheIndex = GetCacheIndex(names[i]);
+        if (cacheIndex >= 0)
+        {
+            values[i] = registers_[cacheIndex];
+            continue;
+        }
+
+        HRESULT result = WHvGetVirtualProcessorRegisters(partitionHandle_, index_, &names[i], 1, &values[i]);
+        if (FAILED(result))
+        {
+            logger_.Log(Logger::LogLevel::Error, "Failed to read register " + std::to_string(names[i]) + ": HRESULT "
+                + std::to_string(result));
+            return result;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT VirtualProcessor::WriteRegisters(const WHV_REGISTER_NAME* names, UINT32 count, const WHV_REGISTER_VALUE* values)
+{
+    HRESULT result = WHvSetVirtualProcessorRegisters(partitionHandle_, index_, names, count, values);
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to write emulated registers: HRESULT " + std::to_string(result));
+        return result;
+    }
+
+    // The rest of the exit is served from the cache, so it has to follow the writes.
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        int cacheIndex = GetCacheIndex(names[i]);
+        if (cacheIndex >= 0)
+        {
+            registers_[cacheIndex] = values[i];
+        }
+    }
+    return S_OK;
+}
+
+HRESULT VirtualProcessor::TranslateGva(UINT64 gva, WHV_TRANSLATE_GVA_FLAGS flags, WHV_TRANSLATE_GVA_RESULT_CODE& resultCode, UINT64& gpa)
+{
+    WHV_TRANSLATE_GVA_RESULT translation = {};
+    HRESULT result = WHvTranslateGva(partitionHandle_, index_, gva, flags, &translation, &gpa);
+    if (FAILED(result))
+    {
+        logger_.Log(Logger::LogLevel::Error, "Failed to translate GVA " + std::to_string(gva) + ": HRESULT " + std::to_string(result));
+        return result;
+    }
+    resultCode = translation.ResultCode;
+    return S_OK;
+}
+
+void VirtualProcessor::SetIoFastPath(bool enabled)
+{
+    ioFastPath_ = enabled;
+}
+
+VirtualProcessor::ExitStats VirtualProcessor::GetExitStats() const
+{
+    return { fastIoExits_, fastIoNanoseconds_, emulatedIoExits_, emulatedIoNanoseconds_, fastMmioExits_, fastMmioNanoseconds_,
+        mmioExits_, mmioNanoseconds_, mmioInstructionCache_.GetStats() };
+}
+
+HRESULT VirtualProcessor::CompleteIoFastPath(const WHV_RUN_VP_EXIT_CONTEXT& context)
+{
+    const auto& ioPortAccess = context.IoPortAccess;
+    const UINT8 size = static_cast<UINT8>(ioPortAccess.AccessInfo.AccessSize);
+    if (size != 1 && size != 2 && size != 4)
+    {
+        return E_INVALIDARG;
+    }
+    const UINT64 mask = size == 4 ? 0xFFFFFFFFull : (1ull << (size * 8)) - 1;
+
+    WHV_REGISTER_NAME names[2] = { WHvX64RegisterRip, WHvX64RegisterRax };
+    WHV_REGISTER_VALUE values[2] = {};
+    values[0].Reg64 = context.VpContext.Rip + context.VpContext.InstructionLength;
+    UINT32 count = 1;
+
+    if (ioPortAccess.AccessInfo.IsWrite)
+    {
+        if (ioBus_ != nullptr)
+        {
+            ioBus_->Write(ioPortAccess.PortNumber, size, static_cast<UINT32>(ioPortAccess.Rax & mask));
+        }
+        MH_TRACE(IoFastPath, ioPortAccess.PortNumber | (size << 16) | (1 << 24), ioPortAccess.Rax & mask, 0);
+    }
+    else
+    {
+        UINT32 data = ioBus_ != nullptr ? ioBus_->Read(ioPortAccess.PortNumber, size) : 0xFFFFFFFF;
+        if (eventRecorder_ != nullptr)
+        {
+            data = eventRecorder_->OnIoRead(ioPortAccess.PortNumber, size, data);
+        }
+        // A 32-bit IN zero-extends into RAX, 8 and 16-bit INs keep the upper bits.
+        values[1].Reg64 = size == 4 ? (data & mask) : ((ioPortAccess.Rax & ~mask) | (data & mask));
+        count = 2;
+        MH_TRACE(IoFastPath, ioPortAccess.PortNumber | (size << 16), data & mask, 0);
+    }
+    return WriteRegisters(names, count, values);
+}
+
+void VirtualProcessor::RegisterHypercall(UINT64 code, HypercallHandler handler)
+{
+    hypercalls_[code] = std::move(handler);
+}
+
+HRESULT VirtualProcessor::CompleteHypercall(const WHV_RUN_VP_EXIT_CONTEXT& context)
+{
+    // Unknown functions return all ones.
+    UINT64 status = ~0ull;
+    auto hypercall = hypercalls_.find(context.Hypercall.Rax);
+    if (hypercall != hypercalls_.end())
+    {
+        status = hypercall->second(context.Hypercall);
+    }
+    else
+    {
+        logger_.Log(Logger::LogLevel::Warning, "Unknown hypercall " + std::to_string(context.Hypercall.Rax));
+    }
+
+    WHV_REGISTER_NAME names[2] = { WHvX64RegisterRip, WHvX64RegisterRax };
+    WHV_REGISTER_VALUE values[2] = {};
+    values[0].Reg64 = context.VpContext.Rip + context.VpContext.InstructionLength;
+    values[1].Reg64 = status;
+    return WriteRegisters(names, 2, values);
+}
+
+HRESULT VirtualProcessor::CompleteMmioFastPath(const WHV_RUN_VP_EXIT_CONTEXT& context)
+{
+    const auto& memoryAccess = context.MemoryAccess;
+    if (mmioBus_ == nullptr || memoryAccess.AccessInfo.AccessType == WHvMemoryAccessExecute)
+    {
+        return E_NOTIMPL;
+    }
+
+    WHV_REGISTER_NAME cr3Name = WHvX64RegisterCr3;
+    WHV_REGISTER_VALUE cr3 = {};
+    HRESULT result = ReadRegisters(&cr3Name, 1, &cr3);
+    if (FAILED(result))
+    {
+        return result;
+    }
+
+    const MmioInstructionCache::Operation* operation = mmioInstructionCache_.Find(cr3.Reg64, context.VpContext.Rip,
+        context.VpContext.Cs, memoryAccess.InstructionBytes, memoryAccess.InstructionByteCount);
+    if (operation == nullptr || operation->isWrite != (memoryAccess.AccessInfo.AccessType == WHvMemoryAccessWrite))
+    {
+        return E_NOTIMPL;
+    }
+
+    WHV_REGISTER_NAME names[2] = { WHvX64RegisterRip, static_cast<WHV_REGISTER_NAME>(WHvX64RegisterRax + operation->registerIndex) };
+    WHV_REGISTER_VALUE values[2] = {};
+    if (!operation->hasImmediate)
+    {
+        result = ReadRegisters(&names[1], 1, &values[1]);
+        if (FAILED(result))
+        {
+            return result;
+        }
+    }
+
+    const UINT8 size = operation->accessSize;
+    const UINT64 mask = size == 8 ? ~0ull : (1ull << (size * 8)) - 1;
+    const UINT64 registerValue = values[1].Reg64;
+    values[0].Reg64 = context.VpContext.Rip + operation->length;
+    UINT32 count = 1;
+
+    if (operation->isWrite)
+    {
+        UINT64 value = operation->hasImmediate ? operation->immediate : (operation->highByte ? registerValue >> 8 : registerValue);
+        mmioBus_->Write(index_, memoryAccess.Gpa, size, value & mask);
+        MH_TRACE(MmioFastPath, size | (1 << 8), memoryAccess.Gpa, value & mask);
+    }
+    else
+    {
+        UINT64 value = ~0ull;
+        mmioBus_->Read(index_, memoryAccess.Gpa, size, value);
+        if (eventRecorder_ != nullptr)
+        {
+            eventRecorder_->OnMmioRead(memoryAccess.Gpa, size, reinterpret_cast<UINT8*>(&value));
+        }
+        value &= mask;
+        MH_TRACE(MmioFastPath, size, memoryAccess.Gpa, value);
+
+        // Same rules as a register write by the instruction: 32-bit results zero-extend, 8 and 16-bit results merge.
+        if (operation->highByte)
+        {
+            values[1].Reg64 = (registerValue & ~0xFF00ull) | (value << 8);
+        }
+        else if (operation->registerSize >= 4)
+        {
+            values[1].Reg64 = value;
+        }
+        else
+        {
+            const UINT64 registerMask = (1ull << (operation->registerSize * 8)) - 1;
+            values[1].Reg64 = (registerValue & ~registerMask) | value;
+        }
+        count = 2;
+    }
+    return WriteRegisters(names, count, values);
+}
+
+int VirtualProcessor::GetCacheIndex(WHV_REGISTER_NAME name)
+{
+    for (size_t i = 0; i < std::size(regNames); ++i)
+    {
+        if (regNames[i] == name)
+        {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
 bool VirtualProcessor::Continue()
 {
     if (partitionHandle_ == nullptr)
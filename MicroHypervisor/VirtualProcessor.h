@@ -8,7 +8,21 @@
 #include <vector>
 #include <array>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <unordered_map>
 #include "Logger.h"
+#include "Emulator.h"
+#include "MmioInstructionCache.h"
+
+class EventRecorder;
+class InterruptController;
+class IoBus;
+class MmioBus;
+class MemoryManager;
 
 /// @brief  Virtual Processor class for the Hypervisor \class VirtualProcessor
 class VirtualProcessor
@@ -42,7 +56,7 @@ public:
     VMConfig GetVMConfig() const;
 
     /**
-     * @brief Starts the Virtual Processor
+     * @brief Starts the Virtual Processor, runs one guest entry and handles its exit, blocks while paused
      *
      */
     void Run();
@@ -104,6 +118,15 @@ public:
      */
     HRESULT SaveState();
 
+    /**
+     * @brief Save the state of the Virtual Processor and copy the saved registers out in one step,
+     *        so concurrent savers cannot swap the saved state in between
+     *
+     * @param registers -> receives the registers in the order of regNames
+     * @return HRESULT -> S_OK if successful
+     */
+    HRESULT SaveState(std::vector<WHV_REGISTER_VALUE>& registers);
+
     /**
      * @brief Restore the state of the Virtual Processor
      * 
@@ -111,6 +134,200 @@ public:
      */
     HRESULT RestoreState();
 
+    /**
+     * @brief Restore the saved state with a single batched register write and no logging on success,
+     *        used by the fast reset path
+     *
+     * @return HRESULT -> S_OK if successful
+     */
+    HRESULT FastRestoreState();
+
+    /**
+     * @brief Load a register state (in the order of regNames) into the Virtual Processor
+     *
+     * @param registers -> the register values to load
+     * @return HRESULT -> S_OK if successful
+     */
+    HRESULT LoadState(const std::vector<WHV_REGISTER_VALUE>& registers);
+
+    /**
+     * @brief Pauses the Virtual Processor, a running guest is kicked out with WHvCancelRunVirtualProcessor
+     *        and Run() blocks until Resume() is called. Pauses nest, every call must be paired with a
+     *        Resume(), also when it fails
+     *
+     * @return HRESULT -> S_OK once the current Run() has returned and the register cache is idle
+     */
+    HRESULT Pause();
+
+    /**
+     * @brief Resumes a paused Virtual Processor
+     *
+     */
+    void Resume();
+
+    /**
+     * @brief Adds a callback for devices that write guest memory from their own threads, they hold back while paused
+     *
+     * @param callback -> Called with true on the first Pause() and with false on the last Resume()
+     */
+    void AddPauseCallback(std::function<void(bool)> callback);
+
+    /**
+     * @brief Checks if the Virtual Processor is currently executing guest code
+     *
+     * @return true -> if the Virtual Processor is inside WHvRunVirtualProcessor
+     */
+    bool IsInGuest() const;
+
+    /**
+     * @brief Forces the Virtual Processor out of the guest so it handles new work, callable from any thread,
+     *        a kick that races with guest entry makes the entry return immediately, a kick that lands in the guest
+     *        returns once the run has exited
+     *
+     */
+    void Kick();
+
+    /**
+     * @brief Sets the event recorder that is clocked by the exits of this Virtual Processor
+     *
+     * @param eventRecorder -> EventRecorder*, the recorder, nullptr to detach
+     */
+    void SetEventRecorder(EventRecorder* eventRecorder);
+
+    /**
+     * @brief Gets the event recorder of this Virtual Processor
+     *
+     * @return EventRecorder* -> the recorder, nullptr if none is attached
+     */
+    EventRecorder* GetEventRecorder() const;
+
+    /**
+     * @brief Sets the interrupt controller whose pending interrupts are injected before every entry
+     *
+     * @param interruptController -> InterruptController*, the controller, nullptr to detach
+     */
+    void SetInterruptController(InterruptController* interruptController);
+
+    /**
+     * @brief Sets the IO bus that handles the port accesses of this Virtual Processor
+     *
+     * @param ioBus -> IoBus*, the bus, nullptr to detach
+     */
+    void SetIoBus(IoBus* ioBus);
+
+    /**
+     * @brief Gets the IO bus of this Virtual Processor
+     *
+     * @return IoBus* -> the bus, nullptr if none is attached
+     */
+    IoBus* GetIoBus() const;
+
+    /**
+     * @brief Sets the MMIO bus that handles the device memory accesses of this Virtual Processor
+     *
+     * @param mmioBus -> MmioBus*, the bus, nullptr to detach
+     */
+    void SetMmioBus(MmioBus* mmioBus);
+
+    /**
+     * @brief Gets the MMIO bus of this Virtual Processor
+     *
+     * @return MmioBus* -> the bus, nullptr if none is attached
+     */
+    MmioBus* GetMmioBus() const;
+
+    /**
+     * @brief Sets the memory manager the emulator uses for guest RAM accesses that no device claims
+     *
+     * @param memoryManager -> MemoryManager*, the memory manager owning the guest RAM, nullptr to detach
+     */
+    void SetMemoryManager(MemoryManager* memoryManager);
+
+    /**
+     * @brief Gets the memory manager of this Virtual Processor
+     *
+     * @return MemoryManager* -> the memory manager, nullptr if none is attached
+     */
+    MemoryManager* GetMemoryManager() const;
+
+    /**
+     * @brief Gets the index of this Virtual Processor in the partition
+     *
+     */
+    UINT GetIndex() const;
+
+    /**
+     * @brief Reads registers for the instruction emulator, served from the register cache that is
+     *        refreshed once per exit, registers outside of the cache are read from the vCPU
+     *
+     * @param names -> Names of the registers
+     * @param count -> Number of registers
+     * @param values -> receives the values
+     * @return HRESULT -> S_OK if all registers were read
+     */
+    HRESULT ReadRegisters(const WHV_REGISTER_NAME* names, UINT32 count, WHV_REGISTER_VALUE* values);
+
+    /**
+     * @brief Writes registers for the instruction emulator, the register cache and the vCPU are updated together
+     *
+     * @param names -> Names of the registers
+     * @param count -> Number of registers
+     * @param values -> Values to write
+     * @return HRESULT -> S_OK if all registers were written
+     */
+    HRESULT WriteRegisters(const WHV_REGISTER_NAME* names, UINT32 count, const WHV_REGISTER_VALUE* values);
+
+    /**
+     * @brief Translates a guest virtual address with the page tables of this vCPU
+     *
+     * @param gva -> Guest virtual address
+     * @param flags -> Access to validate
+     * @param resultCode -> receives the translation result
+     * @param gpa -> receives the guest physical address
+     * @return HRESULT -> S_OK if the translation was performed, resultCode tells whether it succeeded
+     */
+    HRESULT TranslateGva(UINT64 gva, WHV_TRANSLATE_GVA_FLAGS flags, WHV_TRANSLATE_GVA_RESULT_CODE& resultCode, UINT64& gpa);
+
+    using HypercallHandler = std::function<UINT64(const WHV_HYPERCALL_CONTEXT&)>;
+
+    /**
+     * @brief Registers the handler of a VMCALL function, handlers are registered before the guest runs
+     *
+     * @param code -> Function code the guest passes in RAX
+     * @param handler -> Handler, its return value goes back to the guest in RAX
+     */
+    void RegisterHypercall(UINT64 code, HypercallHandler handler);
+
+    /**
+     * @brief Count and host time spent handling the device exits, per path
+     *
+     */
+    struct ExitStats
+    {
+        UINT64 fastIoExits;
+        UINT64 fastIoNanoseconds;
+        UINT64 emulatedIoExits;
+        UINT64 emulatedIoNanoseconds;
+        UINT64 fastMmioExits;
+        UINT64 fastMmioNanoseconds;
+        UINT64 mmioExits;
+        UINT64 mmioNanoseconds;
+        MmioInstructionCache::Stats mmioInstructionCache;
+    };
+
+    /**
+     * @brief Enables completing non-string IN/OUT exits directly from the exit context instead of the emulator
+     *
+     * @param enabled -> true to use the fast path, false to send every port access through the emulator
+     */
+    void SetIoFastPath(bool enabled);
+
+    /**
+     * @brief Gets the exit handling statistics
+     *
+     */
+    ExitStats GetExitStats() const;
+
     /**
      * @brief Get the CPU Usage
      *
@@ -144,6 +361,70 @@ private:
     VMConfig vmConfig_;
     Logger logger_;
 
+    std::atomic<bool> inGuest_;
+    bool busy_;
+    UINT32 pauseCount_;
+    std::thread::id runThread_;
+    std::mutex pauseMutex_;
+    std::condition_variable pauseCv_;
+    std::vector<std::function<void(bool)>> pauseCallbacks_;
+    std::mutex stateMutex_;
+    std::atomic<bool> kickPending_;
+
+    EventRecorder* eventRecorder_;
+    InterruptController* interruptController_;
+    IoBus* ioBus_;
+    MmioBus* mmioBus_;
+    MemoryManager* memoryManager_;
+
+    /**
+     * @brief Gets the index of a register in the register cache
+     *
+     * @return int -> the index, -1 if the register is not cached
+     */
+    static int GetCacheIndex(WHV_REGISTER_NAME name);
+
+    /**
+     * @brief Body of Run(), delivers the pending interrupts, enters the guest once and handles the exit
+     *
+     */
+    void RunOnce();
+
+    /**
+     * @brief Completes a non-string IN/OUT exit on the IO bus, updates RAX for IN and advances RIP
+     *
+     * @return HRESULT -> S_OK if the instruction was completed
+     */
+    HRESULT CompleteIoFastPath(const WHV_RUN_VP_EXIT_CONTEXT& context);
+
+    /**
+     * @brief Completes a memory access exit of a MOV/MOVZX found in the decoded instruction cache on the MMIO bus
+     *
+     * @return HRESULT -> S_OK if the instruction was completed, a failure sends the exit to the emulator
+     */
+    HRESULT CompleteMmioFastPath(const WHV_RUN_VP_EXIT_CONTEXT& context);
+
+    /**
+     * @brief Runs the handler of a VMCALL exit, returns its result in RAX and steps over the VMCALL
+     *
+     * @return HRESULT -> S_OK if the registers were updated
+     */
+    HRESULT CompleteHypercall(const WHV_RUN_VP_EXIT_CONTEXT& context);
+
+    Emulator emulator_;
+    bool registersCached_;
+    bool ioFastPath_;
+    MmioInstructionCache mmioInstructionCache_;
+    std::unordered_map<UINT64, HypercallHandler> hypercalls_;
+    std::atomic<UINT64> fastIoExits_;
+    std::atomic<UINT64> fastIoNanoseconds_;
+    std::atomic<UINT64> emulatedIoExits_;
+    std::atomic<UINT64> emulatedIoNanoseconds_;
+    std::atomic<UINT64> fastMmioExits_;
+    std::atomic<UINT64> fastMmioNanoseconds_;
+    std::atomic<UINT64> mmioExits_;
+    std::atomic<UINT64> mmioNanoseconds_;
+
     struct Kernel 
     {
         uint64_t pml4[512];
@@ -0,0 +1,303 @@
+#define NOMINMAX
+#include "VirtualSwitch.h"
+#include <algorithm>
+
+namespace
+{
+    constexpr size_t EthernetHeaderSize = 14;
+    constexpr size_t DrainBatch = 32;
+
+    UINT64 MacKey(const UINT8* mac)
+    {
+        UINT64 key = 0;
+        memcpy(&key, mac, 6);
+        return key;
+    }
+
+    bool IsMulticast(const UINT8* mac)
+    {
+        return (mac[0] & 1) != 0;
+    }
+
+    UINT64 NanosecondsSince(std::chrono::steady_clock::time_point since)
+    {
+        return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - since).count());
+    }
+}
+
+VirtualSwitch::Port::Port(VirtualSwitch& owner, const std::string& name)
+    : owner_(owner), name_(name), lastSource_(0), receiver_(nullptr), backlog_(BacklogFrames), txPackets_(0), rxPackets_(0),
+    rxBacklogged_(0), rxDropped_(0), latencySumNanoseconds_(0), maxLatencyNanoseconds_(0)
+{
+
+}
+
+void VirtualSwitch::Port::SetReceiver(NetReceiver* receiver)
+{
+    std::lock_guard<std::mutex> consumer(backlogConsumerMutex_);
+    std::unique_lock<std::shared_mutex> lock(receiverMutex_);
+    receiver_ = receiver;
+    if (receiver_ == nullptr)
+    {
+        rxDropped_ += backlog_.Size();
+        backlog_.Discard(backlog_.Size());
+    }
+}
+
+size_t VirtualSwitch::Port::Transmit(UINT32 queueIndex, const NetFrame* frames, size_t count)
+{
+    return owner_.Forward(*this, queueIndex, frames, count);
+}
+
+void VirtualSwitch::Port::OnReceiveBuffers(UINT32 queueIndex)
+{
+    owner_.DrainBacklog(*this);
+}
+
+VirtualSwitch::VirtualSwitch()
+    : portCount_(0), forwarded_(0), flooded_(0), dropped_(0), startTime_(std::chrono::steady_clock::now()), logger_("VirtualSwitch.log")
+{
+
+}
+
+VirtualSwitch::~VirtualSwitch()
+{
+
+}
+
+VirtualSwitch::Port* VirtualSwitch::AddPort(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(portsMutex_);
+    const size_t index = portCount_.load(std::memory_order_relaxed);
+    if (index == MaxPorts)
+    {
+        logger_.Log(Logger::LogLevel::Error, "No free port for " + name);
+        return nullptr;
+    }
+    ports_[index] = std::make_unique<Port>(*this, name);
+    portCount_.store(index + 1, std::memory_order_release);
+    logger_.Log(Logger::LogLevel::Info, "Port " + std::to_string(index) + " added for " + name);
+    return ports_[index].get();
+}
+
+VirtualSwitch::Stats VirtualSwitch::GetStats()
+{
+    Stats stats = {};
+    {
+        std::shared_lock<std::shared_mutex> lock(macMutex_);
+        stats.macEntries = macTable_.size();
+    }
+    stats.forwarded = forwarded_;
+    stats.flooded = flooded_;
+    stats.dropped = dropped_;
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    const size_t portCount = portCount_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < portCount; i++)
+    {
+        const Port& port = *ports_[i];
+        PortStats portStats = {};
+        portStats.name = port.name_;
+        portStats.txPackets = port.txPackets_;
+        portStats.rxPackets = port.rxPackets_;
+        portStats.rxBacklogged = port.rxBacklogged_;
+        portStats.rxDropped = port.rxDropped_;
+        portStats.txPacketsPerSecond = seconds > 0.0 ? static_cast<double>(portStats.txPackets) / seconds : 0.0;
+        portStats.rxPacketsPerSecond = seconds > 0.0 ? static_cast<double>(portStats.rxPackets) / seconds : 0.0;
+        portStats.averageLatencyMicroseconds = portStats.rxPackets > 0
+            ? static_cast<double>(port.latencySumNanoseconds_) / static_cast<double>(portStats.rxPackets) / 1000.0 : 0.0;
+        portStats.maxLatencyMicroseconds = static_cast<double>(port.maxLatencyNanoseconds_) / 1000.0;
+        stats.ports.push_back(portStats);
+    }
+    return stats;
+}
+
+size_t VirtualSwitch::Forward(Port& source, UINT32 queueIndex, const NetFrame* frames, size_t count)
+{
+    const auto sent = std::chrono::steady_clock::now();
+    source.txPackets_ += count;
+
+    // A NIC keeps its address, the table is only written when a source shows up on a new port.
+    for (size_t i = 0; i < count; i++)
+    {
+        if (frames[i].length < EthernetHeaderSize || IsMulticast(frames[i].data + 6))
+        {
+            continue;
+        }
+        const UINT64 sourceMac = MacKey(frames[i].data + 6);
+        if (source.lastSource_.load(std::memory_order_relaxed) == sourceMac)
+        {
+            continue;
+        }
+        source.lastSource_.store(sourceMac, std::memory_order_relaxed);
+        std::unique_lock<std::shared_mutex> lock(macMutex_);
+        macTable_[sourceMac] = &source;
+    }
+
+    // Unknown and multicast destinations flood, frames back to the sender and runts are dropped.
+    thread_local std::vector<Port*> destinations;
+    destinations.assign(count, nullptr);
+    {
+        std::shared_lock<std::shared_mutex> lock(macMutex_);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (frames[i].length < EthernetHeaderSize)
+            {
+                destinations[i] = &source;
+            }
+            else if (!IsMulticast(frames[i].data))
+            {
+                auto found = macTable_.find(MacKey(frames[i].data));
+                destinations[i] = found != macTable_.end() ? found->second : nullptr;
+            }
+        }
+    }
+
+    size_t start = 0;
+    while (start < count)
+    {
+        size_t end = start + 1;
+        while (end < count && destinations[end] == destinations[start])
+        {
+            end++;
+        }
+        Port* destination = destinations[start];
+        if (destination == &source)
+        {
+            dropped_ += end - start;
+        }
+        else if (destination != nullptr)
+        {
+            Deliver(*destination, queueIndex, frames + start, end - start, sent);
+            forwarded_ += end - start;
+        }
+        else
+        {
+            const size_t portCount = portCount_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < portCount; i++)
+            {
+                if (ports_[i].get() != &source)
+                {
+                    Deliver(*ports_[i], queueIndex, frames + start, end - start, sent);
+                }
+            }
+            flooded_ += end - start;
+        }
+        start = end;
+    }
+    return count;
+}
+
+void VirtualSwitch::Deliver(Port& destination, UINT32 queueIndex, const NetFrame* frames, size_t count,
+    std::chrono::steady_clock::time_point sent)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(destination.receiverMutex_);
+        if (destination.receiver_ == nullptr)
+        {
+            destination.rxDropped_ += count;
+            return;
+        }
+
+        // Straight into the guest buffers of the receiver, unless older frames are waiting in front of these.
+        size_t taken = 0;
+        if (destination.backlog_.Size() == 0)
+        {
+            taken = destination.receiver_->Receive(queueIndex, frames, count);
+            destination.rxPackets_ += taken;
+            RecordLatency(destination, NanosecondsSince(sent), taken);
+        }
+        if (taken == count)
+        {
+            return;
+        }
+
+        thread_local Port::BacklogFrame parked;
+        std::lock_guard<std::mutex> producer(destination.backlogProducerMutex_);
+        for (size_t i = taken; i < count; i++)
+        {
+            if (frames[i].length > MaxBacklogFrameSize)
+            {
+                destination.rxDropped_++;
+                continue;
+            }
+            parked.queueIndex = queueIndex;
+            parked.length = static_cast<UINT32>(frames[i].length);
+            parked.sent = sent;
+            memcpy(parked.data, frames[i].data, frames[i].length);
+            if (destination.backlog_.TryPush(parked))
+            {
+                destination.rxBacklogged_++;
+            }
+            else
+            {
+                destination.rxDropped_++;
+            }
+        }
+    }
+    DrainBacklog(destination);
+}
+
+void VirtualSwitch::DrainBacklog(Port& port)
+{
+    bool retry = true;
+    while (retry)
+    {
+        std::unique_lock<std::mutex> consumer(port.backlogConsumerMutex_, std::try_to_lock);
+        if (!consumer.owns_lock())
+        {
+            return;
+        }
+        std::shared_lock<std::shared_mutex> lock(port.receiverMutex_);
+        if (port.receiver_ == nullptr)
+        {
+            return;
+        }
+
+        std::array<NetFrame, DrainBatch> frames;
+        while (true)
+        {
+            const size_t count = std::min(port.backlog_.Size(), DrainBatch);
+            if (count == 0)
+            {
+                break;
+            }
+            // A batch goes to one queue, the receiver maps it onto its active pairs anyway.
+            for (size_t i = 0; i < count; i++)
+            {
+                frames[i] = { port.backlog_.Peek(i).data, port.backlog_.Peek(i).length };
+            }
+            const size_t taken = port.receiver_->Receive(port.backlog_.Peek(0).queueIndex, frames.data(), count);
+            for (size_t i = 0; i < taken; i++)
+            {
+                RecordLatency(port, NanosecondsSince(port.backlog_.Peek(i).sent), 1);
+            }
+            port.rxPackets_ += taken;
+            port.backlog_.Discard(taken);
+            if (taken < count)
+            {
+                // The receiver is out of buffers, posting new ones drains the rest.
+                return;
+            }
+        }
+
+        // A sender may have parked frames after the last look, when this thread held the consumer side.
+        lock.unlock();
+        consumer.unlock();
+        retry = port.backlog_.Size() > 0;
+    }
+}
+
+void VirtualSwitch::RecordLatency(Port& port, UINT64 latencyNanoseconds, size_t frames)
+{
+    if (frames == 0)
+    {
+        return;
+    }
+    port.latencySumNanoseconds_ += latencyNanoseconds * frames;
+    UINT64 maxLatency = port.maxLatencyNanoseconds_;
+    while (latencyNanoseconds > maxLatency && !port.maxLatencyNanoseconds_.compare_exchange_weak(maxLatency, latencyNanoseconds))
+    {
+    }
+}
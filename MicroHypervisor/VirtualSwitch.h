@@ -0,0 +1,168 @@
+#ifndef VIRTUALSWITCH_H
+#define VIRTUALSWITCH_H
+
+#include <Windows.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "NetBackend.h"
+#include "RingBuffer.h"
+#include "Logger.h"
+
+/// @brief In-process L2 switch between the NICs of local VMs, frames are copied once from the sending guest into the receiving one \class VirtualSwitch
+class VirtualSwitch
+{
+public:
+    static constexpr size_t MaxPorts = 64;
+    static constexpr size_t BacklogFrames = 256;
+    static constexpr size_t MaxBacklogFrameSize = 1522;
+
+    /**
+     * @brief Statistics of a port, latency runs from the transmit call of the sender to the frame being in the receiver's buffers
+     *
+     */
+    struct PortStats
+    {
+        std::string name;
+        UINT64 txPackets;
+        UINT64 rxPackets;
+        UINT64 rxBacklogged;
+        UINT64 rxDropped;
+        double txPacketsPerSecond;
+        double rxPacketsPerSecond;
+        double averageLatencyMicroseconds;
+        double maxLatencyMicroseconds;
+    };
+
+    /**
+     * @brief Switch statistics, flooded counts the frames sent to every port for lack of a learned destination
+     *
+     */
+    struct Stats
+    {
+        size_t macEntries;
+        UINT64 forwarded;
+        UINT64 flooded;
+        UINT64 dropped;
+        std::vector<PortStats> ports;
+    };
+
+    /// @brief A port of the switch, the backend of one NIC \class Port
+    class Port : public NetBackend
+    {
+    public:
+        Port(VirtualSwitch& owner, const std::string& name);
+
+        /**
+         * @brief Sets the NIC behind the port, waits for deliveries in progress when the NIC goes away
+         *
+         */
+        void SetReceiver(NetReceiver* receiver) override;
+        size_t Transmit(UINT32 queueIndex, const NetFrame* frames, size_t count) override;
+
+        /**
+         * @brief Delivers the frames that waited in the backlog for receive buffers
+         *
+         */
+        void OnReceiveBuffers(UINT32 queueIndex) override;
+
+    private:
+        friend class VirtualSwitch;
+
+        /**
+         * @brief A frame waiting for the receiver to post buffers, the only case where a frame is copied twice
+         *
+         */
+        struct BacklogFrame
+        {
+            UINT32 queueIndex;
+            UINT32 length;
+            std::chrono::steady_clock::time_point sent;
+            UINT8 data[MaxBacklogFrameSize];
+        };
+
+        VirtualSwitch& owner_;
+        std::string name_;
+        std::atomic<UINT64> lastSource_;
+
+        std::shared_mutex receiverMutex_;
+        NetReceiver* receiver_;
+
+        // Senders serialize on the producer side, the ring itself is lock-free between them and the draining receiver.
+        std::mutex backlogProducerMutex_;
+        std::mutex backlogConsumerMutex_;
+        RingBuffer<BacklogFrame> backlog_;
+
+        std::atomic<UINT64> txPackets_;
+        std::atomic<UINT64> rxPackets_;
+        std::atomic<UINT64> rxBacklogged_;
+        std::atomic<UINT64> rxDropped_;
+        std::atomic<UINT64> latencySumNanoseconds_;
+        std::atomic<UINT64> maxLatencyNanoseconds_;
+    };
+
+    VirtualSwitch();
+    ~VirtualSwitch();
+
+    /**
+     * @brief Adds a port, ports live as long as the switch
+     *
+     * @param name -> Name of the port for the statistics
+     * @return Port* -> the port, nullptr if MaxPorts are in use
+     */
+    Port* AddPort(const std::string& name);
+
+    /**
+     * @brief Gets the switch statistics
+     *
+     */
+    Stats GetStats();
+
+private:
+    /**
+     * @brief Learns the sources of a batch and delivers its frames, consecutive frames to the same port go in one batch
+     *
+     * @return size_t -> number of frames forwarded
+     */
+    size_t Forward(Port& source, UINT32 queueIndex, const NetFrame* frames, size_t count);
+
+    /**
+     * @brief Copies frames into the receive buffers of a port, what finds no buffer waits in its backlog
+     *
+     */
+    void Deliver(Port& destination, UINT32 queueIndex, const NetFrame* frames, size_t count, std::chrono::steady_clock::time_point sent);
+
+    /**
+     * @brief Delivers the backlog of a port in order, skipped when another thread is draining it
+     *
+     */
+    void DrainBacklog(Port& port);
+
+    /**
+     * @brief Records the latency of delivered frames on the receiving port
+     *
+     */
+    void RecordLatency(Port& port, UINT64 latencyNanoseconds, size_t frames);
+
+    std::mutex portsMutex_;
+    std::array<std::unique_ptr<Port>, MaxPorts> ports_;
+    std::atomic<size_t> portCount_;
+
+    std::shared_mutex macMutex_;
+    std::unordered_map<UINT64, Port*> macTable_;
+
+    std::atomic<UINT64> forwarded_;
+    std::atomic<UINT64> flooded_;
+    std::atomic<UINT64> dropped_;
+    std::chrono::steady_clock::time_point startTime_;
+
+    Logger logger_;
+};
+
+#endif // VIRTUALSWITCH_H
\ No newline at end of file